@@ -15,6 +15,7 @@ extern "C" {
 #include "mupdf/fitz/hash.h"
 #include "mupdf/fitz/math.h"
 #include "mupdf/fitz/pool.h"
+#include "mupdf/fitz/task.h"
 #include "mupdf/fitz/string.h"
 #include "mupdf/fitz/tree.h"
 #include "mupdf/fitz/ucdn.h"
@@ -14,6 +14,22 @@
 /* #define FZ_PLOTTERS_CMYK 1 */
 /* #define FZ_PLOTTERS_N 0 */
 
+/*
+	Choose whether to use SIMD versions of the most common plotters.
+	By default we use SSE4.1 or AVX2 on x86 (chosen at runtime
+	according to the CPU) and NEON on AArch64. The PDF lexer also uses
+	SSE2 or NEON to find the ends of tokens. Define FZ_ENABLE_SIMD to 0
+	to use only plain C.
+*/
+/* #define FZ_ENABLE_SIMD 1 */
+
+/*
+	Choose whether fz_open_file_mapped maps files into memory.
+	By default it does on Windows and Unix-like systems. Define
+	FZ_ENABLE_MMAP to 0 to have it read them through a buffer.
+*/
+/* #define FZ_ENABLE_MMAP 1 */
+
 /*
 	Choose which document agents to include.
 	By default all but GPRF are enabled. To avoid building unwanted
@@ -84,6 +100,14 @@
 #define FZ_PLOTTERS_N 0
 #endif /* FZ_PLOTTERS_N */
 
+#ifndef FZ_ENABLE_SIMD
+#define FZ_ENABLE_SIMD 1
+#endif /* FZ_ENABLE_SIMD */
+
+#ifndef FZ_ENABLE_MMAP
+#define FZ_ENABLE_MMAP 1
+#endif /* FZ_ENABLE_MMAP */
+
 /* We need at least 1 plotter defined */
 #if FZ_PLOTTERS_G == 0 && FZ_PLOTTERS_RGB == 0 && FZ_PLOTTERS_CMYK == 0
 #undef FZ_PLOTTERS_N
@@ -5,6 +5,7 @@
 #include "mupdf/fitz/context.h"
 #include "mupdf/fitz/math.h"
 #include "mupdf/fitz/device.h"
+#include "mupdf/fitz/pixmap.h"
 
 /*
 	Display list device -- record and play back device commands.
@@ -64,7 +65,10 @@ fz_device *fz_new_list_device(fz_context *ctx, fz_display_list *list);
 	area: Only the part of the contents of the display list
 	visible within this area will be considered when the list is
 	run through the device. This does not imply for tile objects
-	contained in the display list.
+	contained in the display list. Closing the list device with
+	fz_close_device builds a spatial index over the list, so that
+	running a small area of a large list only visits the parts of
+	the list near that area.
 
 	cookie: Communication mechanism between caller and library
 	running the page. Intended for multi-threaded applications,
@@ -75,6 +79,35 @@ fz_device *fz_new_list_device(fz_context *ctx, fz_display_list *list);
 */
 void fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *ctm, const fz_rect *area, fz_cookie *cookie);
 
+/*
+	fz_draw_display_list: Render a display list into a pixmap,
+	using several threads.
+
+	The area of the pixmap is split into tiles, which are drawn in
+	parallel by fz_run_tasks, each using its own draw device. Tiles
+	are drawn directly into the samples of the destination, and
+	only the display list nodes that touch a tile are run for it.
+	As with banded rendering, anti-aliasing along edges that cross
+	tile boundaries may differ very slightly from a single pass.
+
+	ctm: Transform to apply to display list contents.
+
+	dest: The pixmap to draw into. Its bbox gives the area to be
+	drawn. The caller is expected to have cleared it (or otherwise
+	initialised it) beforehand.
+
+	tile_w, tile_h: The size of the tiles, in pixels. 0 gives a
+	reasonable default. Smaller tiles balance the load better;
+	larger ones repeat less work for objects that span tiles.
+
+	nthreads: The maximum number of threads to use (0 for one per
+	processor). See fz_run_tasks.
+
+	cookie: As for fz_run_display_list. progress counts completed
+	tiles. Once abort is set, no further tiles are started.
+*/
+void fz_draw_display_list(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, fz_pixmap *dest, int tile_w, int tile_h, int nthreads, fz_cookie *cookie);
+
 /*
 	fz_keep_display_list: Keep a reference to a display list.
 
@@ -19,6 +19,7 @@ fz_stream *fz_open_a85d(fz_context *ctx, fz_stream *chain);
 fz_stream *fz_open_ahxd(fz_context *ctx, fz_stream *chain);
 fz_stream *fz_open_rld(fz_context *ctx, fz_stream *chain);
 fz_stream *fz_open_dctd(fz_context *ctx, fz_stream *chain, int color_transform, int l2factor, fz_stream *jpegtables);
+fz_stream *fz_open_dctd_scaled(fz_context *ctx, fz_stream *chain, int color_transform, int scale, fz_stream *jpegtables); /* Decode at scale/8 of full size, 1 <= scale <= 8 */
 fz_stream *fz_open_faxd(fz_context *ctx, fz_stream *chain,
 	int k, int end_of_line, int encoded_byte_align,
 	int columns, int rows, int end_of_block, int black_is_1);
@@ -30,6 +31,31 @@ fz_stream *fz_open_jbig2d(fz_context *ctx, fz_stream *chain, fz_jbig2_globals *g
 fz_jbig2_globals *fz_load_jbig2_globals(fz_context *ctx, fz_buffer *buf);
 void fz_drop_jbig2_globals_imp(fz_context *ctx, fz_storable *globals);
 
+/*
+	fz_deflater: zlib compression on all available threads.
+
+	Data written to the deflater is appended to out in zlib format
+	(the same format that compress produces); set finish on the
+	last write to flush the rest and end the stream. When several
+	threads are available, 128K blocks are compressed in parallel.
+
+	If restart is set, the compression starts afresh every 1M of
+	input, and fz_deflater_restarts returns these restart points as
+	pairs of (uncompressed offset, compressed offset) so that they
+	can be passed to fz_inflate_restarts later.
+
+	fz_inflate_restarts: Inflate a zlib stream of known decoded
+	length dlen on all available threads, given its restart points.
+	Returns NULL if the points do not match the data.
+*/
+typedef struct fz_deflater_s fz_deflater;
+
+fz_deflater *fz_new_deflater(fz_context *ctx, int level, int restart);
+void fz_deflater_write(fz_context *ctx, fz_deflater *z, fz_buffer *out, const unsigned char *data, size_t len, int finish);
+int fz_deflater_restarts(fz_context *ctx, fz_deflater *z, const size_t **points);
+void fz_drop_deflater(fz_context *ctx, fz_deflater *z);
+fz_buffer *fz_inflate_restarts(fz_context *ctx, const unsigned char *data, size_t len, const size_t *points, int count, size_t dlen);
+
 /* Extra filters for tiff */
 fz_stream *fz_open_sgilog16(fz_context *ctx, fz_stream *chain, int w);
 fz_stream *fz_open_sgilog24(fz_context *ctx, fz_stream *chain, int w);
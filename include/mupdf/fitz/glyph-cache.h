@@ -18,6 +18,33 @@ fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx);
 void fz_drop_glyph_cache_context(fz_context *ctx);
 void fz_purge_glyph_cache(fz_context *ctx);
 
+/*
+	Default maximum size of the glyph cache, in bytes.
+*/
+enum
+{
+	FZ_GLYPH_CACHE_DEFAULT = 1024 * 1024
+};
+
+/*
+	fz_set_glyph_cache_size: Set the maximum number of bytes of
+	rendered glyphs to keep in the glyph cache, evicting glyphs at
+	once if the cache is now over size.
+
+	The cache is shared by all the contexts cloned from the same
+	original context. In a context that can be cloned, the cache is
+	split into shards, each with an equal share of the size, so that
+	threads rendering text at the same time rarely contend for the
+	same lock; such caches may want to be made bigger than the default.
+*/
+void fz_set_glyph_cache_size(fz_context *ctx, size_t size);
+
+/*
+	fz_glyph_cache_size: Return the maximum size of the glyph cache,
+	in bytes.
+*/
+size_t fz_glyph_cache_size(fz_context *ctx);
+
 fz_path *fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm);
 fz_path *fz_outline_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *ctm);
 fz_glyph *fz_render_ft_glyph(fz_context *ctx, fz_font *font, int cid, const fz_matrix *trm, int aa);
@@ -83,6 +83,41 @@ fz_pixmap *fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compr
 fz_pixmap *fz_expand_indexed_pixmap(fz_context *ctx, const fz_pixmap *src, int alpha);
 size_t fz_image_size(fz_context *ctx, fz_image *im);
 
+/*
+	fz_open_image_rows: Open an image for decoding one row at a time,
+	so that a large image can be scaled down without ever holding all
+	of it.
+
+	w, h: The size the image will be drawn at. The decoder is asked to
+	reduce the image for free where it can (e.g. JPEG), but no closer
+	than that size; any further scaling is up to the caller.
+
+	Returns NULL if the image cannot be read this way (it is not a
+	simple compressed image, or is already decoded, or a decoded copy
+	is in the store), in which case use fz_get_pixmap_from_image.
+*/
+typedef struct fz_image_rows_s fz_image_rows;
+
+fz_image_rows *fz_open_image_rows(fz_context *ctx, fz_image *image, int w, int h);
+
+/*
+	fz_image_rows_size: Get the width and height, in pixels, of the
+	rows that fz_read_image_row will return.
+*/
+void fz_image_rows_size(fz_context *ctx, fz_image_rows *rows, int *w, int *h);
+
+/*
+	fz_read_image_row: Decode the next row of an image, top first.
+
+	Returns a pixmap one pixel high, with y set to the row number, or
+	NULL after the last row. The pixmap belongs to the reader and is
+	only valid until the next call. Truncated data is padded with
+	zeros.
+*/
+fz_pixmap *fz_read_image_row(fz_context *ctx, fz_image_rows *rows);
+
+void fz_close_image_rows(fz_context *ctx, fz_image_rows *rows);
+
 struct fz_image_s
 {
 	fz_storable storable;
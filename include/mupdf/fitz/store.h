@@ -57,6 +57,13 @@ void fz_drop_storable(fz_context *, const fz_storable *);
 	to an fz_store_hash structure. If make_hash_key function returns 0,
 	then the key is determined not to be hashable, and the value is
 	not stored in the hash table.
+
+	The optional cost function returns an estimate of how expensive
+	it would be to recreate a value of the given size if it were
+	evicted, in units where a value that costs its size in bytes is
+	an ordinary one (cheaply decoded from a flate stream, say). If it
+	is NULL, every value costs its size. Only the FZ_STORE_GDSF policy
+	takes any notice of cost.
 */
 typedef struct fz_store_hash_s fz_store_hash;
 
@@ -93,6 +100,7 @@ struct fz_store_type_s
 	void (*drop_key)(fz_context *,void *);
 	int (*cmp_key)(fz_context *ctx, void *, void *);
 	void (*print)(fz_context *ctx, fz_output *out, void *);
+	size_t (*cost)(fz_context *ctx, void *, size_t size);
 };
 
 /*
@@ -103,6 +111,73 @@ struct fz_store_type_s
 */
 void fz_new_store_context(fz_context *ctx, size_t max);
 
+/*
+	Store eviction policies.
+
+	FZ_STORE_LRU: Evict the least recently used items first. This is
+	the default.
+
+	FZ_STORE_ARC: Adaptive replacement. Items used once recently and
+	items used repeatedly are kept apart, and the balance between the
+	two is tuned by remembering the keys of recently evicted items and
+	noticing which kind gets asked for again.
+
+	FZ_STORE_GDSF: Greedy dual size frequency. Evict the items with the
+	lowest recompute cost per byte first, weighted by how often they
+	have been used, and aged so that items that have fallen out of use
+	do eventually go, however expensive they were.
+*/
+enum
+{
+	FZ_STORE_LRU = 0,
+	FZ_STORE_ARC = 1,
+	FZ_STORE_GDSF = 2
+};
+
+/*
+	fz_set_store_policy: Set the policy the store uses to choose items
+	to evict.
+
+	policy: One of FZ_STORE_LRU, FZ_STORE_ARC or FZ_STORE_GDSF.
+*/
+void fz_set_store_policy(fz_context *ctx, int policy);
+
+/*
+	fz_store_policy: Get the policy the store uses to choose items to
+	evict.
+*/
+int fz_store_policy(fz_context *ctx);
+
+/*
+	fz_store_stats: Counters describing the use of the store.
+
+	size, max: The current and maximum sizes of the store in bytes.
+
+	hits, misses: The number of times fz_find_item has found (or
+	failed to find) an item.
+
+	evictions, evicted: The number of items, and of bytes, evicted to
+	keep the store within its maximum size or to satisfy the scavenging
+	allocator (but not those removed by fz_remove_item or
+	fz_empty_store).
+*/
+typedef struct fz_store_stats_s fz_store_stats;
+
+struct fz_store_stats_s
+{
+	size_t size;
+	size_t max;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t evicted;
+};
+
+/*
+	fz_get_store_stats: Read the store's counters.
+*/
+void fz_get_store_stats(fz_context *ctx, fz_store_stats *stats);
+
 /*
 	fz_drop_store_context: Drop a reference to the store.
 */
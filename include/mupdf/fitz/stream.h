@@ -46,6 +46,78 @@ fz_stream *fz_open_file_progressive(fz_context *ctx, const char *filename, int b
 */
 fz_stream *fz_open_file_w(fz_context *ctx, const wchar_t *filename);
 
+/*
+	fz_open_file_mapped: Open the named file and wrap it in a stream
+	that reads directly from a memory mapping of the file, so that
+	seeking and rereading cost no system calls or copies. Where the
+	address space allows, the whole file is mapped at once, and the
+	stream's buffer (stm->rp to stm->wp) covers all of it.
+
+	If the file cannot be mapped (or mapping is not enabled in this
+	build), it is opened with fz_open_file_buffered instead, reading
+	through a buffer of FZ_FILE_BUFFER_LARGE bytes.
+
+	PDF, XPS, CBZ and TIFF documents and zip archives opened by
+	filename are opened this way.
+
+	The file must not be truncated while it is open; on most systems
+	reading a page that no longer exists kills the process.
+*/
+fz_stream *fz_open_file_mapped(fz_context *ctx, const char *filename);
+
+/*
+	fz_range_fetch_fn: The type of function a ranged stream calls to
+	ask for bytes offset to offset+len-1 of the file. The requested
+	ranges start on a block boundary, and end on one or at the end of
+	the file.
+
+	The function may supply the data at once, by calling
+	fz_range_stream_supply before it returns, or it may start the
+	transfer and return, supplying the data later (from any thread,
+	using a cloned context). A range is only asked for once, unless
+	the fetch is reported to have failed with fz_range_stream_failed.
+	Errors thrown by the function are passed on to the reader.
+*/
+typedef void (fz_range_fetch_fn)(fz_context *ctx, void *opaque, fz_off_t offset, fz_off_t len);
+
+/*
+	fz_open_range_stream: Open a stream on a file of the given length
+	(for instance, one on a web server) whose contents are fetched a
+	block at a time, as they are needed, by the given function.
+
+	A read of data that has not yet arrived asks for it (and a few
+	blocks more) and, if it is still not there when the fetch function
+	returns, throws FZ_ERROR_TRYLATER; try again once more data has
+	been supplied. Documents opened on such a stream are read in
+	progressive mode, and linearized PDF files use their hints to ask
+	for just the ranges that each page needs.
+
+	drop: Called (if not NULL) with opaque when the stream is closed,
+	or if it cannot be opened.
+*/
+fz_stream *fz_open_range_stream(fz_context *ctx, fz_off_t length, fz_range_fetch_fn *fetch, void (*drop)(fz_context *ctx, void *opaque), void *opaque);
+
+/*
+	fz_range_stream_supply: Give a ranged stream the bytes at offset
+	to offset+len-1 of its file. Only the whole blocks that they cover
+	are kept, so data should be supplied in the ranges that were asked
+	for. Safe to call from any thread.
+*/
+void fz_range_stream_supply(fz_context *ctx, fz_stream *stm, fz_off_t offset, const unsigned char *data, fz_off_t len);
+
+/*
+	fz_range_stream_failed: Tell a ranged stream that the fetch of a
+	range has failed, so that it asks for it again when next needed.
+*/
+void fz_range_stream_failed(fz_context *ctx, fz_stream *stm, fz_off_t offset, fz_off_t len);
+
+/*
+	fz_open_file_ranged: Open the named file as a ranged stream whose
+	fetches are answered from the file straight away. A stand-in for
+	a web server accepting range requests, for testing.
+*/
+fz_stream *fz_open_file_ranged(fz_context *ctx, const char *filename);
+
 /*
 	fz_open_file: Wrap an open file descriptor in a stream.
 
@@ -57,6 +129,29 @@ fz_stream *fz_open_file_w(fz_context *ctx, const wchar_t *filename);
 */
 fz_stream *fz_open_file_ptr(fz_context *ctx, FILE *file);
 
+/*
+	fz_open_file_buffered, fz_open_file_ptr_buffered: As fz_open_file
+	and fz_open_file_ptr, but reading through a buffer of the given size
+	rather than FZ_FILE_BUFFER_DEFAULT bytes (0 means the default, and
+	sizes above FZ_FILE_BUFFER_MAX are reduced to it). Larger buffers
+	make for fewer, larger reads, which helps greatly on network
+	filesystems.
+
+	All file streams seek within their buffer without going back to the
+	file where they can. When a file is read sequentially they ask the
+	system (where it supports posix_fadvise or F_RDADVISE) to read ahead
+	of them.
+*/
+enum
+{
+	FZ_FILE_BUFFER_DEFAULT = 4096,
+	FZ_FILE_BUFFER_LARGE = 64 << 10,
+	FZ_FILE_BUFFER_MAX = 64 << 20
+};
+
+fz_stream *fz_open_file_buffered(fz_context *ctx, const char *filename, size_t size);
+fz_stream *fz_open_file_ptr_buffered(fz_context *ctx, FILE *file, size_t size);
+
 /*
 	fz_open_memory: Open a block of memory as a stream.
 
@@ -197,14 +292,28 @@ int64_t fz_read_int64_le(fz_context *ctx, fz_stream *stm);
 */
 void fz_read_string(fz_context *ctx, fz_stream *stm, char *buffer, int len);
 
+/*
+	FZ_STREAM_META_PREFETCH: Asks a stream that fetches its data on
+	demand to start fetching the range given by ptr, which points to
+	two fz_off_t (offset and length); returns 1 if the stream does so.
+	With a NULL ptr, just asks whether it would.
+*/
 enum
 {
 	FZ_STREAM_META_PROGRESSIVE = 1,
-	FZ_STREAM_META_LENGTH = 2
+	FZ_STREAM_META_LENGTH = 2,
+	FZ_STREAM_META_PREFETCH = 3
 };
 
 int fz_stream_meta(fz_context *ctx, fz_stream *stm, int key, int size, void *ptr);
 
+/*
+	fz_prefetch_stream: Ask a stream to start fetching the given range
+	of its data, if it fetches data on demand. Does nothing for other
+	streams.
+*/
+void fz_prefetch_stream(fz_context *ctx, fz_stream *stm, fz_off_t offset, fz_off_t len);
+
 typedef int (fz_stream_next_fn)(fz_context *ctx, fz_stream *stm, size_t max);
 typedef void (fz_stream_close_fn)(fz_context *ctx, void *state);
 typedef void (fz_stream_seek_fn)(fz_context *ctx, fz_stream *stm, fz_off_t offset, int whence);
@@ -0,0 +1,65 @@
+#ifndef MUPDF_FITZ_TASK_H
+#define MUPDF_FITZ_TASK_H
+
+#include "mupdf/fitz/system.h"
+#include "mupdf/fitz/context.h"
+
+/*
+	Parallel task execution.
+
+	MuPDF does not normally create threads of its own. When the
+	library is built with HAVE_PTHREADS (or with MSVC) a small
+	work-stealing scheduler is available that runs a set of
+	independent tasks on a pool of worker threads, each using its
+	own context cloned from the caller's. Without thread support, or
+	when the context has no locks (and so cannot be cloned), the
+	tasks are simply run one after the other on the calling thread.
+*/
+
+/*
+	fz_task_fn: A function to run a single task.
+
+	ctx: The context to use. This will be a clone of the context
+	passed to fz_run_tasks, so may be used freely on the calling
+	thread, but must not be stored.
+
+	arg: The opaque argument passed to fz_run_tasks.
+
+	task: The number of the task to run, in the range 0 to
+	ntasks-1. Each task number is run exactly once (unless an
+	earlier task throws), in no particular order.
+
+	May throw exceptions; the first exception thrown stops any tasks
+	that have not yet started, and is rethrown from fz_run_tasks.
+*/
+typedef void (fz_task_fn)(fz_context *ctx, void *arg, int task);
+
+/*
+	fz_run_tasks: Run ntasks independent tasks using up to nthreads
+	threads (including the calling thread), and wait for them all to
+	complete.
+
+	Tasks are initially divided into contiguous runs, one per
+	worker, so that neighbouring tasks are run by the same thread.
+	Workers that run out of tasks steal half of the remaining work
+	from the most heavily loaded worker, so that a few expensive
+	tasks do not leave the other threads idle.
+
+	nthreads: The maximum number of threads to use. 0 means use
+	one thread per available processor.
+
+	Throws the first error caught in any task.
+*/
+void fz_run_tasks(fz_context *ctx, int nthreads, int ntasks, fz_task_fn *fn, void *arg);
+
+/*
+	fz_available_threads: Return the number of threads that
+	fz_run_tasks would use when asked for nthreads = 0.
+
+	Returns 1 if the library was built without thread support.
+
+	Does not throw exceptions.
+*/
+int fz_available_threads(fz_context *ctx);
+
+#endif
@@ -13,6 +13,8 @@ typedef struct pdf_widget_s pdf_widget;
 typedef struct pdf_hotspot_s pdf_hotspot;
 typedef struct pdf_js_s pdf_js;
 typedef struct pdf_resource_tables_s pdf_resource_tables;
+typedef struct pdf_name_table_s pdf_name_table;
+typedef struct pdf_obj_chunk_s pdf_obj_chunk;
 
 enum
 {
@@ -85,6 +87,30 @@ pdf_document *pdf_open_document(fz_context *ctx, const char *filename);
 */
 pdf_document *pdf_open_document_with_stream(fz_context *ctx, fz_stream *file);
 
+/*
+	pdf_open_document_with_xref_cache: Open a PDF document, using
+	a cache of its cross reference table.
+
+	Same as pdf_open_document, but if the file named by cachename
+	holds the cross reference table and page index of an earlier
+	open of the same, unchanged, file, they are used instead of
+	reading the cross reference sections from the file. Otherwise
+	(or if the cache has grown stale) the file is loaded as usual.
+
+	When the document is dropped the cache file is written, unless
+	the document needed repair or has been changed.
+
+	cachename: a path to the cache file; NULL for no cache.
+*/
+pdf_document *pdf_open_document_with_xref_cache(fz_context *ctx, const char *filename, const char *cachename);
+
+/*
+	pdf_invalidate_xref_cache: Stop the xref cache of a document
+	being written when the document is dropped. Must be called by
+	anything that changes the xref or page tree in place.
+*/
+void pdf_invalidate_xref_cache(fz_context *ctx, pdf_document *doc);
+
 /*
 	pdf_drop_document: Closes and frees an opened PDF document.
 
@@ -197,11 +223,18 @@ struct pdf_document_s
 	int has_xref_streams;
 
 	int page_count;
+	int page_map_len;
+	pdf_obj **page_map; /* Page references by page number, filled in as the page tree is walked */
+
+	char *xref_cache; /* Sidecar file to save the xref and page_map in, or NULL */
+	int64_t xref_cache_mtime;
+	int xref_cache_pages; /* Pages in the cache we loaded, or -1 */
 
 	int repair_attempted;
 
 	/* State indicating which file parsing method we are using */
 	int file_reading_linearly;
+	int file_ranged; /* The file can fetch any range we ask for */
 	fz_off_t file_length;
 
 	pdf_obj *linear_obj; /* Linearized object (if used) */
@@ -267,6 +300,12 @@ struct pdf_document_s
 	fz_font **type3_fonts;
 
 	pdf_resource_tables *resources;
+
+	pdf_name_table *names; /* Interned names; see pdf_new_name */
+
+	int arena_depth; /* > 0 while parsing objects into the arena */
+	int arena_disabled;
+	pdf_obj_chunk *arena; /* Current chunk of the object arena */
 };
 
 /*
@@ -403,6 +442,7 @@ struct pdf_write_options_s
 	int do_clean; /* Sanitize content streams. */
 	int continue_on_error; /* If set, errors are (optionally) counted and writing continues. */
 	int *errors; /* Pointer to a place to store a count of errors */
+	int do_flate_restarts; /* Record restart points in large deflated streams, for parallel inflate. */
 };
 
 /*
@@ -413,6 +453,7 @@ struct pdf_write_options_s
 		l: linearize
 		a: ascii hex encode
 		z: deflate
+		zz: deflate, recording restart points for parallel inflate
 		s: sanitize content streams
 */
 pdf_write_options *pdf_parse_write_options(fz_context *ctx, pdf_write_options *opts, const char *args);
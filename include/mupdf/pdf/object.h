@@ -17,6 +17,23 @@ pdf_obj *pdf_new_int(fz_context *ctx, pdf_document *doc, int i);
 pdf_obj *pdf_new_int_offset(fz_context *ctx, pdf_document *doc, fz_off_t off);
 pdf_obj *pdf_new_real(fz_context *ctx, pdf_document *doc, float f);
 pdf_obj *pdf_new_name(fz_context *ctx, pdf_document *doc, const char *str);
+void pdf_drop_name_table(fz_context *ctx, pdf_document *doc);
+
+/*
+	pdf_begin_object_arena, pdf_end_object_arena: Bracket the parsing
+	of objects from the file. In between, dicts, arrays, strings and
+	references made for doc are allocated from its object arena rather
+	than individually, and ints and reals (on 64 bit systems) are
+	packed into the pdf_obj pointer rather than allocated at all. Ints
+	made this way cannot be changed with pdf_set_int.
+
+	pdf_set_object_arenas: Allow (the default) or prevent the use of
+	the object arena for a document.
+*/
+void pdf_begin_object_arena(fz_context *ctx, pdf_document *doc);
+void pdf_end_object_arena(fz_context *ctx, pdf_document *doc);
+void pdf_set_object_arenas(fz_context *ctx, pdf_document *doc, int enable);
+void pdf_drop_object_arena(fz_context *ctx, pdf_document *doc);
 pdf_obj *pdf_new_string(fz_context *ctx, pdf_document *doc, const char *str, size_t len);
 pdf_obj *pdf_new_indirect(fz_context *ctx, pdf_document *doc, int num, int gen);
 pdf_obj *pdf_new_array(fz_context *ctx, pdf_document *doc, int initialcap);
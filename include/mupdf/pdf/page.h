@@ -5,6 +5,15 @@ int pdf_lookup_page_number(fz_context *ctx, pdf_document *doc, pdf_obj *pageobj)
 int pdf_count_pages(fz_context *ctx, pdf_document *doc);
 pdf_obj *pdf_lookup_page_obj(fz_context *ctx, pdf_document *doc, int needle);
 
+/*
+	pdf_drop_page_map: Forget the page number to page object index.
+
+	The index is built lazily as the page tree is walked, and is kept
+	up to date by pdf_insert_page and pdf_delete_page. Anything else
+	that rewrites the page tree must call this.
+*/
+void pdf_drop_page_map(fz_context *ctx, pdf_document *doc);
+
 /*
 	pdf_lookup_anchor: Find the page number of a named destination.
 
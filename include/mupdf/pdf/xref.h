@@ -80,6 +80,20 @@ pdf_obj *pdf_resolve_indirect(fz_context *ctx, pdf_obj *ref);
 pdf_obj *pdf_resolve_indirect_chain(fz_context *ctx, pdf_obj *ref);
 pdf_obj *pdf_load_object(fz_context *ctx, pdf_document *doc, int num);
 
+/*
+	pdf_prefetch_objects: Load a batch of objects into the xref cache.
+
+	Rather than seeking to each object in turn, the objects are loaded
+	in order of their position in the file, and members of the same
+	object stream are loaded together, so that the file is read in a
+	single forward pass. Objects that cannot be loaded are skipped;
+	the error will be seen again when the object is loaded for real.
+
+	nums: The object numbers to load. Numbers that are out of range,
+	free, or already loaded are ignored.
+*/
+void pdf_prefetch_objects(fz_context *ctx, pdf_document *doc, const int *nums, int n);
+
 fz_buffer *pdf_load_raw_stream(fz_context *ctx, pdf_document *doc, int num);
 fz_buffer *pdf_load_stream(fz_context *ctx, pdf_document *doc, int num);
 fz_stream *pdf_open_raw_stream(fz_context *ctx, pdf_document *doc, int num);
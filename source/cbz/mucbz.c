@@ -223,7 +223,7 @@ cbz_open_document(fz_context *ctx, const char *filename)
 	fz_stream *file;
 	cbz_document *doc;
 
-	file = fz_open_file(ctx, filename);
+	file = fz_open_file_mapped(ctx, filename);
 
 	fz_try(ctx)
 		doc = cbz_open_document_with_stream(ctx, file);
@@ -146,7 +146,7 @@ tiff_open_document(fz_context *ctx, const char *filename)
 	fz_stream *file;
 	tiff_document *doc;
 
-	file = fz_open_file(ctx, filename);
+	file = fz_open_file_mapped(ctx, filename);
 
 	fz_try(ctx)
 		doc = tiff_open_document_with_stream(ctx, file);
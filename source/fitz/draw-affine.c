@@ -3,7 +3,7 @@
 
 typedef unsigned char byte;
 
-typedef void (paintfn_t)(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int n, int alpha, const byte * restrict color, byte * restrict hp);
+typedef fz_affine_painter_t paintfn_t;
 
 static inline int lerp(int a, int b, int t)
 {
@@ -1046,6 +1046,11 @@ paint_affine_lerp_alpha_N(byte * restrict dp, int da, const byte * restrict sp,
 static paintfn_t *
 fz_paint_affine_lerp(int da, int sa, int fa, int fb, int n, int alpha)
 {
+#if FZ_ENABLE_SIMD
+	paintfn_t *simd = fz_get_affine_lerp_painter_simd(da, sa, n, alpha);
+	if (simd)
+		return simd;
+#endif /* FZ_ENABLE_SIMD */
 	switch(n)
 	{
 		case 0:
@@ -1273,6 +1278,11 @@ paint_affine_lerp_g2rgb_alpha(byte * restrict dp, int da, const byte * restrict
 static paintfn_t *
 fz_paint_affine_g2rgb_lerp(int da, int sa, int fa, int fb, int n, int alpha)
 {
+#if FZ_ENABLE_SIMD
+	paintfn_t *simd = fz_get_affine_g2rgb_lerp_painter_simd(da, sa, alpha);
+	if (simd)
+		return simd;
+#endif /* FZ_ENABLE_SIMD */
 	if (da)
 	{
 		if (sa)
@@ -1326,6 +1326,137 @@ fz_default_image_scale(void *arg, int dst_w, int dst_h, int src_w, int src_h)
 	return dst_w < src_w && dst_h < src_h;
 }
 
+/* Images that would take more than this many bytes to hold decoded are
+ * scaled as they are decoded, rather than decoded whole first. */
+#define STREAM_IMAGE_THRESHOLD (4<<20)
+
+static void
+fz_draw_paint_band(fz_context *ctx, fz_draw_device *dev, fz_draw_state *state, fz_pixmap *band)
+{
+	fz_device *devp = &dev->super;
+	fz_colorspace *model = state->dest->colorspace;
+	fz_pixmap *converted = NULL;
+	fz_matrix ctm;
+
+	if (band->colorspace != model)
+	{
+#if FZ_PLOTTERS_RGB
+		if ((band->colorspace == fz_device_gray(ctx) && model == fz_device_rgb(ctx)) ||
+			(band->colorspace == fz_device_gray(ctx) && model == fz_device_bgr(ctx)))
+		{
+			/* We have special case rendering code for gray -> rgb/bgr */
+		}
+		else
+#endif
+		{
+			fz_irect bbox;
+			fz_pixmap_bbox(ctx, band, &bbox);
+			converted = fz_new_pixmap_with_bbox(ctx, model, &bbox, band->alpha);
+			fz_convert_pixmap(ctx, converted, band);
+			band = converted;
+		}
+	}
+
+	ctm.a = band->w;
+	ctm.b = 0;
+	ctm.c = 0;
+	ctm.d = band->h;
+	ctm.e = band->x;
+	ctm.f = band->y;
+	fz_try(ctx)
+		fz_paint_image(state->dest, &state->scissor, state->shape, band, &ctm, 255, !(devp->hints & FZ_DONT_INTERPOLATE_IMAGES), devp->flags & FZ_DEVFLAG_GRIDFIT_AS_TILED);
+	fz_always(ctx)
+		fz_drop_pixmap(ctx, converted);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Draw a large, downscaled, upright image by pulling rows from the
+ * decoder and pushing them through the scaler, painting the result a
+ * band at a time. Returns 0 (having drawn nothing) if the image should
+ * go the usual way instead. */
+static int
+fz_draw_stream_image(fz_context *ctx, fz_draw_device *dev, fz_image *image, const fz_matrix *ctm, const fz_irect *clip)
+{
+	fz_draw_state *state = &dev->stack[dev->top];
+	fz_colorspace *model = state->dest->colorspace;
+	fz_image_rows *rows;
+	fz_scaler *scaler = NULL;
+	fz_pixmap *converted = NULL;
+	fz_pixmap *row, *band;
+	fz_matrix m = *ctm;
+	int w, h;
+
+	if (image->w <= 1 || image->h <= 1)
+		return 0;
+	if ((size_t)image->w * image->h * image->n < STREAM_IMAGE_THRESHOLD)
+		return 0;
+	if (m.a <= 0 || m.b != 0 || m.c != 0 || m.d <= 0)
+		return 0;
+
+	rows = fz_open_image_rows(ctx, image, m.a, m.d);
+	if (!rows)
+		return 0;
+	fz_image_rows_size(ctx, rows, &w, &h);
+	if (!ctx->tuning->image_scale(ctx->tuning->image_scale_arg, m.a, m.d, w, h))
+	{
+		fz_close_image_rows(ctx, rows);
+		return 0;
+	}
+
+	fz_gridfit_matrix(dev->flags & FZ_DEVFLAG_GRIDFIT_AS_TILED, &m);
+
+	fz_var(scaler);
+	fz_var(converted);
+
+	fz_try(ctx)
+	{
+		if (state->blendmode & FZ_BLEND_KNOCKOUT)
+			state = fz_knockout_begin(ctx, dev);
+
+		while ((row = fz_read_image_row(ctx, rows)) != NULL)
+		{
+			/* convert images with more components (cmyk->rgb) before scaling */
+			if (row->colorspace != model && row->colorspace != fz_device_gray(ctx))
+			{
+				if (!converted)
+					converted = fz_new_pixmap(ctx, model, row->w, 1, (model ? row->alpha : 1));
+				fz_convert_pixmap(ctx, converted, row);
+				row = converted;
+			}
+
+			if (!scaler)
+			{
+				scaler = fz_new_scaler(ctx, w, h, row->colorspace, row->alpha, m.e, m.f, m.a, m.d, clip, dev->cache_x, dev->cache_y);
+				/* Nothing of it lands within the clip */
+				if (!scaler)
+					break;
+			}
+
+			fz_scaler_push_row(ctx, scaler, row->samples);
+			while ((band = fz_scaler_band(ctx, scaler)) != NULL)
+				fz_draw_paint_band(ctx, dev, state, band);
+			if (fz_scaler_done(ctx, scaler))
+				break;
+		}
+
+		if (state->blendmode & FZ_BLEND_KNOCKOUT)
+			fz_knockout_end(ctx, dev);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_scaler(ctx, scaler);
+		fz_drop_pixmap(ctx, converted);
+		fz_close_image_rows(ctx, rows);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return 1;
+}
+
 static void
 fz_draw_fill_image(fz_context *ctx, fz_device *devp, fz_image *image, const fz_matrix *in_ctm, float alpha)
 {
@@ -1350,6 +1481,10 @@ fz_draw_fill_image(fz_context *ctx, fz_device *devp, fz_image *image, const fz_m
 	if (image->w == 0 || image->h == 0)
 		return;
 
+	if (alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3) && !(devp->hints & FZ_DONT_INTERPOLATE_IMAGES))
+		if (fz_draw_stream_image(ctx, dev, image, &local_ctm, &clip))
+			return;
+
 	/* ctm maps the image (expressed as the unit square) onto the
 	 * destination device. Reverse that to get a mapping from
 	 * the destination device to the source pixels. */
@@ -2069,13 +2204,23 @@ fz_print_tile(fz_context *ctx, fz_output *out, void *key_)
 	fz_printf(ctx, out, "(tile id=%x, ctm=%g %g %g %g) ", key->id, key->ctm[0], key->ctm[1], key->ctm[2], key->ctm[3]);
 }
 
+static size_t
+fz_tile_cost(fz_context *ctx, void *key_, size_t size)
+{
+	/* Tiles are rendered from whatever was drawn in them, which is
+	 * usually a good deal slower than decoding the same number of bytes
+	 * of image. */
+	return size * 4;
+}
+
 static fz_store_type fz_tile_store_type =
 {
 	fz_make_hash_tile_key,
 	fz_keep_tile_key,
 	fz_drop_tile_key,
 	fz_cmp_tile_key,
-	fz_print_tile
+	fz_print_tile,
+	fz_tile_cost
 };
 
 static void
@@ -23,6 +23,7 @@ struct fz_aa_context_s
 	int scale;
 	int bits;
 	int text_bits;
+	int rasterizer;
 };
 
 void fz_new_aa_context(fz_context *ctx)
@@ -34,12 +35,14 @@ void fz_new_aa_context(fz_context *ctx)
 	ctx->aa->scale = 256;
 	ctx->aa->bits = 8;
 	ctx->aa->text_bits = 8;
+	ctx->aa->rasterizer = FZ_RASTERIZER_GEL;
 
 #define fz_aa_hscale (ctx->aa->hscale)
 #define fz_aa_vscale (ctx->aa->vscale)
 #define fz_aa_scale (ctx->aa->scale)
 #define fz_aa_bits (ctx->aa->bits)
 #define fz_aa_text_bits (ctx->aa->text_bits)
+#define fz_aa_rasterizer (ctx->aa->rasterizer)
 #define AA_SCALE(scale, x) ((x * scale) >> 8)
 
 #endif
@@ -62,6 +65,7 @@ void fz_drop_aa_context(fz_context *ctx)
 #ifdef AA_BITS
 
 #define fz_aa_scale 0
+#define fz_aa_rasterizer FZ_RASTERIZER_GEL
 
 #if AA_BITS > 6
 #define AA_SCALE(s, x) (x)
@@ -119,6 +123,12 @@ fz_text_aa_level(fz_context *ctx)
 	return fz_aa_text_bits;
 }
 
+int
+fz_graphics_rasterizer(fz_context *ctx)
+{
+	return fz_aa_rasterizer;
+}
+
 #ifndef AA_BITS
 static void
 set_gfx_level(fz_context *ctx, int level)
@@ -203,6 +213,19 @@ fz_set_graphics_aa_level(fz_context *ctx, int level)
 #endif
 }
 
+void
+fz_set_graphics_rasterizer(fz_context *ctx, int rasterizer)
+{
+#ifdef AA_BITS
+	fz_warn(ctx, "anti-aliasing was compiled with a fixed precision of %d bits", fz_aa_bits);
+#else
+	if (rasterizer == FZ_RASTERIZER_CELLS)
+		fz_aa_rasterizer = FZ_RASTERIZER_CELLS;
+	else
+		fz_aa_rasterizer = FZ_RASTERIZER_GEL;
+#endif
+}
+
 /*
  * Global Edge List -- list of straight path segments for scan conversion
  *
@@ -221,6 +244,31 @@ struct fz_edge_s
 	int xdir, ydir; /* -1 or +1 */
 };
 
+/*
+ * When the cell rasteriser is in use, the gel holds a list of lines
+ * instead of edges. These are in 24.8 fixed point and always run from
+ * top to bottom, with the winding held separately.
+ */
+
+#define CELL_BITS 8
+#define CELL_ONE (1 << CELL_BITS)
+
+typedef struct fz_line_s fz_line;
+
+struct fz_line_s
+{
+	int x0, y0, x1, y1;
+	int ydir; /* -1 or +1 */
+};
+
+typedef struct fz_cell_s fz_cell;
+
+struct fz_cell_s
+{
+	int x, y;
+	int cover, area;
+};
+
 struct fz_gel_s
 {
 	fz_rect clip;
@@ -229,8 +277,31 @@ struct fz_gel_s
 	fz_edge *edges;
 	int acap, alen;
 	fz_edge **active;
+
+	/* For the cell rasteriser */
+	int cells;
+	int lcap, llen;
+	fz_line *lines;
+	int ccap, clen;
+	fz_cell *cell_list;
+	fz_cell *sorted;
+	int rcap;
+	int *rows;
+	int wcap;
+	unsigned char *alphas;
 };
 
+/* The scale of the gel coordinates to device space */
+static inline int gel_hscale(fz_context *ctx, const fz_gel *gel)
+{
+	return gel->cells ? CELL_ONE : fz_aa_hscale;
+}
+
+static inline int gel_vscale(fz_context *ctx, const fz_gel *gel)
+{
+	return gel->cells ? CELL_ONE : fz_aa_vscale;
+}
+
 #ifdef DUMP_GELS
 static void
 fz_dump_gel(fz_gel *gel)
@@ -286,8 +357,11 @@ fz_new_gel(fz_context *ctx)
 void
 fz_reset_gel(fz_context *ctx, fz_gel *gel, const fz_irect *clip)
 {
-	const int hscale = fz_aa_hscale;
-	const int vscale = fz_aa_vscale;
+	int hscale, vscale;
+
+	gel->cells = fz_aa_bits > 0 && fz_aa_rasterizer == FZ_RASTERIZER_CELLS;
+	hscale = gel_hscale(ctx, gel);
+	vscale = gel_vscale(ctx, gel);
 
 	if (fz_is_infinite_irect(clip))
 	{
@@ -306,6 +380,7 @@ fz_reset_gel(fz_context *ctx, fz_gel *gel, const fz_irect *clip)
 
 	gel->len = 0;
 	gel->alen = 0;
+	gel->llen = 0;
 }
 
 void
@@ -315,16 +390,21 @@ fz_drop_gel(fz_context *ctx, fz_gel *gel)
 		return;
 	fz_free(ctx, gel->active);
 	fz_free(ctx, gel->edges);
+	fz_free(ctx, gel->lines);
+	fz_free(ctx, gel->cell_list);
+	fz_free(ctx, gel->sorted);
+	fz_free(ctx, gel->rows);
+	fz_free(ctx, gel->alphas);
 	fz_free(ctx, gel);
 }
 
 fz_irect *
 fz_bound_gel(fz_context *ctx, const fz_gel *gel, fz_irect *bbox)
 {
-	const int hscale = fz_aa_hscale;
-	const int vscale = fz_aa_vscale;
+	const int hscale = gel_hscale(ctx, gel);
+	const int vscale = gel_vscale(ctx, gel);
 
-	if (gel->len == 0)
+	if ((gel->cells ? gel->llen : gel->len) == 0)
 	{
 		*bbox = fz_empty_irect;
 	}
@@ -341,8 +421,8 @@ fz_bound_gel(fz_context *ctx, const fz_gel *gel, fz_irect *bbox)
 fz_rect *
 fz_gel_scissor(fz_context *ctx, const fz_gel *gel, fz_rect *r)
 {
-	const int hscale = fz_aa_hscale;
-	const int vscale = fz_aa_vscale;
+	const int hscale = gel_hscale(ctx, gel);
+	const int vscale = gel_vscale(ctx, gel);
 
 	r->x0 = gel->clip.x0 / hscale;
 	r->x1 = gel->clip.x1 / vscale;
@@ -409,6 +489,25 @@ fz_insert_gel_raw(fz_context *ctx, fz_gel *gel, int x0, int y0, int x1, int y1)
 	if (y0 < gel->bbox.y0) gel->bbox.y0 = y0;
 	if (y1 > gel->bbox.y1) gel->bbox.y1 = y1;
 
+	if (gel->cells)
+	{
+		fz_line *line;
+
+		if (gel->llen + 1 >= gel->lcap) {
+			int new_cap = gel->lcap ? gel->lcap * 2 : 512;
+			gel->lines = fz_resize_array(ctx, gel->lines, new_cap, sizeof(fz_line));
+			gel->lcap = new_cap;
+		}
+
+		line = &gel->lines[gel->llen++];
+		line->x0 = x0;
+		line->y0 = y0;
+		line->x1 = x1;
+		line->y1 = y1;
+		line->ydir = winding;
+		return;
+	}
+
 	if (gel->len + 1 == gel->cap) {
 		int new_cap = gel->cap * 2;
 		gel->edges = fz_resize_array(ctx, gel->edges, new_cap, sizeof(fz_edge));
@@ -452,8 +551,8 @@ fz_insert_gel(fz_context *ctx, fz_gel *gel, float fx0, float fy0, float fx1, flo
 {
 	int x0, y0, x1, y1;
 	int d, v;
-	const int hscale = fz_aa_hscale;
-	const int vscale = fz_aa_vscale;
+	const int hscale = gel_hscale(ctx, gel);
+	const int vscale = gel_vscale(ctx, gel);
 
 	fx0 = floorf(fx0 * hscale);
 	fx1 = floorf(fx1 * hscale);
@@ -516,8 +615,8 @@ void
 fz_insert_gel_rect(fz_context *ctx, fz_gel *gel, float fx0, float fy0, float fx1, float fy1)
 {
 	int x0, y0, x1, y1;
-	const int hscale = fz_aa_hscale;
-	const int vscale = fz_aa_vscale;
+	const int hscale = gel_hscale(ctx, gel);
+	const int vscale = gel_vscale(ctx, gel);
 
 	if (fx0 <= fx1)
 	{
@@ -574,6 +673,10 @@ fz_sort_gel(fz_context *ctx, fz_gel *gel)
 	int h, i, k;
 	fz_edge t;
 
+	/* the cell rasteriser has no need of a sorted list */
+	if (gel->cells)
+		return;
+
 	/* quick sort for long lists */
 	if (n > 10000)
 	{
@@ -620,6 +723,17 @@ int
 fz_is_rect_gel(fz_context *ctx, fz_gel *gel)
 {
 	/* a rectangular path is converted into two vertical edges of identical height */
+	if (gel->cells)
+	{
+		if (gel->llen == 2)
+		{
+			fz_line *a = gel->lines + 0;
+			fz_line *b = gel->lines + 1;
+			return a->y0 == b->y0 && a->y1 == b->y1 &&
+				a->x0 == a->x1 && b->x0 == b->x1;
+		}
+		return 0;
+	}
 	if (gel->len == 2)
 	{
 		fz_edge *a = gel->edges + 0;
@@ -1022,6 +1136,397 @@ clip_ended:
 	fz_free(ctx, alphas);
 }
 
+/*
+ * Cell based anti-aliased scan conversion.
+ *
+ * Rather than stepping the edges down through sub-scanlines, each line
+ * is walked through the pixel grid once, accumulating for every pixel
+ * ('cell') it passes through the signed height of the line within it
+ * (cover) and twice the area of the pixel to the left of the line
+ * (area), as in FreeType's "gray" rasteriser. The coverage of a pixel is
+ * then the sum of the covers of all the cells to its left on the same
+ * scanline, less the area of its own cell.
+ *
+ * The cells are only sorted within each scanline, and there is no
+ * active edge list to maintain, so this is much faster than the above
+ * for paths made of many short edges. Coverage is always calculated to
+ * the full 8 bits, whatever the anti-aliasing level.
+ *
+ * Where parts of a path overlap within a pixel, their areas are added
+ * rather than merged, so the antialiased edges of self-overlapping
+ * paths (such as the pieces of a thin stroke) come out a little darker
+ * than with the gel.
+ */
+
+typedef struct
+{
+	int x0, y0, x1, y1;	/* clip, in pixels */
+	int ex, ey;		/* current cell */
+	int cover, area;
+} fz_cell_state;
+
+static void
+flush_cell(fz_context *ctx, fz_gel *gel, fz_cell_state *s)
+{
+	fz_cell *cell;
+
+	if (s->cover == 0 && s->area == 0)
+		return;
+
+	/* Cells to the right of the clip cannot affect it. */
+	if (s->ex >= s->x1)
+		return;
+
+	/* The cells are bucketed into 'sorted' later; keep space for them
+	 * there, too. */
+	if (gel->clen == gel->ccap)
+	{
+		int new_cap = gel->ccap ? gel->ccap * 2 : 1024;
+		gel->cell_list = fz_resize_array(ctx, gel->cell_list, new_cap, sizeof(fz_cell));
+		gel->sorted = fz_resize_array(ctx, gel->sorted, new_cap, sizeof(fz_cell));
+		gel->ccap = new_cap;
+	}
+
+	cell = &gel->cell_list[gel->clen++];
+	cell->x = s->ex;
+	cell->y = s->ey - s->y0;
+	cell->cover = s->cover;
+	cell->area = s->area;
+}
+
+static inline void
+set_cell(fz_context *ctx, fz_gel *gel, fz_cell_state *s, int ex, int ey)
+{
+	/* Everything to the left of the clip only contributes its cover,
+	 * so it can all go in the one cell. */
+	if (ex < s->x0)
+		ex = s->x0 - 1;
+
+	if (ex != s->ex || ey != s->ey)
+	{
+		flush_cell(ctx, gel, s);
+		s->ex = ex;
+		s->ey = ey;
+		s->cover = 0;
+		s->area = 0;
+	}
+}
+
+/* Render the part of a line within scanline ey, from (x1, fy1) to
+ * (x2, fy2), where fy1 < fy2 are relative to the top of the scanline. */
+static void
+render_scanline(fz_context *ctx, fz_gel *gel, fz_cell_state *s, int ey, int x1, int fy1, int x2, int fy2, int dir)
+{
+	int ex1 = x1 >> CELL_BITS;
+	int ex2 = x2 >> CELL_BITS;
+	int fx1 = x1 & (CELL_ONE - 1);
+	int fx2 = x2 & (CELL_ONE - 1);
+	int dx, dy, first, incr, p, delta, mod, lift, rem;
+
+	dy = fy2 - fy1;
+	if (dy == 0)
+		return;
+
+	/* Everything in one cell */
+	if (ex1 == ex2)
+	{
+		set_cell(ctx, gel, s, ex1, ey);
+		s->cover += dir * dy;
+		s->area += dir * (fx1 + fx2) * dy;
+		return;
+	}
+
+	/* Otherwise share out dy between the cells we pass through,
+	 * Bresenham style. */
+	dx = x2 - x1;
+	if (dx > 0)
+	{
+		first = CELL_ONE;
+		incr = 1;
+		p = (CELL_ONE - fx1) * dy;
+	}
+	else
+	{
+		first = 0;
+		incr = -1;
+		p = fx1 * dy;
+		dx = -dx;
+	}
+
+	delta = (int)((int64_t)p / dx);
+	mod = (int)((int64_t)p % dx);
+
+	set_cell(ctx, gel, s, ex1, ey);
+	s->cover += dir * delta;
+	s->area += dir * (fx1 + first) * delta;
+	fy1 += delta;
+	ex1 += incr;
+
+	if (ex1 != ex2)
+	{
+		p = CELL_ONE * dy;
+		lift = (int)((int64_t)p / dx);
+		rem = (int)((int64_t)p % dx);
+		mod -= dx;
+
+		do
+		{
+			delta = lift;
+			mod += rem;
+			if (mod >= 0)
+			{
+				mod -= dx;
+				delta++;
+			}
+			set_cell(ctx, gel, s, ex1, ey);
+			s->cover += dir * delta;
+			s->area += dir * CELL_ONE * delta;
+			fy1 += delta;
+			ex1 += incr;
+		}
+		while (ex1 != ex2);
+	}
+
+	set_cell(ctx, gel, s, ex2, ey);
+	s->cover += dir * (fy2 - fy1);
+	s->area += dir * (fx2 + CELL_ONE - first) * (fy2 - fy1);
+}
+
+static void
+render_line(fz_context *ctx, fz_gel *gel, fz_cell_state *s, const fz_line *line)
+{
+	const int top = s->y0 << CELL_BITS;
+	const int bottom = s->y1 << CELL_BITS;
+	int x0 = line->x0, y0 = line->y0;
+	int x1 = line->x1, y1 = line->y1;
+	int dx = x1 - x0;
+	int dy = y1 - y0;
+	int ey, xa, ya, xb, yb, ex, fx;
+
+	if (y1 <= top || y0 >= bottom)
+		return;
+
+	/* Clip to the scanlines we want */
+	if (y0 < top)
+	{
+		x0 = line->x0 + (int)((int64_t)dx * (top - line->y0) / dy);
+		y0 = top;
+	}
+	if (y1 > bottom)
+	{
+		x1 = line->x0 + (int)((int64_t)dx * (bottom - line->y0) / dy);
+		y1 = bottom;
+	}
+
+	ey = y0 >> CELL_BITS;
+
+	/* Vertical lines are common, and simple. */
+	if (dx == 0)
+	{
+		ex = x0 >> CELL_BITS;
+		fx = 2 * (x0 & (CELL_ONE - 1));
+		for (ya = y0; ya < y1; ya = yb, ey++)
+		{
+			yb = fz_mini((ey + 1) << CELL_BITS, y1);
+			set_cell(ctx, gel, s, ex, ey);
+			s->cover += line->ydir * (yb - ya);
+			s->area += line->ydir * fx * (yb - ya);
+		}
+		return;
+	}
+
+	xa = x0;
+	for (ya = y0; ya < y1; ya = yb, xa = xb, ey++)
+	{
+		yb = (ey + 1) << CELL_BITS;
+		if (yb >= y1)
+		{
+			yb = y1;
+			xb = x1;
+		}
+		else
+			xb = line->x0 + (int)((int64_t)dx * (yb - line->y0) / dy);
+		render_scanline(ctx, gel, s, ey, xa, ya - (ey << CELL_BITS), xb, yb - (ey << CELL_BITS), line->ydir);
+	}
+}
+
+static inline int
+cell_coverage(int area, int eofill)
+{
+	int c = fz_absi(area) >> (2 * CELL_BITS + 1 - 8);
+	if (eofill)
+	{
+		c &= 511;
+		if (c > 256)
+			c = 512 - c;
+	}
+	return c > 255 ? 255 : c;
+}
+
+static int
+cmpcell(const void *va, const void *vb)
+{
+	const fz_cell *a = va;
+	const fz_cell *b = vb;
+	return a->x - b->x;
+}
+
+static void
+sort_cells(fz_cell *a, int n)
+{
+	int i, k;
+	fz_cell t;
+
+	/* quick sort for long lists */
+	if (n > 16)
+	{
+		qsort(a, n, sizeof *a, cmpcell);
+		return;
+	}
+
+	/* insertion sort for short lists */
+	for (i = 1; i < n; i++)
+	{
+		t = a[i];
+		k = i - 1;
+		while (k >= 0 && a[k].x > t.x)
+		{
+			a[k + 1] = a[k];
+			k--;
+		}
+		a[k + 1] = t;
+	}
+}
+
+static void
+fz_scan_convert_cells(fz_context *ctx, fz_gel *gel, int eofill, const fz_irect *clip, fz_pixmap *dst, unsigned char *color, void *painter)
+{
+	fz_cell_state s;
+	fz_cell *cells;
+	unsigned char *alphas;
+	int *rows;
+	int w = clip->x1 - clip->x0;
+	int h = clip->y1 - clip->y0;
+	int i, y, end, cover, x, minx, maxx, v;
+
+	if (gel->llen == 0)
+		return;
+
+	/* Turn the lines into cells */
+	s.x0 = clip->x0;
+	s.y0 = clip->y0;
+	s.x1 = clip->x1;
+	s.y1 = clip->y1;
+	s.ex = s.x0 - 1;
+	s.ey = s.y0;
+	s.cover = 0;
+	s.area = 0;
+	gel->clen = 0;
+	for (i = 0; i < gel->llen; i++)
+		render_line(ctx, gel, &s, &gel->lines[i]);
+	flush_cell(ctx, gel, &s);
+	if (gel->clen == 0)
+		return;
+
+	if (gel->rcap < h + 1)
+	{
+		gel->rows = fz_resize_array(ctx, gel->rows, h + 1, sizeof(int));
+		gel->rcap = h + 1;
+	}
+	if (gel->wcap < w)
+	{
+		fz_free(ctx, gel->alphas);
+		gel->alphas = NULL;
+		gel->wcap = 0;
+		gel->alphas = fz_calloc(ctx, w, 1);
+		gel->wcap = w;
+	}
+
+	/* Bucket the cells by scanline; rows[y] is the end of scanline y. */
+	rows = gel->rows;
+	cells = gel->sorted;
+	alphas = gel->alphas;
+	memset(rows, 0, (h + 1) * sizeof(int));
+	for (i = 0; i < gel->clen; i++)
+		rows[gel->cell_list[i].y + 1]++;
+	for (y = 1; y <= h; y++)
+		rows[y] += rows[y - 1];
+	for (i = 0; i < gel->clen; i++)
+		cells[rows[gel->cell_list[i].y]++] = gel->cell_list[i];
+
+	i = 0;
+	for (y = 0; y < h; y++)
+	{
+		end = rows[y];
+		if (i == end)
+			continue;
+
+		sort_cells(cells + i, end - i);
+
+		cover = 0;
+		x = clip->x0;
+		minx = clip->x1;
+		maxx = clip->x0;
+		while (i < end)
+		{
+			int cx = cells[i].x;
+			int c = 0;
+			int area = 0;
+
+			do
+			{
+				c += cells[i].cover;
+				area += cells[i].area;
+				i++;
+			}
+			while (i < end && cells[i].x == cx);
+
+			/* The run of pixels since the last cell */
+			if (cover != 0 && cx > x)
+			{
+				v = cell_coverage(cover * 2 * CELL_ONE, eofill);
+				if (v)
+				{
+					memset(alphas + x - clip->x0, v, cx - x);
+					minx = fz_mini(minx, x);
+					maxx = fz_maxi(maxx, cx);
+				}
+			}
+
+			cover += c;
+			if (cx >= clip->x0)
+			{
+				v = cell_coverage(cover * 2 * CELL_ONE - area, eofill);
+				if (v)
+				{
+					alphas[cx - clip->x0] = v;
+					minx = fz_mini(minx, cx);
+					maxx = fz_maxi(maxx, cx + 1);
+				}
+			}
+			x = cx + 1;
+		}
+
+		/* Anything left open runs off to the right of the clip. */
+		if (cover != 0 && x < clip->x1)
+		{
+			v = cell_coverage(cover * 2 * CELL_ONE, eofill);
+			if (v)
+			{
+				memset(alphas + x - clip->x0, v, clip->x1 - x);
+				minx = fz_mini(minx, x);
+				maxx = clip->x1;
+			}
+		}
+
+		if (minx < maxx)
+		{
+			blit_aa(dst, minx, clip->y0 + y, alphas + minx - clip->x0, maxx - minx, color, painter);
+			memset(alphas + minx - clip->x0, 0, maxx - minx);
+		}
+	}
+}
+
 /*
  * Sharp (not anti-aliased) scan conversion
  */
@@ -1139,7 +1644,7 @@ fz_scan_convert(fz_context *ctx, fz_gel *gel, int eofill, const fz_irect *clip,
 	if (fz_is_empty_irect(fz_intersect_irect(fz_pixmap_bbox_no_ctx(dst, &local_clip), clip)))
 		return;
 
-	if (fz_aa_bits > 0)
+	if (gel->cells || fz_aa_bits > 0)
 	{
 		void *fn;
 		if (color)
@@ -1149,7 +1654,10 @@ fz_scan_convert(fz_context *ctx, fz_gel *gel, int eofill, const fz_irect *clip,
 		assert(fn);
 		if (fn == NULL)
 			return;
-		fz_scan_convert_aa(ctx, gel, eofill, &local_clip, dst, color, fn);
+		if (gel->cells)
+			fz_scan_convert_cells(ctx, gel, eofill, &local_clip, dst, color, fn);
+		else
+			fz_scan_convert_aa(ctx, gel, eofill, &local_clip, dst, color, fn);
 	}
 	else
 	{
@@ -1,12 +1,18 @@
 #include "mupdf/fitz.h"
 #include "draw-imp.h"
+#include "fitz-imp.h"
 
 #define MAX_GLYPH_SIZE 256
-#define MAX_CACHE_SIZE (1024*1024)
 
 #define GLYPH_HASH_LEN 509
 
+/* Number of shards for a cache shared between threads; must be a power
+ * of 2. A cache that can only ever be used by one thread has just the
+ * one shard. */
+#define GLYPH_SHARDS 16
+
 typedef struct fz_glyph_cache_entry_s fz_glyph_cache_entry;
+typedef struct fz_glyph_cache_shard_s fz_glyph_cache_shard;
 typedef struct fz_glyph_key_s fz_glyph_key;
 
 struct fz_glyph_key_s
@@ -30,10 +36,19 @@ struct fz_glyph_cache_entry_s
 	fz_glyph *val;
 };
 
-struct fz_glyph_cache_s
+/*
+	Each shard is a hash table with its own LRU list and its own share
+	of the cache size, so threads drawing different glyphs rarely
+	contend for the same lock. When the library is built without thread
+	support, all the shards are guarded by FZ_LOCK_GLYPHCACHE.
+*/
+struct fz_glyph_cache_shard_s
 {
-	int refs;
+#ifdef FZ_THREADS
+	MUTEX mutex;
+#endif
 	size_t total;
+	size_t max;
 #ifndef NDEBUG
 	int num_evictions;
 	ptrdiff_t evicted;
@@ -43,82 +58,197 @@ struct fz_glyph_cache_s
 	fz_glyph_cache_entry *lru_tail;
 };
 
+struct fz_glyph_cache_s
+{
+	int refs;
+	size_t max;
+	int nshards;
+	fz_glyph_cache_shard *shard;
+};
+
+static inline void
+lock_shard(fz_context *ctx, fz_glyph_cache_shard *shard)
+{
+#ifdef FZ_THREADS
+	MUTEX_LOCK(shard->mutex);
+#else
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+#endif
+}
+
+static inline void
+unlock_shard(fz_context *ctx, fz_glyph_cache_shard *shard)
+{
+#ifdef FZ_THREADS
+	MUTEX_UNLOCK(shard->mutex);
+#else
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+#endif
+}
+
 void
 fz_new_glyph_cache_context(fz_context *ctx)
 {
 	fz_glyph_cache *cache;
+	int i;
 
 	cache = fz_malloc_struct(ctx, fz_glyph_cache);
-	cache->total = 0;
+	fz_try(ctx)
+	{
+		/* Contexts without locks cannot be cloned, so there is no
+		 * point in sharding their cache. */
+		cache->nshards = ctx->locks == &fz_locks_default ? 1 : GLYPH_SHARDS;
+		cache->shard = fz_malloc_array(ctx, cache->nshards, sizeof(fz_glyph_cache_shard));
+		memset(cache->shard, 0, cache->nshards * sizeof(fz_glyph_cache_shard));
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, cache);
+		fz_rethrow(ctx);
+	}
 	cache->refs = 1;
+	cache->max = FZ_GLYPH_CACHE_DEFAULT;
+	for (i = 0; i < cache->nshards; i++)
+	{
+#ifdef FZ_THREADS
+		MUTEX_INIT(cache->shard[i].mutex);
+#endif
+		cache->shard[i].max = cache->max / cache->nshards;
+	}
 
 	ctx->glyph_cache = cache;
 }
 
+/* The shard lock is always held when this function is called. */
 static void
-drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_entry *entry)
+drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
-
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	if (entry->lru_prev)
 		entry->lru_prev->lru_next = entry->lru_next;
 	else
-		cache->lru_head = entry->lru_next;
-	cache->total -= fz_glyph_size(ctx, entry->val);
+		shard->lru_head = entry->lru_next;
+	shard->total -= fz_glyph_size(ctx, entry->val);
 	if (entry->bucket_next)
 		entry->bucket_next->bucket_prev = entry->bucket_prev;
 	if (entry->bucket_prev)
 		entry->bucket_prev->bucket_next = entry->bucket_next;
 	else
-		cache->entry[entry->hash] = entry->bucket_next;
+		shard->entry[entry->hash] = entry->bucket_next;
 	fz_drop_font(ctx, entry->key.font);
 	fz_drop_glyph(ctx, entry->val);
 	fz_free(ctx, entry);
 }
 
-/* The glyph cache lock is always held when this function is called. */
+/* The shard lock is always held when this function is called. */
 static void
-do_purge(fz_context *ctx)
+do_purge(fz_context *ctx, fz_glyph_cache_shard *shard)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
 	int i;
 
 	for (i = 0; i < GLYPH_HASH_LEN; i++)
 	{
-		while (cache->entry[i])
-			drop_glyph_cache_entry(ctx, cache->entry[i]);
+		while (shard->entry[i])
+			drop_glyph_cache_entry(ctx, shard, shard->entry[i]);
 	}
 
-	cache->total = 0;
+	shard->total = 0;
+}
+
+/* The shard lock is always held when this function is called.
+ * A glyph that has just been inserted can be kept, even if it is too
+ * big for the shard on its own; a shard's share of the cache is much
+ * smaller than the cache, and glyphs that fit in the cache as a whole
+ * should still be cached. */
+static void
+do_evict(fz_context *ctx, fz_glyph_cache_shard *shard, fz_glyph_cache_entry *keep)
+{
+	while (shard->total > shard->max && shard->lru_tail && shard->lru_tail != keep)
+	{
+#ifndef NDEBUG
+		shard->num_evictions++;
+		shard->evicted += fz_glyph_size(ctx, shard->lru_tail->val);
+#endif
+		drop_glyph_cache_entry(ctx, shard, shard->lru_tail);
+	}
 }
 
 void
 fz_purge_glyph_cache(fz_context *ctx)
 {
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	for (i = 0; i < cache->nshards; i++)
+	{
+		lock_shard(ctx, &cache->shard[i]);
+		do_purge(ctx, &cache->shard[i]);
+		unlock_shard(ctx, &cache->shard[i]);
+	}
+}
+
+void
+fz_set_glyph_cache_size(fz_context *ctx, size_t size)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	cache->max = size;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+
+	for (i = 0; i < cache->nshards; i++)
+	{
+		lock_shard(ctx, &cache->shard[i]);
+		cache->shard[i].max = size / cache->nshards;
+		do_evict(ctx, &cache->shard[i], NULL);
+		unlock_shard(ctx, &cache->shard[i]);
+	}
+}
+
+size_t
+fz_glyph_cache_size(fz_context *ctx)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	size_t size;
+
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	do_purge(ctx);
+	size = cache->max;
 	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	return size;
 }
 
 void
 fz_drop_glyph_cache_context(fz_context *ctx)
 {
-	if (!ctx->glyph_cache)
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i, drop;
+
+	if (!cache)
 		return;
 
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	ctx->glyph_cache->refs--;
-	if (ctx->glyph_cache->refs == 0)
+	drop = --cache->refs == 0;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	ctx->glyph_cache = NULL;
+
+	if (!drop)
+		return;
+
+	/* Nobody else can see the cache now, so there is no need to lock
+	 * the shards. */
+	for (i = 0; i < cache->nshards; i++)
 	{
-		do_purge(ctx);
-		fz_free(ctx, ctx->glyph_cache);
-		ctx->glyph_cache = NULL;
+		do_purge(ctx, &cache->shard[i]);
+#ifdef FZ_THREADS
+		MUTEX_FIN(cache->shard[i].mutex);
+#endif
 	}
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	fz_free(ctx, cache->shard);
+	fz_free(ctx, cache);
 }
 
 fz_glyph_cache *
@@ -221,7 +351,7 @@ static unsigned do_hash(unsigned char *s, int len)
 }
 
 static inline void
-move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+move_to_front(fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
 {
 	if (entry->lru_prev == NULL)
 		return; /* At front already */
@@ -231,30 +361,46 @@ move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	/* Relink */
-	entry->lru_next = cache->lru_head;
+	entry->lru_next = shard->lru_head;
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry;
-	cache->lru_head = entry;
+	shard->lru_head = entry;
 	entry->lru_prev = NULL;
 }
 
+/* The shard lock is always held when this function is called. */
+static fz_glyph *
+lookup_glyph(fz_context *ctx, fz_glyph_cache_shard *shard, unsigned hash, const fz_glyph_key *key)
+{
+	fz_glyph_cache_entry *entry = shard->entry[hash];
+	while (entry)
+	{
+		if (memcmp(&entry->key, key, sizeof(*key)) == 0)
+		{
+			move_to_front(shard, entry);
+			return fz_keep_glyph(ctx, entry->val);
+		}
+		entry = entry->bucket_next;
+	}
+	return NULL;
+}
+
 fz_glyph *
 fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colorspace *model, const fz_irect *scissor, int alpha)
 {
 	fz_glyph_cache *cache;
+	fz_glyph_cache_shard *shard;
 	fz_glyph_key key;
 	fz_matrix subpix_ctm;
 	fz_irect subpix_scissor;
 	float size;
-	fz_glyph *val;
-	int do_cache, locked, caching;
+	fz_glyph *val, *old;
+	int do_cache;
 	fz_glyph_cache_entry *entry;
 	unsigned hash;
 
-	fz_var(locked);
-	fz_var(caching);
 	fz_var(val);
 
 	memset(&key, 0, sizeof key);
@@ -286,121 +432,73 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	key.d = subpix_ctm.d * 65536;
 	key.aa = fz_text_aa_level(ctx);
 
-	hash = do_hash((unsigned char *)&key, sizeof(key)) % GLYPH_HASH_LEN;
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	entry = cache->entry[hash];
-	while (entry)
-	{
-		if (memcmp(&entry->key, &key, sizeof(key)) == 0)
-		{
-			move_to_front(cache, entry);
-			val = fz_keep_glyph(ctx, entry->val);
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			return val;
-		}
-		entry = entry->bucket_next;
-	}
+	hash = do_hash((unsigned char *)&key, sizeof(key));
+	shard = &cache->shard[hash & (cache->nshards - 1)];
+	hash = (hash / cache->nshards) % GLYPH_HASH_LEN;
+
+	lock_shard(ctx, shard);
+	val = lookup_glyph(ctx, shard, hash, &key);
+	unlock_shard(ctx, shard);
+	if (val)
+		return val;
+
+	/* Render the glyph without holding the lock. The danger here is
+	 * that some other thread will come along, and want the same glyph
+	 * too. If it does, we may both end up rendering it. We cope with
+	 * this later on, by ensuring that only one gets inserted into the
+	 * cache. If we insert ours to find one already there, we abandon
+	 * ours, and use the one there already. */
+	if (font->ft_face)
+		val = fz_render_ft_glyph(ctx, font, gid, &subpix_ctm, key.aa);
+	else if (font->t3procs)
+		val = fz_render_t3_glyph(ctx, font, gid, &subpix_ctm, model, scissor);
+	else
+		fz_warn(ctx, "assert: uninitialized font structure");
 
-	locked = 1;
-	caching = 0;
-	val = NULL;
+	if (!val || !do_cache || val->w >= MAX_GLYPH_SIZE || val->h >= MAX_GLYPH_SIZE)
+		return val;
 
+	lock_shard(ctx, shard);
 	fz_try(ctx)
 	{
-		if (font->ft_face)
-		{
-			val = fz_render_ft_glyph(ctx, font, gid, &subpix_ctm, key.aa);
-		}
-		else if (font->t3procs)
+		old = lookup_glyph(ctx, shard, hash, &key);
+		if (old)
 		{
-			/* We drop the glyphcache here, and execute the t3
-			 * glyph code. The danger here is that some other
-			 * thread will come along, and want the same glyph
-			 * too. If it does, we may both end up rendering
-			 * pixmaps. We cope with this later on, by ensuring
-			 * that only one gets inserted into the cache. If
-			 * we insert ours to find one already there, we
-			 * abandon ours, and use the one there already.
-			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			locked = 0;
-			val = fz_render_t3_glyph(ctx, font, gid, &subpix_ctm, model, scissor);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-			locked = 1;
+			fz_drop_glyph(ctx, val);
+			val = old;
 		}
 		else
 		{
-			fz_warn(ctx, "assert: uninitialized font structure");
-		}
-		if (val && do_cache)
-		{
-			if (val->w < MAX_GLYPH_SIZE && val->h < MAX_GLYPH_SIZE)
-			{
-				/* If we throw an exception whilst caching,
-				 * just ignore the exception and carry on. */
-				caching = 1;
-				if (!font->ft_face)
-				{
-					/* We had to unlock. Someone else might
-					 * have rendered in the meantime */
-					entry = cache->entry[hash];
-					while (entry)
-					{
-						if (memcmp(&entry->key, &key, sizeof(key)) == 0)
-						{
-							fz_drop_glyph(ctx, val);
-							move_to_front(cache, entry);
-							val = fz_keep_glyph(ctx, entry->val);
-							goto unlock_and_return_val;
-						}
-						entry = entry->bucket_next;
-					}
-				}
-
-				entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
-				entry->key = key;
-				entry->hash = hash;
-				entry->bucket_next = cache->entry[hash];
-				if (entry->bucket_next)
-					entry->bucket_next->bucket_prev = entry;
-				cache->entry[hash] = entry;
-				entry->val = fz_keep_glyph(ctx, val);
-				fz_keep_font(ctx, key.font);
-
-				entry->lru_next = cache->lru_head;
-				if (entry->lru_next)
-					entry->lru_next->lru_prev = entry;
-				else
-					cache->lru_tail = entry;
-				cache->lru_head = entry;
-
-				cache->total += fz_glyph_size(ctx, val);
-				while (cache->total > MAX_CACHE_SIZE)
-				{
-#ifndef NDEBUG
-					cache->num_evictions++;
-					cache->evicted += fz_glyph_size(ctx, cache->lru_tail->val);
-#endif
-					drop_glyph_cache_entry(ctx, cache->lru_tail);
-				}
-
-			}
-		}
-unlock_and_return_val:
-		{
+			entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
+			entry->key = key;
+			entry->hash = hash;
+			entry->bucket_next = shard->entry[hash];
+			if (entry->bucket_next)
+				entry->bucket_next->bucket_prev = entry;
+			shard->entry[hash] = entry;
+			entry->val = fz_keep_glyph(ctx, val);
+			fz_keep_font(ctx, key.font);
+
+			entry->lru_next = shard->lru_head;
+			if (entry->lru_next)
+				entry->lru_next->lru_prev = entry;
+			else
+				shard->lru_tail = entry;
+			shard->lru_head = entry;
+
+			shard->total += fz_glyph_size(ctx, val);
+			do_evict(ctx, shard, entry);
 		}
 	}
 	fz_always(ctx)
 	{
-		if (locked)
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+		unlock_shard(ctx, shard);
 	}
 	fz_catch(ctx)
 	{
-		if (caching)
-			fz_warn(ctx, "cannot encache glyph; continuing");
-		else
-			fz_rethrow(ctx);
+		/* If we throw an exception whilst caching,
+		 * just ignore the exception and carry on. */
+		fz_warn(ctx, "cannot encache glyph; continuing");
 	}
 
 	return val;
@@ -452,9 +550,26 @@ void
 fz_dump_glyph_cache_stats(fz_context *ctx)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
+	size_t total = 0;
+#ifndef NDEBUG
+	int num_evictions = 0;
+	ptrdiff_t evicted = 0;
+#endif
+	int i;
+
+	for (i = 0; i < cache->nshards; i++)
+	{
+		lock_shard(ctx, &cache->shard[i]);
+		total += cache->shard[i].total;
+#ifndef NDEBUG
+		num_evictions += cache->shard[i].num_evictions;
+		evicted += cache->shard[i].evicted;
+#endif
+		unlock_shard(ctx, &cache->shard[i]);
+	}
 
-	fprintf(stderr, "Glyph Cache Size: " FMT_zu "\n", cache->total);
+	fprintf(stderr, "Glyph Cache Size: " FMT_zu "\n", total);
 #ifndef NDEBUG
-	fprintf(stderr, "Glyph Cache Evictions: %d (" FMT_zu " bytes)\n", cache->num_evictions, cache->evicted);
+	fprintf(stderr, "Glyph Cache Evictions: %d (" FMT_zu " bytes)\n", num_evictions, evicted);
 #endif
 }
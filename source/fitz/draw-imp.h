@@ -38,6 +38,16 @@ fz_solid_color_painter_t *fz_get_solid_color_painter(int n, const unsigned char
 fz_span_painter_t *fz_get_span_painter(int da, int sa, int n, int alpha);
 fz_span_color_painter_t *fz_get_span_color_painter(int n, int da, const unsigned char * restrict color);
 
+/* SIMD versions of the above, or NULL if there is none for this case on this CPU. */
+fz_solid_color_painter_t *fz_get_solid_color_painter_simd(int n, const unsigned char * restrict color, int da);
+fz_span_painter_t *fz_get_span_painter_simd(int da, int sa, int n, int alpha);
+fz_span_color_painter_t *fz_get_span_color_painter_simd(int n, int da, const unsigned char * restrict color);
+
+typedef void (fz_affine_painter_t)(unsigned char * restrict dp, int da, const unsigned char * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int n, int alpha, const unsigned char * restrict color, unsigned char * restrict hp);
+
+fz_affine_painter_t *fz_get_affine_lerp_painter_simd(int da, int sa, int n, int alpha);
+fz_affine_painter_t *fz_get_affine_g2rgb_lerp_painter_simd(int da, int sa, int alpha);
+
 void fz_paint_image(fz_pixmap * restrict dst, const fz_irect * restrict scissor, fz_pixmap * restrict shape, const fz_pixmap * restrict img, const fz_matrix * restrict ctm, int alpha, int lerp_allowed, int gridfit_as_tiled);
 void fz_paint_image_with_color(fz_pixmap * restrict dst, const fz_irect * restrict scissor, fz_pixmap *restrict shape, const fz_pixmap * restrict img, const fz_matrix * restrict ctm, const unsigned char * restrict colorbv, int lerp_allowed, int gridfit_as_tiled);
 
@@ -50,4 +60,21 @@ void fz_blend_pixel(unsigned char dp[3], unsigned char bp[3], unsigned char sp[3
 
 void fz_paint_glyph(const unsigned char * restrict colorbv, fz_pixmap * restrict dst, unsigned char * restrict dp, const fz_glyph * restrict glyph, int w, int h, int skip_x, int skip_y);
 
+/*
+ * Streaming scaler. Source rows are pushed in from the top; the scaled
+ * result comes back a band at a time. After each push, call
+ * fz_scaler_band until it returns NULL, and paint each band before
+ * asking for the next. fz_new_scaler returns NULL for the cases it cannot
+ * stream (vertical flips, fractional placement), which should go
+ * through fz_scale_pixmap instead.
+ */
+
+typedef struct fz_scaler_s fz_scaler;
+
+fz_scaler *fz_new_scaler(fz_context *ctx, int src_w, int src_h, fz_colorspace *colorspace, int alpha, float x, float y, float w, float h, const fz_irect *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y);
+void fz_scaler_push_row(fz_context *ctx, fz_scaler *s, const unsigned char *row);
+fz_pixmap *fz_scaler_band(fz_context *ctx, fz_scaler *s);
+int fz_scaler_done(fz_context *ctx, fz_scaler *s);
+void fz_drop_scaler(fz_context *ctx, fz_scaler *s);
+
 #endif
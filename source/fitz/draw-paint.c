@@ -465,6 +465,11 @@ static void paint_solid_color_N_da(byte * restrict dp, int n, int w, const byte
 fz_solid_color_painter_t *
 fz_get_solid_color_painter(int n, const byte * restrict color, int da)
 {
+#if FZ_ENABLE_SIMD
+	fz_solid_color_painter_t *simd = fz_get_solid_color_painter_simd(n, color, da);
+	if (simd)
+		return simd;
+#endif /* FZ_ENABLE_SIMD */
 	switch (n-da)
 	{
 		case 0:
@@ -818,6 +823,11 @@ paint_span_with_color_N_da(byte * restrict dp, const byte * restrict mp, int n,
 fz_span_color_painter_t *
 fz_get_span_color_painter(int n, int da, const byte * restrict color)
 {
+#if FZ_ENABLE_SIMD
+	fz_span_color_painter_t *simd = fz_get_span_color_painter_simd(n, da, color);
+	if (simd)
+		return simd;
+#endif /* FZ_ENABLE_SIMD */
 	switch(n-da)
 	{
 	case 0: return da ? paint_span_with_color_0_da : NULL;
@@ -1937,6 +1947,11 @@ paint_span_N_alpha(byte * restrict dp, int da, const byte * restrict sp, int sa,
 fz_span_painter_t *
 fz_get_span_painter(int da, int sa, int n, int alpha)
 {
+#if FZ_ENABLE_SIMD
+	fz_span_painter_t *simd = fz_get_span_painter_simd(da, sa, n, alpha);
+	if (simd)
+		return simd;
+#endif /* FZ_ENABLE_SIMD */
 	switch (n)
 	{
 	case 0:
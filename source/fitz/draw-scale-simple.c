@@ -1526,27 +1526,24 @@ fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, floa
 	return fz_scale_pixmap_cached(ctx, src, x, y, w, h, clip, NULL, NULL);
 }
 
-fz_pixmap *
-fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y, float w, float h, const fz_irect *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y)
+typedef struct fz_scale_geometry_s
 {
-	fz_scale_filter *filter = &fz_scale_filter_simple;
-	fz_weights *contrib_rows = NULL;
-	fz_weights *contrib_cols = NULL;
-	fz_pixmap *output = NULL;
-	unsigned char *temp = NULL;
-	int max_row, temp_span, temp_rows, row;
-	int dst_w_int, dst_h_int, dst_x_int, dst_y_int;
+	float x, y, w, h; /* sub pixel offsets, and absolute scaled size */
+	int dst_x_int, dst_y_int, dst_w_int, dst_h_int;
 	int flip_x, flip_y, forcealpha;
 	fz_rect patch;
+} fz_scale_geometry;
 
-	fz_var(contrib_cols);
-	fz_var(contrib_rows);
-
+/* Work out where a source scaled to (x, y, w, h) lands, and which part
+ * of it lies within clip. Returns 0 if there is nothing to do. */
+static int
+scale_geometry(fz_scale_geometry *g, int src_alpha, float x, float y, float w, float h, const fz_irect *clip)
+{
 	/* Avoid extreme scales where overflows become problematic. */
 	if (w > (1<<24) || h > (1<<24) || w < -(1<<24) || h < -(1<<24))
-		return NULL;
+		return 0;
 	if (x > (1<<24) || y > (1<<24) || x < -(1<<24) || y < -(1<<24))
-		return NULL;
+		return 0;
 
 	/* Clamp small ranges of w and h */
 	if (w <= -1)
@@ -1574,7 +1571,7 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 
 	/* If the src has an alpha, we'll make the dst have an alpha automatically.
 	 * We also need to force the dst to have an alpha if x/y/w/h aren't ints. */
-	forcealpha = !src->alpha && (x != (float)(int)x || y != (float)(int)y || w != (float)(int)w || h != (float)(int)h);
+	g->forcealpha = !src_alpha && (x != (float)(int)x || y != (float)(int)y || w != (float)(int)w || h != (float)(int)h);
 
 	/* Find the destination bbox, width/height, and sub pixel offset,
 	 * allowing for whether we're flipping or not. */
@@ -1597,97 +1594,121 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 	/* dst_x_int is calculated to be the left of the scaled image, and
 	 * x (the sub pixel offset) is the distance in from either the left
 	 * or right pixel expanded edge. */
-	flip_x = (w < 0);
-	if (flip_x)
+	g->flip_x = (w < 0);
+	if (g->flip_x)
 	{
 		float tmp;
 		w = -w;
-		dst_x_int = floorf(x-w);
+		g->dst_x_int = floorf(x-w);
 		tmp = ceilf(x);
-		dst_w_int = (int)tmp;
+		g->dst_w_int = (int)tmp;
 		x = tmp - x;
-		dst_w_int -= dst_x_int;
+		g->dst_w_int -= g->dst_x_int;
 	}
 	else
 	{
-		dst_x_int = floorf(x);
-		x -= (float)dst_x_int;
-		dst_w_int = (int)ceilf(x + w);
+		g->dst_x_int = floorf(x);
+		x -= (float)g->dst_x_int;
+		g->dst_w_int = (int)ceilf(x + w);
 	}
 	/* dst_y_int is calculated to be the top of the scaled image, and
 	 * y (the sub pixel offset) is the distance in from either the top
 	 * or bottom pixel expanded edge.
 	 */
-	flip_y = (h < 0);
-	if (flip_y)
+	g->flip_y = (h < 0);
+	if (g->flip_y)
 	{
 		float tmp;
 		h = -h;
-		dst_y_int = floorf(y-h);
+		g->dst_y_int = floorf(y-h);
 		tmp = ceilf(y);
-		dst_h_int = (int)tmp;
+		g->dst_h_int = (int)tmp;
 		y = tmp - y;
-		dst_h_int -= dst_y_int;
+		g->dst_h_int -= g->dst_y_int;
 	}
 	else
 	{
-		dst_y_int = floorf(y);
-		y -= (float)dst_y_int;
-		dst_h_int = (int)ceilf(y + h);
+		g->dst_y_int = floorf(y);
+		y -= (float)g->dst_y_int;
+		g->dst_h_int = (int)ceilf(y + h);
 	}
 
-	fz_valgrind_pixmap(src);
-
 	/* Step 0: Calculate the patch */
-	patch.x0 = 0;
-	patch.y0 = 0;
-	patch.x1 = dst_w_int;
-	patch.y1 = dst_h_int;
+	g->patch.x0 = 0;
+	g->patch.y0 = 0;
+	g->patch.x1 = g->dst_w_int;
+	g->patch.y1 = g->dst_h_int;
 	if (clip)
 	{
-		if (flip_x)
+		if (g->flip_x)
 		{
-			if (dst_x_int + dst_w_int > clip->x1)
-				patch.x0 = dst_x_int + dst_w_int - clip->x1;
-			if (clip->x0 > dst_x_int)
+			if (g->dst_x_int + g->dst_w_int > clip->x1)
+				g->patch.x0 = g->dst_x_int + g->dst_w_int - clip->x1;
+			if (clip->x0 > g->dst_x_int)
 			{
-				patch.x1 = dst_w_int - (clip->x0 - dst_x_int);
-				dst_x_int = clip->x0;
+				g->patch.x1 = g->dst_w_int - (clip->x0 - g->dst_x_int);
+				g->dst_x_int = clip->x0;
 			}
 		}
 		else
 		{
-			if (dst_x_int + dst_w_int > clip->x1)
-				patch.x1 = clip->x1 - dst_x_int;
-			if (clip->x0 > dst_x_int)
+			if (g->dst_x_int + g->dst_w_int > clip->x1)
+				g->patch.x1 = clip->x1 - g->dst_x_int;
+			if (clip->x0 > g->dst_x_int)
 			{
-				patch.x0 = clip->x0 - dst_x_int;
-				dst_x_int += patch.x0;
+				g->patch.x0 = clip->x0 - g->dst_x_int;
+				g->dst_x_int += g->patch.x0;
 			}
 		}
 
-		if (flip_y)
+		if (g->flip_y)
 		{
-			if (dst_y_int + dst_h_int > clip->y1)
-				patch.y1 = clip->y1 - dst_y_int;
-			if (clip->y0 > dst_y_int)
+			if (g->dst_y_int + g->dst_h_int > clip->y1)
+				g->patch.y1 = clip->y1 - g->dst_y_int;
+			if (clip->y0 > g->dst_y_int)
 			{
-				patch.y0 = clip->y0 - dst_y_int;
-				dst_y_int = clip->y0;
+				g->patch.y0 = clip->y0 - g->dst_y_int;
+				g->dst_y_int = clip->y0;
 			}
 		}
 		else
 		{
-			if (dst_y_int + dst_h_int > clip->y1)
-				patch.y1 = clip->y1 - dst_y_int;
-			if (clip->y0 > dst_y_int)
+			if (g->dst_y_int + g->dst_h_int > clip->y1)
+				g->patch.y1 = clip->y1 - g->dst_y_int;
+			if (clip->y0 > g->dst_y_int)
 			{
-				patch.y0 = clip->y0 - dst_y_int;
-				dst_y_int += patch.y0;
+				g->patch.y0 = clip->y0 - g->dst_y_int;
+				g->dst_y_int += g->patch.y0;
 			}
 		}
 	}
-	if (patch.x0 >= patch.x1 || patch.y0 >= patch.y1)
+	if (g->patch.x0 >= g->patch.x1 || g->patch.y0 >= g->patch.y1)
+		return 0;
+
+	g->x = x;
+	g->y = y;
+	g->w = w;
+	g->h = h;
+	return 1;
+}
+
+fz_pixmap *
+fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y, float w, float h, const fz_irect *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y)
+{
+	fz_scale_filter *filter = &fz_scale_filter_simple;
+	fz_weights *contrib_rows = NULL;
+	fz_weights *contrib_cols = NULL;
+	fz_pixmap *output = NULL;
+	unsigned char *temp = NULL;
+	int max_row, temp_span, temp_rows, row;
+	fz_scale_geometry g;
+
+	fz_var(contrib_cols);
+	fz_var(contrib_rows);
+
+	fz_valgrind_pixmap(src);
+
+	if (!scale_geometry(&g, src->alpha, x, y, w, h, clip))
 		return NULL;
 
 	fz_try(ctx)
@@ -1698,15 +1719,15 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 			contrib_cols = NULL;
 		else
 #endif /* SINGLE_PIXEL_SPECIALS */
-			contrib_cols = make_weights(ctx, src->w, x, w, filter, 0, dst_w_int, patch.x0, patch.x1, src->n, flip_x, cache_x);
+			contrib_cols = make_weights(ctx, src->w, g.x, g.w, filter, 0, g.dst_w_int, g.patch.x0, g.patch.x1, src->n, g.flip_x, cache_x);
 #ifdef SINGLE_PIXEL_SPECIALS
 		if (src->h == 1)
 			contrib_rows = NULL;
 		else
 #endif /* SINGLE_PIXEL_SPECIALS */
-			contrib_rows = make_weights(ctx, src->h, y, h, filter, 1, dst_h_int, patch.y0, patch.y1, src->n, flip_y, cache_y);
+			contrib_rows = make_weights(ctx, src->h, g.y, g.h, filter, 1, g.dst_h_int, g.patch.y0, g.patch.y1, src->n, g.flip_y, cache_y);
 
-		output = fz_new_pixmap(ctx, src->colorspace, patch.x1 - patch.x0, patch.y1 - patch.y0, src->alpha || forcealpha);
+		output = fz_new_pixmap(ctx, src->colorspace, g.patch.x1 - g.patch.x0, g.patch.y1 - g.patch.y0, src->alpha || g.forcealpha);
 	}
 	fz_catch(ctx)
 	{
@@ -1716,8 +1737,8 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 			fz_free(ctx, contrib_rows);
 		fz_rethrow(ctx);
 	}
-	output->x = dst_x_int;
-	output->y = dst_y_int;
+	output->x = g.dst_x_int;
+	output->y = g.dst_y_int;
 
 	/* Step 2: Apply the weights */
 #ifdef SINGLE_PIXEL_SPECIALS
@@ -1727,20 +1748,20 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 		if (!contrib_cols)
 		{
 			/* Only 1 pixel in the entire image! */
-			duplicate_single_pixel(output->samples, src->samples, src->n, forcealpha, patch.x1-patch.x0, patch.y1-patch.y0, output->stride);
+			duplicate_single_pixel(output->samples, src->samples, src->n, g.forcealpha, g.patch.x1-g.patch.x0, g.patch.y1-g.patch.y0, output->stride);
 			fz_valgrind_pixmap(output);
 		}
 		else
 		{
 			/* Scale the row once, then copy it. */
-			scale_single_row(output->samples, output->stride, src->samples, contrib_cols, src->w, patch.y1-patch.y0, forcealpha);
+			scale_single_row(output->samples, output->stride, src->samples, contrib_cols, src->w, g.patch.y1-g.patch.y0, g.forcealpha);
 			fz_valgrind_pixmap(output);
 		}
 	}
 	else if (!contrib_cols)
 	{
 		/* Only 1 source pixel wide. Scale the col and duplicate. */
-		scale_single_col(output->samples, output->stride, src->samples, src->stride, contrib_rows, src->h, src->n, patch.x1-patch.x0, forcealpha);
+		scale_single_col(output->samples, output->stride, src->samples, src->stride, contrib_rows, src->h, src->n, g.patch.x1-g.patch.x0, g.forcealpha);
 		fz_valgrind_pixmap(output);
 	}
 	else
@@ -1784,7 +1805,7 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 			row_scale_in = scale_row_to_temp4;
 			break;
 		}
-		row_scale_out = forcealpha ? scale_row_from_temp_alpha : scale_row_from_temp;
+		row_scale_out = g.forcealpha ? scale_row_from_temp_alpha : scale_row_from_temp;
 		max_row = contrib_rows->index[contrib_rows->index[0]];
 		for (row = 0; row < contrib_rows->count; row++)
 		{
@@ -1800,7 +1821,7 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 			{
 				/* Scale another row */
 				assert(max_row < src->h);
-				(*row_scale_in)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->stride], contrib_cols);
+				(*row_scale_in)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(g.flip_y ? (src->h-1-max_row): max_row)*src->stride], contrib_cols);
 				max_row++;
 			}
 
@@ -1808,7 +1829,7 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 		}
 		fz_free(ctx, temp);
 
-		if (forcealpha)
+		if (g.forcealpha)
 			adjust_alpha_edges(output, contrib_rows, contrib_cols);
 
 		fz_valgrind_pixmap(output);
@@ -1823,6 +1844,162 @@ cleanup:
 	return output;
 }
 
+/* Streaming scaler: source rows are pushed in one at a time, from the
+ * top of the image down, and the scaled output is handed back in bands
+ * of SCALER_BAND rows. Only enough source rows to feed the vertical
+ * filter are held at any one time. */
+
+#define SCALER_BAND 16
+
+struct fz_scaler_s
+{
+	int src_w, src_h, n;
+	fz_weights *contrib_cols;
+	fz_weights *contrib_rows;
+	fz_scale_cache *cache_x;
+	fz_scale_cache *cache_y;
+	void (*row_scale_in)(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights);
+	unsigned char *temp;
+	int temp_span, temp_rows;
+	int src_row; /* Number of source rows pushed so far */
+	int row; /* Next output row to produce */
+	int band_row; /* Output row at the top of the current band */
+	int dst_y_int;
+	fz_pixmap *band;
+};
+
+fz_scaler *
+fz_new_scaler(fz_context *ctx, int src_w, int src_h, fz_colorspace *colorspace, int alpha, float x, float y, float w, float h, const fz_irect *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y)
+{
+	fz_scale_filter *filter = &fz_scale_filter_simple;
+	fz_scaler *s;
+	fz_scale_geometry g;
+	int n = (colorspace ? colorspace->n : 0) + alpha;
+
+	if (!scale_geometry(&g, alpha, x, y, w, h, clip))
+		return NULL;
+
+	/* Rows arrive in stream order, so we can't flip vertically, and
+	 * the edge fixups for forced alpha need the whole output. The
+	 * single pixel special cases are left to fz_scale_pixmap too. */
+	if (g.flip_y || g.forcealpha)
+		return NULL;
+#ifdef SINGLE_PIXEL_SPECIALS
+	if (src_w == 1 || src_h == 1)
+		return NULL;
+#endif /* SINGLE_PIXEL_SPECIALS */
+
+	s = fz_malloc_struct(ctx, fz_scaler);
+	s->src_w = src_w;
+	s->src_h = src_h;
+	s->n = n;
+	s->cache_x = cache_x;
+	s->cache_y = cache_y;
+	s->dst_y_int = g.dst_y_int;
+
+	fz_try(ctx)
+	{
+		s->contrib_cols = make_weights(ctx, src_w, g.x, g.w, filter, 0, g.dst_w_int, g.patch.x0, g.patch.x1, n, g.flip_x, cache_x);
+		s->contrib_rows = make_weights(ctx, src_h, g.y, g.h, filter, 1, g.dst_h_int, g.patch.y0, g.patch.y1, n, 0, cache_y);
+		s->temp_span = s->contrib_cols->count * n;
+		s->temp_rows = s->contrib_rows->max_len;
+		if (s->temp_span <= 0 || s->temp_rows > INT_MAX / s->temp_span)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "scaled image too large");
+		s->temp = fz_calloc(ctx, s->temp_span*s->temp_rows, sizeof(unsigned char));
+		s->band = fz_new_pixmap(ctx, colorspace, g.patch.x1 - g.patch.x0, fz_mini(SCALER_BAND, s->contrib_rows->count), alpha);
+		s->band->x = g.dst_x_int;
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_scaler(ctx, s);
+		fz_rethrow(ctx);
+	}
+
+	switch (n)
+	{
+	default:
+		s->row_scale_in = scale_row_to_temp;
+		break;
+	case 1: /* Image mask case or Greyscale case */
+		s->row_scale_in = scale_row_to_temp1;
+		break;
+	case 2: /* Greyscale with alpha case */
+		s->row_scale_in = scale_row_to_temp2;
+		break;
+	case 3: /* RGB case */
+		s->row_scale_in = scale_row_to_temp3;
+		break;
+	case 4: /* RGBA or CMYK case */
+		s->row_scale_in = scale_row_to_temp4;
+		break;
+	}
+
+	return s;
+}
+
+void
+fz_drop_scaler(fz_context *ctx, fz_scaler *s)
+{
+	if (!s)
+		return;
+	if (!s->cache_x)
+		fz_free(ctx, s->contrib_cols);
+	if (!s->cache_y)
+		fz_free(ctx, s->contrib_rows);
+	fz_free(ctx, s->temp);
+	fz_drop_pixmap(ctx, s->band);
+	fz_free(ctx, s);
+}
+
+void
+fz_scaler_push_row(fz_context *ctx, fz_scaler *s, const unsigned char *row)
+{
+	const fz_weights *rows = s->contrib_rows;
+
+	if (s->src_row >= s->src_h || s->row >= rows->count)
+		return;
+
+	/* Rows above the first one the filter reaches are of no interest. */
+	if (s->src_row >= rows->index[rows->index[0]])
+		(*s->row_scale_in)(&s->temp[s->temp_span*(s->src_row % s->temp_rows)], row, s->contrib_cols);
+	s->src_row++;
+}
+
+fz_pixmap *
+fz_scaler_band(fz_context *ctx, fz_scaler *s)
+{
+	const fz_weights *rows = s->contrib_rows;
+	fz_pixmap *band = s->band;
+
+	while (s->row < rows->count && s->row - s->band_row < band->h)
+	{
+		int row_index = rows->index[s->row];
+		int row_min = rows->index[row_index++];
+		int row_len = rows->index[row_index];
+		if (row_min + row_len > s->src_row)
+			break;
+		scale_row_from_temp(&band->samples[(s->row - s->band_row) * band->stride], s->temp, rows, s->contrib_cols->count, s->n, s->row);
+		s->row++;
+	}
+
+	if (s->row - s->band_row == band->h || (s->row == rows->count && s->row > s->band_row))
+	{
+		band->y = s->dst_y_int + s->band_row;
+		band->h = s->row - s->band_row;
+		s->band_row = s->row;
+		fz_valgrind_pixmap(band);
+		return band;
+	}
+
+	return NULL;
+}
+
+int
+fz_scaler_done(fz_context *ctx, fz_scaler *s)
+{
+	return s->row == s->contrib_rows->count;
+}
+
 void
 fz_drop_scale_cache(fz_context *ctx, fz_scale_cache *sc)
 {
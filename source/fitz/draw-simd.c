@@ -0,0 +1,1520 @@
+#include "mupdf/fitz.h"
+#include "draw-imp.h"
+
+#include <string.h>
+
+/*
+
+SIMD versions of the most heavily used plotters from draw-paint.c.
+
+On x86 we build SSE4.1 and AVX2 versions, and pick between them (or the
+plain C versions) at runtime according to what the CPU supports. On
+AArch64, NEON is always present, so we use it unconditionally.
+
+Every plotter here gives exactly the same results as the C version it
+replaces. All of the blends we accelerate can be written per byte as:
+
+	FZ_BLEND(S, D, a) = (S.a + D.(256-a)) >> 8
+
+where neither product, nor their sum, can exceed 255.256; so we can do
+the sums in unsigned 16 bit lanes without any loss. 'Over' (the alpha
+255 case of the span painters) is done as S + FZ_COMBINE(D, 256-a),
+masked to 8 bits, exactly as the C code would truncate it.
+
+We work in blocks of 16 bytes at a time. Each block holds a whole number
+of pixels; any bytes left over at the end of the block ('pass through'
+lanes) are given a blend factor of 0, so we write back the value we
+read. We only process a block while there are enough pixels left in the
+span that the 16 byte loads and stores cannot stray beyond it; the
+remaining few pixels are done by the C code at the bottom of each
+plotter.
+
+*/
+
+typedef unsigned char byte;
+
+#if FZ_ENABLE_SIMD
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#if defined(__clang__) && (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))
+#define SIMD_X86
+#elif defined(__GNUC__) && !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SIMD_X86
+#elif defined(_MSC_VER) && _MSC_VER >= 1800
+#define SIMD_X86
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_NEON
+#endif
+#endif /* FZ_ENABLE_SIMD */
+
+#if defined(SIMD_X86) || defined(SIMD_NEON)
+
+#define Z 0x80 /* A shuffle index that selects 0 */
+
+/*
+	Layout of a span of source pixels (with alpha) painted over a
+	span of destination pixels. gather picks the source byte for each
+	destination byte, alpha picks the source alpha for each
+	destination byte.
+*/
+typedef struct
+{
+	int sb, db;	/* bytes per source/destination pixel */
+	int step;	/* pixels per 16 byte block */
+	int need;	/* pixels needed for a block to be safe */
+	byte gather[16];
+	byte alpha[16];
+} span_layout;
+
+static const span_layout span_layouts[] =
+{
+	{ 1, 1, 16, 16, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 } }, /* n=0 sa=1 da=1 */
+	{ 2, 2, 8, 8, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, { 1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15 } }, /* n=1 sa=1 da=1 */
+	{ 4, 4, 4, 4, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, { 3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15 } }, /* n=3 sa=1 da=1 */
+	{ 5, 5, 3, 4, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, Z }, { 4, 4, 4, 4, 4, 9, 9, 9, 9, 9, 14, 14, 14, 14, 14, Z } }, /* n=4 sa=1 da=1 */
+	{ 2, 1, 8, 16, { 0, 2, 4, 6, 8, 10, 12, 14, Z, Z, Z, Z, Z, Z, Z, Z }, { 1, 3, 5, 7, 9, 11, 13, 15, Z, Z, Z, Z, Z, Z, Z, Z } }, /* n=1 sa=1 da=0 */
+	{ 4, 3, 4, 6, { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, Z, Z, Z, Z }, { 3, 3, 3, 7, 7, 7, 11, 11, 11, 15, 15, 15, Z, Z, Z, Z } }, /* n=3 sa=1 da=0 */
+	{ 5, 4, 3, 4, { 0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, Z, Z, Z, Z }, { 4, 4, 4, 4, 9, 9, 9, 9, 14, 14, 14, 14, Z, Z, Z, Z } }, /* n=4 sa=1 da=0 */
+};
+
+/*
+	Layout of a span of destination pixels painted with a single
+	color. pixel picks the mask byte for each destination byte, chan
+	picks the color component.
+*/
+typedef struct
+{
+	int db;		/* bytes per destination pixel */
+	int step;	/* pixels per 16 byte block */
+	int need;	/* pixels needed for a block (and its mask) to be safe */
+	byte pixel[16];
+	byte chan[16];
+} color_layout;
+
+static const color_layout color_layouts[] =
+{
+	{ 1, 16, 16, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+	{ 2, 8, 8, { 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7 }, { 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1 } },
+	{ 3, 5, 8, { 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, Z }, { 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0 } },
+	{ 4, 4, 4, { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3 }, { 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3 } },
+	{ 5, 3, 4, { 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, Z }, { 0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 0 } },
+};
+
+#undef Z
+
+static const span_layout *
+find_span_layout(int n, int da)
+{
+	switch (n)
+	{
+	case 0: return &span_layouts[0];
+	case 1: return &span_layouts[da ? 1 : 4];
+	case 3: return &span_layouts[da ? 2 : 5];
+	case 4: return &span_layouts[da ? 3 : 6];
+	}
+	return NULL;
+}
+
+/* Unpack the color into one byte per destination byte, with an
+ * opaque alpha if the destination has one. */
+static void
+expand_color(byte cv[16], const color_layout *l, const byte * restrict color, int n1)
+{
+	byte c[8];
+	int k;
+	for (k = 0; k < n1; k++)
+		c[k] = color[k];
+	c[n1] = 255;
+	for (k = 0; k < 16; k++)
+		cv[k] = c[l->chan[k]];
+}
+
+/* The C versions, for the pixels at the end of a span. */
+
+static void
+tail_span_over(byte * restrict dp, const byte * restrict sp, int w, const span_layout *l)
+{
+	int n1 = l->sb - 1;
+	int da = l->db - n1;
+	int k;
+	while (w--)
+	{
+		int t = FZ_EXPAND(sp[n1]);
+		if (t != 0)
+		{
+			t = 256 - t;
+			for (k = 0; k < n1 + da; k++)
+				dp[k] = sp[k] + FZ_COMBINE(dp[k], t);
+		}
+		dp += l->db;
+		sp += l->sb;
+	}
+}
+
+static void
+tail_span_over_alpha(byte * restrict dp, const byte * restrict sp, int w, const span_layout *l, int alpha)
+{
+	int n1 = l->sb - 1;
+	int da = l->db - n1;
+	int k;
+	while (w--)
+	{
+		int masa = FZ_COMBINE(sp[n1], alpha);
+		for (k = 0; k < n1 + da; k++)
+			dp[k] = FZ_BLEND(sp[k], dp[k], masa);
+		dp += l->db;
+		sp += l->sb;
+	}
+}
+
+static void
+tail_span_alpha(byte * restrict dp, const byte * restrict sp, int len, int alpha)
+{
+	while (len--)
+	{
+		*dp = FZ_BLEND(*sp, *dp, alpha);
+		dp++;
+		sp++;
+	}
+}
+
+static void
+tail_span_color(byte * restrict dp, const byte * restrict mp, int w, const byte *cv, int db, int sa)
+{
+	int k;
+	while (w--)
+	{
+		int ma = FZ_EXPAND(*mp);
+		if (sa != 256)
+			ma = FZ_COMBINE(ma, sa);
+		for (k = 0; k < db; k++)
+			dp[k] = FZ_BLEND(cv[k], dp[k], ma);
+		dp += db;
+		mp++;
+	}
+}
+
+static void
+tail_solid_color(byte * restrict dp, int w, const byte *cv, int db, int sa)
+{
+	int k;
+	while (w--)
+	{
+		for (k = 0; k < db; k++)
+			dp[k] = FZ_BLEND(cv[k], dp[k], sa);
+		dp += db;
+	}
+}
+
+typedef struct
+{
+	fz_span_painter_t *over;
+	fz_span_painter_t *over_alpha;
+	fz_span_painter_t *alpha;
+	fz_span_color_painter_t *color;
+	fz_solid_color_painter_t *solid;
+	fz_affine_painter_t *affine_lerp;
+	fz_affine_painter_t *affine_lerp_g2rgb;
+} simd_painters;
+
+/* Plotter entry points */
+
+#define SIMD_PAINTERS(ISA) \
+static void \
+ISA##_paint_span_over(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha) \
+{ \
+	ISA##_span_over(dp, sp, w, find_span_layout(n, da)); \
+} \
+ \
+static void \
+ISA##_paint_span_over_alpha(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha) \
+{ \
+	ISA##_span_over_alpha(dp, sp, w, find_span_layout(n, da), FZ_EXPAND(alpha)); \
+} \
+ \
+static void \
+ISA##_paint_span_alpha(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha) \
+{ \
+	ISA##_span_alpha(dp, sp, n * w, alpha); \
+} \
+ \
+static void \
+ISA##_paint_span_with_color(byte * restrict dp, const byte * restrict mp, int n, int w, const byte * restrict color, int da) \
+{ \
+	const color_layout *l = &color_layouts[n - 1]; \
+	int sa = FZ_EXPAND(color[n - da]); \
+	byte cv[16]; \
+	if (sa == 0) \
+		return; \
+	expand_color(cv, l, color, n - da); \
+	ISA##_span_color(dp, mp, w, cv, l, sa); \
+} \
+ \
+static void \
+ISA##_paint_solid_color(byte * restrict dp, int n, int w, const byte * restrict color, int da) \
+{ \
+	const color_layout *l = &color_layouts[n - 1]; \
+	int sa = FZ_EXPAND(color[n - da]); \
+	byte cv[16]; \
+	if (sa == 0) \
+		return; \
+	expand_color(cv, l, color, n - da); \
+	ISA##_solid_color(dp, w, cv, l, sa); \
+} \
+
+
+#endif /* SIMD_X86 || SIMD_NEON */
+
+#ifdef SIMD_X86
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SSE41_FN
+#define AVX2_FN
+#define SIMD_INLINE __forceinline
+#else
+#define SSE41_FN __attribute__((target("sse4.1")))
+#define AVX2_FN __attribute__((target("avx2")))
+#define SIMD_INLINE inline __attribute__((always_inline))
+#endif
+#include <immintrin.h>
+
+/* SSE4.1 */
+
+static inline SSE41_FN __m128i
+sse_load_mask(const byte *mp, int step)
+{
+	if (step <= 4)
+	{
+		int m;
+		memcpy(&m, mp, 4);
+		return _mm_cvtsi32_si128(m);
+	}
+	if (step <= 8)
+		return _mm_loadl_epi64((const __m128i *)mp);
+	return _mm_loadu_si128((const __m128i *)mp);
+}
+
+/* (s * f + d * (256 - f)) >> 8, with f given as two sets of 16 bit lanes */
+static inline SSE41_FN __m128i
+sse_blend(__m128i s, __m128i d, __m128i flo, __m128i fhi)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i k256 = _mm_set1_epi16(256);
+	__m128i lo = _mm_add_epi16(
+		_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), flo),
+		_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(k256, flo)));
+	__m128i hi = _mm_add_epi16(
+		_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), fhi),
+		_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(k256, fhi)));
+	return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+/* s + FZ_COMBINE(d, 256 - FZ_EXPAND(a)), or d where a is 0 */
+static inline SSE41_FN __m128i
+sse_over(__m128i s, __m128i d, __m128i a)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i k256 = _mm_set1_epi16(256);
+	const __m128i k255 = _mm_set1_epi16(255);
+	__m128i tlo = _mm_unpacklo_epi8(a, zero);
+	__m128i thi = _mm_unpackhi_epi8(a, zero);
+	__m128i lo, hi;
+	tlo = _mm_sub_epi16(k256, _mm_add_epi16(tlo, _mm_srli_epi16(tlo, 7)));
+	thi = _mm_sub_epi16(k256, _mm_add_epi16(thi, _mm_srli_epi16(thi, 7)));
+	lo = _mm_add_epi16(_mm_unpacklo_epi8(s, zero), _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), tlo), 8));
+	hi = _mm_add_epi16(_mm_unpackhi_epi8(s, zero), _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), thi), 8));
+	lo = _mm_packus_epi16(_mm_and_si128(lo, k255), _mm_and_si128(hi, k255));
+	return _mm_blendv_epi8(lo, d, _mm_cmpeq_epi8(a, zero));
+}
+
+/* FZ_COMBINE(a, alpha), as 16 bit lanes */
+static inline SSE41_FN void
+sse_masa(__m128i a, __m128i alpha, __m128i *flo, __m128i *fhi)
+{
+	const __m128i zero = _mm_setzero_si128();
+	*flo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), alpha), 8);
+	*fhi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), alpha), 8);
+}
+
+/* FZ_EXPAND(m), then FZ_COMBINE with sa if sa != 256, as 16 bit lanes */
+static inline SSE41_FN void
+sse_mask(__m128i m, __m128i sa, int opaque, __m128i *flo, __m128i *fhi)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_unpacklo_epi8(m, zero);
+	__m128i hi = _mm_unpackhi_epi8(m, zero);
+	lo = _mm_add_epi16(lo, _mm_srli_epi16(lo, 7));
+	hi = _mm_add_epi16(hi, _mm_srli_epi16(hi, 7));
+	if (!opaque)
+	{
+		lo = _mm_srli_epi16(_mm_mullo_epi16(lo, sa), 8);
+		hi = _mm_srli_epi16(_mm_mullo_epi16(hi, sa), 8);
+	}
+	*flo = lo;
+	*fhi = hi;
+}
+
+static SSE41_FN void
+sse_span_over(byte * restrict dp, const byte * restrict sp, int w, const span_layout *l)
+{
+	const __m128i gather = _mm_loadu_si128((const __m128i *)l->gather);
+	const __m128i alpha = _mm_loadu_si128((const __m128i *)l->alpha);
+	int sstep = l->step * l->sb;
+	int dstep = l->step * l->db;
+
+	while (w >= l->need)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)sp);
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		d = sse_over(_mm_shuffle_epi8(s, gather), d, _mm_shuffle_epi8(s, alpha));
+		_mm_storeu_si128((__m128i *)dp, d);
+		sp += sstep;
+		dp += dstep;
+		w -= l->step;
+	}
+	tail_span_over(dp, sp, w, l);
+}
+
+static SSE41_FN void
+sse_span_over_alpha(byte * restrict dp, const byte * restrict sp, int w, const span_layout *l, int alpha)
+{
+	const __m128i gather = _mm_loadu_si128((const __m128i *)l->gather);
+	const __m128i ashuf = _mm_loadu_si128((const __m128i *)l->alpha);
+	const __m128i va = _mm_set1_epi16(alpha);
+	int sstep = l->step * l->sb;
+	int dstep = l->step * l->db;
+
+	while (w >= l->need)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)sp);
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		__m128i flo, fhi;
+		sse_masa(_mm_shuffle_epi8(s, ashuf), va, &flo, &fhi);
+		d = sse_blend(_mm_shuffle_epi8(s, gather), d, flo, fhi);
+		_mm_storeu_si128((__m128i *)dp, d);
+		sp += sstep;
+		dp += dstep;
+		w -= l->step;
+	}
+	tail_span_over_alpha(dp, sp, w, l, alpha);
+}
+
+static SSE41_FN void
+sse_span_alpha(byte * restrict dp, const byte * restrict sp, int len, int alpha)
+{
+	const __m128i va = _mm_set1_epi16(alpha);
+
+	while (len >= 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)sp);
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		_mm_storeu_si128((__m128i *)dp, sse_blend(s, d, va, va));
+		sp += 16;
+		dp += 16;
+		len -= 16;
+	}
+	tail_span_alpha(dp, sp, len, alpha);
+}
+
+static SSE41_FN void
+sse_span_color(byte * restrict dp, const byte * restrict mp, int w, const byte *cv, const color_layout *l, int sa)
+{
+	const __m128i pixel = _mm_loadu_si128((const __m128i *)l->pixel);
+	const __m128i c = _mm_loadu_si128((const __m128i *)cv);
+	const __m128i vsa = _mm_set1_epi16(sa);
+	int dstep = l->step * l->db;
+
+	while (w >= l->need)
+	{
+		__m128i m = _mm_shuffle_epi8(sse_load_mask(mp, l->step), pixel);
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		__m128i flo, fhi;
+		sse_mask(m, vsa, sa == 256, &flo, &fhi);
+		_mm_storeu_si128((__m128i *)dp, sse_blend(c, d, flo, fhi));
+		mp += l->step;
+		dp += dstep;
+		w -= l->step;
+	}
+	tail_span_color(dp, mp, w, cv, l->db, sa);
+}
+
+static SSE41_FN void
+sse_solid_color(byte * restrict dp, int w, const byte *cv, const color_layout *l, int sa)
+{
+	const __m128i c = _mm_loadu_si128((const __m128i *)cv);
+	/* A factor of sa for real lanes, 0 for the pass through ones. */
+	const __m128i live = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)l->pixel), _mm_set1_epi8(-1));
+	const __m128i f = _mm_and_si128(_mm_set1_epi16(sa), _mm_unpacklo_epi8(live, live));
+	const __m128i g = _mm_and_si128(_mm_set1_epi16(sa), _mm_unpackhi_epi8(live, live));
+	int dstep = l->step * l->db;
+	int need = (16 + l->db - 1) / l->db;
+
+	while (w >= need)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)dp);
+		_mm_storeu_si128((__m128i *)dp, sse_blend(c, d, f, g));
+		dp += dstep;
+		w -= l->step;
+	}
+	tail_solid_color(dp, w, cv, l->db, sa);
+}
+
+/* AVX2; as SSE4.1, but two blocks at a time, one in each 128 bit lane. */
+
+static inline AVX2_FN __m256i
+avx2_load2(const byte *p, int step)
+{
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)), _mm_loadu_si128((const __m128i *)(p + step)), 1);
+}
+
+/* The blocks may overlap in their pass through lanes, so store the
+ * first before the second. */
+static inline AVX2_FN void
+avx2_store2(byte *p, int step, __m256i v)
+{
+	_mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(v));
+	_mm_storeu_si128((__m128i *)(p + step), _mm256_extracti128_si256(v, 1));
+}
+
+static inline AVX2_FN __m256i
+avx2_blend(__m256i s, __m256i d, __m256i flo, __m256i fhi)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i k256 = _mm256_set1_epi16(256);
+	__m256i lo = _mm256_add_epi16(
+		_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), flo),
+		_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(k256, flo)));
+	__m256i hi = _mm256_add_epi16(
+		_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), fhi),
+		_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(k256, fhi)));
+	return _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+}
+
+static AVX2_FN void
+avx2_span_over(byte * restrict dp, const byte * restrict sp, int w, const span_layout *l)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i k256 = _mm256_set1_epi16(256);
+	const __m256i k255 = _mm256_set1_epi16(255);
+	const __m256i gather = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)l->gather));
+	const __m256i ashuf = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)l->alpha));
+	int sstep = l->step * l->sb;
+	int dstep = l->step * l->db;
+
+	while (w >= l->step + l->need)
+	{
+		__m256i s = avx2_load2(sp, sstep);
+		__m256i d = avx2_load2(dp, dstep);
+		__m256i a = _mm256_shuffle_epi8(s, ashuf);
+		__m256i tlo = _mm256_unpacklo_epi8(a, zero);
+		__m256i thi = _mm256_unpackhi_epi8(a, zero);
+		__m256i lo, hi;
+		s = _mm256_shuffle_epi8(s, gather);
+		tlo = _mm256_sub_epi16(k256, _mm256_add_epi16(tlo, _mm256_srli_epi16(tlo, 7)));
+		thi = _mm256_sub_epi16(k256, _mm256_add_epi16(thi, _mm256_srli_epi16(thi, 7)));
+		lo = _mm256_add_epi16(_mm256_unpacklo_epi8(s, zero), _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), tlo), 8));
+		hi = _mm256_add_epi16(_mm256_unpackhi_epi8(s, zero), _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), thi), 8));
+		lo = _mm256_packus_epi16(_mm256_and_si256(lo, k255), _mm256_and_si256(hi, k255));
+		avx2_store2(dp, dstep, _mm256_blendv_epi8(lo, d, _mm256_cmpeq_epi8(a, zero)));
+		sp += 2 * sstep;
+		dp += 2 * dstep;
+		w -= 2 * l->step;
+	}
+	sse_span_over(dp, sp, w, l);
+}
+
+static AVX2_FN void
+avx2_span_over_alpha(byte * restrict dp, const byte * restrict sp, int w, const span_layout *l, int alpha)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i gather = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)l->gather));
+	const __m256i ashuf = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)l->alpha));
+	const __m256i va = _mm256_set1_epi16(alpha);
+	int sstep = l->step * l->sb;
+	int dstep = l->step * l->db;
+
+	while (w >= l->step + l->need)
+	{
+		__m256i s = avx2_load2(sp, sstep);
+		__m256i d = avx2_load2(dp, dstep);
+		__m256i a = _mm256_shuffle_epi8(s, ashuf);
+		__m256i flo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), va), 8);
+		__m256i fhi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), va), 8);
+		avx2_store2(dp, dstep, avx2_blend(_mm256_shuffle_epi8(s, gather), d, flo, fhi));
+		sp += 2 * sstep;
+		dp += 2 * dstep;
+		w -= 2 * l->step;
+	}
+	sse_span_over_alpha(dp, sp, w, l, alpha);
+}
+
+static AVX2_FN void
+avx2_span_alpha(byte * restrict dp, const byte * restrict sp, int len, int alpha)
+{
+	const __m256i va = _mm256_set1_epi16(alpha);
+
+	while (len >= 32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)sp);
+		__m256i d = _mm256_loadu_si256((const __m256i *)dp);
+		_mm256_storeu_si256((__m256i *)dp, avx2_blend(s, d, va, va));
+		sp += 32;
+		dp += 32;
+		len -= 32;
+	}
+	sse_span_alpha(dp, sp, len, alpha);
+}
+
+static AVX2_FN void
+avx2_span_color(byte * restrict dp, const byte * restrict mp, int w, const byte *cv, const color_layout *l, int sa)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i pixel = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)l->pixel));
+	const __m256i c = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cv));
+	const __m256i vsa = _mm256_set1_epi16(sa);
+	int dstep = l->step * l->db;
+
+	while (w >= l->step + l->need)
+	{
+		__m256i m = _mm256_inserti128_si256(_mm256_castsi128_si256(sse_load_mask(mp, l->step)), sse_load_mask(mp + l->step, l->step), 1);
+		__m256i d = avx2_load2(dp, dstep);
+		__m256i flo, fhi;
+		m = _mm256_shuffle_epi8(m, pixel);
+		flo = _mm256_unpacklo_epi8(m, zero);
+		fhi = _mm256_unpackhi_epi8(m, zero);
+		flo = _mm256_add_epi16(flo, _mm256_srli_epi16(flo, 7));
+		fhi = _mm256_add_epi16(fhi, _mm256_srli_epi16(fhi, 7));
+		if (sa != 256)
+		{
+			flo = _mm256_srli_epi16(_mm256_mullo_epi16(flo, vsa), 8);
+			fhi = _mm256_srli_epi16(_mm256_mullo_epi16(fhi, vsa), 8);
+		}
+		avx2_store2(dp, dstep, avx2_blend(c, d, flo, fhi));
+		mp += 2 * l->step;
+		dp += 2 * dstep;
+		w -= 2 * l->step;
+	}
+	sse_span_color(dp, mp, w, cv, l, sa);
+}
+
+static AVX2_FN void
+avx2_solid_color(byte * restrict dp, int w, const byte *cv, const color_layout *l, int sa)
+{
+	const __m256i c = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cv));
+	const __m128i live = _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)l->pixel), _mm_set1_epi8(-1));
+	const __m256i f = _mm256_broadcastsi128_si256(_mm_and_si128(_mm_set1_epi16(sa), _mm_unpacklo_epi8(live, live)));
+	const __m256i g = _mm256_broadcastsi128_si256(_mm_and_si128(_mm_set1_epi16(sa), _mm_unpackhi_epi8(live, live)));
+	int dstep = l->step * l->db;
+	int need = (16 + l->db - 1) / l->db;
+
+	while (w >= l->step + need)
+	{
+		__m256i d = avx2_load2(dp, dstep);
+		avx2_store2(dp, dstep, avx2_blend(c, d, f, g));
+		dp += 2 * dstep;
+		w -= 2 * l->step;
+	}
+	sse_solid_color(dp, w, cv, l, sa);
+}
+
+/*
+	The affine plotters work on blocks of up to 4 destination pixels,
+	computing each component of the 4 pixels in the 32 bit lanes of a
+	vector, exactly as the C code in draw-affine.c does for a single
+	pixel. The results are packed into bytes by component (chan0 for
+	components 0 to 3, chan4 for component 4) and shuffled into place
+	in the destination.
+
+	The pixel formats (sn, sa, dn, da) are passed down as constants
+	and everything is inlined into the plotter entry points, so that
+	each format gets a loop of its own, as with the C templates.
+*/
+typedef struct
+{
+	int db;		/* bytes per destination pixel */
+	int step;	/* pixels per block */
+	int need;	/* pixels needed to load and store a whole block */
+	int width;	/* bytes loaded and stored per block */
+	byte chan0[16];
+	byte chan4[16];
+	byte pixel[16];
+} affine_layout;
+
+#define Z 0x80
+
+static const affine_layout affine_layouts[] =
+{
+	{ 1, 4, 4, 4, { 0, 1, 2, 3, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z }, { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z }, { 0, 1, 2, 3, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z } },
+	{ 2, 4, 4, 8, { 0, 4, 1, 5, 2, 6, 3, 7, Z, Z, Z, Z, Z, Z, Z, Z }, { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z }, { 0, 0, 1, 1, 2, 2, 3, 3, Z, Z, Z, Z, Z, Z, Z, Z } },
+	{ 3, 4, 6, 16, { 0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, Z, Z, Z, Z }, { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z }, { 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, Z, Z, Z, Z } },
+	{ 4, 4, 4, 16, { 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 }, { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z }, { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3 } },
+	{ 5, 3, 4, 16, { 0, 4, 8, 12, Z, 1, 5, 9, 13, Z, 2, 6, 10, 14, Z, Z }, { Z, Z, Z, Z, 0, Z, Z, Z, Z, 1, Z, Z, Z, Z, 2, Z }, { 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, Z } },
+};
+
+#undef Z
+
+typedef struct
+{
+	const byte *sp;
+	int sw, sh, ss;	/* as passed to the plotter */
+	int w, h;	/* image size in pixels */
+	int alpha;
+} affine_args;
+
+static void
+init_affine_args(affine_args *a, const byte *sp, int sw, int sh, int ss, int alpha)
+{
+	a->sp = sp;
+	a->sw = sw;
+	a->sh = sh;
+	a->ss = ss;
+	a->w = sw >> 16;
+	a->h = sh >> 16;
+	a->alpha = alpha;
+}
+
+/* Read the 4 byte word that ends with the last byte of the source
+ * pixel at offset o, so that component k of the pixel is in byte
+ * 4 - sb + k. Near the very start of the image there is no such word,
+ * so we put it together a byte at a time. */
+static inline unsigned int
+load_tap(const byte *sp, int o, int sb)
+{
+	unsigned int x;
+	int k;
+	if (o >= 4 - sb)
+	{
+		memcpy(&x, sp + o + sb - 4, 4);
+		return x;
+	}
+	x = 0;
+	for (k = 0; k < sb; k++)
+		x |= (unsigned int)sp[o + k] << (8 * (4 - sb + k));
+	return x;
+}
+
+static inline unsigned int
+load_word(const byte *p)
+{
+	unsigned int x;
+	memcpy(&x, p, 4);
+	return x;
+}
+
+/* Plot up to a block of pixels one at a time, for the end of a span. */
+static void
+put_affine_pixels(byte * restrict dp, int n, int db, const int x[5][4], const int *t, const int *m)
+{
+	int i, k;
+	for (i = 0; i < n; i++)
+	{
+		if (m[i])
+			for (k = 0; k < db; k++)
+				dp[k] = x[k][i] + fz_mul255(dp[k], t[i]);
+		dp += db;
+	}
+}
+
+static void
+put_affine_shape(byte * restrict hp, int n, const int *y, const int *t, const int *m)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		if (m[i])
+			hp[i] = y[i] + fz_mul255(hp[i], t[i]);
+}
+
+#define AFFINE_PAINTERS(ISA, FN) \
+static FN void \
+ISA##_paint_affine_lerp(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int n, int alpha, const byte * restrict color, byte * restrict hp) \
+{ \
+	affine_args a; \
+	init_affine_args(&a, sp, sw, sh, ss, alpha); \
+	switch (n * 4 + sa * 2 + da) \
+	{ \
+	case 4: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 1, 0, 1, 0); break; \
+	case 5: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 1, 0, 1, 1); break; \
+	case 6: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 1, 1, 1, 0); break; \
+	case 7: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 1, 1, 1, 1); break; \
+	case 12: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 3, 0, 3, 0); break; \
+	case 13: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 3, 0, 3, 1); break; \
+	case 14: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 3, 1, 3, 0); break; \
+	case 15: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 3, 1, 3, 1); break; \
+	case 16: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 4, 0, 4, 0); break; \
+	case 17: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 4, 0, 4, 1); break; \
+	} \
+} \
+ \
+static FN void \
+ISA##_paint_affine_lerp_g2rgb(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int n, int alpha, const byte * restrict color, byte * restrict hp) \
+{ \
+	affine_args a; \
+	init_affine_args(&a, sp, sw, sh, ss, alpha); \
+	switch (sa * 2 + da) \
+	{ \
+	case 0: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 1, 0, 3, 0); break; \
+	case 1: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 1, 0, 3, 1); break; \
+	case 2: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 1, 1, 3, 0); break; \
+	case 3: ISA##_affine_lerp(dp, &a, u, v, fa, fb, w, hp, 1, 1, 3, 1); break; \
+	} \
+}
+
+/* Affine plotters, SSE4.1 */
+
+static inline SSE41_FN __m128i
+sse_mul255(__m128i a, __m128i b)
+{
+	__m128i x = _mm_add_epi32(_mm_mullo_epi32(a, b), _mm_set1_epi32(128));
+	x = _mm_add_epi32(x, _mm_srli_epi32(x, 8));
+	return _mm_srli_epi32(x, 8);
+}
+
+static inline SSE41_FN __m128i
+sse_lerp(__m128i a, __m128i b, __m128i t)
+{
+	return _mm_add_epi32(a, _mm_srai_epi32(_mm_mullo_epi32(_mm_sub_epi32(b, a), t), 16));
+}
+
+static inline SSE41_FN __m128i
+sse_clamp(__m128i x, int max)
+{
+	return _mm_min_epi32(_mm_max_epi32(x, _mm_setzero_si128()), _mm_set1_epi32(max - 1));
+}
+
+static inline SSE41_FN __m128i
+sse_gather(const byte *sp, __m128i off)
+{
+	return _mm_setr_epi32(
+		load_word(sp + _mm_cvtsi128_si32(off)),
+		load_word(sp + _mm_extract_epi32(off, 1)),
+		load_word(sp + _mm_extract_epi32(off, 2)),
+		load_word(sp + _mm_extract_epi32(off, 3)));
+}
+
+static SIMD_INLINE SSE41_FN void
+sse_affine_sample(const affine_args *a, __m128i U, __m128i V, __m128i valid, __m128i x[5], __m128i *y, __m128i *t, __m128i *m,
+	const int sn, const int sa, const int dn, const int da)
+{
+	const int sb = sn + sa;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i k255 = _mm_set1_epi32(255);
+	const __m128i mask = _mm_set1_epi32(0xffff);
+	const __m128i half = _mm_set1_epi32(32768);
+	const __m128i m1 = _mm_set1_epi32(-1);
+	__m128i inside, ui, vi, uf, vf, c0, c1, r0, r1, ya;
+	__m128i off[4], tap[4], c[5];
+	int i, k;
+
+	inside = _mm_and_si128(valid, _mm_and_si128(
+		_mm_and_si128(_mm_cmpgt_epi32(_mm_add_epi32(U, half), m1), _mm_cmpgt_epi32(_mm_set1_epi32(a->sw), U)),
+		_mm_and_si128(_mm_cmpgt_epi32(_mm_add_epi32(V, half), m1), _mm_cmpgt_epi32(_mm_set1_epi32(a->sh), V))));
+	ui = _mm_srai_epi32(U, 16);
+	vi = _mm_srai_epi32(V, 16);
+	uf = _mm_and_si128(U, mask);
+	vf = _mm_and_si128(V, mask);
+	c0 = _mm_mullo_epi32(sse_clamp(ui, a->w), _mm_set1_epi32(sb));
+	c1 = _mm_mullo_epi32(sse_clamp(_mm_sub_epi32(ui, m1), a->w), _mm_set1_epi32(sb));
+	r0 = _mm_mullo_epi32(sse_clamp(vi, a->h), _mm_set1_epi32(a->ss));
+	r1 = _mm_mullo_epi32(sse_clamp(_mm_sub_epi32(vi, m1), a->h), _mm_set1_epi32(a->ss));
+	off[0] = _mm_add_epi32(r0, c0);
+	off[1] = _mm_add_epi32(r0, c1);
+	off[2] = _mm_add_epi32(r1, c0);
+	off[3] = _mm_add_epi32(r1, c1);
+
+	/* off[0] is the smallest offset; only read whole words if every
+	 * word we read lies within the image. */
+	if (!_mm_movemask_epi8(_mm_cmpgt_epi32(_mm_set1_epi32(4 - sb), off[0])))
+	{
+		const byte *sp = a->sp + sb - 4;
+		for (i = 0; i < 4; i++)
+			tap[i] = sse_gather(sp, off[i]);
+	}
+	else
+	{
+		int o[4];
+		for (i = 0; i < 4; i++)
+		{
+			_mm_storeu_si128((__m128i *)o, off[i]);
+			tap[i] = _mm_setr_epi32(
+				load_tap(a->sp, o[0], sb), load_tap(a->sp, o[1], sb),
+				load_tap(a->sp, o[2], sb), load_tap(a->sp, o[3], sb));
+		}
+	}
+
+	for (k = 0; k < sb; k++)
+	{
+		const int shift = 8 * (4 - sb + k);
+		__m128i ta = _mm_and_si128(_mm_srli_epi32(tap[0], shift), k255);
+		__m128i tb = _mm_and_si128(_mm_srli_epi32(tap[1], shift), k255);
+		__m128i tc = _mm_and_si128(_mm_srli_epi32(tap[2], shift), k255);
+		__m128i td = _mm_and_si128(_mm_srli_epi32(tap[3], shift), k255);
+		c[k] = sse_lerp(sse_lerp(ta, tb, uf), sse_lerp(tc, td, uf), vf);
+	}
+
+	ya = sa ? c[sn] : k255;
+	if (a->alpha != 255)
+	{
+		__m128i alpha = _mm_set1_epi32(a->alpha);
+		ya = sa ? sse_mul255(ya, alpha) : alpha;
+		for (k = 0; k < sn; k++)
+			c[k] = sse_mul255(c[k], alpha);
+	}
+	for (k = 0; k < dn; k++)
+		x[k] = c[k < sn ? k : 0];
+	if (da)
+		x[k++] = ya;
+	for (; k < 5; k++)
+		x[k] = zero;
+	*y = ya;
+	*t = _mm_sub_epi32(k255, ya);
+	*m = _mm_andnot_si128(_mm_cmpeq_epi32(ya, zero), inside);
+}
+
+static inline SSE41_FN __m128i
+sse_load_bytes(const byte *p, int width)
+{
+	if (width == 4)
+		return _mm_cvtsi32_si128(load_word(p));
+	if (width == 8)
+		return _mm_loadl_epi64((const __m128i *)p);
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline SSE41_FN void
+sse_store_bytes(byte *p, int width, __m128i v)
+{
+	if (width == 4)
+	{
+		int x = _mm_cvtsi128_si32(v);
+		memcpy(p, &x, 4);
+	}
+	else if (width == 8)
+		_mm_storel_epi64((__m128i *)p, v);
+	else
+		_mm_storeu_si128((__m128i *)p, v);
+}
+
+/* Plot a block of pixels: x + fz_mul255(d, t) where m is set. */
+static SIMD_INLINE SSE41_FN void
+sse_affine_put(byte * restrict dp, byte * restrict hp, int w, const __m128i x[5], __m128i y, __m128i t, __m128i m, const int db)
+{
+	const affine_layout *l = &affine_layouts[db - 1];
+	const __m128i zero = _mm_setzero_si128();
+	int n = w < l->step ? w : l->step;
+	int tv[4], mv[4];
+
+	if (w >= l->need)
+	{
+		const __m128i pixel = _mm_loadu_si128((const __m128i *)l->pixel);
+		const __m128i k128 = _mm_set1_epi16(128);
+		const __m128i k255 = _mm_set1_epi16(255);
+		__m128i s, tb, mb, d, lo, hi;
+
+		s = _mm_packus_epi16(_mm_packus_epi32(x[0], x[1]), _mm_packus_epi32(x[2], x[3]));
+		s = _mm_shuffle_epi8(s, _mm_loadu_si128((const __m128i *)l->chan0));
+		if (db == 5)
+			s = _mm_or_si128(s, _mm_shuffle_epi8(_mm_packus_epi16(_mm_packus_epi32(x[4], zero), zero), _mm_loadu_si128((const __m128i *)l->chan4)));
+		tb = _mm_shuffle_epi8(_mm_packus_epi16(_mm_packus_epi32(t, zero), zero), pixel);
+		mb = _mm_shuffle_epi8(_mm_packs_epi16(_mm_packs_epi32(m, zero), zero), pixel);
+
+		d = sse_load_bytes(dp, l->width);
+		lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(tb, zero)), k128);
+		hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(tb, zero)), k128);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		lo = _mm_and_si128(_mm_add_epi16(lo, _mm_unpacklo_epi8(s, zero)), k255);
+		hi = _mm_and_si128(_mm_add_epi16(hi, _mm_unpackhi_epi8(s, zero)), k255);
+		sse_store_bytes(dp, l->width, _mm_blendv_epi8(d, _mm_packus_epi16(lo, hi), mb));
+	}
+	else
+	{
+		int xv[5][4];
+		int k;
+		for (k = 0; k < db; k++)
+			_mm_storeu_si128((__m128i *)xv[k], x[k]);
+		_mm_storeu_si128((__m128i *)tv, t);
+		_mm_storeu_si128((__m128i *)mv, m);
+		put_affine_pixels(dp, n, db, (const int (*)[4])xv, tv, mv);
+	}
+
+	if (hp)
+	{
+		int yv[4];
+		_mm_storeu_si128((__m128i *)yv, y);
+		_mm_storeu_si128((__m128i *)tv, t);
+		_mm_storeu_si128((__m128i *)mv, m);
+		put_affine_shape(hp, n, yv, tv, mv);
+	}
+}
+
+static SIMD_INLINE SSE41_FN void
+sse_affine_lerp(byte * restrict dp, const affine_args *a, int u, int v, int fa, int fb, int w, byte * restrict hp,
+	const int sn, const int sa, const int dn, const int da)
+{
+	const affine_layout *l = &affine_layouts[dn + da - 1];
+	const int step = l->step;
+	const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+	const __m128i valid = _mm_cmpgt_epi32(_mm_set1_epi32(step), lane);
+	const __m128i du = _mm_set1_epi32(step * fa);
+	const __m128i dv = _mm_set1_epi32(step * fb);
+	__m128i U = _mm_add_epi32(_mm_set1_epi32(u), _mm_mullo_epi32(lane, _mm_set1_epi32(fa)));
+	__m128i V = _mm_add_epi32(_mm_set1_epi32(v), _mm_mullo_epi32(lane, _mm_set1_epi32(fb)));
+	__m128i x[5], y, t, m;
+
+	while (w > 0)
+	{
+		sse_affine_sample(a, U, V, valid, x, &y, &t, &m, sn, sa, dn, da);
+		sse_affine_put(dp, hp, w, x, y, t, m, dn + da);
+		dp += step * (dn + da);
+		if (hp)
+			hp += step;
+		U = _mm_add_epi32(U, du);
+		V = _mm_add_epi32(V, dv);
+		w -= step;
+	}
+}
+
+/* Affine plotters, AVX2; two blocks at a time, one in each half. */
+
+static inline AVX2_FN __m256i
+avx2_mul255(__m256i a, __m256i b)
+{
+	__m256i x = _mm256_add_epi32(_mm256_mullo_epi32(a, b), _mm256_set1_epi32(128));
+	x = _mm256_add_epi32(x, _mm256_srli_epi32(x, 8));
+	return _mm256_srli_epi32(x, 8);
+}
+
+static inline AVX2_FN __m256i
+avx2_lerp(__m256i a, __m256i b, __m256i t)
+{
+	return _mm256_add_epi32(a, _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(b, a), t), 16));
+}
+
+static inline AVX2_FN __m256i
+avx2_clamp(__m256i x, int max)
+{
+	return _mm256_min_epi32(_mm256_max_epi32(x, _mm256_setzero_si256()), _mm256_set1_epi32(max - 1));
+}
+
+static SIMD_INLINE AVX2_FN void
+avx2_affine_sample(const affine_args *a, __m256i U, __m256i V, __m256i valid, __m256i x[5], __m256i *y, __m256i *t, __m256i *m,
+	const int sn, const int sa, const int dn, const int da)
+{
+	const int sb = sn + sa;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i k255 = _mm256_set1_epi32(255);
+	const __m256i mask = _mm256_set1_epi32(0xffff);
+	const __m256i half = _mm256_set1_epi32(32768);
+	const __m256i m1 = _mm256_set1_epi32(-1);
+	__m256i inside, ui, vi, uf, vf, c0, c1, r0, r1, ya;
+	__m256i off[4], tap[4], c[5];
+	int i, k;
+
+	inside = _mm256_and_si256(valid, _mm256_and_si256(
+		_mm256_and_si256(_mm256_cmpgt_epi32(_mm256_add_epi32(U, half), m1), _mm256_cmpgt_epi32(_mm256_set1_epi32(a->sw), U)),
+		_mm256_and_si256(_mm256_cmpgt_epi32(_mm256_add_epi32(V, half), m1), _mm256_cmpgt_epi32(_mm256_set1_epi32(a->sh), V))));
+	ui = _mm256_srai_epi32(U, 16);
+	vi = _mm256_srai_epi32(V, 16);
+	uf = _mm256_and_si256(U, mask);
+	vf = _mm256_and_si256(V, mask);
+	c0 = _mm256_mullo_epi32(avx2_clamp(ui, a->w), _mm256_set1_epi32(sb));
+	c1 = _mm256_mullo_epi32(avx2_clamp(_mm256_sub_epi32(ui, m1), a->w), _mm256_set1_epi32(sb));
+	r0 = _mm256_mullo_epi32(avx2_clamp(vi, a->h), _mm256_set1_epi32(a->ss));
+	r1 = _mm256_mullo_epi32(avx2_clamp(_mm256_sub_epi32(vi, m1), a->h), _mm256_set1_epi32(a->ss));
+	off[0] = _mm256_add_epi32(r0, c0);
+	off[1] = _mm256_add_epi32(r0, c1);
+	off[2] = _mm256_add_epi32(r1, c0);
+	off[3] = _mm256_add_epi32(r1, c1);
+
+	/* off[0] is the smallest offset; only gather if every word we
+	 * read lies within the image. */
+	if (!_mm256_movemask_epi8(_mm256_cmpgt_epi32(_mm256_set1_epi32(4 - sb), off[0])))
+	{
+		const int *sp = (const int *)(a->sp + sb - 4);
+		for (i = 0; i < 4; i++)
+			tap[i] = _mm256_i32gather_epi32(sp, off[i], 1);
+	}
+	else
+	{
+		int o[8];
+		for (i = 0; i < 4; i++)
+		{
+			_mm256_storeu_si256((__m256i *)o, off[i]);
+			tap[i] = _mm256_setr_epi32(
+				load_tap(a->sp, o[0], sb), load_tap(a->sp, o[1], sb),
+				load_tap(a->sp, o[2], sb), load_tap(a->sp, o[3], sb),
+				load_tap(a->sp, o[4], sb), load_tap(a->sp, o[5], sb),
+				load_tap(a->sp, o[6], sb), load_tap(a->sp, o[7], sb));
+		}
+	}
+
+	for (k = 0; k < sb; k++)
+	{
+		const int shift = 8 * (4 - sb + k);
+		__m256i ta = _mm256_and_si256(_mm256_srli_epi32(tap[0], shift), k255);
+		__m256i tb = _mm256_and_si256(_mm256_srli_epi32(tap[1], shift), k255);
+		__m256i tc = _mm256_and_si256(_mm256_srli_epi32(tap[2], shift), k255);
+		__m256i td = _mm256_and_si256(_mm256_srli_epi32(tap[3], shift), k255);
+		c[k] = avx2_lerp(avx2_lerp(ta, tb, uf), avx2_lerp(tc, td, uf), vf);
+	}
+
+	ya = sa ? c[sn] : k255;
+	if (a->alpha != 255)
+	{
+		__m256i alpha = _mm256_set1_epi32(a->alpha);
+		ya = sa ? avx2_mul255(ya, alpha) : alpha;
+		for (k = 0; k < sn; k++)
+			c[k] = avx2_mul255(c[k], alpha);
+	}
+	for (k = 0; k < dn; k++)
+		x[k] = c[k < sn ? k : 0];
+	if (da)
+		x[k++] = ya;
+	for (; k < 5; k++)
+		x[k] = zero;
+	*y = ya;
+	*t = _mm256_sub_epi32(k255, ya);
+	*m = _mm256_andnot_si256(_mm256_cmpeq_epi32(ya, zero), inside);
+}
+
+static SIMD_INLINE AVX2_FN void
+avx2_affine_lerp(byte * restrict dp, const affine_args *a, int u, int v, int fa, int fb, int w, byte * restrict hp,
+	const int sn, const int sa, const int dn, const int da)
+{
+	const int db = dn + da;
+	const int step = affine_layouts[db - 1].step;
+	const __m256i pixel = _mm256_setr_epi32(0, 1, 2, 3, step, step + 1, step + 2, step + 3);
+	const __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(step), _mm256_setr_epi32(0, 1, 2, 3, 0, 1, 2, 3));
+	const __m256i du = _mm256_set1_epi32(2 * step * fa);
+	const __m256i dv = _mm256_set1_epi32(2 * step * fb);
+	__m256i U = _mm256_add_epi32(_mm256_set1_epi32(u), _mm256_mullo_epi32(pixel, _mm256_set1_epi32(fa)));
+	__m256i V = _mm256_add_epi32(_mm256_set1_epi32(v), _mm256_mullo_epi32(pixel, _mm256_set1_epi32(fb)));
+	__m256i x[5], y, t, m;
+	__m128i xh[5];
+	int k;
+
+	while (w > 0)
+	{
+		avx2_affine_sample(a, U, V, valid, x, &y, &t, &m, sn, sa, dn, da);
+		for (k = 0; k < 5; k++)
+			xh[k] = _mm256_castsi256_si128(x[k]);
+		sse_affine_put(dp, hp, w, xh, _mm256_castsi256_si128(y), _mm256_castsi256_si128(t), _mm256_castsi256_si128(m), db);
+		if (w > step)
+		{
+			for (k = 0; k < 5; k++)
+				xh[k] = _mm256_extracti128_si256(x[k], 1);
+			sse_affine_put(dp + step * db, hp ? hp + step : NULL, w - step, xh,
+				_mm256_extracti128_si256(y, 1), _mm256_extracti128_si256(t, 1), _mm256_extracti128_si256(m, 1), db);
+		}
+		dp += 2 * step * db;
+		if (hp)
+			hp += 2 * step;
+		U = _mm256_add_epi32(U, du);
+		V = _mm256_add_epi32(V, dv);
+		w -= 2 * step;
+	}
+}
+
+AFFINE_PAINTERS(sse, SSE41_FN)
+AFFINE_PAINTERS(avx2, AVX2_FN)
+
+SIMD_PAINTERS(sse)
+SIMD_PAINTERS(avx2)
+
+static const simd_painters sse_painters =
+{
+	sse_paint_span_over,
+	sse_paint_span_over_alpha,
+	sse_paint_span_alpha,
+	sse_paint_span_with_color,
+	sse_paint_solid_color,
+	sse_paint_affine_lerp,
+	sse_paint_affine_lerp_g2rgb,
+};
+
+static const simd_painters avx2_painters =
+{
+	avx2_paint_span_over,
+	avx2_paint_span_over_alpha,
+	avx2_paint_span_alpha,
+	avx2_paint_span_with_color,
+	avx2_paint_solid_color,
+	avx2_paint_affine_lerp,
+	avx2_paint_affine_lerp_g2rgb,
+};
+
+static const simd_painters *
+detect_painters(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+	int sse41, avx2 = 0;
+	__cpuid(info, 0);
+	if (info[0] < 1)
+		return NULL;
+	__cpuid(info, 1);
+	sse41 = (info[2] >> 19) & 1;
+	/* AVX2 needs the OS to save the YMM registers, too. */
+	if (((info[2] >> 27) & 1) && ((info[2] >> 28) & 1) && (_xgetbv(0) & 6) == 6)
+	{
+		__cpuid(info, 0);
+		if (info[0] >= 7)
+		{
+			__cpuidex(info, 7, 0);
+			avx2 = (info[1] >> 5) & 1;
+		}
+	}
+	if (avx2)
+		return &avx2_painters;
+	if (sse41)
+		return &sse_painters;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &avx2_painters;
+	if (__builtin_cpu_supports("sse4.1"))
+		return &sse_painters;
+#endif
+	return NULL;
+}
+
+#endif /* SIMD_X86 */
+
+#ifdef SIMD_NEON
+
+#include <arm_neon.h>
+
+static inline uint8x16_t
+neon_load_mask(const byte *mp, int step)
+{
+	if (step <= 4)
+	{
+		uint32_t m;
+		memcpy(&m, mp, 4);
+		return vreinterpretq_u8_u32(vdupq_n_u32(m));
+	}
+	if (step <= 8)
+		return vcombine_u8(vld1_u8(mp), vdup_n_u8(0));
+	return vld1q_u8(mp);
+}
+
+static inline uint8x16_t
+neon_blend(uint8x16_t s, uint8x16_t d, uint16x8_t flo, uint16x8_t fhi)
+{
+	const uint16x8_t k256 = vdupq_n_u16(256);
+	uint16x8_t lo = vmlaq_u16(vmulq_u16(vmovl_u8(vget_low_u8(s)), flo), vmovl_u8(vget_low_u8(d)), vsubq_u16(k256, flo));
+	uint16x8_t hi = vmlaq_u16(vmulq_u16(vmovl_u8(vget_high_u8(s)), fhi), vmovl_u8(vget_high_u8(d)), vsubq_u16(k256, fhi));
+	return vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+}
+
+static void
+neon_span_over(byte * restrict dp, const byte * restrict sp, int w, const span_layout *l)
+{
+	const uint8x16_t gather = vld1q_u8(l->gather);
+	const uint8x16_t ashuf = vld1q_u8(l->alpha);
+	const uint16x8_t k256 = vdupq_n_u16(256);
+	int sstep = l->step * l->sb;
+	int dstep = l->step * l->db;
+
+	while (w >= l->need)
+	{
+		uint8x16_t s = vld1q_u8(sp);
+		uint8x16_t d = vld1q_u8(dp);
+		uint8x16_t a = vqtbl1q_u8(s, ashuf);
+		uint16x8_t tlo = vmovl_u8(vget_low_u8(a));
+		uint16x8_t thi = vmovl_u8(vget_high_u8(a));
+		uint16x8_t lo, hi;
+		s = vqtbl1q_u8(s, gather);
+		tlo = vsubq_u16(k256, vsraq_n_u16(tlo, tlo, 7));
+		thi = vsubq_u16(k256, vsraq_n_u16(thi, thi, 7));
+		lo = vaddq_u16(vmovl_u8(vget_low_u8(s)), vshrq_n_u16(vmulq_u16(vmovl_u8(vget_low_u8(d)), tlo), 8));
+		hi = vaddq_u16(vmovl_u8(vget_high_u8(s)), vshrq_n_u16(vmulq_u16(vmovl_u8(vget_high_u8(d)), thi), 8));
+		/* vmovn truncates to 8 bits, as the C code does */
+		vst1q_u8(dp, vbslq_u8(vceqq_u8(a, vdupq_n_u8(0)), d, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi))));
+		sp += sstep;
+		dp += dstep;
+		w -= l->step;
+	}
+	tail_span_over(dp, sp, w, l);
+}
+
+static void
+neon_span_over_alpha(byte * restrict dp, const byte * restrict sp, int w, const span_layout *l, int alpha)
+{
+	const uint8x16_t gather = vld1q_u8(l->gather);
+	const uint8x16_t ashuf = vld1q_u8(l->alpha);
+	const uint16x8_t va = vdupq_n_u16(alpha);
+	int sstep = l->step * l->sb;
+	int dstep = l->step * l->db;
+
+	while (w >= l->need)
+	{
+		uint8x16_t s = vld1q_u8(sp);
+		uint8x16_t d = vld1q_u8(dp);
+		uint8x16_t a = vqtbl1q_u8(s, ashuf);
+		uint16x8_t flo = vshrq_n_u16(vmulq_u16(vmovl_u8(vget_low_u8(a)), va), 8);
+		uint16x8_t fhi = vshrq_n_u16(vmulq_u16(vmovl_u8(vget_high_u8(a)), va), 8);
+		vst1q_u8(dp, neon_blend(vqtbl1q_u8(s, gather), d, flo, fhi));
+		sp += sstep;
+		dp += dstep;
+		w -= l->step;
+	}
+	tail_span_over_alpha(dp, sp, w, l, alpha);
+}
+
+static void
+neon_span_alpha(byte * restrict dp, const byte * restrict sp, int len, int alpha)
+{
+	const uint16x8_t va = vdupq_n_u16(alpha);
+
+	while (len >= 16)
+	{
+		vst1q_u8(dp, neon_blend(vld1q_u8(sp), vld1q_u8(dp), va, va));
+		sp += 16;
+		dp += 16;
+		len -= 16;
+	}
+	tail_span_alpha(dp, sp, len, alpha);
+}
+
+static void
+neon_span_color(byte * restrict dp, const byte * restrict mp, int w, const byte *cv, const color_layout *l, int sa)
+{
+	const uint8x16_t pixel = vld1q_u8(l->pixel);
+	const uint8x16_t c = vld1q_u8(cv);
+	const uint16x8_t vsa = vdupq_n_u16(sa);
+	int dstep = l->step * l->db;
+
+	while (w >= l->need)
+	{
+		uint8x16_t m = vqtbl1q_u8(neon_load_mask(mp, l->step), pixel);
+		uint16x8_t flo = vmovl_u8(vget_low_u8(m));
+		uint16x8_t fhi = vmovl_u8(vget_high_u8(m));
+		flo = vsraq_n_u16(flo, flo, 7);
+		fhi = vsraq_n_u16(fhi, fhi, 7);
+		if (sa != 256)
+		{
+			flo = vshrq_n_u16(vmulq_u16(flo, vsa), 8);
+			fhi = vshrq_n_u16(vmulq_u16(fhi, vsa), 8);
+		}
+		vst1q_u8(dp, neon_blend(c, vld1q_u8(dp), flo, fhi));
+		mp += l->step;
+		dp += dstep;
+		w -= l->step;
+	}
+	tail_span_color(dp, mp, w, cv, l->db, sa);
+}
+
+static void
+neon_solid_color(byte * restrict dp, int w, const byte *cv, const color_layout *l, int sa)
+{
+	const uint8x16_t c = vld1q_u8(cv);
+	const uint8x16_t live = vcltq_u8(vld1q_u8(l->pixel), vdupq_n_u8(16));
+	const uint16x8_t f = vandq_u16(vdupq_n_u16(sa), vreinterpretq_u16_u8(vzip1q_u8(live, live)));
+	const uint16x8_t g = vandq_u16(vdupq_n_u16(sa), vreinterpretq_u16_u8(vzip2q_u8(live, live)));
+	int dstep = l->step * l->db;
+	int need = (16 + l->db - 1) / l->db;
+
+	while (w >= need)
+	{
+		vst1q_u8(dp, neon_blend(c, vld1q_u8(dp), f, g));
+		dp += dstep;
+		w -= l->step;
+	}
+	tail_solid_color(dp, w, cv, l->db, sa);
+}
+
+SIMD_PAINTERS(neon)
+
+/* There are no NEON affine plotters yet. */
+static const simd_painters neon_painters =
+{
+	neon_paint_span_over,
+	neon_paint_span_over_alpha,
+	neon_paint_span_alpha,
+	neon_paint_span_with_color,
+	neon_paint_solid_color,
+	NULL,
+	NULL,
+};
+
+static const simd_painters *
+detect_painters(void)
+{
+	return &neon_painters;
+}
+
+#endif /* SIMD_NEON */
+
+#if defined(SIMD_X86) || defined(SIMD_NEON)
+
+static const simd_painters *
+get_painters(void)
+{
+	/* Racing threads will all arrive at the same answer. */
+	static const simd_painters *painters;
+	static int detected = 0;
+	if (!detected)
+	{
+		painters = detect_painters();
+		detected = 1;
+	}
+	return painters;
+}
+
+fz_solid_color_painter_t *
+fz_get_solid_color_painter_simd(int n, const byte * restrict color, int da)
+{
+	const simd_painters *p = get_painters();
+	if (!p)
+		return NULL;
+	switch (n - da)
+	{
+#if FZ_PLOTTERS_G
+	case 1:
+		return p->solid;
+#endif /* FZ_PLOTTERS_G */
+#if FZ_PLOTTERS_RGB
+	case 3:
+		return p->solid;
+#endif /* FZ_PLOTTERS_RGB */
+#if FZ_PLOTTERS_CMYK
+	case 4:
+		/* paint_solid_color_4_da blends its alpha channel slightly
+		 * differently; leave it to the C version. */
+		return da ? NULL : p->solid;
+#endif /* FZ_PLOTTERS_CMYK */
+	}
+	return NULL;
+}
+
+fz_span_color_painter_t *
+fz_get_span_color_painter_simd(int n, int da, const byte * restrict color)
+{
+	const simd_painters *p = get_painters();
+	if (!p)
+		return NULL;
+	switch (n - da)
+	{
+	case 0:
+		return da ? p->color : NULL;
+	case 1:
+		return p->color;
+#if FZ_PLOTTERS_RGB
+	case 3:
+		return p->color;
+#endif /* FZ_PLOTTERS_RGB */
+#if FZ_PLOTTERS_CMYK
+	case 4:
+		return p->color;
+#endif /* FZ_PLOTTERS_CMYK */
+	}
+	return NULL;
+}
+
+fz_span_painter_t *
+fz_get_span_painter_simd(int da, int sa, int n, int alpha)
+{
+	const simd_painters *p = get_painters();
+	if (!p || alpha <= 0)
+		return NULL;
+	switch (n)
+	{
+	case 0:
+		if (!da || !sa)
+			return NULL;
+		break;
+	case 1:
+		if (!sa && !FZ_PLOTTERS_G)
+			return NULL;
+		break;
+#if FZ_PLOTTERS_RGB
+	case 3:
+		break;
+#endif /* FZ_PLOTTERS_RGB */
+#if FZ_PLOTTERS_CMYK
+	case 4:
+		break;
+#endif /* FZ_PLOTTERS_CMYK */
+	default:
+		return NULL;
+	}
+	if (sa)
+		return alpha == 255 ? p->over : p->over_alpha;
+	if (!da && alpha < 255)
+		return p->alpha;
+	return NULL;
+}
+
+fz_affine_painter_t *
+fz_get_affine_lerp_painter_simd(int da, int sa, int n, int alpha)
+{
+	const simd_painters *p = get_painters();
+	if (!p || !p->affine_lerp || alpha <= 0)
+		return NULL;
+	switch (n)
+	{
+	case 1:
+		if (sa && !FZ_PLOTTERS_G)
+			return NULL;
+		return p->affine_lerp;
+#if FZ_PLOTTERS_RGB
+	case 3:
+		return p->affine_lerp;
+#endif /* FZ_PLOTTERS_RGB */
+#if FZ_PLOTTERS_CMYK
+	case 4:
+		/* Source pixels must fit in 4 bytes. */
+		return sa ? NULL : p->affine_lerp;
+#endif /* FZ_PLOTTERS_CMYK */
+	}
+	return NULL;
+}
+
+fz_affine_painter_t *
+fz_get_affine_g2rgb_lerp_painter_simd(int da, int sa, int alpha)
+{
+	const simd_painters *p = get_painters();
+	if (!p || !p->affine_lerp_g2rgb || alpha <= 0)
+		return NULL;
+	/* The C version with constant alpha always steps 4 bytes per
+	 * pixel; leave that alone. */
+	if (alpha < 255 && !da)
+		return NULL;
+	return p->affine_lerp_g2rgb;
+}
+
+#else
+
+fz_solid_color_painter_t *
+fz_get_solid_color_painter_simd(int n, const byte * restrict color, int da)
+{
+	return NULL;
+}
+
+fz_span_color_painter_t *
+fz_get_span_color_painter_simd(int n, int da, const byte * restrict color)
+{
+	return NULL;
+}
+
+fz_span_painter_t *
+fz_get_span_painter_simd(int da, int sa, int n, int alpha)
+{
+	return NULL;
+}
+
+fz_affine_painter_t *
+fz_get_affine_lerp_painter_simd(int da, int sa, int n, int alpha)
+{
+	return NULL;
+}
+
+fz_affine_painter_t *
+fz_get_affine_g2rgb_lerp_painter_simd(int da, int sa, int alpha)
+{
+	return NULL;
+}
+
+#endif /* SIMD_X86 || SIMD_NEON */
@@ -18,7 +18,7 @@ struct fz_dctd_s
 	int color_transform;
 	int init;
 	int stride;
-	int l2factor;
+	int scale;
 	unsigned char *scanline;
 	unsigned char *rp, *wp;
 	struct jpeg_decompress_struct cinfo;
@@ -236,7 +236,7 @@ next_dctd(fz_context *ctx, fz_stream *stm, size_t max)
 			break;
 		}
 
-		cinfo->scale_num = 8/(1<<state->l2factor);
+		cinfo->scale_num = state->scale;
 		cinfo->scale_denom = 8;
 
 		jpeg_start_decompress(cinfo);
@@ -311,9 +311,9 @@ skip:
 	fz_free(ctx, state);
 }
 
-/* Default: color_transform = -1 (unset), l2factor = 0, jpegtables = NULL */
+/* Default: color_transform = -1 (unset), scale = 8, jpegtables = NULL */
 fz_stream *
-fz_open_dctd(fz_context *ctx, fz_stream *chain, int color_transform, int l2factor, fz_stream *jpegtables)
+fz_open_dctd_scaled(fz_context *ctx, fz_stream *chain, int color_transform, int scale, fz_stream *jpegtables)
 {
 	fz_dctd *state = NULL;
 
@@ -328,7 +328,7 @@ fz_open_dctd(fz_context *ctx, fz_stream *chain, int color_transform, int l2facto
 		state->curr_stm = chain;
 		state->color_transform = color_transform;
 		state->init = 0;
-		state->l2factor = l2factor;
+		state->scale = scale;
 		state->cinfo.client_data = NULL;
 	}
 	fz_catch(ctx)
@@ -341,3 +341,10 @@ fz_open_dctd(fz_context *ctx, fz_stream *chain, int color_transform, int l2facto
 
 	return fz_new_stream(ctx, state, next_dctd, close_dctd);
 }
+
+/* Default: color_transform = -1 (unset), l2factor = 0, jpegtables = NULL */
+fz_stream *
+fz_open_dctd(fz_context *ctx, fz_stream *chain, int color_transform, int l2factor, fz_stream *jpegtables)
+{
+	return fz_open_dctd_scaled(ctx, chain, color_transform, 8/(1<<l2factor), jpegtables);
+}
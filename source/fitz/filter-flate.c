@@ -131,3 +131,524 @@ fz_open_flated(fz_context *ctx, fz_stream *chain, int window_bits)
 	}
 	return fz_new_stream(ctx, state, next_flated, close_flated);
 }
+
+/*
+	Parallel deflate, after pigz. The input is cut into blocks that
+	are compressed independently on all the threads fz_run_tasks
+	will give us, each primed with the last 32K of the input before
+	it so that matches can still reach back across block boundaries.
+	Each block but the last is ended with a sync flush, so that it
+	finishes on a byte boundary and the raw deflate outputs can
+	simply be concatenated; the adler32 checksums of the blocks are
+	combined to make the zlib trailer.
+
+	When asked to, every RESTART_BLOCKS blocks we start a block
+	without a dictionary. Nothing before such a restart point is
+	needed to decode the data after it, so a reader that knows where
+	they are can inflate the stream on several threads too.
+
+	The sync flushes cost a few bytes per block, so with only one
+	thread to use and no restart points wanted we simply run zlib
+	over the whole stream as before.
+*/
+
+enum
+{
+	DEFLATE_BLOCK = 128 << 10,
+	DEFLATE_WINDOW = 32 << 10,
+	RESTART_BLOCKS = 8
+};
+
+struct fz_deflater_s
+{
+	int level;
+	int restart;
+	int serial;
+	z_stream stream;
+	int started;
+	uLong adler;
+	size_t total_in, total_out;
+	int blocks;
+	unsigned char *pending;
+	size_t pending_len;
+	unsigned char history[DEFLATE_WINDOW];
+	size_t history_len;
+	size_t *restarts;
+	int restart_count, restart_cap;
+};
+
+typedef struct
+{
+	const unsigned char *src;
+	size_t len;
+	const unsigned char *dict;
+	size_t dict_len;
+	int last;
+	unsigned char *out;
+	size_t out_len;
+	uLong adler;
+} deflate_block;
+
+typedef struct
+{
+	int level;
+	deflate_block *blocks;
+} deflate_batch;
+
+static void
+deflate_block_task(fz_context *ctx, void *arg, int i)
+{
+	deflate_batch *batch = arg;
+	deflate_block *b = &batch->blocks[i];
+	z_stream z = { 0 };
+	uLong bound;
+	int code;
+
+	z.zalloc = zalloc;
+	z.zfree = zfree;
+	z.opaque = ctx;
+
+	code = deflateInit2(&z, batch->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	if (code != Z_OK)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "zlib error: deflateInit: %s", z.msg);
+
+	fz_try(ctx)
+	{
+		if (b->dict_len > 0)
+			deflateSetDictionary(&z, b->dict, (uInt)b->dict_len);
+
+		/* A sync flush can add up to 5 bytes (and a block header)
+		 * beyond what deflateBound allows for. */
+		bound = deflateBound(&z, (uLong)b->len) + 16;
+		b->out = fz_malloc(ctx, bound);
+
+		z.next_in = (Bytef *)b->src;
+		z.avail_in = (uInt)b->len;
+		z.next_out = b->out;
+		z.avail_out = (uInt)bound;
+		code = deflate(&z, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+		if (b->last ? code != Z_STREAM_END : (code != Z_OK || z.avail_in != 0 || z.avail_out == 0))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "zlib error: deflate: %s", z.msg ? z.msg : "output overflow");
+
+		b->out_len = bound - z.avail_out;
+		b->adler = adler32(adler32(0, NULL, 0), b->src, (uInt)b->len);
+	}
+	fz_always(ctx)
+		deflateEnd(&z);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+fz_deflater *
+fz_new_deflater(fz_context *ctx, int level, int restart)
+{
+	fz_deflater *z = fz_malloc_struct(ctx, fz_deflater);
+	int code;
+
+	z->level = level;
+	z->restart = restart;
+	z->serial = !restart && fz_available_threads(ctx) <= 1;
+	z->adler = adler32(0, NULL, 0);
+
+	if (z->serial)
+	{
+		z->stream.zalloc = zalloc;
+		z->stream.zfree = zfree;
+		z->stream.opaque = ctx;
+		code = deflateInit(&z->stream, level);
+		if (code != Z_OK)
+		{
+			fz_free(ctx, z);
+			fz_throw(ctx, FZ_ERROR_GENERIC, "zlib error: deflateInit: %d", code);
+		}
+		return z;
+	}
+
+	fz_try(ctx)
+		z->pending = fz_malloc(ctx, DEFLATE_BLOCK);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, z);
+		fz_rethrow(ctx);
+	}
+	return z;
+}
+
+void
+fz_drop_deflater(fz_context *ctx, fz_deflater *z)
+{
+	if (!z)
+		return;
+	if (z->serial)
+		deflateEnd(&z->stream);
+	fz_free(ctx, z->restarts);
+	fz_free(ctx, z->pending);
+	fz_free(ctx, z);
+}
+
+int
+fz_deflater_restarts(fz_context *ctx, fz_deflater *z, const size_t **points)
+{
+	*points = z->restarts;
+	return z->restart_count;
+}
+
+static void
+add_restart(fz_context *ctx, fz_deflater *z)
+{
+	if (z->restart_count == z->restart_cap)
+	{
+		int cap = z->restart_cap ? z->restart_cap * 2 : 16;
+		z->restarts = fz_resize_array(ctx, z->restarts, cap, 2 * sizeof(*z->restarts));
+		z->restart_cap = cap;
+	}
+	z->restarts[2 * z->restart_count] = z->total_in;
+	z->restarts[2 * z->restart_count + 1] = z->total_out;
+	z->restart_count++;
+}
+
+static void
+write_deflate_header(fz_context *ctx, fz_deflater *z, fz_buffer *out)
+{
+	unsigned char head[2];
+	int flevel;
+
+	if (z->level == Z_DEFAULT_COMPRESSION || z->level == 6)
+		flevel = 2;
+	else if (z->level < 2)
+		flevel = 0;
+	else if (z->level < 6)
+		flevel = 1;
+	else
+		flevel = 3;
+	head[0] = 0x78;
+	head[1] = flevel << 6;
+	head[1] += 31 - (head[0] * 256 + head[1]) % 31;
+	fz_write_buffer(ctx, out, head, 2);
+	z->total_out = 2;
+	z->started = 1;
+}
+
+static void
+write_deflate_batch(fz_context *ctx, fz_deflater *z, fz_buffer *out, deflate_batch *batch, int n)
+{
+	int i;
+
+	fz_try(ctx)
+	{
+		fz_run_tasks(ctx, 0, n, deflate_block_task, batch);
+
+		for (i = 0; i < n; i++)
+		{
+			deflate_block *b = &batch->blocks[i];
+			if (z->restart && b->dict_len == 0 && b->len > 0 && z->blocks > 0)
+				add_restart(ctx, z);
+			fz_write_buffer(ctx, out, b->out, b->out_len);
+			z->adler = adler32_combine(z->adler, b->adler, (z_off_t)b->len);
+			z->total_in += b->len;
+			z->total_out += b->out_len;
+			z->blocks++;
+		}
+	}
+	fz_always(ctx)
+	{
+		for (i = 0; i < n; i++)
+		{
+			fz_free(ctx, batch->blocks[i].out);
+			batch->blocks[i].out = NULL;
+		}
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static void
+deflate_serial(fz_context *ctx, fz_deflater *z, fz_buffer *out, const unsigned char *data, size_t len, int finish)
+{
+	size_t chunk;
+	int code;
+
+	do
+	{
+		chunk = fz_minz(len, 1 << 30);
+		z->stream.next_in = (Bytef *)data;
+		z->stream.avail_in = (uInt)chunk;
+		data += chunk;
+		len -= chunk;
+		do
+		{
+			if (out->cap - out->len < 4096)
+				fz_resize_buffer(ctx, out, out->cap + fz_minz(out->cap, 1 << 30) + 4096);
+			z->stream.next_out = out->data + out->len;
+			z->stream.avail_out = (uInt)fz_minz(out->cap - out->len, 1 << 30);
+			chunk = z->stream.avail_out;
+			code = deflate(&z->stream, finish && len == 0 ? Z_FINISH : Z_NO_FLUSH);
+			out->len += chunk - z->stream.avail_out;
+			if (code != Z_OK && code != Z_STREAM_END && code != Z_BUF_ERROR)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "zlib error: deflate: %s", z->stream.msg ? z->stream.msg : "unknown error");
+		}
+		while (z->stream.avail_in > 0 || z->stream.avail_out == 0 || (finish && len == 0 && code != Z_STREAM_END));
+	}
+	while (len > 0);
+}
+
+void
+fz_deflater_write(fz_context *ctx, fz_deflater *z, fz_buffer *out, const unsigned char *data, size_t len, int finish)
+{
+	deflate_batch batch;
+	deflate_block *b;
+	const unsigned char *prev = z->history;
+	size_t prev_len = z->history_len;
+	size_t pos = 0, take;
+	int n = 0, batch_size;
+
+	if (z->serial)
+	{
+		deflate_serial(ctx, z, out, data, len, finish);
+		return;
+	}
+
+	if (!z->started)
+		write_deflate_header(ctx, z, out);
+
+	/* Top up a partial block left over from the last call first. */
+	if (z->pending_len > 0)
+	{
+		take = fz_minz(DEFLATE_BLOCK - z->pending_len, len);
+		memcpy(z->pending + z->pending_len, data, take);
+		z->pending_len += take;
+		pos = take;
+		if (z->pending_len < DEFLATE_BLOCK && !finish)
+			return;
+	}
+
+	batch_size = fz_available_threads(ctx) * 4;
+	batch.level = z->level;
+	batch.blocks = fz_calloc(ctx, batch_size, sizeof(*batch.blocks));
+
+	fz_try(ctx)
+	{
+		for (;;)
+		{
+			b = &batch.blocks[n];
+			if (z->pending_len > 0)
+			{
+				b->src = z->pending;
+				b->len = z->pending_len;
+				z->pending_len = 0;
+			}
+			else if (len - pos >= DEFLATE_BLOCK || (finish && pos < len))
+			{
+				b->src = data + pos;
+				b->len = fz_minz(DEFLATE_BLOCK, len - pos);
+				pos += b->len;
+			}
+			else if (finish)
+			{
+				/* Everything has been written already; we still
+				 * need a final block to end the stream. */
+				b->src = NULL;
+				b->len = 0;
+			}
+			else
+				break;
+
+			if (!z->restart || (z->blocks + n) % RESTART_BLOCKS != 0)
+			{
+				b->dict = prev;
+				b->dict_len = prev_len;
+			}
+			else
+			{
+				b->dict = NULL;
+				b->dict_len = 0;
+			}
+			b->last = finish && pos == len;
+			if (b->len > 0)
+			{
+				prev_len = fz_minz(b->len, DEFLATE_WINDOW);
+				prev = b->src + b->len - prev_len;
+			}
+
+			if (++n == batch_size || b->last)
+			{
+				write_deflate_batch(ctx, z, out, &batch, n);
+				n = 0;
+			}
+			if (b->last)
+				break;
+		}
+		if (n > 0)
+			write_deflate_batch(ctx, z, out, &batch, n);
+
+		/* Keep the window for the next call before the pending
+		 * block, which it may point into, is overwritten. */
+		if (prev != z->history)
+		{
+			memmove(z->history, prev, prev_len);
+			z->history_len = prev_len;
+		}
+		if (pos < len)
+		{
+			memcpy(z->pending, data + pos, len - pos);
+			z->pending_len = len - pos;
+		}
+
+		if (finish)
+		{
+			unsigned char tail[4];
+			tail[0] = z->adler >> 24;
+			tail[1] = z->adler >> 16;
+			tail[2] = z->adler >> 8;
+			tail[3] = z->adler;
+			fz_write_buffer(ctx, out, tail, 4);
+			z->total_out += 4;
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, batch.blocks);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/*
+	The other half: inflate a zlib stream with known restart points
+	one segment per task, straight into its place in the output.
+	Any surprise at all (a segment that does not end exactly where
+	it should, a bad checksum) makes us give up and return NULL, so
+	that the caller can fall back to the ordinary filter; points
+	that do not match the data can therefore cost time, but never
+	give wrong results.
+*/
+
+typedef struct
+{
+	const unsigned char *src;
+	size_t src_len, used;
+	unsigned char *dst;
+	size_t dst_len;
+	int last;
+	int ok;
+	uLong adler;
+} inflate_segment;
+
+static void
+inflate_segment_task(fz_context *ctx, void *arg, int i)
+{
+	inflate_segment *seg = &((inflate_segment *)arg)[i];
+	int flush = seg->last ? Z_FINISH : Z_SYNC_FLUSH;
+	z_stream z = { 0 };
+	unsigned char spare;
+	int code;
+
+	z.zalloc = zalloc;
+	z.zfree = zfree;
+	z.opaque = ctx;
+
+	if (inflateInit2(&z, -15) != Z_OK)
+		return;
+
+	z.next_in = (Bytef *)seg->src;
+	z.avail_in = (uInt)seg->src_len;
+	z.next_out = seg->dst;
+	z.avail_out = (uInt)seg->dst_len;
+	code = inflate(&z, flush);
+
+	/* With the output exactly full inflate may not yet have looked
+	 * at the end of the segment (the empty stored block of a sync
+	 * flush, or the end of the last block); let it, making sure it
+	 * has nothing more to say. */
+	if ((code == Z_OK || code == Z_BUF_ERROR) && z.avail_out == 0 && z.avail_in > 0)
+	{
+		z.next_out = &spare;
+		z.avail_out = 1;
+		code = inflate(&z, flush);
+		if (z.avail_out == 0)
+			code = Z_DATA_ERROR;
+		z.avail_out = 0;
+	}
+
+	if (seg->last)
+		seg->ok = (code == Z_STREAM_END && z.avail_out == 0);
+	else
+		seg->ok = ((code == Z_OK || code == Z_BUF_ERROR) && z.avail_out == 0 && z.avail_in == 0);
+	seg->used = seg->src_len - z.avail_in;
+	inflateEnd(&z);
+
+	if (seg->ok)
+		seg->adler = adler32(adler32(0, NULL, 0), seg->dst, (uInt)seg->dst_len);
+}
+
+fz_buffer *
+fz_inflate_restarts(fz_context *ctx, const unsigned char *data, size_t len, const size_t *points, int count, size_t dlen)
+{
+	inflate_segment *segs;
+	fz_buffer *buf = NULL;
+	const unsigned char *tail;
+	size_t u, c;
+	uLong adler;
+	int i, ok;
+
+	/* Check the zlib header, that the points are in order, and that
+	 * the length is one that deflate could have produced. */
+	if (len < 6 || dlen / 1032 > len || (data[0] & 0x0f) != Z_DEFLATED || (data[1] & 0x20) || (data[0] * 256 + data[1]) % 31 != 0)
+		return NULL;
+	u = 0;
+	c = 2;
+	for (i = 0; i < count; i++)
+	{
+		if (points[2 * i] <= u || points[2 * i] > dlen || points[2 * i + 1] <= c || points[2 * i + 1] >= len)
+			return NULL;
+		u = points[2 * i];
+		c = points[2 * i + 1];
+	}
+
+	segs = fz_calloc(ctx, count + 1, sizeof(*segs));
+	fz_var(buf);
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer(ctx, dlen > 0 ? dlen : 1);
+		for (i = 0; i <= count; i++)
+		{
+			u = i > 0 ? points[2 * i - 2] : 0;
+			c = i > 0 ? points[2 * i - 1] : 2;
+			segs[i].src = data + c;
+			segs[i].src_len = (i < count ? points[2 * i + 1] : len) - c;
+			segs[i].dst = buf->data + u;
+			segs[i].dst_len = (i < count ? points[2 * i] : dlen) - u;
+			segs[i].last = (i == count);
+		}
+
+		fz_run_tasks(ctx, 0, count + 1, inflate_segment_task, segs);
+
+		ok = 1;
+		adler = adler32(0, NULL, 0);
+		for (i = 0; i <= count && ok; i++)
+		{
+			ok = segs[i].ok;
+			adler = adler32_combine(adler, segs[i].adler, (z_off_t)segs[i].dst_len);
+		}
+		if (ok)
+		{
+			tail = segs[count].src + segs[count].used;
+			ok = (data + len - tail >= 4 &&
+				tail[0] == ((adler >> 24) & 0xff) && tail[1] == ((adler >> 16) & 0xff) &&
+				tail[2] == ((adler >> 8) & 0xff) && tail[3] == (adler & 0xff));
+		}
+		if (ok)
+			buf->len = dlen;
+		else
+		{
+			fz_drop_buffer(ctx, buf);
+			buf = NULL;
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, segs);
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_rethrow(ctx);
+	}
+	return buf;
+}
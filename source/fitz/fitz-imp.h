@@ -0,0 +1,79 @@
+#ifndef MUPDF_FITZ_IMP_H
+#define MUPDF_FITZ_IMP_H
+
+/*
+	Thread primitives for the parts of the library that run threads or
+	keep locks of their own, rather than using the client's locks.
+
+	FZ_THREADS is defined when the library is built with HAVE_PTHREADS
+	(or with MSVC); otherwise there are no threads or mutexes, and
+	callers must fall back to the fz_lock mechanism.
+*/
+
+#ifdef _MSC_VER
+#include <windows.h>
+#define FZ_THREADS 1
+#elif defined(HAVE_PTHREADS)
+#include <pthread.h>
+#include <unistd.h>
+#define FZ_THREADS 2
+#endif
+
+#ifdef FZ_THREADS
+
+#if FZ_THREADS == 1
+
+#define THREAD HANDLE
+#define THREAD_INIT(A,B,C) ((A = CreateThread(NULL, 0, B, C, 0, NULL)) != NULL)
+#define THREAD_FIN(A) do { (void)WaitForSingleObject(A, INFINITE); CloseHandle(A); } while (0)
+#define THREAD_RETURN_TYPE DWORD WINAPI
+#define THREAD_RETURN() return 0
+#define MUTEX CRITICAL_SECTION
+#define MUTEX_INIT(A) do { InitializeCriticalSection(&A); } while (0)
+#define MUTEX_FIN(A) do { DeleteCriticalSection(&A); } while (0)
+#define MUTEX_LOCK(A) do { EnterCriticalSection(&A); } while (0)
+#define MUTEX_UNLOCK(A) do { LeaveCriticalSection(&A); } while (0)
+
+#else
+
+#define THREAD pthread_t
+#define THREAD_INIT(A,B,C) (pthread_create(&A, NULL, B, C) == 0)
+#define THREAD_FIN(A) do { void *res; (void)pthread_join(A, &res); } while (0)
+#define THREAD_RETURN_TYPE void *
+#define THREAD_RETURN() return NULL
+#define MUTEX pthread_mutex_t
+#define MUTEX_INIT(A) do { (void)pthread_mutex_init(&A, NULL); } while (0)
+#define MUTEX_FIN(A) do { (void)pthread_mutex_destroy(&A); } while (0)
+#define MUTEX_LOCK(A) do { (void)pthread_mutex_lock(&A); } while (0)
+#define MUTEX_UNLOCK(A) do { (void)pthread_mutex_unlock(&A); } while (0)
+
+#endif
+
+#endif /* FZ_THREADS */
+
+/*
+	Atomic reference counts. FZ_ATOMIC_INC and FZ_ATOMIC_DEC return
+	the new value of the int they point to, and FZ_ATOMIC_GET reads
+	it. FZ_ATOMIC_ADD_SIZE adds to a size_t and returns the new value.
+	They are not defined when the compiler offers no atomic operations,
+	in which case reference counts must be taken under FZ_LOCK_ALLOC
+	as usual.
+*/
+
+#if defined(_MSC_VER)
+#define FZ_ATOMIC_INC(P) InterlockedIncrement((volatile LONG *)(P))
+#define FZ_ATOMIC_DEC(P) InterlockedDecrement((volatile LONG *)(P))
+#define FZ_ATOMIC_GET(P) InterlockedCompareExchange((volatile LONG *)(P), 0, 0)
+#ifdef _WIN64
+#define FZ_ATOMIC_ADD_SIZE(P,V) ((size_t)InterlockedExchangeAdd64((volatile LONGLONG *)(P), (LONGLONG)(V)) + (V))
+#else
+#define FZ_ATOMIC_ADD_SIZE(P,V) ((size_t)InterlockedExchangeAdd((volatile LONG *)(P), (LONG)(V)) + (V))
+#endif
+#elif defined(__GNUC__) || defined(__clang__)
+#define FZ_ATOMIC_INC(P) __sync_add_and_fetch((P), 1)
+#define FZ_ATOMIC_DEC(P) __sync_sub_and_fetch((P), 1)
+#define FZ_ATOMIC_GET(P) __sync_add_and_fetch((P), 0)
+#define FZ_ATOMIC_ADD_SIZE(P,V) __sync_add_and_fetch((P), (V))
+#endif
+
+#endif
@@ -1,30 +1,62 @@
 #include "mupdf/fitz.h"
+#include "fitz-imp.h"
 
 #define RLE_THRESHOLD 256
 
+static void
+fz_drop_glyph_imp(fz_context *ctx, fz_storable *glyph_)
+{
+	fz_glyph *glyph = (fz_glyph *)glyph_;
+
+	if (glyph == NULL)
+		return;
+	fz_drop_pixmap(ctx, glyph->pixmap);
+	fz_free(ctx, glyph);
+}
+
+/* Glyphs are never put in the store, so their reference counts can be
+ * kept with atomic operations rather than under the alloc lock, which
+ * every thread drawing text would otherwise contend for. */
+#ifdef FZ_ATOMIC_INC
+
 fz_glyph *
 fz_keep_glyph(fz_context *ctx, fz_glyph *glyph)
 {
-	return fz_keep_storable(ctx, &glyph->storable);
+	if (glyph)
+	{
+		(void)Memento_takeRef(glyph);
+		FZ_ATOMIC_INC(&glyph->storable.refs);
+	}
+	return glyph;
 }
 
 void
 fz_drop_glyph(fz_context *ctx, fz_glyph *glyph)
 {
-	fz_drop_storable(ctx, &glyph->storable);
+	if (glyph)
+	{
+		(void)Memento_dropRef(glyph);
+		if (FZ_ATOMIC_DEC(&glyph->storable.refs) == 0)
+			fz_drop_glyph_imp(ctx, &glyph->storable);
+	}
 }
 
-static void
-fz_drop_glyph_imp(fz_context *ctx, fz_storable *glyph_)
+#else
+
+fz_glyph *
+fz_keep_glyph(fz_context *ctx, fz_glyph *glyph)
 {
-	fz_glyph *glyph = (fz_glyph *)glyph_;
+	return fz_keep_storable(ctx, &glyph->storable);
+}
 
-	if (glyph == NULL)
-		return;
-	fz_drop_pixmap(ctx, glyph->pixmap);
-	fz_free(ctx, glyph);
+void
+fz_drop_glyph(fz_context *ctx, fz_glyph *glyph)
+{
+	fz_drop_storable(ctx, &glyph->storable);
 }
 
+#endif
+
 fz_irect *
 fz_glyph_bbox(fz_context *ctx, fz_glyph *glyph, fz_irect *bbox)
 {
@@ -36,6 +36,7 @@ struct fz_image_key_s {
 	int refs;
 	fz_image *image;
 	int l2factor;
+	int dct_scale; /* JPEG decoded at dct_scale/8, or 0 */
 	fz_irect rect;
 };
 
@@ -72,7 +73,7 @@ fz_cmp_image_key(fz_context *ctx, void *k0_, void *k1_)
 {
 	fz_image_key *k0 = (fz_image_key *)k0_;
 	fz_image_key *k1 = (fz_image_key *)k1_;
-	return k0->image == k1->image && k0->l2factor == k1->l2factor && k0->rect.x0 == k1->rect.x0 && k0->rect.y0 == k1->rect.y0 && k0->rect.x1 == k1->rect.x1 && k0->rect.y1 == k1->rect.y1;
+	return k0->image == k1->image && k0->l2factor == k1->l2factor && k0->dct_scale == k1->dct_scale && k0->rect.x0 == k1->rect.x0 && k0->rect.y0 == k1->rect.y0 && k0->rect.x1 == k1->rect.x1 && k0->rect.y1 == k1->rect.y1;
 }
 
 static void
@@ -82,13 +83,36 @@ fz_print_image(fz_context *ctx, fz_output *out, void *key_)
 	fz_printf(ctx, out, "(image %d x %d sf=%d) ", key->image->w, key->image->h, key->l2factor);
 }
 
+static size_t
+fz_image_cost(fz_context *ctx, void *key_, size_t size)
+{
+	fz_image_key *key = (fz_image_key *)key_;
+	fz_compressed_buffer *buffer = fz_compressed_image_buffer(ctx, key->image);
+
+	/* Rough costs of decoding, relative to flate. */
+	switch (buffer ? buffer->params.type : FZ_IMAGE_UNKNOWN)
+	{
+	case FZ_IMAGE_JPX:
+		return size * 16;
+	case FZ_IMAGE_JBIG2:
+	case FZ_IMAGE_JXR:
+		return size * 8;
+	case FZ_IMAGE_JPEG:
+	case FZ_IMAGE_FAX:
+		return size * 4;
+	default:
+		return size;
+	}
+}
+
 static fz_store_type fz_image_store_type =
 {
 	fz_make_hash_image_key,
 	fz_keep_image_key,
 	fz_drop_image_key,
 	fz_cmp_image_key,
-	fz_print_image
+	fz_print_image,
+	fz_image_cost
 };
 
 static void
@@ -164,16 +188,24 @@ fz_unblend_masked_tile(fz_context *ctx, fz_pixmap *tile, fz_image *image)
 	fz_drop_pixmap(ctx, mask);
 }
 
-fz_pixmap *
-fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image *cimg, fz_irect *subarea, int indexed, int l2factor)
+/* Size of x pixels once scaled by num/denom, as decoders round it. */
+static int
+scaled_size(int x, int num, int denom)
+{
+	return (int)(((int64_t)x * num + denom - 1) / denom);
+}
+
+/* The stream holds the image scaled by num/denom; denom is a power of
+ * two, and subareas are aligned to multiples of it. */
+static fz_pixmap *
+decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image *cimg, fz_irect *subarea, int indexed, int num, int denom)
 {
 	fz_image *image = &cimg->super;
 	fz_pixmap *tile = NULL;
 	size_t stride, len, i;
 	unsigned char *samples = NULL;
-	int f = 1<<l2factor;
-	int w = image->w;
-	int h = image->h;
+	int f = denom;
+	int w, h;
 
 	if (subarea)
 	{
@@ -225,11 +257,14 @@ fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image
 		subarea->y1 = (subarea->y1 + f - 1) & ~(f - 1);
 		if (subarea->y1 > image->h)
 			subarea->y1 = image->h;
-		w = (subarea->x1 - subarea->x0);
-		h = (subarea->y1 - subarea->y0);
+		w = scaled_size(subarea->x1, num, denom) - scaled_size(subarea->x0, num, denom);
+		h = scaled_size(subarea->y1, num, denom) - scaled_size(subarea->y0, num, denom);
+	}
+	else
+	{
+		w = scaled_size(image->w, num, denom);
+		h = scaled_size(image->h, num, denom);
 	}
-	w = (w + f - 1) >> l2factor;
-	h = (h + f - 1) >> l2factor;
 
 	fz_var(tile);
 	fz_var(samples);
@@ -250,12 +285,12 @@ fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image
 		{
 			int hh;
 			unsigned char *s = samples;
-			int stream_w = (image->w + f - 1)>>l2factor;
+			int stream_w = scaled_size(image->w, num, denom);
 			size_t stream_stride = (stream_w * image->n * image->bpc + 7) / 8;
-			int l_margin = subarea->x0 >> l2factor;
-			int t_margin = subarea->y0 >> l2factor;
-			int r_margin = (image->w + f - 1 - subarea->x1) >> l2factor;
-			int b_margin = (image->h + f - 1 - subarea->y1) >> l2factor;
+			int l_margin = scaled_size(subarea->x0, num, denom);
+			int t_margin = scaled_size(subarea->y0, num, denom);
+			int r_margin = stream_w - scaled_size(subarea->x1, num, denom);
+			int b_margin = scaled_size(image->h, num, denom) - scaled_size(subarea->y1, num, denom);
 			int l_skip = (l_margin * image->n * image->bpc)/8;
 			int r_skip = (r_margin * image->n * image->bpc + 7)/8;
 			size_t t_skip = t_margin * stream_stride + l_skip;
@@ -346,6 +381,12 @@ fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image
 	return tile;
 }
 
+fz_pixmap *
+fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image *cimg, fz_irect *subarea, int indexed, int l2factor)
+{
+	return decomp_image_from_stream(ctx, stm, cimg, subarea, indexed, 1, 1<<l2factor);
+}
+
 void
 fz_drop_image_imp(fz_context *ctx, fz_storable *image_)
 {
@@ -381,6 +422,47 @@ drop_pixmap_image(fz_context *ctx, fz_image *image_)
 	fz_drop_image_base(ctx, &image->super);
 }
 
+/* Scan JPEG stream and patch missing height values in header */
+static void
+patch_jpeg_height(fz_compressed_image *image)
+{
+	unsigned char *s = image->buffer->buffer->data;
+	unsigned char *e = s + image->buffer->buffer->len;
+	unsigned char *d;
+	for (d = s + 2; s < d && d < e - 9 && d[0] == 0xFF; d += (d[2] << 8 | d[3]) + 2)
+	{
+		if (d[1] < 0xC0 || (0xC3 < d[1] && d[1] < 0xC9) || 0xCB < d[1])
+			continue;
+		if ((d[5] == 0 && d[6] == 0) || ((d[5] << 8) | d[6]) > image->super.h)
+		{
+			d[5] = (image->super.h >> 8) & 0xFF;
+			d[6] = image->super.h & 0xFF;
+		}
+	}
+}
+
+/* The DCT decoder can scale JPEG images by any n/8, not just powers of
+ * two. Pick the smallest n that keeps the (sub)area at least w+2 by h+2
+ * pixels, as with l2factor. Returns 0 if the answer is a power of two,
+ * which the l2factor machinery already covers. */
+static int
+image_dct_scale(fz_context *ctx, fz_image *image, const fz_irect *subarea, int w, int h)
+{
+	fz_compressed_buffer *buffer = fz_compressed_image_buffer(ctx, image);
+	int sw = subarea ? subarea->x1 - subarea->x0 : image->w;
+	int sh = subarea ? subarea->y1 - subarea->y0 : image->h;
+	int n;
+
+	if (!buffer || buffer->params.type != FZ_IMAGE_JPEG || w == 0 || h == 0)
+		return 0;
+	for (n = 1; n < 8; n++)
+		if (scaled_size(sw, n, 8) >= w+2 && scaled_size(sh, n, 8) >= h+2)
+			break;
+	if ((n & (n - 1)) == 0)
+		return 0;
+	return n;
+}
+
 static fz_pixmap *
 compressed_image_get_pixmap(fz_context *ctx, fz_image *image_, fz_irect *subarea, int w, int h, int *l2factor)
 {
@@ -390,6 +472,8 @@ compressed_image_get_pixmap(fz_context *ctx, fz_image *image_, fz_irect *subarea
 	int indexed;
 	fz_pixmap *tile;
 	int can_sub = 0;
+	int dct_scale = 0;
+	int num, denom;
 
 	/* We need to make a new one. */
 	/* First check for ones that we can't decode using streams */
@@ -417,33 +501,33 @@ compressed_image_get_pixmap(fz_context *ctx, fz_image *image_, fz_irect *subarea
 		tile = fz_load_jpx(ctx, image->buffer->buffer->data, image->buffer->buffer->len, NULL, 0);
 		break;
 	case FZ_IMAGE_JPEG:
-		/* Scan JPEG stream and patch missing height values in header */
-		{
-			unsigned char *s = image->buffer->buffer->data;
-			unsigned char *e = s + image->buffer->buffer->len;
-			unsigned char *d;
-			for (d = s + 2; s < d && d < e - 9 && d[0] == 0xFF; d += (d[2] << 8 | d[3]) + 2)
-			{
-				if (d[1] < 0xC0 || (0xC3 < d[1] && d[1] < 0xC9) || 0xCB < d[1])
-					continue;
-				if ((d[5] == 0 && d[6] == 0) || ((d[5] << 8) | d[6]) > image->super.h)
-				{
-					d[5] = (image->super.h >> 8) & 0xFF;
-					d[6] = image->super.h & 0xFF;
-				}
-			}
-		}
+		patch_jpeg_height(image);
+		dct_scale = image_dct_scale(ctx, image_, subarea, w, h);
 		/* fall through */
 
 	default:
-		native_l2factor = l2factor ? *l2factor : 0;
-		stm = fz_open_image_decomp_stream_from_buffer(ctx, image->buffer, l2factor);
-		if (l2factor)
-			native_l2factor -= *l2factor;
+		if (dct_scale)
+		{
+			/* The decoder does all the scaling there is to do. */
+			stm = fz_open_dctd_scaled(ctx, fz_open_buffer(ctx, image->buffer->buffer), image->buffer->params.u.jpeg.color_transform, dct_scale, NULL);
+			if (l2factor)
+				*l2factor = 0;
+			num = dct_scale;
+			denom = 8;
+		}
+		else
+		{
+			native_l2factor = l2factor ? *l2factor : 0;
+			stm = fz_open_image_decomp_stream_from_buffer(ctx, image->buffer, l2factor);
+			if (l2factor)
+				native_l2factor -= *l2factor;
+			num = 1;
+			denom = 1 << native_l2factor;
+		}
 
 		indexed = fz_colorspace_is_indexed(ctx, image->super.colorspace);
 		can_sub = 1;
-		tile = fz_decomp_image_from_stream(ctx, stm, image, subarea, indexed, native_l2factor);
+		tile = decomp_image_from_stream(ctx, stm, image, subarea, indexed, num, denom);
 
 		/* CMYK JPEGs in XPS documents have to be inverted */
 		if (image->super.invert_cmyk_jpeg &&
@@ -525,6 +609,21 @@ void fz_default_image_decode(void *arg, int w, int h, int l2factor, fz_irect *su
 	}
 }
 
+/* What is our ideal factor? We search for the largest factor where
+ * we can subdivide and stay larger than the required size. We add
+ * a fudge factor of +2 here to allow for the possibility of
+ * expansion due to grid fitting. */
+static int
+image_l2factor(fz_image *image, int w, int h)
+{
+	int l2factor;
+
+	if (w == 0 || h == 0)
+		return 0;
+	for (l2factor=0; image->w>>(l2factor+1) >= w+2 && image->h>>(l2factor+1) >= h+2 && l2factor < 6; l2factor++);
+	return l2factor;
+}
+
 fz_pixmap *
 fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subarea, fz_matrix *ctm, int *dw, int *dh)
 {
@@ -534,6 +633,7 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 	fz_image_key *keyp;
 	int w;
 	int h;
+	int dct_scale;
 
 	if (!image)
 		return NULL;
@@ -576,14 +676,7 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 		return image->get_pixmap(ctx, image, NULL, image->w, image->h, &l2factor_remaining);
 	}
 
-	/* What is our ideal factor? We search for the largest factor where
-	 * we can subdivide and stay larger than the required size. We add
-	 * a fudge factor of +2 here to allow for the possibility of
-	 * expansion due to grid fitting. */
-	if (w == 0 || h == 0)
-		l2factor = 0;
-	else
-		for (l2factor=0; image->w>>(l2factor+1) >= w+2 && image->h>>(l2factor+1) >= h+2 && l2factor < 6; l2factor++);
+	l2factor = image_l2factor(image, w, h);
 
 	/* Now figure out if we want to decode just a subarea */
 	if (subarea == NULL)
@@ -631,10 +724,24 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 	if (w == 0 || h == 0)
 		l2factor = 0;
 
+	/* JPEGs may be decoded at a finer scale than l2factor allows. */
+	dct_scale = image_dct_scale(ctx, image, &key.rect, w, h);
+
 	/* Can we find any suitable tiles in the cache? */
 	key.refs = 1;
 	key.image = image;
 	key.l2factor = l2factor;
+	key.dct_scale = dct_scale;
+	if (dct_scale)
+	{
+		tile = fz_find_item(ctx, fz_drop_pixmap_imp, &key, &fz_image_store_type);
+		if (tile)
+		{
+			update_ctm_for_subarea(ctm, &key.rect, image->w, image->h);
+			return tile;
+		}
+		key.dct_scale = 0;
+	}
 	do
 	{
 		tile = fz_find_item(ctx, fz_drop_pixmap_imp, &key, &fz_image_store_type);
@@ -673,6 +780,7 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 		keyp->refs = 1;
 		keyp->image = fz_keep_image(ctx, image);
 		keyp->l2factor = l2factor;
+		keyp->dct_scale = dct_scale;
 		keyp->rect = key.rect;
 		existing_tile = fz_store_item(ctx, keyp, tile, fz_pixmap_size(ctx, tile), &fz_image_store_type);
 		if (existing_tile)
@@ -695,6 +803,182 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 	return tile;
 }
 
+struct fz_image_rows_s
+{
+	fz_image *image;
+	fz_stream *stm;
+	int w, h, y;
+	int indexed;
+	int invert;
+	int truncated;
+	size_t stride;
+	unsigned char *samples;
+	fz_pixmap *raw;
+	fz_pixmap *row;
+};
+
+fz_image_rows *
+fz_open_image_rows(fz_context *ctx, fz_image *image, int w, int h)
+{
+	fz_compressed_image *cimg = (fz_compressed_image *)image;
+	fz_image_rows *rows;
+	fz_image_key key;
+	int l2factor, remaining, dct_scale;
+
+	if (image->get_pixmap != compressed_image_get_pixmap)
+		return NULL;
+	if (image->imagemask || image->use_colorkey || image->decoded || image->scalable || cimg->tile)
+		return NULL;
+	switch (cimg->buffer->params.type)
+	{
+	case FZ_IMAGE_RAW:
+	case FZ_IMAGE_FAX:
+	case FZ_IMAGE_JPEG:
+	case FZ_IMAGE_RLD:
+	case FZ_IMAGE_FLATE:
+	case FZ_IMAGE_LZW:
+		break;
+	default:
+		return NULL;
+	}
+
+	if (w > image->w)
+		w = image->w;
+	if (h > image->h)
+		h = image->h;
+	l2factor = image_l2factor(image, w, h);
+	dct_scale = image_dct_scale(ctx, image, NULL, w, h);
+
+	/* If a decoded copy is already to hand, the caller is better off
+	 * using that. */
+	key.refs = 1;
+	key.image = image;
+	key.rect.x0 = 0;
+	key.rect.y0 = 0;
+	key.rect.x1 = image->w;
+	key.rect.y1 = image->h;
+	key.l2factor = l2factor;
+	key.dct_scale = dct_scale;
+	do
+	{
+		fz_pixmap *tile = fz_find_item(ctx, fz_drop_pixmap_imp, &key, &fz_image_store_type);
+		if (tile)
+		{
+			fz_drop_pixmap(ctx, tile);
+			return NULL;
+		}
+		if (key.dct_scale)
+			key.dct_scale = 0;
+		else
+			key.l2factor--;
+	}
+	while (key.l2factor >= 0);
+
+	if (cimg->buffer->params.type == FZ_IMAGE_JPEG)
+		patch_jpeg_height(cimg);
+
+	/* Only take the reduction the decoder can do for free; the rest is
+	 * left to the caller's scaler. */
+	remaining = l2factor;
+	rows = fz_malloc_struct(ctx, fz_image_rows);
+	fz_try(ctx)
+	{
+		rows->image = fz_keep_image(ctx, image);
+		if (dct_scale)
+		{
+			rows->stm = fz_open_dctd_scaled(ctx, fz_open_buffer(ctx, cimg->buffer->buffer), cimg->buffer->params.u.jpeg.color_transform, dct_scale, NULL);
+			rows->w = scaled_size(image->w, dct_scale, 8);
+			rows->h = scaled_size(image->h, dct_scale, 8);
+		}
+		else
+		{
+			rows->stm = fz_open_image_decomp_stream_from_buffer(ctx, cimg->buffer, &remaining);
+			rows->w = scaled_size(image->w, 1, 1 << (l2factor - remaining));
+			rows->h = scaled_size(image->h, 1, 1 << (l2factor - remaining));
+		}
+		rows->indexed = fz_colorspace_is_indexed(ctx, image->colorspace);
+		rows->invert = (image->invert_cmyk_jpeg &&
+			cimg->buffer->params.type == FZ_IMAGE_JPEG &&
+			image->colorspace == fz_device_cmyk(ctx) &&
+			cimg->buffer->params.u.jpeg.color_transform);
+		rows->stride = (rows->w * image->n * image->bpc + 7) / 8;
+		rows->samples = fz_malloc(ctx, rows->stride);
+		rows->raw = fz_new_pixmap(ctx, image->colorspace, rows->w, 1, image->colorspace == NULL);
+		rows->raw->interpolate = image->interpolate;
+	}
+	fz_catch(ctx)
+	{
+		fz_close_image_rows(ctx, rows);
+		fz_rethrow(ctx);
+	}
+
+	return rows;
+}
+
+void
+fz_image_rows_size(fz_context *ctx, fz_image_rows *rows, int *w, int *h)
+{
+	*w = rows->w;
+	*h = rows->h;
+}
+
+fz_pixmap *
+fz_read_image_row(fz_context *ctx, fz_image_rows *rows)
+{
+	fz_image *image = rows->image;
+	size_t len = 0;
+
+	if (rows->y >= rows->h)
+		return NULL;
+
+	if (!rows->truncated)
+		len = fz_read(ctx, rows->stm, rows->samples, rows->stride);
+	if (len < rows->stride)
+	{
+		/* Pad truncated images */
+		if (!rows->truncated)
+			fz_warn(ctx, "padding truncated image");
+		rows->truncated = 1;
+		memset(rows->samples + len, 0, rows->stride - len);
+	}
+
+	fz_unpack_tile(ctx, rows->raw, rows->samples, image->n, image->bpc, rows->stride, rows->indexed);
+
+	if (rows->indexed)
+	{
+		fz_decode_indexed_tile(ctx, rows->raw, image->decode, (1 << image->bpc) - 1);
+		fz_drop_pixmap(ctx, rows->row);
+		rows->row = NULL;
+		rows->row = fz_expand_indexed_pixmap(ctx, rows->raw, rows->raw->alpha);
+	}
+	else
+	{
+		fz_decode_tile(ctx, rows->raw, image->decode);
+		if (!rows->row)
+			rows->row = fz_keep_pixmap(ctx, rows->raw);
+	}
+
+	/* CMYK JPEGs in XPS documents have to be inverted */
+	if (rows->invert)
+		fz_invert_pixmap(ctx, rows->row);
+
+	rows->row->y = rows->y++;
+	return rows->row;
+}
+
+void
+fz_close_image_rows(fz_context *ctx, fz_image_rows *rows)
+{
+	if (!rows)
+		return;
+	fz_drop_pixmap(ctx, rows->row);
+	fz_drop_pixmap(ctx, rows->raw);
+	fz_free(ctx, rows->samples);
+	fz_drop_stream(ctx, rows->stm);
+	fz_drop_image(ctx, rows->image);
+	fz_free(ctx, rows);
+}
+
 static size_t
 pixmap_image_get_size(fz_context *ctx, fz_image *image)
 {
@@ -1,6 +1,7 @@
 #include "mupdf/fitz.h"
 
 typedef struct fz_display_node_s fz_display_node;
+typedef struct fz_display_index_s fz_display_index;
 typedef struct fz_list_device_s fz_list_device;
 
 #define STACK_SIZE 96
@@ -116,6 +117,7 @@ struct fz_display_list_s
 	fz_rect mediabox;
 	int max;
 	int len;
+	fz_display_index *index;
 };
 
 struct fz_list_device_s
@@ -1198,6 +1200,464 @@ fz_list_render_flags(fz_context *ctx, fz_device *dev, int set, int clear)
 		0); /* private_data_len */
 }
 
+/* Current graphics state as unpacked from a list. The list holds
+ * references to the path, stroke state and colorspace for as long as
+ * it lives, so the pointers here are borrowed. */
+typedef struct fz_list_state_s
+{
+	fz_path *path;
+	float alpha;
+	fz_matrix ctm;
+	fz_stroke_state *stroke;
+	float color[FZ_MAX_COLORS];
+	fz_colorspace *colorspace;
+	fz_rect rect;
+} fz_list_state;
+
+static void
+fz_init_list_state(fz_context *ctx, fz_list_state *st)
+{
+	memset(st, 0, sizeof *st);
+	st->alpha = 1.0f;
+	st->ctm = fz_identity;
+	st->colorspace = fz_device_gray(ctx);
+}
+
+/* Update the state with the changes carried in a node, and return a
+ * pointer to the node's private data. */
+static fz_display_node *
+fz_unpack_display_node(fz_context *ctx, fz_display_node *node, fz_list_state *st)
+{
+	fz_display_node n = *node;
+
+	node++;
+	if (n.rect)
+	{
+		st->rect = *(fz_rect *)node;
+		node += SIZE_IN_NODES(sizeof(fz_rect));
+	}
+	if (n.cs)
+	{
+		int i;
+
+		switch (n.cs)
+		{
+		default:
+		case CS_GRAY_0:
+			st->colorspace = fz_device_gray(ctx);
+			st->color[0] = 0.0f;
+			break;
+		case CS_GRAY_1:
+			st->colorspace = fz_device_gray(ctx);
+			st->color[0] = 1.0f;
+			break;
+		case CS_RGB_0:
+			st->colorspace = fz_device_rgb(ctx);
+			st->color[0] = 0.0f;
+			st->color[1] = 0.0f;
+			st->color[2] = 0.0f;
+			break;
+		case CS_RGB_1:
+			st->colorspace = fz_device_rgb(ctx);
+			st->color[0] = 1.0f;
+			st->color[1] = 1.0f;
+			st->color[2] = 1.0f;
+			break;
+		case CS_CMYK_0:
+			st->colorspace = fz_device_cmyk(ctx);
+			st->color[0] = 0.0f;
+			st->color[1] = 0.0f;
+			st->color[2] = 0.0f;
+			st->color[3] = 0.0f;
+			break;
+		case CS_CMYK_1:
+			st->colorspace = fz_device_cmyk(ctx);
+			st->color[0] = 0.0f;
+			st->color[1] = 0.0f;
+			st->color[2] = 0.0f;
+			st->color[3] = 1.0f;
+			break;
+		case CS_OTHER_0:
+			st->colorspace = *(fz_colorspace **)(node);
+			node += SIZE_IN_NODES(sizeof(fz_colorspace *));
+			for (i = 0; i < st->colorspace->n; i++)
+				st->color[i] = 0.0f;
+			break;
+		}
+	}
+	if (n.color)
+	{
+		memcpy(st->color, (float *)node, st->colorspace->n * sizeof(float));
+		node += SIZE_IN_NODES(st->colorspace->n * sizeof(float));
+	}
+	if (n.alpha)
+	{
+		switch(n.alpha)
+		{
+		default:
+		case ALPHA_0:
+			st->alpha = 0.0f;
+			break;
+		case ALPHA_1:
+			st->alpha = 1.0f;
+			break;
+		case ALPHA_PRESENT:
+			st->alpha = *(float *)node;
+			node += SIZE_IN_NODES(sizeof(float));
+			break;
+		}
+	}
+	if (n.ctm != 0)
+	{
+		float *packed_ctm = (float *)node;
+		if (n.ctm & CTM_CHANGE_AD)
+		{
+			st->ctm.a = *packed_ctm++;
+			st->ctm.d = *packed_ctm++;
+			node += SIZE_IN_NODES(2*sizeof(float));
+		}
+		if (n.ctm & CTM_CHANGE_BC)
+		{
+			st->ctm.b = *packed_ctm++;
+			st->ctm.c = *packed_ctm++;
+			node += SIZE_IN_NODES(2*sizeof(float));
+		}
+		if (n.ctm & CTM_CHANGE_EF)
+		{
+			st->ctm.e = *packed_ctm++;
+			st->ctm.f = *packed_ctm;
+			node += SIZE_IN_NODES(2*sizeof(float));
+		}
+	}
+	if (n.stroke)
+	{
+		st->stroke = *(fz_stroke_state **)node;
+		node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+	}
+	if (n.path)
+	{
+		st->path = (fz_path *)node;
+		node += SIZE_IN_NODES(fz_packed_path_size(st->path));
+	}
+	return node;
+}
+
+/*
+	Spatial index over the nodes of a closed display list.
+
+	The list is split into 'units', which are drawn or culled as a whole
+	based on the rectangle of their first node, just as the plain run
+	loop would cull that node. A unit is a single drawing node, or a
+	whole tile block, at any nesting level. Clip, mask and group blocks
+	are not units themselves, but 'wrappers' around the units they
+	contain: each records the node(s) that open it (for a mask, the
+	whole mask definition up to the END_MASK), the node that closes it,
+	and the wrapper it sits in.
+
+	Units are bucketed into a uniform grid over the bounds of the list,
+	so that running a small area only has to visit the units whose
+	buckets it touches. Replaying a unit opens any of its wrappers that
+	are not open yet, and closes the ones the previous unit was in but
+	this one is not, so the device sees the same push/pop structure
+	that a plain run gives it, minus the parts that are culled.
+
+	As the graphics state is delta encoded in the nodes, we keep a
+	snapshot of the state every CHECKPOINT_STEP nodes, and decode
+	forwards from the nearest snapshot to reach any node.
+*/
+
+#define CHECKPOINT_STEP 32
+#define MIN_INDEX_UNITS 256
+#define MAX_GRID_SIZE 128
+
+typedef struct fz_display_unit_s
+{
+	fz_rect rect;
+	int start, end;
+	int wrapper;
+} fz_display_unit;
+
+typedef struct fz_display_wrapper_s
+{
+	fz_rect rect;
+	int start, body, close;
+	int parent;
+	int depth;
+} fz_display_wrapper;
+
+typedef struct fz_display_checkpoint_s
+{
+	int pos;
+	fz_list_state state;
+} fz_display_checkpoint;
+
+struct fz_display_index_s
+{
+	int unit_count;
+	fz_display_unit *units;
+	int wrapper_count;
+	fz_display_wrapper *wrappers;
+	int max_depth;
+	int checkpoint_count;
+	fz_display_checkpoint *checkpoints;
+	fz_rect bounds;
+	int grid_w, grid_h;
+	float cell_w, cell_h;
+	int *cell_start;
+	int *cell_units;
+	int always_count;
+	int *always;
+};
+
+static void
+fz_drop_display_index(fz_context *ctx, fz_display_index *index)
+{
+	if (index == NULL)
+		return;
+	fz_free(ctx, index->units);
+	fz_free(ctx, index->wrappers);
+	fz_free(ctx, index->checkpoints);
+	fz_free(ctx, index->cell_start);
+	fz_free(ctx, index->cell_units);
+	fz_free(ctx, index->always);
+	fz_free(ctx, index);
+}
+
+static int
+fz_is_opening_cmd(int cmd)
+{
+	switch (cmd)
+	{
+	case FZ_CMD_CLIP_PATH:
+	case FZ_CMD_CLIP_STROKE_PATH:
+	case FZ_CMD_CLIP_TEXT:
+	case FZ_CMD_CLIP_STROKE_TEXT:
+	case FZ_CMD_CLIP_IMAGE_MASK:
+	case FZ_CMD_BEGIN_MASK:
+	case FZ_CMD_BEGIN_GROUP:
+	case FZ_CMD_BEGIN_TILE:
+		return 1;
+	}
+	return 0;
+}
+
+static int
+fz_is_closing_cmd(int cmd)
+{
+	return cmd == FZ_CMD_POP_CLIP || cmd == FZ_CMD_END_GROUP || cmd == FZ_CMD_END_TILE;
+}
+
+/* Find the grid cells covered by a rectangle; returns 0 if none. */
+static int
+fz_display_index_cells(fz_display_index *index, const fz_rect *r, int *cx0, int *cy0, int *cx1, int *cy1)
+{
+	fz_rect a = *r;
+
+	fz_intersect_rect(&a, &index->bounds);
+	if (fz_is_empty_rect(&a))
+		return 0;
+	*cx0 = fz_clampi((a.x0 - index->bounds.x0) / index->cell_w, 0, index->grid_w - 1);
+	*cy0 = fz_clampi((a.y0 - index->bounds.y0) / index->cell_h, 0, index->grid_h - 1);
+	*cx1 = fz_clampi((a.x1 - index->bounds.x0) / index->cell_w, 0, index->grid_w - 1);
+	*cy1 = fz_clampi((a.y1 - index->bounds.y0) / index->cell_h, 0, index->grid_h - 1);
+	return 1;
+}
+
+static void
+fz_build_display_index(fz_context *ctx, fz_display_list *list)
+{
+	fz_display_index *index;
+	fz_display_node *node, *node_end;
+	fz_list_state st;
+	fz_display_unit *unit;
+	fz_display_wrapper *wrapper;
+	int max_nodes, count, top, in_mask, in_tile, i, x, y, side, total;
+
+	/* Count the nodes first; units and wrappers can't outnumber them. */
+	max_nodes = 0;
+	for (node = list->list, node_end = list->list + list->len; node != node_end; node += node->size)
+		max_nodes++;
+	if (max_nodes < MIN_INDEX_UNITS)
+		return;
+
+	index = fz_malloc_struct(ctx, fz_display_index);
+	fz_try(ctx)
+	{
+		index->units = fz_malloc_array(ctx, max_nodes, sizeof(fz_display_unit));
+		index->wrappers = fz_malloc_array(ctx, max_nodes, sizeof(fz_display_wrapper));
+		index->checkpoints = fz_malloc_array(ctx, max_nodes / CHECKPOINT_STEP + 1, sizeof(fz_display_checkpoint));
+
+		/* Split the list into units and wrappers. top is the innermost
+		 * open wrapper; in_mask and in_tile count the nesting within
+		 * a mask definition or tile, which are replayed whole. */
+		fz_init_list_state(ctx, &st);
+		index->bounds = fz_empty_rect;
+		top = -1;
+		in_mask = in_tile = 0;
+		count = 0;
+		for (node = list->list; node != node_end; node += node->size)
+		{
+			fz_display_node n = *node;
+			int pos = node - list->list;
+			int next = pos + n.size;
+
+			if (count++ % CHECKPOINT_STEP == 0)
+			{
+				fz_display_checkpoint *cp = &index->checkpoints[index->checkpoint_count++];
+				cp->pos = pos;
+				cp->state = st;
+			}
+			(void)fz_unpack_display_node(ctx, node, &st);
+
+			if (in_mask)
+			{
+				if (fz_is_opening_cmd(n.cmd))
+					in_mask++;
+				else if (fz_is_closing_cmd(n.cmd) && in_mask > 1)
+					in_mask--;
+				else if (n.cmd == FZ_CMD_END_MASK && in_mask == 1)
+				{
+					in_mask = 0;
+					index->wrappers[top].body = next;
+				}
+				continue;
+			}
+
+			if (in_tile)
+			{
+				if (n.cmd == FZ_CMD_BEGIN_TILE)
+					in_tile++;
+				else if (n.cmd == FZ_CMD_END_TILE && --in_tile == 0)
+					index->units[index->unit_count-1].end = next;
+				continue;
+			}
+
+			if (n.cmd != FZ_CMD_BEGIN_TILE && fz_is_opening_cmd(n.cmd))
+			{
+				wrapper = &index->wrappers[index->wrapper_count];
+				wrapper->rect = st.rect;
+				wrapper->start = pos;
+				wrapper->body = next;
+				wrapper->close = -1;
+				wrapper->parent = top;
+				wrapper->depth = top < 0 ? 1 : index->wrappers[top].depth + 1;
+				if (index->max_depth < wrapper->depth)
+					index->max_depth = wrapper->depth;
+				top = index->wrapper_count++;
+				if (n.cmd == FZ_CMD_BEGIN_MASK)
+				{
+					wrapper->body = list->len;
+					in_mask = 1;
+				}
+				continue;
+			}
+
+			if ((n.cmd == FZ_CMD_POP_CLIP || n.cmd == FZ_CMD_END_GROUP) && top >= 0)
+			{
+				index->wrappers[top].close = pos;
+				top = index->wrappers[top].parent;
+				continue;
+			}
+
+			unit = &index->units[index->unit_count++];
+			unit->start = pos;
+			unit->end = next;
+			unit->wrapper = top;
+			unit->rect = st.rect;
+			/* These must always be seen by the device. An unclosed
+			 * tile runs to the end of the list. */
+			if (n.cmd == FZ_CMD_BEGIN_TILE)
+			{
+				unit->end = list->len;
+				in_tile = 1;
+			}
+			if (n.cmd == FZ_CMD_RENDER_FLAGS || n.cmd == FZ_CMD_BEGIN_TILE || fz_is_closing_cmd(n.cmd) || n.cmd == FZ_CMD_END_MASK)
+				unit->rect = fz_infinite_rect;
+			else if (!fz_is_infinite_rect(&unit->rect))
+				fz_union_rect(&index->bounds, &unit->rect);
+		}
+
+		/* Size the grid to hold a handful of units per cell. */
+		side = (int)sqrtf(index->unit_count / 4.0f);
+		side = fz_clampi(side, 1, MAX_GRID_SIZE);
+		index->grid_w = index->grid_h = side;
+		if (fz_is_empty_rect(&index->bounds))
+			index->bounds.x0 = index->bounds.y0 = index->bounds.x1 = index->bounds.y1 = 0;
+		index->cell_w = (index->bounds.x1 - index->bounds.x0) / side;
+		index->cell_h = (index->bounds.y1 - index->bounds.y0) / side;
+		if (index->cell_w <= 0)
+			index->cell_w = 1;
+		if (index->cell_h <= 0)
+			index->cell_h = 1;
+
+		/* Count the units in each cell, then fill them in. Units that
+		 * cover a large part of the grid are visited for every area
+		 * instead of being repeated in all those cells. */
+		index->cell_start = fz_calloc(ctx, side * side + 1, sizeof(int));
+		index->always = fz_malloc_array(ctx, index->unit_count, sizeof(int));
+		for (i = 0; i < index->unit_count; i++)
+		{
+			fz_display_unit *unit = &index->units[i];
+			int cx0, cy0, cx1, cy1;
+
+			if (fz_is_infinite_rect(&unit->rect))
+				index->always[index->always_count++] = i;
+			else if (fz_display_index_cells(index, &unit->rect, &cx0, &cy0, &cx1, &cy1))
+			{
+				if ((cx1 - cx0 + 1) * (cy1 - cy0 + 1) * 8 > side * side)
+					index->always[index->always_count++] = i;
+				else
+					for (y = cy0; y <= cy1; y++)
+						for (x = cx0; x <= cx1; x++)
+							index->cell_start[y * side + x + 1]++;
+			}
+		}
+		for (i = 0; i < side * side; i++)
+			index->cell_start[i + 1] += index->cell_start[i];
+		total = index->cell_start[side * side];
+		index->cell_units = fz_malloc_array(ctx, total + 1, sizeof(int));
+		for (i = 0; i < index->unit_count; i++)
+		{
+			fz_display_unit *unit = &index->units[i];
+			int cx0, cy0, cx1, cy1;
+
+			if (fz_is_infinite_rect(&unit->rect))
+				continue;
+			if (fz_display_index_cells(index, &unit->rect, &cx0, &cy0, &cx1, &cy1))
+			{
+				if ((cx1 - cx0 + 1) * (cy1 - cy0 + 1) * 8 > side * side)
+					continue;
+				for (y = cy0; y <= cy1; y++)
+					for (x = cx0; x <= cx1; x++)
+						index->cell_units[index->cell_start[y * side + x]++] = i;
+			}
+		}
+		/* Filling in advanced each start to the next cell's start. */
+		for (i = side * side; i > 0; i--)
+			index->cell_start[i] = index->cell_start[i - 1];
+		index->cell_start[0] = 0;
+	}
+	fz_catch(ctx)
+	{
+		/* The index is only an optimisation. */
+		fz_drop_display_index(ctx, index);
+		fz_warn(ctx, "cannot index display list");
+		return;
+	}
+
+	list->index = index;
+}
+
+static void
+fz_list_close_device(fz_context *ctx, fz_device *dev)
+{
+	fz_list_device *writer = (fz_list_device *)dev;
+
+	fz_drop_display_index(ctx, writer->list->index);
+	writer->list->index = NULL;
+	fz_build_display_index(ctx, writer->list);
+}
+
 static void
 fz_list_drop_device(fz_context *ctx, fz_device *dev)
 {
@@ -1243,6 +1703,7 @@ fz_new_list_device(fz_context *ctx, fz_display_list *list)
 
 	dev->super.render_flags = fz_list_render_flags;
 
+	dev->super.close_device = fz_list_close_device;
 	dev->super.drop_device = fz_list_drop_device;
 
 	dev->list = list;
@@ -1255,6 +1716,10 @@ fz_new_list_device(fz_context *ctx, fz_display_list *list)
 	dev->top = 0;
 	dev->tiled = 0;
 
+	/* Anything appended will invalidate an existing index. */
+	fz_drop_display_index(ctx, list->index);
+	list->index = NULL;
+
 	return &dev->super;
 }
 
@@ -1347,6 +1812,7 @@ fz_drop_display_list_imp(fz_context *ctx, fz_storable *list_)
 
 		node = next;
 	}
+	fz_drop_display_index(ctx, list->index);
 	fz_free(ctx, list->list);
 	fz_free(ctx, list);
 }
@@ -1360,6 +1826,7 @@ fz_new_display_list(fz_context *ctx, const fz_rect *mediabox)
 	list->mediabox = mediabox ? *mediabox : fz_empty_rect;
 	list->max = 0;
 	list->len = 0;
+	list->index = NULL;
 	return list;
 }
 
@@ -1382,43 +1849,24 @@ fz_bound_display_list(fz_context *ctx, fz_display_list *list, fz_rect *bounds)
 	return bounds;
 }
 
-void
-fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie)
+/* Run the nodes in [start, end), culling against scissor. Returns 1 if
+ * the run was aborted. */
+static int
+fz_run_display_nodes(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie, fz_list_state *st, int start, int end, int *progress)
 {
 	fz_display_node *node;
 	fz_display_node *node_end;
 	fz_display_node *next_node;
 	int clipped = 0;
 	int tiled = 0;
-	int progress = 0;
-
-	/* Current graphics state as unpacked from list */
-	fz_path *path = NULL;
-	float alpha = 1.0f;
-	fz_matrix ctm = fz_identity;
-	fz_stroke_state *stroke = NULL;
-	float color[FZ_MAX_COLORS] = { 0 };
-	fz_colorspace *colorspace = fz_device_gray(ctx);
-	fz_rect rect = { 0 };
 
 	/* Transformed versions of graphic state entries */
 	fz_rect trans_rect;
 	fz_matrix trans_ctm;
 	int tile_skip_depth = 0;
 
-	fz_var(colorspace);
-
-	if (!scissor)
-		scissor = &fz_infinite_rect;
-
-	if (cookie)
-	{
-		cookie->progress_max = list->len;
-		cookie->progress = 0;
-	}
-
-	node = list->list;
-	node_end = &list->list[list->len];
+	node = &list->list[start];
+	node_end = &list->list[end];
 	for (; node != node_end ; node = next_node)
 	{
 		int empty;
@@ -1430,122 +1878,11 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, cons
 		if (cookie)
 		{
 			if (cookie->abort)
-				break;
-			cookie->progress = progress++;
+				return 1;
+			cookie->progress = (*progress)++;
 		}
 
-		node++;
-		if (n.rect)
-		{
-			rect = *(fz_rect *)node;
-			node += SIZE_IN_NODES(sizeof(fz_rect));
-		}
-		if (n.cs)
-		{
-			int i;
-
-			fz_drop_colorspace(ctx, colorspace);
-			switch (n.cs)
-			{
-			default:
-			case CS_GRAY_0:
-				colorspace = fz_device_gray(ctx);
-				color[0] = 0.0f;
-				break;
-			case CS_GRAY_1:
-				colorspace = fz_device_gray(ctx);
-				color[0] = 1.0f;
-				break;
-			case CS_RGB_0:
-				colorspace = fz_device_rgb(ctx);
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				break;
-			case CS_RGB_1:
-				colorspace = fz_device_rgb(ctx);
-				color[0] = 1.0f;
-				color[1] = 1.0f;
-				color[2] = 1.0f;
-				break;
-			case CS_CMYK_0:
-				colorspace = fz_device_cmyk(ctx);
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				color[3] = 0.0f;
-				break;
-			case CS_CMYK_1:
-				colorspace = fz_device_cmyk(ctx);
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				color[3] = 1.0f;
-				break;
-			case CS_OTHER_0:
-				colorspace = fz_keep_colorspace(ctx, *(fz_colorspace **)(node));
-				node += SIZE_IN_NODES(sizeof(fz_colorspace *));
-				for (i = 0; i < colorspace->n; i++)
-					color[i] = 0.0f;
-				break;
-			}
-		}
-		if (n.color)
-		{
-			memcpy(color, (float *)node, colorspace->n * sizeof(float));
-			node += SIZE_IN_NODES(colorspace->n * sizeof(float));
-		}
-		if (n.alpha)
-		{
-			switch(n.alpha)
-			{
-			default:
-			case ALPHA_0:
-				alpha = 0.0f;
-				break;
-			case ALPHA_1:
-				alpha = 1.0f;
-				break;
-			case ALPHA_PRESENT:
-				alpha = *(float *)node;
-				node += SIZE_IN_NODES(sizeof(float));
-				break;
-			}
-		}
-		if (n.ctm != 0)
-		{
-			float *packed_ctm = (float *)node;
-			if (n.ctm & CTM_CHANGE_AD)
-			{
-				ctm.a = *packed_ctm++;
-				ctm.d = *packed_ctm++;
-				node += SIZE_IN_NODES(2*sizeof(float));
-			}
-			if (n.ctm & CTM_CHANGE_BC)
-			{
-				ctm.b = *packed_ctm++;
-				ctm.c = *packed_ctm++;
-				node += SIZE_IN_NODES(2*sizeof(float));
-			}
-			if (n.ctm & CTM_CHANGE_EF)
-			{
-				ctm.e = *packed_ctm++;
-				ctm.f = *packed_ctm;
-				node += SIZE_IN_NODES(2*sizeof(float));
-			}
-		}
-		if (n.stroke)
-		{
-			fz_drop_stroke_state(ctx, stroke);
-			stroke = fz_keep_stroke_state(ctx, *(fz_stroke_state **)node);
-			node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
-		}
-		if (n.path)
-		{
-			fz_drop_path(ctx, path);
-			path = fz_keep_path(ctx, (fz_path *)node);
-			node += SIZE_IN_NODES(fz_packed_path_size(path));
-		}
+		node = fz_unpack_display_node(ctx, node, st);
 
 		if (tile_skip_depth > 0)
 		{
@@ -1557,7 +1894,7 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, cons
 				continue;
 		}
 
-		trans_rect = rect;
+		trans_rect = st->rect;
 		fz_transform_rect(&trans_rect, top_ctm);
 
 		/* cull objects to draw using a quick visibility test */
@@ -1604,50 +1941,50 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, cons
 		}
 
 visible:
-		fz_concat(&trans_ctm, &ctm, top_ctm);
+		fz_concat(&trans_ctm, &st->ctm, top_ctm);
 
 		fz_try(ctx)
 		{
 			switch (n.cmd)
 			{
 			case FZ_CMD_FILL_PATH:
-				fz_fill_path(ctx, dev, path, n.flags, &trans_ctm, colorspace, color, alpha);
+				fz_fill_path(ctx, dev, st->path, n.flags, &trans_ctm, st->colorspace, st->color, st->alpha);
 				break;
 			case FZ_CMD_STROKE_PATH:
-				fz_stroke_path(ctx, dev, path, stroke, &trans_ctm, colorspace, color, alpha);
+				fz_stroke_path(ctx, dev, st->path, st->stroke, &trans_ctm, st->colorspace, st->color, st->alpha);
 				break;
 			case FZ_CMD_CLIP_PATH:
-				fz_clip_path(ctx, dev, path, n.flags, &trans_ctm, &trans_rect);
+				fz_clip_path(ctx, dev, st->path, n.flags, &trans_ctm, &trans_rect);
 				break;
 			case FZ_CMD_CLIP_STROKE_PATH:
-				fz_clip_stroke_path(ctx, dev, path, stroke, &trans_ctm, &trans_rect);
+				fz_clip_stroke_path(ctx, dev, st->path, st->stroke, &trans_ctm, &trans_rect);
 				break;
 			case FZ_CMD_FILL_TEXT:
-				fz_fill_text(ctx, dev, *(fz_text **)node, &trans_ctm, colorspace, color, alpha);
+				fz_fill_text(ctx, dev, *(fz_text **)node, &trans_ctm, st->colorspace, st->color, st->alpha);
 				break;
 			case FZ_CMD_STROKE_TEXT:
-				fz_stroke_text(ctx, dev, *(fz_text **)node, stroke, &trans_ctm, colorspace, color, alpha);
+				fz_stroke_text(ctx, dev, *(fz_text **)node, st->stroke, &trans_ctm, st->colorspace, st->color, st->alpha);
 				break;
 			case FZ_CMD_CLIP_TEXT:
 				fz_clip_text(ctx, dev, *(fz_text **)node, &trans_ctm, &trans_rect);
 				break;
 			case FZ_CMD_CLIP_STROKE_TEXT:
-				fz_clip_stroke_text(ctx, dev, *(fz_text **)node, stroke, &trans_ctm, &trans_rect);
+				fz_clip_stroke_text(ctx, dev, *(fz_text **)node, st->stroke, &trans_ctm, &trans_rect);
 				break;
 			case FZ_CMD_IGNORE_TEXT:
 				fz_ignore_text(ctx, dev, *(fz_text **)node, &trans_ctm);
 				break;
 			case FZ_CMD_FILL_SHADE:
 				if ((dev->hints & FZ_IGNORE_SHADE) == 0)
-					fz_fill_shade(ctx, dev, *(fz_shade **)node, &trans_ctm, alpha);
+					fz_fill_shade(ctx, dev, *(fz_shade **)node, &trans_ctm, st->alpha);
 				break;
 			case FZ_CMD_FILL_IMAGE:
 				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
-					fz_fill_image(ctx, dev, *(fz_image **)node, &trans_ctm, alpha);
+					fz_fill_image(ctx, dev, *(fz_image **)node, &trans_ctm, st->alpha);
 				break;
 			case FZ_CMD_FILL_IMAGE_MASK:
 				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
-					fz_fill_image_mask(ctx, dev, *(fz_image **)node, &trans_ctm, colorspace, color, alpha);
+					fz_fill_image_mask(ctx, dev, *(fz_image **)node, &trans_ctm, st->colorspace, st->color, st->alpha);
 				break;
 			case FZ_CMD_CLIP_IMAGE_MASK:
 				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
@@ -1657,13 +1994,13 @@ visible:
 				fz_pop_clip(ctx, dev);
 				break;
 			case FZ_CMD_BEGIN_MASK:
-				fz_begin_mask(ctx, dev, &trans_rect, n.flags, colorspace, color);
+				fz_begin_mask(ctx, dev, &trans_rect, n.flags, st->colorspace, st->color);
 				break;
 			case FZ_CMD_END_MASK:
 				fz_end_mask(ctx, dev);
 				break;
 			case FZ_CMD_BEGIN_GROUP:
-				fz_begin_group(ctx, dev, &trans_rect, (n.flags & ISOLATED) != 0, (n.flags & KNOCKOUT) != 0, (n.flags>>2), alpha);
+				fz_begin_group(ctx, dev, &trans_rect, (n.flags & ISOLATED) != 0, (n.flags & KNOCKOUT) != 0, (n.flags>>2), st->alpha);
 				break;
 			case FZ_CMD_END_GROUP:
 				fz_end_group(ctx, dev);
@@ -1675,7 +2012,7 @@ visible:
 				fz_rect tile_rect;
 				tiled++;
 				tile_rect = data->view;
-				cached = fz_begin_tile_id(ctx, dev, &rect, &tile_rect, data->xstep, data->ystep, &trans_ctm, n.flags);
+				cached = fz_begin_tile_id(ctx, dev, &st->rect, &tile_rect, data->xstep, data->ystep, &trans_ctm, n.flags);
 				if (cached)
 					tile_skip_depth = 1;
 				break;
@@ -1698,11 +2035,332 @@ visible:
 			if (cookie)
 				cookie->errors++;
 			if (fz_caught(ctx) == FZ_ERROR_ABORT)
-				break;
+				return 1;
 			fz_warn(ctx, "Ignoring error during interpretation");
 		}
 	}
-	fz_drop_colorspace(ctx, colorspace);
-	fz_drop_stroke_state(ctx, stroke);
-	fz_drop_path(ctx, path);
+	return 0;
+}
+
+static int
+fz_cmp_int(const void *a_, const void *b_)
+{
+	int a = *(const int *)a_;
+	int b = *(const int *)b_;
+	return a < b ? -1 : a > b;
+}
+
+/* Gather the units whose cells touch an area, in list order. Returns
+ * the number of units, or -1 if the area covers so much of the list
+ * that a plain run is cheaper. */
+static int
+fz_find_display_units(fz_context *ctx, fz_display_index *index, const fz_rect *area, int **unitsp)
+{
+	int cx0, cy0, cx1, cy1, x, y, i, n, max;
+	int *units;
+
+	if (!fz_display_index_cells(index, area, &cx0, &cy0, &cx1, &cy1))
+		cx1 = cx0 = cy1 = cy0 = max = 0;
+	else
+	{
+		if ((cx1 - cx0 + 1) * (cy1 - cy0 + 1) * 2 > index->grid_w * index->grid_h)
+			return -1;
+		max = 0;
+		for (y = cy0; y <= cy1; y++)
+			max += index->cell_start[y * index->grid_w + cx1 + 1] - index->cell_start[y * index->grid_w + cx0];
+	}
+
+	units = fz_malloc_array(ctx, max + index->always_count + 1, sizeof(int));
+	n = 0;
+	if (max > 0)
+		for (y = cy0; y <= cy1; y++)
+			for (i = index->cell_start[y * index->grid_w + cx0]; i < index->cell_start[y * index->grid_w + cx1 + 1]; i++)
+				units[n++] = index->cell_units[i];
+	memcpy(&units[n], index->always, index->always_count * sizeof(int));
+	n += index->always_count;
+
+	qsort(units, n, sizeof(int), fz_cmp_int);
+	for (i = 0, x = 0; i < n; i++)
+		if (x == 0 || units[x-1] != units[i])
+			units[x++] = units[i];
+
+	*unitsp = units;
+	return x;
+}
+
+/* The culling test of the plain run loop, applied to a unit or wrapper. */
+static int
+fz_display_rect_visible(const fz_rect *rect, const fz_matrix *top_ctm, const fz_rect *scissor)
+{
+	fz_rect r;
+
+	if (fz_is_infinite_rect(rect))
+		return 1;
+	r = *rect;
+	fz_transform_rect(&r, top_ctm);
+	fz_intersect_rect(&r, scissor);
+	return !fz_is_empty_rect(&r);
+}
+
+/* Bring the state up to the start of the node at pos, starting from
+ * where we are (*cur) or from the nearest snapshot before pos. */
+static void
+fz_seek_display_state(fz_context *ctx, fz_display_list *list, fz_display_index *index, fz_list_state *st, int *cur, int pos)
+{
+	int lo = 0, hi = index->checkpoint_count - 1;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+		if (index->checkpoints[mid].pos <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	if (*cur > pos || *cur < index->checkpoints[lo].pos)
+	{
+		*cur = index->checkpoints[lo].pos;
+		*st = index->checkpoints[lo].state;
+	}
+	while (*cur < pos)
+	{
+		(void)fz_unpack_display_node(ctx, &list->list[*cur], st);
+		*cur += list->list[*cur].size;
+	}
+}
+
+/* Run the nodes in [start, end), wherever the state was left. */
+static int
+fz_run_display_range(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie, fz_list_state *st, int *cur, int start, int end, int *progress)
+{
+	fz_seek_display_state(ctx, list, list->index, st, cur, start);
+	*cur = end;
+	return fz_run_display_nodes(ctx, list, dev, top_ctm, scissor, cookie, st, start, end, progress);
+}
+
+void
+fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie)
+{
+	fz_display_index *index = list->index;
+	fz_list_state st;
+	fz_matrix inv_ctm;
+	fz_rect area;
+	int *units = NULL;
+	int *chain = NULL;
+	int *opened = NULL;
+	int count = -1;
+	int progress = 0;
+	int i, cur, nopen, aborted;
+
+	if (!scissor)
+		scissor = &fz_infinite_rect;
+
+	if (cookie)
+	{
+		cookie->progress_max = list->len;
+		cookie->progress = 0;
+	}
+
+	fz_init_list_state(ctx, &st);
+
+	/* Map the scissor back into list space to look up the index. This
+	 * only gives the same answer as culling in device space when the
+	 * transform keeps rectangles axis aligned; otherwise the bounds of
+	 * a rotated node can reach areas the node itself never touches. */
+	if (index && !fz_is_infinite_rect(scissor) && fz_is_rectilinear(top_ctm) && fz_try_invert_matrix(&inv_ctm, top_ctm) == 0)
+	{
+		area = *scissor;
+		fz_transform_rect(&area, &inv_ctm);
+		fz_expand_rect(&area, 1);
+		count = fz_find_display_units(ctx, index, &area, &units);
+	}
+
+	if (count < 0)
+	{
+		(void)fz_run_display_nodes(ctx, list, dev, top_ctm, scissor, cookie, &st, 0, list->len, &progress);
+		return;
+	}
+
+	fz_var(chain);
+	fz_var(opened);
+
+	fz_try(ctx)
+	{
+		/* opened[] holds the wrappers we are in, outermost first. */
+		chain = fz_malloc_array(ctx, index->max_depth + 1, sizeof(int));
+		opened = fz_malloc_array(ctx, index->max_depth + 1, sizeof(int));
+		nopen = 0;
+		cur = 0;
+		aborted = 0;
+		for (i = 0; i < count && !aborted; i++)
+		{
+			fz_display_unit *unit = &index->units[units[i]];
+			fz_display_wrapper *wrapper;
+			int depth, w, k;
+
+			/* The same tests as the node culling, so that we draw
+			 * exactly what a plain run would: the unit, and every
+			 * wrapper around it, must touch the scissor. */
+			if (!fz_display_rect_visible(&unit->rect, top_ctm, scissor))
+				continue;
+			depth = 0;
+			for (w = unit->wrapper; w >= 0; w = index->wrappers[w].parent)
+			{
+				if (!fz_display_rect_visible(&index->wrappers[w].rect, top_ctm, scissor))
+					break;
+				chain[depth++] = w;
+			}
+			if (w >= 0)
+				continue;
+
+			/* Close the wrappers this unit is not in, and open the
+			 * ones it is in that are not open yet. */
+			for (k = 0; k < nopen && k < depth && opened[k] == chain[depth - 1 - k]; k++)
+				;
+			while (nopen > k && !aborted)
+			{
+				wrapper = &index->wrappers[opened[--nopen]];
+				if (wrapper->close >= 0)
+					aborted = fz_run_display_range(ctx, list, dev, top_ctm, scissor, cookie, &st, &cur, wrapper->close, wrapper->close + list->list[wrapper->close].size, &progress);
+			}
+			while (nopen < depth && !aborted)
+			{
+				w = chain[depth - 1 - nopen];
+				wrapper = &index->wrappers[w];
+				opened[nopen++] = w;
+				aborted = fz_run_display_range(ctx, list, dev, top_ctm, scissor, cookie, &st, &cur, wrapper->start, wrapper->body, &progress);
+			}
+			if (!aborted)
+				aborted = fz_run_display_range(ctx, list, dev, top_ctm, scissor, cookie, &st, &cur, unit->start, unit->end, &progress);
+		}
+		while (nopen > 0 && !aborted)
+		{
+			fz_display_wrapper *wrapper = &index->wrappers[opened[--nopen]];
+			if (wrapper->close >= 0)
+				aborted = fz_run_display_range(ctx, list, dev, top_ctm, scissor, cookie, &st, &cur, wrapper->close, wrapper->close + list->list[wrapper->close].size, &progress);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, opened);
+		fz_free(ctx, chain);
+		fz_free(ctx, units);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+typedef struct
+{
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_pixmap *dest;
+	int tile_w, tile_h;
+	int tiles_x;
+	fz_cookie *cookie;
+	fz_cookie *tile_cookies;
+} fz_draw_tiles_job;
+
+static void
+fz_draw_display_list_tile(fz_context *ctx, void *arg, int tile)
+{
+	fz_draw_tiles_job *job = (fz_draw_tiles_job *)arg;
+	fz_pixmap *dest = job->dest;
+	fz_cookie *cookie = &job->tile_cookies[tile];
+	fz_pixmap *pix = NULL;
+	fz_device *dev = NULL;
+	fz_irect bbox;
+	fz_rect scissor;
+
+	if (job->cookie && job->cookie->abort)
+		return;
+
+	bbox.x0 = dest->x + (tile % job->tiles_x) * job->tile_w;
+	bbox.y0 = dest->y + (tile / job->tiles_x) * job->tile_h;
+	bbox.x1 = fz_mini(bbox.x0 + job->tile_w, dest->x + dest->w);
+	bbox.y1 = fz_mini(bbox.y0 + job->tile_h, dest->y + dest->h);
+	fz_rect_from_irect(&scissor, &bbox);
+
+	fz_var(pix);
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		/* Draw straight into the destination through a pixmap that
+		 * shares its samples. */
+		pix = fz_new_pixmap_with_data(ctx, dest->colorspace, bbox.x1 - bbox.x0, bbox.y1 - bbox.y0, dest->alpha, dest->stride,
+			dest->samples + (bbox.y0 - dest->y) * dest->stride + (bbox.x0 - dest->x) * dest->n);
+		pix->x = bbox.x0;
+		pix->y = bbox.y0;
+		pix->xres = dest->xres;
+		pix->yres = dest->yres;
+		dev = fz_new_draw_device(ctx, NULL, pix);
+		fz_run_display_list(ctx, job->list, dev, &job->ctm, &scissor, cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, pix);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	/* Tiles finish on several threads at once. */
+	if (job->cookie)
+	{
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		job->cookie->progress++;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	}
+}
+
+void
+fz_draw_display_list(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, fz_pixmap *dest, int tile_w, int tile_h, int nthreads, fz_cookie *cookie)
+{
+	fz_draw_tiles_job job;
+	int i, tiles_y, count;
+
+	if (tile_w <= 0)
+		tile_w = 256;
+	if (tile_h <= 0)
+		tile_h = 256;
+	if (dest->w <= 0 || dest->h <= 0)
+		return;
+
+	job.list = list;
+	job.ctm = *ctm;
+	job.dest = dest;
+	job.tile_w = tile_w;
+	job.tile_h = tile_h;
+	job.tiles_x = (dest->w + tile_w - 1) / tile_w;
+	tiles_y = (dest->h + tile_h - 1) / tile_h;
+	count = job.tiles_x * tiles_y;
+	job.cookie = cookie;
+	job.tile_cookies = fz_calloc(ctx, count, sizeof(fz_cookie));
+
+	if (cookie)
+	{
+		cookie->progress_max = count;
+		cookie->progress = 0;
+		for (i = 0; i < count; i++)
+			job.tile_cookies[i].incomplete_ok = cookie->incomplete_ok;
+	}
+
+	fz_try(ctx)
+		fz_run_tasks(ctx, nthreads, count, fz_draw_display_list_tile, &job);
+	fz_always(ctx)
+	{
+		if (cookie)
+		{
+			for (i = 0; i < count; i++)
+			{
+				cookie->errors += job.tile_cookies[i].errors;
+				cookie->incomplete |= job.tile_cookies[i].incomplete;
+			}
+		}
+		fz_free(ctx, job.tile_cookies);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 }
@@ -77,9 +77,9 @@ fz_write_pixmap_as_png(fz_context *ctx, fz_output *out, const fz_pixmap *pixmap)
 struct fz_png_output_context_s
 {
 	unsigned char *udata;
-	unsigned char *cdata;
-	uLong usize, csize;
-	z_stream stream;
+	size_t usize;
+	fz_buffer *cbuf;
+	fz_deflater *deflater;
 	int w;
 	int h;
 	int n;
@@ -133,7 +133,7 @@ void
 fz_write_png_band(fz_context *ctx, fz_output *out, fz_png_output_context *poc, int stride, int band_start, int bandheight, unsigned char *sp)
 {
 	unsigned char *dp;
-	int y, x, k, err, finalband;
+	int y, x, k, finalband;
 	int w, h, n, alpha;
 
 	if (!out || !sp || !poc)
@@ -150,28 +150,21 @@ fz_write_png_band(fz_context *ctx, fz_output *out, fz_png_output_context *poc, i
 
 	if (poc->udata == NULL)
 	{
-		poc->usize = (w * n + 1) * bandheight;
-		/* Sadly the bound returned by compressBound is just for a
-		 * single usize chunk; if you compress a sequence of them
-		 * the buffering can result in you suddenly getting a block
-		 * larger than compressBound outputted in one go, even if you
-		 * take all the data out each time. */
-		poc->csize = compressBound(poc->usize);
+		poc->usize = (size_t)(w * n + 1) * bandheight;
 		fz_try(ctx)
 		{
 			poc->udata = fz_malloc(ctx, poc->usize);
-			poc->cdata = fz_malloc(ctx, poc->csize);
+			poc->cbuf = fz_new_buffer(ctx, poc->usize / 2 + 64);
+			poc->deflater = fz_new_deflater(ctx, Z_DEFAULT_COMPRESSION, 0);
 		}
 		fz_catch(ctx)
 		{
+			fz_drop_buffer(ctx, poc->cbuf);
 			fz_free(ctx, poc->udata);
 			poc->udata = NULL;
-			poc->cdata = NULL;
+			poc->cbuf = NULL;
 			fz_rethrow(ctx);
 		}
-		err = deflateInit(&poc->stream, Z_DEFAULT_COMPRESSION);
-		if (err != Z_OK)
-			fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
 	}
 
 	dp = poc->udata;
@@ -194,46 +187,23 @@ fz_write_png_band(fz_context *ctx, fz_output *out, fz_png_output_context *poc, i
 		sp += stride;
 	}
 
-	poc->stream.next_in = (Bytef*)poc->udata;
-	poc->stream.avail_in = (uInt)(dp - poc->udata);
-	do
-	{
-		poc->stream.next_out = poc->cdata;
-		poc->stream.avail_out = (uInt)poc->csize;
-
-		if (!finalband)
-		{
-			err = deflate(&poc->stream, Z_NO_FLUSH);
-			if (err != Z_OK)
-				fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
-		}
-		else
-		{
-			err = deflate(&poc->stream, Z_FINISH);
-			if (err != Z_STREAM_END)
-				fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
-		}
-
-		if (poc->stream.next_out != poc->cdata)
-			putchunk(ctx, out, "IDAT", poc->cdata, poc->stream.next_out - poc->cdata);
-	}
-	while (poc->stream.avail_out == 0);
+	/* Tall bands are compressed on several threads at once. */
+	fz_deflater_write(ctx, poc->deflater, poc->cbuf, poc->udata, dp - poc->udata, finalband);
+	if (poc->cbuf->len > 0)
+		putchunk(ctx, out, "IDAT", poc->cbuf->data, (int)poc->cbuf->len);
+	poc->cbuf->len = 0;
 }
 
 void
 fz_write_png_trailer(fz_context *ctx, fz_output *out, fz_png_output_context *poc)
 {
 	unsigned char block[1];
-	int err;
 
 	if (!out || !poc)
 		return;
 
-	err = deflateEnd(&poc->stream);
-	if (err != Z_OK)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
-
-	fz_free(ctx, poc->cdata);
+	fz_drop_deflater(ctx, poc->deflater);
+	fz_drop_buffer(ctx, poc->cbuf);
 	fz_free(ctx, poc->udata);
 	fz_free(ctx, poc);
 
@@ -1,213 +1,790 @@
 #include "mupdf/fitz.h"
 
+#include "fitz-imp.h"
+
+/*
+	The store is split into a number of stripes, each with its own lock,
+	lists of items and hash table, so that threads finding and storing
+	resources under different keys neither contend with one another nor
+	with the allocator (which uses FZ_LOCK_ALLOC). Items whose keys can
+	be hashed live in the stripe chosen by their hash; all others live
+	in stripe 0, and are found by searching its list.
+
+	FZ_LOCK_ALLOC may be held while a stripe is locked (the scavenger
+	does this), but never the other way around, so nothing that is done
+	with a stripe locked may allocate, free, or call drop functions.
+	Reference counts of storables are changed atomically, so that the
+	store never needs FZ_LOCK_ALLOC to keep or drop a value.
+
+	Without threads (or atomics) there is a single stripe, and it is
+	protected by FZ_LOCK_ALLOC as before.
+*/
+
+#if defined(FZ_THREADS) && defined(FZ_ATOMIC_INC)
+#define STORE_STRIPES 16
+#else
+#define STORE_STRIPES 1
+#endif
+
+enum { STORE_HASH_LEN = 4096 / STORE_STRIPES };
+
+/*
+	Each stripe keeps its items on up to four lists, each ordered by
+	usage (so LRU entries are at the end). The LRU and GDSF policies use
+	only LIST_T1. ARC keeps items that have been used once recently on
+	LIST_T1 and those used more than once on LIST_T2; LIST_B1 and LIST_B2
+	hold 'ghosts' (the hash keys, but no values) of items recently
+	evicted from each.
+*/
+enum { LIST_T1, LIST_T2, LIST_B1, LIST_B2, NUM_LISTS };
+
+/* Items freed per batch, and the number of candidates GDSF considers. */
+enum { STORE_VICTIMS = 32, GDSF_WINDOW = 16 };
+
 typedef struct fz_item_s fz_item;
+typedef struct fz_store_stripe_s fz_store_stripe;
 
 struct fz_item_s
 {
 	void *key;
-	fz_storable *val;
+	fz_storable *val; /* NULL for ghosts */
 	size_t size;
 	fz_item *next;
 	fz_item *prev;
-	fz_store *store;
+	fz_item *hash_next;
+	unsigned hash_val;
+	int use_hash;
+	int list;
+	int freq;
+	double density; /* recompute cost per byte */
+	double prio; /* GDSF priority */
+	fz_store_hash hash;
 	fz_store_type *type;
 };
 
+struct fz_store_stripe_s
+{
+#if STORE_STRIPES > 1
+	MUTEX lock;
+#endif
+	int policy;
+
+	fz_item *head[NUM_LISTS];
+	fz_item *tail[NUM_LISTS];
+	size_t list_size[NUM_LISTS];
+
+	/* ARC: the size LIST_T1 is aiming for. */
+	size_t arc_p;
+
+	/* GDSF: the priority of the last item evicted. */
+	double inflation;
+
+	/* Items with hashable keys are also chained from a hash table. */
+	int hash_len;
+	int hash_load;
+	fz_item **hash;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t evicted;
+};
+
 struct fz_store_s
 {
 	int refs;
 
-	/* Every item in the store is kept in a doubly linked list, ordered
-	 * by usage (so LRU entries are at the end). */
-	fz_item *head;
-	fz_item *tail;
+	fz_store_stripe stripe[STORE_STRIPES];
 
-	/* We have a hash table that allows to quickly find a subset of the
-	 * entries (those whose keys are indirect objects). */
-	fz_hash_table *hash;
+	/* Stripe to start evicting from next time, so that eviction is
+	 * spread evenly over the stripes. */
+	int evict;
 
 	/* We keep track of the size of the store, and keep it below max. */
 	size_t max;
 	size_t size;
 };
 
-void
-fz_new_store_context(fz_context *ctx, size_t max)
+/*
+	Values and keys cannot be dropped (nor items freed) with a stripe
+	locked, so they are gathered into a victim list and dropped once it
+	has been unlocked. item is the item to free (NULL if it lives on as
+	a ghost), and key and val are NULL if there is nothing to drop.
+*/
+typedef struct
 {
-	fz_store *store;
-	store = fz_malloc_struct(ctx, fz_store);
-	fz_try(ctx)
+	int len;
+	struct
 	{
-		store->hash = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), FZ_LOCK_ALLOC);
+		fz_item *item;
+		void *key;
+		fz_storable *val;
+		fz_store_type *type;
+		int last_ref;
+	} v[STORE_VICTIMS];
+} victim_list;
+
+static void
+lock_stripe(fz_context *ctx, fz_store_stripe *stripe, int alloc_held)
+{
+#if STORE_STRIPES > 1
+	MUTEX_LOCK(stripe->lock);
+#else
+	if (!alloc_held)
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+#endif
+}
+
+static void
+unlock_stripe(fz_context *ctx, fz_store_stripe *stripe, int alloc_held)
+{
+#if STORE_STRIPES > 1
+	MUTEX_UNLOCK(stripe->lock);
+#else
+	if (!alloc_held)
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
+}
+
+/* Reference counts of values, and the size of the store, are changed
+ * atomically where we can; otherwise they are only changed with
+ * FZ_LOCK_ALLOC held (i.e. with the only stripe locked). */
+
+static inline int
+val_refs(fz_storable *val)
+{
+#ifdef FZ_ATOMIC_GET
+	return FZ_ATOMIC_GET(&val->refs);
+#else
+	return val->refs;
+#endif
+}
+
+static inline void
+keep_val(fz_storable *val)
+{
+	if (val_refs(val) > 0)
+	{
+#ifdef FZ_ATOMIC_INC
+		(void)FZ_ATOMIC_INC(&val->refs);
+#else
+		val->refs++;
+#endif
 	}
-	fz_catch(ctx)
+}
+
+/* Returns non zero if the last reference was dropped. */
+static inline int
+drop_val(fz_storable *val)
+{
+	if (val_refs(val) > 0)
 	{
-		fz_free(ctx, store);
-		fz_rethrow(ctx);
+#ifdef FZ_ATOMIC_DEC
+		return FZ_ATOMIC_DEC(&val->refs) == 0;
+#else
+		return --val->refs == 0;
+#endif
 	}
-	store->refs = 1;
-	store->head = NULL;
-	store->tail = NULL;
-	store->size = 0;
-	store->max = max;
-	ctx->store = store;
+	return 0;
 }
 
-void *
-fz_keep_storable(fz_context *ctx, const fz_storable *sc)
+static inline size_t
+add_size(fz_store *store, size_t size)
 {
-	/* Explicitly drop const to allow us to use const
-	 * sanely throughout the code. */
-	fz_storable *s = (fz_storable *)sc;
+#if STORE_STRIPES > 1
+	return FZ_ATOMIC_ADD_SIZE(&store->size, size);
+#else
+	return store->size += size;
+#endif
+}
 
-	if (s && s->refs > 0)
-		(void)Memento_takeRef(s);
-	return fz_keep_imp(ctx, s, &s->refs);
+static inline size_t
+store_size(fz_store *store)
+{
+	return add_size(store, 0);
 }
 
-void
-fz_drop_storable(fz_context *ctx, const fz_storable *sc)
+static unsigned
+hash_key(const fz_store_hash *hash)
 {
-	/* Explicitly drop const to allow us to use const
-	 * sanely throughout the code. */
-	fz_storable *s = (fz_storable *)sc;
+	const unsigned char *s = (const unsigned char *)hash;
+	unsigned val = 0;
+	size_t i;
+	for (i = 0; i < sizeof(*hash); i++)
+	{
+		val += s[i];
+		val += (val << 10);
+		val ^= (val >> 6);
+	}
+	val += (val << 3);
+	val ^= (val >> 11);
+	val += (val << 15);
+	return val;
+}
 
-	/*
-		If we are dropping the last reference to an object, then
-		it cannot possibly be in the store (as the store always
-		keeps a ref to everything in it, and doesn't drop via
-		this method. So we can simply drop the storable object
-		itself without any operations on the fz_store.
-	 */
-	if (s && s->refs > 0)
-		(void)Memento_dropRef(s);
-	if (fz_drop_imp(ctx, s, &s->refs))
-		s->drop(ctx, s);
+static inline fz_store_stripe *
+stripe_for(fz_store *store, int use_hash, unsigned hash_val)
+{
+	return &store->stripe[use_hash ? hash_val % STORE_STRIPES : 0];
+}
+
+static inline fz_item **
+bucket_for(fz_store_stripe *stripe, unsigned hash_val)
+{
+	return &stripe->hash[(hash_val / STORE_STRIPES) & (stripe->hash_len - 1)];
+}
+
+/* Finds live items and ghosts alike. */
+static fz_item *
+hash_find(fz_store_stripe *stripe, unsigned hash_val, const fz_store_hash *hash)
+{
+	fz_item *item;
+
+	for (item = *bucket_for(stripe, hash_val); item; item = item->hash_next)
+		if (item->hash_val == hash_val && !memcmp(&item->hash, hash, sizeof(*hash)))
+			return item;
+	return NULL;
 }
 
 static void
-evict(fz_context *ctx, fz_item *item)
+hash_insert(fz_store_stripe *stripe, fz_item *item)
 {
-	fz_store *store = ctx->store;
-	int drop;
+	fz_item **bucket = bucket_for(stripe, item->hash_val);
+
+	item->hash_next = *bucket;
+	*bucket = item;
+	stripe->hash_load++;
+}
+
+static void
+hash_remove(fz_store_stripe *stripe, fz_item *item)
+{
+	fz_item **p = bucket_for(stripe, item->hash_val);
+
+	while (*p && *p != item)
+		p = &(*p)->hash_next;
+	if (*p)
+	{
+		*p = item->hash_next;
+		stripe->hash_load--;
+	}
+}
+
+/* Grow the hash table of a stripe to len buckets. The new table is
+ * allocated with the stripe unlocked. */
+static void
+grow_hash(fz_context *ctx, fz_store_stripe *stripe, int len)
+{
+	fz_item **hash, **old;
+	fz_item *item, *next;
+	int i, old_len;
+
+	hash = fz_calloc_no_throw(ctx, len, sizeof(*hash));
+	if (hash == NULL)
+		return;
+
+	lock_stripe(ctx, stripe, 0);
+	if (stripe->hash_len >= len)
+	{
+		/* Someone else beat us to it */
+		old = hash;
+	}
+	else
+	{
+		old = stripe->hash;
+		old_len = stripe->hash_len;
+		stripe->hash = hash;
+		stripe->hash_len = len;
+		for (i = 0; i < old_len; i++)
+		{
+			for (item = old[i]; item; item = next)
+			{
+				fz_item **bucket = bucket_for(stripe, item->hash_val);
+				next = item->hash_next;
+				item->hash_next = *bucket;
+				*bucket = item;
+			}
+		}
+	}
+	unlock_stripe(ctx, stripe, 0);
+
+	fz_free(ctx, old);
+}
+
+static void
+list_unlink(fz_store_stripe *stripe, fz_item *item)
+{
+	int list = item->list;
 
-	store->size -= item->size;
-	/* Unlink from the linked list */
 	if (item->next)
 		item->next->prev = item->prev;
 	else
-		store->tail = item->prev;
+		stripe->tail[list] = item->prev;
 	if (item->prev)
 		item->prev->next = item->next;
 	else
-		store->head = item->next;
+		stripe->head[list] = item->next;
+	stripe->list_size[list] -= item->size;
+}
+
+static void
+list_push(fz_store_stripe *stripe, fz_item *item, int list)
+{
+	item->list = list;
+	item->next = stripe->head[list];
+	if (item->next)
+		item->next->prev = item;
+	else
+		stripe->tail[list] = item;
+	stripe->head[list] = item;
+	item->prev = NULL;
+	stripe->list_size[list] += item->size;
+}
 
-	/* Drop a reference to the value (freeing if required) */
-	drop = (item->val->refs > 0 && --item->val->refs == 0);
+/* Move an item to the start of its LRU chain. */
+static void
+touch(fz_store_stripe *stripe, fz_item *item)
+{
+	int list = item->list;
+	list_unlink(stripe, item);
+	list_push(stripe, item, list);
+}
 
-	/* Remove from the hash table */
-	if (item->type->make_hash_key)
+/* Take an item (live or ghost) out of its locked stripe altogether,
+ * dropping the store's reference to its value. */
+static void
+detach(fz_store *store, fz_store_stripe *stripe, fz_item *item, victim_list *vl)
+{
+	int n = vl->len++;
+
+	list_unlink(stripe, item);
+	if (item->use_hash)
+		hash_remove(stripe, item);
+
+	vl->v[n].item = item;
+	vl->v[n].key = item->key;
+	vl->v[n].val = item->val;
+	vl->v[n].type = item->type;
+	vl->v[n].last_ref = 0;
+	if (item->val)
 	{
-		fz_store_hash hash = { NULL };
-		hash.drop = item->val->drop;
-		if (item->type->make_hash_key(ctx, &hash, item->key))
-			fz_hash_remove(ctx, store->hash, &hash);
+		(void)add_size(store, (size_t)0 - item->size);
+		vl->v[n].last_ref = drop_val(item->val);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	if (drop)
-		item->val->drop(ctx, item->val);
+}
 
-	/* Always drops the key and drop the item */
-	item->type->drop_key(ctx, item->key);
-	fz_free(ctx, item);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+/* Evict a live item from an ARC stripe, leaving its ghost behind. */
+static void
+make_ghost(fz_store *store, fz_store_stripe *stripe, fz_item *item, victim_list *vl)
+{
+	int n = vl->len++;
+
+	list_unlink(stripe, item);
+	(void)add_size(store, (size_t)0 - item->size);
+
+	vl->v[n].item = NULL;
+	vl->v[n].key = item->key;
+	vl->v[n].val = item->val;
+	vl->v[n].type = item->type;
+	vl->v[n].last_ref = drop_val(item->val);
+
+	item->key = NULL;
+	item->val = NULL;
+	list_push(stripe, item, item->list == LIST_T1 ? LIST_B1 : LIST_B2);
 }
 
+static void
+free_victims(fz_context *ctx, victim_list *vl, int alloc_held)
+{
+	int i;
+
+	if (vl->len == 0)
+		return;
+	if (alloc_held)
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < vl->len; i++)
+	{
+		if (vl->v[i].last_ref)
+			vl->v[i].val->drop(ctx, vl->v[i].val);
+		if (vl->v[i].key)
+			vl->v[i].type->drop_key(ctx, vl->v[i].key);
+		fz_free(ctx, vl->v[i].item);
+	}
+	if (alloc_held)
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	vl->len = 0;
+}
+
+/* The number of bytes of live items (and of ghosts) an ARC stripe
+ * aims to keep. */
 static size_t
-ensure_space(fz_context *ctx, size_t tofree)
+arc_capacity(fz_store *store, fz_store_stripe *stripe)
 {
-	fz_item *item, *prev;
-	size_t count;
-	fz_store *store = ctx->store;
+	if (store->max != FZ_STORE_UNLIMITED)
+		return store->max / STORE_STRIPES;
+	return stripe->list_size[LIST_T1] + stripe->list_size[LIST_T2];
+}
 
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+/* Forget the oldest ghosts once the history outgrows the stripe, as
+ * far as there is room in the victim list. */
+static void
+trim_ghosts(fz_store *store, fz_store_stripe *stripe, victim_list *vl)
+{
+	size_t c = arc_capacity(store, stripe);
+	size_t *size = stripe->list_size;
+
+	while (vl->len < STORE_VICTIMS && stripe->tail[LIST_B1] && size[LIST_T1] + size[LIST_B1] > c)
+		detach(store, stripe, stripe->tail[LIST_B1], vl);
+	while (vl->len < STORE_VICTIMS && stripe->tail[LIST_B2] && size[LIST_T1] + size[LIST_T2] + size[LIST_B1] + size[LIST_B2] > 2 * c)
+		detach(store, stripe, stripe->tail[LIST_B2], vl);
+}
+
+/* The least recently used item on a list that nobody but the store is
+ * using. */
+static fz_item *
+oldest_unused(fz_store_stripe *stripe, int list)
+{
+	fz_item *item;
+
+	for (item = stripe->tail[list]; item; item = item->prev)
+		if (val_refs(item->val) == 1)
+			return item;
+	return NULL;
+}
+
+/* Choose the next item to evict from a locked stripe, or NULL if
+ * nothing in it can be evicted. */
+static fz_item *
+choose_victim(fz_store_stripe *stripe)
+{
+	fz_item *item, *best, *t1, *t2;
+	int n;
 
-	/* First check that we *can* free tofree; if not, we'd rather not
-	 * cache this. */
-	count = 0;
-	for (item = store->tail; item; item = item->prev)
+	switch (stripe->policy)
 	{
-		if (item->val->refs == 1)
+	default:
+	case FZ_STORE_LRU:
+		return oldest_unused(stripe, LIST_T1);
+
+	case FZ_STORE_GDSF:
+		/* Rather than keeping the items in a priority queue, take the
+		 * one with the lowest priority of the oldest few. */
+		best = NULL;
+		n = 0;
+		for (item = stripe->tail[LIST_T1]; item && n < GDSF_WINDOW; item = item->prev)
 		{
-			count += item->size;
-			if (count >= tofree)
-				break;
+			if (val_refs(item->val) == 1)
+			{
+				if (best == NULL || item->prio < best->prio)
+					best = item;
+				n++;
+			}
 		}
+		return best;
+
+	case FZ_STORE_ARC:
+		t1 = oldest_unused(stripe, LIST_T1);
+		t2 = oldest_unused(stripe, LIST_T2);
+		if (t1 && (!t2 || stripe->list_size[LIST_T1] > stripe->arc_p))
+			return t1;
+		return t2;
 	}
+}
 
-	/* If we ran out of items to search, then we can never free enough */
-	if (item == NULL)
+/* Note a use of a live item in a locked stripe. */
+static void
+use_item(fz_store_stripe *stripe, fz_item *item)
+{
+	switch (stripe->policy)
 	{
-		return 0;
+	default:
+	case FZ_STORE_LRU:
+		touch(stripe, item);
+		break;
+	case FZ_STORE_GDSF:
+		item->freq++;
+		item->prio = stripe->inflation + item->freq * item->density;
+		touch(stripe, item);
+		break;
+	case FZ_STORE_ARC:
+		list_unlink(stripe, item);
+		list_push(stripe, item, LIST_T2);
+		break;
 	}
+}
+
+/* Link a new item into a locked stripe. If the stripe remembers
+ * evicting an item with the same key, ghost is its ghost. */
+static void
+add_item(fz_store *store, fz_store_stripe *stripe, fz_item *item, fz_item *ghost)
+{
+	int list = LIST_T1;
 
-	/* Actually free the items */
-	count = 0;
-	for (item = store->tail; item; item = prev)
+	switch (stripe->policy)
 	{
-		prev = item->prev;
-		if (item->val->refs == 1)
+	case FZ_STORE_GDSF:
+		item->freq = 1;
+		item->prio = stripe->inflation + item->density;
+		break;
+	case FZ_STORE_ARC:
+		if (ghost)
 		{
-			/* Free this item. Evict has to drop the lock to
-			 * manage that, which could cause prev to be removed
-			 * in the meantime. To avoid that we bump its reference
-			 * count here. This may cause another simultaneous
-			 * evict process to fail to make enough space as prev is
-			 * pinned - but that will only happen if we're near to
-			 * the limit anyway, and it will only cause something to
-			 * not be cached. */
-			count += item->size;
-			if (prev)
-				prev->val->refs++;
-			evict(ctx, item); /* Drops then retakes lock */
-			/* So the store has 1 reference to prev, as do we, so
-			 * no other evict process can have thrown prev away in
-			 * the meantime. So we are safe to just decrement its
-			 * reference count here. */
-			if (prev)
-				--prev->val->refs;
-
-			if (count >= tofree)
-				return count;
+			/* We evicted this too soon; adapt towards keeping more
+			 * of the kind of item it was. */
+			size_t b1 = stripe->list_size[LIST_B1];
+			size_t b2 = stripe->list_size[LIST_B2];
+			size_t c = arc_capacity(store, stripe);
+			size_t delta;
+			if (ghost->list == LIST_B1)
+			{
+				delta = ghost->size * (b1 && b2 > b1 ? b2 / b1 : 1);
+				stripe->arc_p = stripe->arc_p + delta < c ? stripe->arc_p + delta : c;
+			}
+			else
+			{
+				delta = ghost->size * (b2 && b1 > b2 ? b1 / b2 : 1);
+				stripe->arc_p = stripe->arc_p > delta ? stripe->arc_p - delta : 0;
+			}
+			list = LIST_T2;
 		}
+		break;
 	}
+	list_push(stripe, item, list);
+}
+
+/* Evict items that nobody but the store is using from the given
+ * stripe, in the order given by its policy, until at least tofree
+ * bytes have gone. Returns the number of bytes freed. */
+static size_t
+evict_stripe(fz_context *ctx, fz_store_stripe *stripe, size_t tofree, int alloc_held)
+{
+	fz_store *store = ctx->store;
+	victim_list vl;
+	size_t count = 0;
+	fz_item *item;
+
+	vl.len = 0;
+	lock_stripe(ctx, stripe, alloc_held);
+	while (count < tofree && (item = choose_victim(stripe)) != NULL)
+	{
+		count += item->size;
+		stripe->evictions++;
+		stripe->evicted += item->size;
+		if (stripe->policy == FZ_STORE_GDSF)
+			stripe->inflation = item->prio;
+		if (stripe->policy == FZ_STORE_ARC && item->use_hash)
+		{
+			make_ghost(store, stripe, item, &vl);
+			trim_ghosts(store, stripe, &vl);
+		}
+		else
+			detach(store, stripe, item, &vl);
+		if (vl.len == STORE_VICTIMS)
+		{
+			unlock_stripe(ctx, stripe, alloc_held);
+			free_victims(ctx, &vl, alloc_held);
+			lock_stripe(ctx, stripe, alloc_held);
+		}
+	}
+	unlock_stripe(ctx, stripe, alloc_held);
+	free_victims(ctx, &vl, alloc_held);
 
 	return count;
 }
 
-static void
-touch(fz_store *store, fz_item *item)
+/* Evict at least tofree bytes from the store, if possible. The stripes
+ * are managed separately, so we approximate a global policy by taking
+ * an even share from each stripe in turn, and then going round again
+ * for whatever shortfall remains (from stripes that had nothing to
+ * give). Returns the number of bytes freed. */
+static size_t
+evict(fz_context *ctx, size_t tofree, int alloc_held)
 {
-	if (item->next != item)
+	fz_store *store = ctx->store;
+	size_t count = 0;
+	int i, first;
+
+#if STORE_STRIPES > 1
+	first = (unsigned)FZ_ATOMIC_INC(&store->evict) % STORE_STRIPES;
+#else
+	first = 0;
+#endif
+
+	for (i = 0; i < STORE_STRIPES && count < tofree; i++)
 	{
-		/* Already in the list - unlink it */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+		size_t share = (tofree - count + STORE_STRIPES - i - 1) / (STORE_STRIPES - i);
+		count += evict_stripe(ctx, &store->stripe[(first + i) % STORE_STRIPES], share, alloc_held);
+	}
+	for (i = 0; i < STORE_STRIPES && count < tofree && STORE_STRIPES > 1; i++)
+		count += evict_stripe(ctx, &store->stripe[(first + i) % STORE_STRIPES], tofree - count, alloc_held);
+
+	return count;
+}
+
+void
+fz_new_store_context(fz_context *ctx, size_t max)
+{
+	fz_store *store;
+	int i;
+
+	store = fz_malloc_struct(ctx, fz_store);
+	fz_try(ctx)
+	{
+		for (i = 0; i < STORE_STRIPES; i++)
+		{
+			store->stripe[i].hash = fz_calloc(ctx, STORE_HASH_LEN, sizeof(fz_item *));
+			store->stripe[i].hash_len = STORE_HASH_LEN;
+			store->stripe[i].policy = FZ_STORE_LRU;
+		}
+	}
+	fz_catch(ctx)
+	{
+		for (i = 0; i < STORE_STRIPES; i++)
+			fz_free(ctx, store->stripe[i].hash);
+		fz_free(ctx, store);
+		fz_rethrow(ctx);
+	}
+#if STORE_STRIPES > 1
+	for (i = 0; i < STORE_STRIPES; i++)
+		MUTEX_INIT(store->stripe[i].lock);
+#endif
+	store->refs = 1;
+	store->size = 0;
+	store->max = max;
+	ctx->store = store;
+}
+
+void
+fz_set_store_policy(fz_context *ctx, int policy)
+{
+	fz_store *store = ctx->store;
+	victim_list vl;
+	fz_item *item;
+	int i, more;
+
+	if (store == NULL)
+		return;
+	if (policy != FZ_STORE_ARC && policy != FZ_STORE_GDSF)
+		policy = FZ_STORE_LRU;
+
+	for (i = 0; i < STORE_STRIPES; i++)
+	{
+		fz_store_stripe *stripe = &store->stripe[i];
+
+		vl.len = 0;
+		lock_stripe(ctx, stripe, 0);
+		if (stripe->policy != policy)
+		{
+			/* Put everything back onto the one list, and start
+			 * afresh. */
+			while ((item = stripe->tail[LIST_T2]) != NULL)
+			{
+				list_unlink(stripe, item);
+				list_push(stripe, item, LIST_T1);
+			}
+			for (item = stripe->head[LIST_T1]; item; item = item->next)
+			{
+				item->freq = 1;
+				item->prio = item->density;
+			}
+			stripe->arc_p = 0;
+			stripe->inflation = 0;
+			stripe->policy = policy;
+		}
+		/* Only ARC has any use for ghosts. */
+		do
+		{
+			while (policy != FZ_STORE_ARC && vl.len < STORE_VICTIMS && (item = stripe->tail[LIST_B1] ? stripe->tail[LIST_B1] : stripe->tail[LIST_B2]) != NULL)
+				detach(store, stripe, item, &vl);
+			more = (vl.len == STORE_VICTIMS);
+			unlock_stripe(ctx, stripe, 0);
+			free_victims(ctx, &vl, 0);
+			if (more)
+				lock_stripe(ctx, stripe, 0);
+		}
+		while (more);
+	}
+}
+
+int
+fz_store_policy(fz_context *ctx)
+{
+	fz_store *store = ctx->store;
+	int policy;
+
+	if (store == NULL)
+		return FZ_STORE_LRU;
+	lock_stripe(ctx, &store->stripe[0], 0);
+	policy = store->stripe[0].policy;
+	unlock_stripe(ctx, &store->stripe[0], 0);
+	return policy;
+}
+
+void
+fz_get_store_stats(fz_context *ctx, fz_store_stats *stats)
+{
+	fz_store *store = ctx->store;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (store == NULL)
+		return;
+
+	stats->max = store->max;
+	stats->size = store_size(store);
+	for (i = 0; i < STORE_STRIPES; i++)
+	{
+		fz_store_stripe *stripe = &store->stripe[i];
+		lock_stripe(ctx, stripe, 0);
+		stats->hits += stripe->hits;
+		stats->misses += stripe->misses;
+		stats->evictions += stripe->evictions;
+		stats->evicted += stripe->evicted;
+		unlock_stripe(ctx, stripe, 0);
 	}
-	/* Now relink it at the start of the LRU chain */
-	item->next = store->head;
-	if (item->next)
-		item->next->prev = item;
-	else
-		store->tail = item;
-	store->head = item;
-	item->prev = NULL;
+}
+
+void *
+fz_keep_storable(fz_context *ctx, const fz_storable *sc)
+{
+	/* Explicitly drop const to allow us to use const
+	 * sanely throughout the code. */
+	fz_storable *s = (fz_storable *)sc;
+
+	if (s && s->refs > 0)
+		(void)Memento_takeRef(s);
+#ifdef FZ_ATOMIC_INC
+	if (s)
+		keep_val(s);
+	return s;
+#else
+	return fz_keep_imp(ctx, s, &s->refs);
+#endif
+}
+
+void
+fz_drop_storable(fz_context *ctx, const fz_storable *sc)
+{
+	/* Explicitly drop const to allow us to use const
+	 * sanely throughout the code. */
+	fz_storable *s = (fz_storable *)sc;
+
+	/*
+		If we are dropping the last reference to an object, then
+		it cannot possibly be in the store (as the store always
+		keeps a ref to everything in it, and doesn't drop via
+		this method. So we can simply drop the storable object
+		itself without any operations on the fz_store.
+	 */
+	if (s && s->refs > 0)
+		(void)Memento_dropRef(s);
+#ifdef FZ_ATOMIC_DEC
+	if (s && drop_val(s))
+		s->drop(ctx, s);
+#else
+	if (fz_drop_imp(ctx, s, &s->refs))
+		s->drop(ctx, s);
+#endif
 }
 
 void *
@@ -217,9 +794,9 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, fz_store_
 	size_t size;
 	fz_storable *val = (fz_storable *)val_;
 	fz_store *store = ctx->store;
-	fz_store_hash hash = { NULL };
-	int use_hash = 0;
-	unsigned pos;
+	fz_store_stripe *stripe;
+	victim_list vl;
+	int grow = 0;
 
 	if (!store)
 		return NULL;
@@ -240,90 +817,71 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, fz_store_
 
 	if (type->make_hash_key)
 	{
-		hash.drop = val->drop;
-		use_hash = type->make_hash_key(ctx, &hash, key);
+		item->hash.drop = val->drop;
+		item->use_hash = type->make_hash_key(ctx, &item->hash, key);
+		if (item->use_hash)
+			item->hash_val = hash_key(&item->hash);
 	}
+	stripe = stripe_for(store, item->use_hash, item->hash_val);
 
 	type->keep_key(ctx, key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 
-	/* Fill out the item. To start with, we always set item->next == item
-	 * and item->prev == item. This is so that we can spot items that have
-	 * been put into the hash table without having made it into the linked
-	 * list yet. */
 	item->key = key;
 	item->val = val;
 	item->size = itemsize;
-	item->next = item;
-	item->prev = item;
 	item->type = type;
+	item->density = 1;
+	if (type->cost && itemsize > 0)
+		item->density = (double)type->cost(ctx, key, itemsize) / itemsize;
 
-	/* If we can index it fast, put it into the hash table. This serves
-	 * to check whether we have one there already. */
-	if (use_hash)
-	{
-		fz_item *existing;
+	vl.len = 0;
+	lock_stripe(ctx, stripe, 0);
 
-		fz_try(ctx)
-		{
-			/* May drop and retake the lock */
-			existing = fz_hash_insert_with_pos(ctx, store->hash, &hash, item, &pos);
-		}
-		fz_catch(ctx)
-		{
-			/* Any error here means that item never made it into the
-			 * hash - so no one else can have a reference. */
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
-			fz_free(ctx, item);
-			type->drop_key(ctx, key);
-			return NULL;
-		}
-		if (existing)
+	/* If we can index it fast, check whether we have one there
+	 * already, and if not, put it into the hash table. */
+	if (item->use_hash)
+	{
+		fz_item *existing = hash_find(stripe, item->hash_val, &item->hash);
+		if (existing && existing->val)
 		{
 			/* There was one there already! Take a new reference
 			 * to the existing one, and drop our current one. */
-			touch(store, existing);
-			if (existing->val->refs > 0)
-				existing->val->refs++;
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			fz_storable *existing_val = existing->val;
+			use_item(stripe, existing);
+			keep_val(existing_val);
+			unlock_stripe(ctx, stripe, 0);
 			fz_free(ctx, item);
 			type->drop_key(ctx, key);
-			return existing->val;
-		}
-	}
-	/* Now bump the ref */
-	if (val->refs > 0)
-		val->refs++;
-	/* If we haven't got an infinite store, check for space within it */
-	if (store->max != FZ_STORE_UNLIMITED)
-	{
-		size = store->size + itemsize;
-		while (size > store->max)
-		{
-			/* ensure_space may drop, then retake the lock */
-			size_t saved = ensure_space(ctx, size - store->max);
-			size -= saved;
-			if (saved == 0)
-			{
-				/* Failed to free any space. */
-				/* We used to 'unstore' it here, but that's wrong.
-				 * If we've already spent the memory to malloc it
-				 * then not putting it in the store just means that
-				 * a resource used multiple times will just be malloced
-				 * again. Better to put it in the store, have the
-				 * store account for it, and for it to potentially be reused.
-				 * When the caller drops the reference to it, it can then
-				 * be dropped from the store on the next attempt to store
-				 * anything else. */
-				break;
-			}
+			return existing_val;
 		}
+		add_item(store, stripe, item, existing);
+		if (existing)
+			detach(store, stripe, existing, &vl);
+		hash_insert(stripe, item);
+		if (stripe->hash_load > stripe->hash_len * 2)
+			grow = stripe->hash_len * 2;
 	}
-	store->size += itemsize;
+	else
+		add_item(store, stripe, item, NULL);
 
-	/* Regardless of whether it's indexed, it goes into the linked list */
-	touch(store, item);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	/* Now bump the ref */
+	keep_val(val);
+	size = add_size(store, itemsize);
+	unlock_stripe(ctx, stripe, 0);
+
+	free_victims(ctx, &vl, 0);
+	if (grow)
+		grow_hash(ctx, stripe, grow);
+
+	/* If we haven't got an infinite store, make sure we are within it.
+	 * The item we have just stored is in use by the caller, so will not
+	 * be evicted. If we cannot free enough, we leave the store over its
+	 * limit; dropping the item here would only mean that a resource used
+	 * multiple times would be malloced again. Once the caller drops its
+	 * reference, it can be evicted by the next attempt to store anything
+	 * else. */
+	if (store->max != FZ_STORE_UNLIMITED && size > store->max)
+		(void)evict(ctx, size - store->max, 0);
 
 	return NULL;
 }
@@ -333,7 +891,9 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type *
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_stripe *stripe;
 	fz_store_hash hash = { NULL };
+	unsigned hash_val = 0;
 	int use_hash = 0;
 
 	if (!store)
@@ -346,37 +906,41 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type *
 	{
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
+		if (use_hash)
+			hash_val = hash_key(&hash);
 	}
+	stripe = stripe_for(store, use_hash, hash_val);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	lock_stripe(ctx, stripe, 0);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirected objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = hash_find(stripe, hash_val, &hash);
+		if (item && !item->val)
+			item = NULL;
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
-		{
+		for (item = stripe->head[LIST_T1]; item; item = item->next)
 			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
-		}
+		if (!item)
+			for (item = stripe->head[LIST_T2]; item; item = item->next)
+				if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
+					break;
 	}
 	if (item)
 	{
-		/* LRU the block. This also serves to ensure that any item
-		 * picked up from the hash before it has made it into the
-		 * linked list does not get whipped out again due to the
-		 * store being full. */
-		touch(store, item);
-		/* And bump the refcount before returning */
-		if (item->val->refs > 0)
-			item->val->refs++;
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		return (void *)item->val;
+		fz_storable *val = item->val;
+		stripe->hits++;
+		use_item(stripe, item);
+		keep_val(val);
+		unlock_stripe(ctx, stripe, 0);
+		return (void *)val;
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	stripe->misses++;
+	unlock_stripe(ctx, stripe, 0);
 
 	return NULL;
 }
@@ -386,73 +950,78 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
-	int dodrop;
+	fz_store_stripe *stripe;
 	fz_store_hash hash = { NULL };
+	unsigned hash_val = 0;
 	int use_hash = 0;
+	victim_list vl;
 
 	if (type->make_hash_key)
 	{
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
+		if (use_hash)
+			hash_val = hash_key(&hash);
 	}
+	stripe = stripe_for(store, use_hash, hash_val);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	vl.len = 0;
+	lock_stripe(ctx, stripe, 0);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirect objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
-		if (item)
-			fz_hash_remove(ctx, store->hash, &hash);
+		item = hash_find(stripe, hash_val, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = stripe->head[LIST_T1]; item; item = item->next)
 			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
+		if (!item)
+			for (item = stripe->head[LIST_T2]; item; item = item->next)
+				if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
+					break;
 	}
 	if (item)
-	{
-		/* Momentarily things can be in the hash table without being
-		 * in the list. Don't attempt to unlink these. We indicate
-		 * such items by setting item->next == item. */
-		if (item->next != item)
-		{
-			if (item->next)
-				item->next->prev = item->prev;
-			else
-				store->tail = item->prev;
-			if (item->prev)
-				item->prev->next = item->next;
-			else
-				store->head = item->next;
-		}
-		dodrop = (item->val->refs > 0 && --item->val->refs == 0);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		if (dodrop)
-			item->val->drop(ctx, item->val);
-		type->drop_key(ctx, item->key);
-		fz_free(ctx, item);
-	}
-	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		detach(store, stripe, item, &vl);
+	unlock_stripe(ctx, stripe, 0);
+
+	free_victims(ctx, &vl, 0);
 }
 
 void
 fz_empty_store(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
+	victim_list vl;
+	int i, list;
 
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	/* Run through all the items in the store */
-	while (store->head)
+	/* Run through all the items (and ghosts) in the store */
+	for (i = 0; i < STORE_STRIPES; i++)
 	{
-		evict(ctx, store->head); /* Drops then retakes lock */
+		fz_store_stripe *stripe = &store->stripe[i];
+		vl.len = 0;
+		lock_stripe(ctx, stripe, 0);
+		for (list = 0; list < NUM_LISTS; list++)
+		{
+			while (stripe->head[list])
+			{
+				detach(store, stripe, stripe->head[list], &vl);
+				if (vl.len == STORE_VICTIMS)
+				{
+					unlock_stripe(ctx, stripe, 0);
+					free_victims(ctx, &vl, 0);
+					lock_stripe(ctx, stripe, 0);
+				}
+			}
+		}
+		unlock_stripe(ctx, stripe, 0);
+		free_victims(ctx, &vl, 0);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
 fz_store *
@@ -470,43 +1039,62 @@ fz_drop_store_context(fz_context *ctx)
 		return;
 	if (fz_drop_imp(ctx, ctx->store, &ctx->store->refs))
 	{
+		fz_store *store = ctx->store;
+		int i;
 		fz_empty_store(ctx);
-		fz_drop_hash(ctx, ctx->store->hash);
-		fz_free(ctx, ctx->store);
+		for (i = 0; i < STORE_STRIPES; i++)
+		{
+#if STORE_STRIPES > 1
+			MUTEX_FIN(store->stripe[i].lock);
+#endif
+			fz_free(ctx, store->stripe[i].hash);
+		}
+		fz_free(ctx, store);
 		ctx->store = NULL;
 	}
 }
 
-static void
-print_item(fz_context *ctx, fz_output *out, void *item_)
-{
-	fz_item *item = (fz_item *)item_;
-	fz_printf(ctx, out, " val=%p item=%p\n", item->val, item);
-}
-
 void
 fz_print_store_locked(fz_context *ctx, fz_output *out)
 {
 	fz_item *item, *next;
 	fz_store *store = ctx->store;
+	int i, list;
 
 	fz_printf(ctx, out, "-- resource store contents --\n");
 
-	for (item = store->head; item; item = next)
+	for (i = 0; i < STORE_STRIPES; i++)
 	{
-		next = item->next;
-		if (next)
-			next->val->refs++;
-		fz_printf(ctx, out, "store[*][refs=%d][size=%d] ", item->val->refs, item->size);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		item->type->print(ctx, out, item->key);
-		fz_printf(ctx, out, " = %p\n", item->val);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		if (next)
-			next->val->refs--;
+		fz_store_stripe *stripe = &store->stripe[i];
+		lock_stripe(ctx, stripe, 1);
+		for (list = LIST_T1; list <= LIST_T2; list++)
+		{
+			for (item = stripe->head[list]; item; item = next)
+			{
+				next = item->next;
+				if (next)
+					keep_val(next->val);
+				fz_printf(ctx, out, "store[%d][refs=%d][size=" FMT_zu "] ", i, val_refs(item->val), item->size);
+				unlock_stripe(ctx, stripe, 1);
+				fz_unlock(ctx, FZ_LOCK_ALLOC);
+				item->type->print(ctx, out, item->key);
+				fz_printf(ctx, out, " = %p\n", item->val);
+				fz_lock(ctx, FZ_LOCK_ALLOC);
+				lock_stripe(ctx, stripe, 1);
+				if (next)
+					(void)drop_val(next->val);
+			}
+		}
+		unlock_stripe(ctx, stripe, 1);
 	}
 	fz_printf(ctx, out, "-- resource store hash contents --\n");
-	fz_print_hash_details(ctx, out, store->hash, print_item);
+	for (i = 0; i < STORE_STRIPES; i++)
+	{
+		fz_store_stripe *stripe = &store->stripe[i];
+		lock_stripe(ctx, stripe, 1);
+		fz_printf(ctx, out, "stripe %d: %d hashed items in %d buckets\n", i, stripe->hash_load, stripe->hash_len);
+		unlock_stripe(ctx, stripe, 1);
+	}
 	fz_printf(ctx, out, "-- end --\n");
 }
 
@@ -518,35 +1106,12 @@ fz_print_store(fz_context *ctx, fz_output *out)
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
-/* This is now an n^2 algorithm - not ideal, but it'll only be bad if we are
- * actually managing to scavenge lots of blocks back. */
+/* Called with FZ_LOCK_ALLOC held; evict drops and retakes it. */
 static int
 scavenge(fz_context *ctx, size_t tofree)
 {
-	fz_store *store = ctx->store;
-	size_t count = 0;
-	fz_item *item, *prev;
-
-	/* Free the items */
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->val->refs == 1)
-		{
-			/* Free this item */
-			count += item->size;
-			evict(ctx, item); /* Drops then retakes lock */
-
-			if (count >= tofree)
-				break;
-
-			/* Have to restart search again, as prev may no longer
-			 * be valid due to release of lock in evict. */
-			prev = store->tail;
-		}
-	}
 	/* Success is managing to evict any blocks */
-	return count != 0;
+	return evict(ctx, tofree, 1) != 0;
 }
 
 int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
@@ -561,13 +1126,14 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 		return 0;
 
 #ifdef DEBUG_SCAVENGING
-	printf("Scavenging: store=" FMT_zu " size=" FMT_zu " phase=%d\n", store->size, size, *phase);
+	printf("Scavenging: store=" FMT_zu " size=" FMT_zu " phase=%d\n", store_size(store), size, *phase);
 	fz_print_store_locked(ctx, stderr);
 	Memento_stats();
 #endif
 	do
 	{
 		size_t tofree;
+		size_t current = store_size(store);
 
 		/* Calculate 'max' as the maximum size of the store for this phase */
 		if (*phase >= 16)
@@ -575,21 +1141,21 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 		else if (store->max != FZ_STORE_UNLIMITED)
 			max = store->max / 16 * (16 - *phase);
 		else
-			max = store->size / (16 - *phase) * (15 - *phase);
+			max = current / (16 - *phase) * (15 - *phase);
 		(*phase)++;
 
 		/* Slightly baroque calculations to avoid overflow */
-		if (size > SIZE_MAX - store->size)
+		if (size > SIZE_MAX - current)
 			tofree = SIZE_MAX - max;
-		else if (size + store->size > max)
+		else if (size + current > max)
 			continue;
 		else
-			tofree = size + store->size - max;
+			tofree = size + current - max;
 
 		if (scavenge(ctx, tofree))
 		{
 #ifdef DEBUG_SCAVENGING
-			printf("scavenged: store=" FMT_zu "\n", store->size);
+			printf("scavenged: store=" FMT_zu "\n", store_size(store));
 			fz_print_store(ctx, stderr);
 			Memento_stats();
 #endif
@@ -611,7 +1177,7 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 {
 	int success;
 	fz_store *store;
-	size_t new_size;
+	size_t size, new_size;
 
 	if (ctx == NULL)
 		return 0;
@@ -624,18 +1190,19 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 		return 0;
 
 #ifdef DEBUG_SCAVENGING
-	fprintf(stderr, "fz_shrink_store: " FMT_zu "\n", store->size/(1024*1024));
+	fprintf(stderr, "fz_shrink_store: " FMT_zu "\n", store_size(store)/(1024*1024));
 #endif
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 
-	new_size = (size_t)(((uint64_t)store->size * percent) / 100);
-	if (store->size > new_size)
-		scavenge(ctx, store->size - new_size);
+	size = store_size(store);
+	new_size = (size_t)(((uint64_t)size * percent) / 100);
+	if (size > new_size)
+		scavenge(ctx, size - new_size);
 
-	success = (store->size <= new_size) ? 1 : 0;
+	success = (store_size(store) <= new_size) ? 1 : 0;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 #ifdef DEBUG_SCAVENGING
-	fprintf(stderr, "fz_shrink_store after: " FMT_zu "\n", store->size/(1024*1024));
+	fprintf(stderr, "fz_shrink_store after: " FMT_zu "\n", store_size(store)/(1024*1024));
 #endif
 
 	return success;
@@ -0,0 +1,279 @@
+#include "mupdf/fitz.h"
+
+#if FZ_ENABLE_MMAP
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+/*
+	Memory mapped file stream.
+
+	The file is mapped into memory, and the stream reads straight from
+	the mapping, so seeking never discards (and rereads) a buffer. On
+	64 bit systems the whole file is mapped at once, and the stream
+	behaves exactly like one opened with fz_open_memory. On 32 bit
+	systems we cannot expect to find room in the address space for
+	large files, so we map a window of it at a time.
+*/
+
+enum { MAPPED_WINDOW = 64 << 20 };
+
+typedef struct fz_mapped_stream_s
+{
+#if defined(_WIN32) || defined(_WIN64)
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+	fz_off_t size;
+	size_t window; /* 0 to map the whole file */
+	size_t granularity; /* window offsets must be multiples of this */
+	fz_off_t offset; /* of the current window */
+	unsigned char *base;
+	size_t len;
+} fz_mapped_stream;
+
+static void
+unmap_window(fz_mapped_stream *state)
+{
+	if (state->base)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		UnmapViewOfFile(state->base);
+#else
+		munmap(state->base, state->len);
+#endif
+	}
+	state->base = NULL;
+	state->len = 0;
+}
+
+/* Map the window containing offset. Returns 0 on failure. */
+static int
+map_window(fz_mapped_stream *state, fz_off_t offset)
+{
+	fz_off_t start = offset - offset % state->granularity;
+	size_t len = (size_t)(state->size - start);
+	void *base;
+
+	if (state->window && len > state->window)
+		len = state->window;
+
+	unmap_window(state);
+#if defined(_WIN32) || defined(_WIN64)
+	base = MapViewOfFile(state->mapping, FILE_MAP_READ, (DWORD)((uint64_t)start >> 32), (DWORD)start, len);
+	if (base == NULL)
+		return 0;
+#else
+	base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, state->fd, (off_t)start);
+	if (base == MAP_FAILED)
+		return 0;
+#endif
+	state->offset = start;
+	state->base = base;
+	state->len = len;
+	return 1;
+}
+
+/* Point the stream at offset within the current window. */
+static void
+set_window(fz_stream *stm, fz_mapped_stream *state, fz_off_t offset)
+{
+	stm->rp = state->base + (offset - state->offset);
+	stm->wp = state->base + state->len;
+	stm->pos = state->offset + (fz_off_t)state->len;
+}
+
+static int next_mapped(fz_context *ctx, fz_stream *stm, size_t n)
+{
+	fz_mapped_stream *state = stm->state;
+	fz_off_t offset = stm->pos;
+
+	/* stm->pos is the end of the current window */
+	if (offset >= state->size)
+		return EOF;
+	if (!map_window(state, offset))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot map file: %s", strerror(errno));
+	set_window(stm, state, offset);
+
+	return *stm->rp++;
+}
+
+static void seek_mapped(fz_context *ctx, fz_stream *stm, fz_off_t offset, int whence)
+{
+	fz_mapped_stream *state = stm->state;
+	fz_off_t pos = stm->pos - (stm->wp - stm->rp);
+
+	/* Convert to absolute pos */
+	if (whence == 1)
+		offset += pos; /* Was relative to current pos */
+	else if (whence == 2)
+		offset += state->size; /* Was relative to end */
+
+	if (offset < 0)
+		offset = 0;
+	if (offset > state->size)
+		offset = state->size;
+
+	if (state->base && offset >= state->offset && offset <= state->offset + (fz_off_t)state->len)
+	{
+		/* Within the current window; no need to touch the file. */
+		set_window(stm, state, offset);
+	}
+	else if (offset == state->size)
+	{
+		/* At the end; nothing to map. */
+		stm->rp = stm->wp;
+		stm->pos = state->size;
+	}
+	else
+	{
+		if (!map_window(state, offset))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot map file: %s", strerror(errno));
+		set_window(stm, state, offset);
+	}
+}
+
+static int meta_mapped(fz_context *ctx, fz_stream *stm, int key, int size, void *ptr)
+{
+	fz_mapped_stream *state = stm->state;
+
+	switch (key)
+	{
+	case FZ_STREAM_META_LENGTH:
+		/* Lengths that do not fit an int are reported as unknown
+		 * rather than truncated. */
+		if (state->size > INT_MAX)
+			return -1;
+		return (int)state->size;
+	}
+	return -1;
+}
+
+static void close_mapped(fz_context *ctx, void *state_)
+{
+	fz_mapped_stream *state = state_;
+
+	unmap_window(state);
+#if defined(_WIN32) || defined(_WIN64)
+	CloseHandle(state->mapping);
+	CloseHandle(state->file);
+#else
+	if (close(state->fd) < 0)
+		fz_warn(ctx, "close error: %s", strerror(errno));
+#endif
+	fz_free(ctx, state);
+}
+
+/* Open and map the file. Returns NULL (having cleaned up) if it cannot
+ * be mapped, for whatever reason. */
+static fz_mapped_stream *
+map_file(fz_context *ctx, const char *name)
+{
+	fz_mapped_stream *state = fz_malloc_struct(ctx, fz_mapped_stream);
+#if defined(_WIN32) || defined(_WIN64)
+	SYSTEM_INFO info;
+	LARGE_INTEGER size;
+	char *s = (char*)name;
+	wchar_t *wname, *d;
+	int c;
+
+	fz_try(ctx)
+	{
+		d = wname = fz_malloc(ctx, (strlen(name)+1) * sizeof(wchar_t));
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, state);
+		fz_rethrow(ctx);
+	}
+	while (*s) {
+		s += fz_chartorune(&c, s);
+		*d++ = c;
+	}
+	*d = 0;
+	state->file = CreateFileW(wname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	fz_free(ctx, wname);
+	if (state->file == INVALID_HANDLE_VALUE)
+	{
+		fz_free(ctx, state);
+		return NULL;
+	}
+	if (!GetFileSizeEx(state->file, &size) || size.QuadPart == 0 || size.QuadPart > FZ_OFF_MAX)
+	{
+		CloseHandle(state->file);
+		fz_free(ctx, state);
+		return NULL;
+	}
+	state->mapping = CreateFileMappingW(state->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (state->mapping == NULL)
+	{
+		CloseHandle(state->file);
+		fz_free(ctx, state);
+		return NULL;
+	}
+	GetSystemInfo(&info);
+	state->size = (fz_off_t)size.QuadPart;
+	state->granularity = info.dwAllocationGranularity;
+#else
+	struct stat st;
+
+	state->fd = open(name, O_RDONLY | O_BINARY);
+	if (state->fd < 0)
+	{
+		fz_free(ctx, state);
+		return NULL;
+	}
+	if (fstat(state->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > FZ_OFF_MAX)
+	{
+		close(state->fd);
+		fz_free(ctx, state);
+		return NULL;
+	}
+	state->size = (fz_off_t)st.st_size;
+	state->granularity = sysconf(_SC_PAGESIZE);
+#endif
+	state->window = sizeof(void *) >= 8 ? 0 : MAPPED_WINDOW;
+
+	if (!map_window(state, 0))
+	{
+		close_mapped(ctx, state);
+		return NULL;
+	}
+
+	return state;
+}
+
+fz_stream *
+fz_open_file_mapped(fz_context *ctx, const char *name)
+{
+	fz_stream *stm;
+	fz_mapped_stream *state = map_file(ctx, name);
+
+	if (state == NULL)
+		return fz_open_file_buffered(ctx, name, FZ_FILE_BUFFER_LARGE);
+
+	stm = fz_new_stream(ctx, state, next_mapped, close_mapped);
+	stm->seek = seek_mapped;
+	stm->meta = meta_mapped;
+	set_window(stm, state, 0);
+
+	return stm;
+}
+
+#else
+
+fz_stream *
+fz_open_file_mapped(fz_context *ctx, const char *name)
+{
+	return fz_open_file_buffered(ctx, name, FZ_FILE_BUFFER_LARGE);
+}
+
+#endif
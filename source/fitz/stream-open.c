@@ -1,5 +1,9 @@
 #include "mupdf/fitz.h"
 
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#endif
+
 int
 fz_file_exists(fz_context *ctx, const char *path)
 {
@@ -65,16 +69,52 @@ fz_drop_stream(fz_context *ctx, fz_stream *stm)
 typedef struct fz_file_stream_s
 {
 	FILE *file;
-	unsigned char buffer[4096];
+	size_t size;
+	int sequential; /* refills since the last seek */
+	fz_off_t advised; /* read ahead has been asked for up to here */
+	unsigned char *buffer;
 } fz_file_stream;
 
+/*
+	When the stream is being read sequentially, ask the system to start
+	fetching the next few buffers' worth of the file while we decode this
+	one. Over a network filesystem this hides most of the latency of the
+	next refill.
+*/
+static void read_ahead(fz_context *ctx, fz_file_stream *state, fz_off_t pos)
+{
+#if defined(POSIX_FADV_WILLNEED) || defined(F_RDADVISE)
+	size_t len = state->size * 4;
+	if (len < 256 << 10)
+		len = 256 << 10;
+
+	if (++state->sequential < 2)
+		return;
+	if (state->advised > pos + (fz_off_t)state->size)
+		return;
+	if (state->advised < pos)
+		state->advised = pos;
+#if defined(POSIX_FADV_WILLNEED)
+	(void)posix_fadvise(fileno(state->file), state->advised, len, POSIX_FADV_WILLNEED);
+#else
+	{
+		struct radvisory ra;
+		ra.ra_offset = state->advised;
+		ra.ra_count = len;
+		(void)fcntl(fileno(state->file), F_RDADVISE, &ra);
+	}
+#endif
+	state->advised += len;
+#endif
+}
+
 static int next_file(fz_context *ctx, fz_stream *stm, size_t n)
 {
 	fz_file_stream *state = stm->state;
 
 	/* n is only a hint, that we can safely ignore */
-	n = fread(state->buffer, 1, sizeof(state->buffer), state->file);
-	if (n < sizeof(state->buffer) && ferror(state->file))
+	n = fread(state->buffer, 1, state->size, state->file);
+	if (n < state->size && ferror(state->file))
 		fz_throw(ctx, FZ_ERROR_GENERIC, "read error: %s", strerror(errno));
 	stm->rp = state->buffer;
 	stm->wp = state->buffer + n;
@@ -82,18 +122,39 @@ static int next_file(fz_context *ctx, fz_stream *stm, size_t n)
 
 	if (n == 0)
 		return EOF;
+	if (n == state->size)
+		read_ahead(ctx, state, stm->pos);
 	return *stm->rp++;
 }
 
 static void seek_file(fz_context *ctx, fz_stream *stm, fz_off_t offset, int whence)
 {
 	fz_file_stream *state = stm->state;
-	fz_off_t n = fz_fseek(state->file, offset, whence);
+	fz_off_t n;
+
+	/* If the target is within the buffer, there is no need to go to
+	 * the file (and throw away what we have read). */
+	if (whence != 2)
+	{
+		fz_off_t start = stm->pos - (stm->wp - state->buffer);
+		if (whence == 1)
+			offset += stm->pos - (stm->wp - stm->rp);
+		whence = 0;
+		if (offset >= start && offset <= stm->pos)
+		{
+			stm->rp = state->buffer + (offset - start);
+			return;
+		}
+	}
+
+	n = fz_fseek(state->file, offset, whence);
 	if (n < 0)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot seek: %s", strerror(errno));
 	stm->pos = fz_ftell(state->file);
 	stm->rp = state->buffer;
 	stm->wp = state->buffer;
+	state->sequential = 0;
+	state->advised = 0;
 }
 
 static void close_file(fz_context *ctx, void *state_)
@@ -106,11 +167,20 @@ static void close_file(fz_context *ctx, void *state_)
 }
 
 fz_stream *
-fz_open_file_ptr(fz_context *ctx, FILE *file)
+fz_open_file_ptr_buffered(fz_context *ctx, FILE *file, size_t size)
 {
 	fz_stream *stm;
-	fz_file_stream *state = fz_malloc_struct(ctx, fz_file_stream);
+	fz_file_stream *state;
+
+	if (size == 0)
+		size = FZ_FILE_BUFFER_DEFAULT;
+	else if (size > FZ_FILE_BUFFER_MAX)
+		size = FZ_FILE_BUFFER_MAX;
+	state = fz_malloc(ctx, sizeof(fz_file_stream) + size);
+	memset(state, 0, sizeof(fz_file_stream));
 	state->file = file;
+	state->size = size;
+	state->buffer = (unsigned char *)(state + 1);
 
 	fz_try(ctx)
 	{
@@ -122,12 +192,20 @@ fz_open_file_ptr(fz_context *ctx, FILE *file)
 		fz_rethrow(ctx);
 	}
 	stm->seek = seek_file;
+	stm->rp = state->buffer;
+	stm->wp = state->buffer;
 
 	return stm;
 }
 
 fz_stream *
-fz_open_file(fz_context *ctx, const char *name)
+fz_open_file_ptr(fz_context *ctx, FILE *file)
+{
+	return fz_open_file_ptr_buffered(ctx, file, FZ_FILE_BUFFER_DEFAULT);
+}
+
+static FILE *
+open_file(fz_context *ctx, const char *name)
 {
 	FILE *f;
 #if defined(_WIN32) || defined(_WIN64)
@@ -147,7 +225,36 @@ fz_open_file(fz_context *ctx, const char *name)
 #endif
 	if (f == NULL)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot open %s: %s", name, strerror(errno));
-	return fz_open_file_ptr(ctx, f);
+	return f;
+}
+
+fz_stream *
+fz_open_file_buffered(fz_context *ctx, const char *name, size_t size)
+{
+	FILE *f = open_file(ctx, name);
+	fz_stream *stm;
+
+	/* With a large buffer of our own, stdio's would only cost a copy. */
+	if (size > BUFSIZ)
+		setvbuf(f, NULL, _IONBF, 0);
+
+	fz_try(ctx)
+	{
+		stm = fz_open_file_ptr_buffered(ctx, f, size);
+	}
+	fz_catch(ctx)
+	{
+		fclose(f);
+		fz_rethrow(ctx);
+	}
+
+	return stm;
+}
+
+fz_stream *
+fz_open_file(fz_context *ctx, const char *name)
+{
+	return fz_open_file_buffered(ctx, name, FZ_FILE_BUFFER_DEFAULT);
 }
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -0,0 +1,380 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+
+/*
+	Ranged stream.
+
+	The file is divided into blocks, each of which is either present
+	(in which case we hold a copy of it) or not. Reads are served
+	straight from the block holding the read position; a read that
+	falls in a missing block asks the fetch function for it, along
+	with the next few missing blocks in case we are reading forwards,
+	and throws FZ_ERROR_TRYLATER if the fetch does not supply it at
+	once. We remember which blocks we have asked for, so that a reader
+	retrying after a TRYLATER does not ask for them again.
+
+	Blocks are only ever added, never changed or removed, until the
+	stream is closed; so once a block is present the reader can use it
+	without holding the lock.
+*/
+
+enum
+{
+	RANGE_BLOCK_SHIFT = 16,
+	RANGE_BLOCK_SIZE = 1 << RANGE_BLOCK_SHIFT,
+	RANGE_READ_AHEAD = 4 /* blocks to ask for on a miss */
+};
+
+typedef struct fz_range_stream_s
+{
+	fz_off_t length;
+	int block_count;
+	int blocks_present;
+	unsigned char **block; /* NULL until the block is present */
+	unsigned char *requested;
+	fz_range_fetch_fn *fetch;
+	void (*drop)(fz_context *ctx, void *opaque);
+	void *opaque;
+#ifdef FZ_THREADS
+	MUTEX lock;
+#endif
+} fz_range_stream;
+
+#ifdef FZ_THREADS
+#define LOCK(state) MUTEX_LOCK((state)->lock)
+#define UNLOCK(state) MUTEX_UNLOCK((state)->lock)
+#else
+#define LOCK(state) do { } while (0)
+#define UNLOCK(state) do { } while (0)
+#endif
+
+static size_t
+block_len(fz_range_stream *state, int i)
+{
+	fz_off_t left = state->length - ((fz_off_t)i << RANGE_BLOCK_SHIFT);
+	return left < RANGE_BLOCK_SIZE ? (size_t)left : RANGE_BLOCK_SIZE;
+}
+
+/* Ask for the blocks from first to last that are neither present nor
+ * already asked for, in as few ranges as possible. */
+static void
+request_blocks(fz_context *ctx, fz_range_stream *state, int first, int last)
+{
+	int i = first;
+
+	if (last >= state->block_count)
+		last = state->block_count - 1;
+
+	while (i <= last)
+	{
+		int start, end;
+
+		LOCK(state);
+		while (i <= last && (state->block[i] || state->requested[i]))
+			i++;
+		start = i;
+		while (i <= last && !state->block[i] && !state->requested[i])
+			state->requested[i++] = 1;
+		end = i;
+		UNLOCK(state);
+
+		if (start < end)
+		{
+			fz_off_t ofs = (fz_off_t)start << RANGE_BLOCK_SHIFT;
+			fz_off_t len = ((fz_off_t)(end - 1) << RANGE_BLOCK_SHIFT) + block_len(state, end - 1) - ofs;
+			fz_try(ctx)
+			{
+				state->fetch(ctx, state->opaque, ofs, len);
+			}
+			fz_catch(ctx)
+			{
+				/* Ask again next time. */
+				LOCK(state);
+				for (i = start; i < end; i++)
+					state->requested[i] = 0;
+				UNLOCK(state);
+				fz_rethrow(ctx);
+			}
+		}
+	}
+}
+
+static int
+next_range(fz_context *ctx, fz_stream *stm, size_t len)
+{
+	fz_range_stream *state = stm->state;
+	fz_off_t pos = stm->pos;
+	int i = (int)(pos >> RANGE_BLOCK_SHIFT);
+	unsigned char *block;
+
+	if (pos >= state->length)
+		return EOF;
+
+	LOCK(state);
+	block = state->block[i];
+	UNLOCK(state);
+
+	if (!block)
+	{
+		request_blocks(ctx, state, i, i + RANGE_READ_AHEAD - 1);
+		LOCK(state);
+		block = state->block[i];
+		UNLOCK(state);
+		if (!block)
+		{
+			stm->rp = stm->wp;
+			fz_throw(ctx, FZ_ERROR_TRYLATER, "data not available yet (offset=%Zd)", pos);
+		}
+	}
+
+	stm->rp = block + (pos - ((fz_off_t)i << RANGE_BLOCK_SHIFT));
+	stm->wp = block + block_len(state, i);
+	stm->pos = ((fz_off_t)i << RANGE_BLOCK_SHIFT) + block_len(state, i);
+	return *stm->rp++;
+}
+
+static void
+seek_range(fz_context *ctx, fz_stream *stm, fz_off_t offset, int whence)
+{
+	fz_range_stream *state = stm->state;
+
+	if (whence == SEEK_END)
+		offset += state->length;
+	if (offset < 0)
+		offset = 0;
+	if (offset > state->length)
+		offset = state->length;
+	stm->rp = stm->wp;
+	stm->pos = offset;
+}
+
+static int
+meta_range(fz_context *ctx, fz_stream *stm, int key, int size, void *ptr)
+{
+	fz_range_stream *state = stm->state;
+	int complete;
+
+	switch (key)
+	{
+	case FZ_STREAM_META_LENGTH:
+		/* As for mmapped files: too long for an int is unknown. */
+		if (state->length > INT_MAX)
+			return -1;
+		return (int)state->length;
+	case FZ_STREAM_META_PROGRESSIVE:
+		LOCK(state);
+		complete = (state->blocks_present == state->block_count);
+		UNLOCK(state);
+		return !complete;
+	case FZ_STREAM_META_PREFETCH:
+		if (ptr && size == 2 * sizeof(fz_off_t))
+		{
+			fz_off_t *range = ptr;
+			fz_off_t start = range[0] < 0 ? 0 : range[0];
+			fz_off_t end = range[0] + range[1];
+			if (end > state->length)
+				end = state->length;
+			if (start < end)
+				request_blocks(ctx, state, (int)(start >> RANGE_BLOCK_SHIFT), (int)((end - 1) >> RANGE_BLOCK_SHIFT));
+		}
+		return 1;
+	}
+	return -1;
+}
+
+static void
+close_ranged(fz_context *ctx, void *state_)
+{
+	fz_range_stream *state = state_;
+	int i;
+
+	if (state->drop)
+		state->drop(ctx, state->opaque);
+	for (i = 0; i < state->block_count; i++)
+		fz_free(ctx, state->block[i]);
+	fz_free(ctx, state->block);
+	fz_free(ctx, state->requested);
+#ifdef FZ_THREADS
+	MUTEX_FIN(state->lock);
+#endif
+	fz_free(ctx, state);
+}
+
+fz_stream *
+fz_open_range_stream(fz_context *ctx, fz_off_t length, fz_range_fetch_fn *fetch, void (*drop)(fz_context *ctx, void *opaque), void *opaque)
+{
+	fz_range_stream *state = NULL;
+	fz_stream *stm;
+
+	fz_var(state);
+
+	fz_try(ctx)
+	{
+		if (length <= 0)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "ranged stream needs a length");
+		if (((length - 1) >> RANGE_BLOCK_SHIFT) >= INT_MAX)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "ranged stream too long");
+		state = fz_malloc_struct(ctx, fz_range_stream);
+		state->length = length;
+		state->block_count = (int)(((length - 1) >> RANGE_BLOCK_SHIFT) + 1);
+		state->block = fz_malloc_array(ctx, state->block_count, sizeof(*state->block));
+		memset(state->block, 0, state->block_count * sizeof(*state->block));
+		state->requested = fz_malloc(ctx, state->block_count);
+		memset(state->requested, 0, state->block_count);
+	}
+	fz_catch(ctx)
+	{
+		if (state)
+			fz_free(ctx, state->block);
+		fz_free(ctx, state);
+		if (drop)
+			drop(ctx, opaque);
+		fz_rethrow(ctx);
+	}
+	state->fetch = fetch;
+	state->drop = drop;
+	state->opaque = opaque;
+#ifdef FZ_THREADS
+	MUTEX_INIT(state->lock);
+#endif
+
+	stm = fz_new_stream(ctx, state, next_range, close_ranged);
+	stm->seek = seek_range;
+	stm->meta = meta_range;
+
+	return stm;
+}
+
+static fz_range_stream *
+range_state(fz_context *ctx, fz_stream *stm)
+{
+	if (!stm || stm->next != next_range)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "not a ranged stream");
+	return stm->state;
+}
+
+void
+fz_range_stream_supply(fz_context *ctx, fz_stream *stm, fz_off_t offset, const unsigned char *data, fz_off_t len)
+{
+	fz_range_stream *state = range_state(ctx, stm);
+	fz_off_t end = offset + len;
+	int i;
+
+	if (offset < 0 || !data)
+		return;
+	i = (int)((offset + RANGE_BLOCK_SIZE - 1) >> RANGE_BLOCK_SHIFT);
+
+	for (; i < state->block_count; i++)
+	{
+		fz_off_t start = (fz_off_t)i << RANGE_BLOCK_SHIFT;
+		size_t n = block_len(state, i);
+		unsigned char *block;
+
+		if (start + (fz_off_t)n > end)
+			break;
+
+		LOCK(state);
+		block = state->block[i];
+		UNLOCK(state);
+		if (block)
+			continue;
+
+		block = fz_malloc(ctx, n);
+		memcpy(block, data + (start - offset), n);
+
+		LOCK(state);
+		if (state->block[i] == NULL)
+		{
+			state->block[i] = block;
+			state->blocks_present++;
+			block = NULL;
+		}
+		state->requested[i] = 0;
+		UNLOCK(state);
+
+		/* Someone else supplied it while we were copying. */
+		fz_free(ctx, block);
+	}
+}
+
+void
+fz_range_stream_failed(fz_context *ctx, fz_stream *stm, fz_off_t offset, fz_off_t len)
+{
+	fz_range_stream *state = range_state(ctx, stm);
+	fz_off_t start = offset < 0 ? 0 : offset;
+	fz_off_t end = offset + len;
+	int i;
+
+	if (end > state->length)
+		end = state->length;
+	if (start >= end)
+		return;
+
+	LOCK(state);
+	for (i = (int)(start >> RANGE_BLOCK_SHIFT); i <= (int)((end - 1) >> RANGE_BLOCK_SHIFT); i++)
+		state->requested[i] = 0;
+	UNLOCK(state);
+}
+
+/* A stand-in for a web server: fetches are answered from a file stream
+ * straight away. */
+
+typedef struct file_range_s
+{
+	fz_stream *file;
+	fz_stream *stm;
+} file_range;
+
+static void
+fetch_file_range(fz_context *ctx, void *opaque, fz_off_t offset, fz_off_t len)
+{
+	file_range *fr = opaque;
+	unsigned char *data = fz_malloc(ctx, (size_t)len);
+
+	fz_try(ctx)
+	{
+		fz_seek(ctx, fr->file, offset, SEEK_SET);
+		if (fz_read(ctx, fr->file, data, (size_t)len) != (size_t)len)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "short read from ranged file");
+		fz_range_stream_supply(ctx, fr->stm, offset, data, len);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, data);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+drop_file_range(fz_context *ctx, void *opaque)
+{
+	file_range *fr = opaque;
+
+	fz_drop_stream(ctx, fr->file);
+	fz_free(ctx, fr);
+}
+
+fz_stream *
+fz_open_file_ranged(fz_context *ctx, const char *filename)
+{
+	file_range *fr = fz_malloc_struct(ctx, file_range);
+	fz_off_t length = 0;
+
+	fz_try(ctx)
+	{
+		fr->file = fz_open_file(ctx, filename);
+		fz_seek(ctx, fr->file, 0, SEEK_END);
+		length = fz_tell(ctx, fr->file);
+	}
+	fz_catch(ctx)
+	{
+		drop_file_range(ctx, fr);
+		fz_rethrow(ctx);
+	}
+
+	fr->stm = fz_open_range_stream(ctx, length, fetch_file_range, drop_file_range, fr);
+	return fr->stm;
+}
@@ -66,10 +66,15 @@ fz_read_best(fz_context *ctx, fz_stream *stm, size_t initial, int *truncated)
 
 	fz_try(ctx)
 	{
+		size_t avail = stm->wp - stm->rp;
+
 		if (initial < 1024)
 			initial = 1024;
 
-		buf = fz_new_buffer(ctx, initial+1);
+		/* Memory and mapped file streams have everything available
+		 * up front, so we can read it with a single copy rather than
+		 * growing the buffer as we go. */
+		buf = fz_new_buffer(ctx, (avail > initial ? avail : initial) + 1);
 
 		while (1)
 		{
@@ -182,6 +187,17 @@ int fz_stream_meta(fz_context *ctx, fz_stream *stm, int key, int size, void *ptr
 	return stm->meta(ctx, stm, key, size, ptr);
 }
 
+void fz_prefetch_stream(fz_context *ctx, fz_stream *stm, fz_off_t offset, fz_off_t len)
+{
+	fz_off_t range[2];
+
+	if (len <= 0)
+		return;
+	range[0] = offset;
+	range[1] = len;
+	(void)fz_stream_meta(ctx, stm, FZ_STREAM_META_PREFETCH, sizeof range, range);
+}
+
 fz_buffer *
 fz_read_file(fz_context *ctx, const char *filename)
 {
@@ -0,0 +1,271 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+
+/* Hard limit on the size of the worker pool */
+#define MAX_TASK_THREADS 256
+
+#ifdef FZ_THREADS
+
+#if FZ_THREADS == 1
+
+static int
+count_cpus(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+
+#else
+
+static int
+count_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return (int)n;
+#endif
+	return 1;
+}
+
+#endif
+
+typedef struct fz_task_worker_s fz_task_worker;
+typedef struct fz_task_pool_s fz_task_pool;
+
+/*
+	Each worker owns a queue of tasks, held as the half open range
+	[next, end). The owner takes tasks from the front of its range;
+	thieves take the back half of the range, so each thread keeps
+	working on a contiguous run of tasks for as long as possible.
+*/
+struct fz_task_worker_s
+{
+	fz_task_pool *pool;
+	fz_context *ctx;
+	MUTEX mutex;
+	int next, end;
+	int started;
+	THREAD thread;
+};
+
+struct fz_task_pool_s
+{
+	fz_task_fn *fn;
+	void *arg;
+	int count;
+	fz_task_worker *workers;
+	MUTEX mutex;
+	volatile int abort;
+	int errcode;
+	char message[256];
+};
+
+static int
+pop_task(fz_task_worker *me)
+{
+	int task = -1;
+
+	MUTEX_LOCK(me->mutex);
+	if (me->next < me->end)
+		task = me->next++;
+	MUTEX_UNLOCK(me->mutex);
+
+	return task;
+}
+
+static int
+steal_task(fz_task_worker *me)
+{
+	fz_task_pool *pool = me->pool;
+	int start, end;
+
+	for (;;)
+	{
+		fz_task_worker *victim = NULL;
+		int i, best = 0;
+
+		/* Pick the worker with the most work left. Each count is read
+		 * under its owner's lock, but may be stale by the time we act
+		 * on it, so it is checked again below. */
+		for (i = 0; i < pool->count; i++)
+		{
+			fz_task_worker *w = &pool->workers[i];
+			int left;
+			if (w == me)
+				continue;
+			MUTEX_LOCK(w->mutex);
+			left = w->end - w->next;
+			MUTEX_UNLOCK(w->mutex);
+			if (left > best)
+			{
+				best = left;
+				victim = w;
+			}
+		}
+		if (victim == NULL)
+			return -1;
+
+		MUTEX_LOCK(victim->mutex);
+		start = end = victim->end;
+		if (victim->next < victim->end)
+		{
+			start = victim->end - (victim->end - victim->next + 1) / 2;
+			victim->end = start;
+		}
+		MUTEX_UNLOCK(victim->mutex);
+
+		if (start < end)
+			break;
+	}
+
+	/* Our own queue is empty, and nobody else ever adds to it, so
+	 * there is no need to hold two locks at once. */
+	MUTEX_LOCK(me->mutex);
+	me->next = start + 1;
+	me->end = end;
+	MUTEX_UNLOCK(me->mutex);
+
+	return start;
+}
+
+static void
+run_worker(fz_task_worker *me)
+{
+	fz_task_pool *pool = me->pool;
+	fz_context *ctx = me->ctx;
+	int task;
+
+	while (!pool->abort)
+	{
+		task = pop_task(me);
+		if (task < 0)
+			task = steal_task(me);
+		if (task < 0)
+			break;
+
+		fz_try(ctx)
+			pool->fn(ctx, pool->arg, task);
+		fz_catch(ctx)
+		{
+			MUTEX_LOCK(pool->mutex);
+			if (!pool->abort)
+			{
+				pool->abort = 1;
+				pool->errcode = fz_caught(ctx);
+				fz_strlcpy(pool->message, fz_caught_message(ctx), sizeof pool->message);
+			}
+			MUTEX_UNLOCK(pool->mutex);
+		}
+	}
+}
+
+static THREAD_RETURN_TYPE
+worker_thread(void *arg)
+{
+	run_worker((fz_task_worker *)arg);
+	THREAD_RETURN();
+}
+
+int
+fz_available_threads(fz_context *ctx)
+{
+	int n;
+
+	if (ctx == NULL || ctx->locks == &fz_locks_default)
+		return 1;
+	n = count_cpus();
+	if (n > MAX_TASK_THREADS)
+		n = MAX_TASK_THREADS;
+	return n < 1 ? 1 : n;
+}
+
+void
+fz_run_tasks(fz_context *ctx, int nthreads, int ntasks, fz_task_fn *fn, void *arg)
+{
+	fz_task_pool pool = { 0 };
+	int i, n;
+
+	if (ntasks <= 0)
+		return;
+
+	if (nthreads <= 0)
+		nthreads = fz_available_threads(ctx);
+	if (nthreads > MAX_TASK_THREADS)
+		nthreads = MAX_TASK_THREADS;
+	if (nthreads > ntasks)
+		nthreads = ntasks;
+
+	if (nthreads <= 1 || ctx->locks == &fz_locks_default)
+	{
+		for (i = 0; i < ntasks; i++)
+			fn(ctx, arg, i);
+		return;
+	}
+
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.workers = fz_calloc(ctx, nthreads, sizeof(fz_task_worker));
+
+	/* Worker 0 is the calling thread. Stop adding workers as soon as
+	 * a context cannot be cloned; we just end up with fewer threads. */
+	pool.workers[0].ctx = ctx;
+	for (n = 1; n < nthreads; n++)
+	{
+		pool.workers[n].ctx = fz_clone_context(ctx);
+		if (pool.workers[n].ctx == NULL)
+			break;
+	}
+	pool.count = n;
+
+	MUTEX_INIT(pool.mutex);
+	for (i = 0; i < n; i++)
+	{
+		fz_task_worker *w = &pool.workers[i];
+		w->pool = &pool;
+		w->next = (int)((int64_t)ntasks * i / n);
+		w->end = (int)((int64_t)ntasks * (i + 1) / n);
+		MUTEX_INIT(w->mutex);
+	}
+
+	/* If a thread fails to start, its tasks are simply stolen by the
+	 * others. */
+	for (i = 1; i < n; i++)
+		pool.workers[i].started = THREAD_INIT(pool.workers[i].thread, worker_thread, &pool.workers[i]);
+
+	run_worker(&pool.workers[0]);
+
+	for (i = 1; i < n; i++)
+	{
+		if (pool.workers[i].started)
+			THREAD_FIN(pool.workers[i].thread);
+		fz_drop_context(pool.workers[i].ctx);
+	}
+	for (i = 0; i < n; i++)
+		MUTEX_FIN(pool.workers[i].mutex);
+	MUTEX_FIN(pool.mutex);
+	fz_free(ctx, pool.workers);
+
+	if (pool.errcode)
+		fz_throw(ctx, pool.errcode, "%s", pool.message);
+}
+
+#else
+
+int
+fz_available_threads(fz_context *ctx)
+{
+	return 1;
+}
+
+void
+fz_run_tasks(fz_context *ctx, int nthreads, int ntasks, fz_task_fn *fn, void *arg)
+{
+	int i;
+
+	for (i = 0; i < ntasks; i++)
+		fn(ctx, arg, i);
+}
+
+#endif
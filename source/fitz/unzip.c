@@ -483,7 +483,7 @@ fz_open_archive(fz_context *ctx, const char *filename)
 	fz_stream *file;
 	fz_archive *zip;
 
-	file = fz_open_file(ctx, filename);
+	file = fz_open_file_mapped(ctx, filename);
 
 	fz_try(ctx)
 		zip = fz_open_archive_with_stream(ctx, file);
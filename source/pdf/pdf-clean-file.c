@@ -232,6 +232,8 @@ static void retainpages(fz_context *ctx, globals *glo, int argc, char **argv)
 
 	/* Force the next call to pdf_count_pages to recount */
 	glo->doc->page_count = 0;
+	pdf_drop_page_map(ctx, glo->doc);
+	pdf_invalidate_xref_cache(ctx, glo->doc);
 
 	pagecount = pdf_count_pages(ctx, doc);
 	page_object_nums = fz_calloc(ctx, pagecount, sizeof(*page_object_nums));
@@ -775,12 +775,9 @@ pdf_process_end(fz_context *ctx, pdf_processor *proc, pdf_csi *csi)
 #define C(a,b,c) (a | b << 8 | c << 16)
 
 static int
-pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm, char *word)
+pdf_keyword_key(const char *word)
 {
-	float *s = csi->stack;
-	int key;
-
-	key = word[0];
+	int key = word[0];
 	if (word[1])
 	{
 		key |= word[1] << 8;
@@ -791,6 +788,13 @@ pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_strea
 				key = 0;
 		}
 	}
+	return key;
+}
+
+static int
+pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, int key, const char *word, fz_image *img)
+{
+	float *s = csi->stack;
 
 	switch (key)
 	{
@@ -948,18 +952,8 @@ pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_strea
 
 	/* shadings, images, xobjects */
 	case B('B','I'):
-		{
-			fz_image *img = parse_inline_image(ctx, csi, stm);
-			fz_try(ctx)
-			{
-				if (proc->op_BI)
-					proc->op_BI(ctx, proc, img);
-			}
-			fz_always(ctx)
-				fz_drop_image(ctx, img);
-			fz_catch(ctx)
-				fz_rethrow(ctx);
-		}
+		if (proc->op_BI && img)
+			proc->op_BI(ctx, proc, img);
 		break;
 
 	case B('s','h'):
@@ -1000,28 +994,276 @@ pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_strea
 	return 0;
 }
 
+/* Whether pdf_process_keyword knows the operator. Keep in step with it. */
+static int
+pdf_is_known_keyword(int key)
+{
+	switch (key)
+	{
+	case A('w'): case A('j'): case A('J'): case A('M'): case A('d'):
+	case B('r','i'): case A('i'): case B('g','s'):
+	case A('q'): case A('Q'): case B('c','m'):
+	case A('m'): case A('l'): case A('c'): case A('v'): case A('y'):
+	case A('h'): case B('r','e'):
+	case A('S'): case A('s'): case A('F'): case A('f'): case B('f','*'):
+	case A('B'): case B('B','*'): case A('b'): case B('b','*'): case A('n'):
+	case A('W'): case B('W','*'):
+	case B('B','T'): case B('E','T'):
+	case B('T','c'): case B('T','w'): case B('T','z'): case B('T','L'):
+	case B('T','r'): case B('T','s'): case B('T','f'):
+	case B('T','d'): case B('T','D'): case B('T','m'): case B('T','*'):
+	case B('T','J'): case B('T','j'): case A('\''): case A('"'):
+	case B('d','0'): case B('d','1'):
+	case B('C','S'): case B('c','s'): case B('S','C'): case B('s','c'):
+	case C('S','C','N'): case C('s','c','n'):
+	case A('G'): case A('g'): case B('R','G'): case B('r','g'): case A('K'): case A('k'):
+	case B('B','I'): case B('s','h'): case B('D','o'):
+	case B('M','P'): case B('D','P'): case C('B','M','C'): case C('B','D','C'): case C('E','M','C'):
+	case B('B','X'): case B('E','X'):
+		return 1;
+	}
+	return 0;
+}
+
+/*
+	Content streams are not interpreted straight from the lexer. They are
+	first compiled into an op list, a flat array of records each holding
+	an operator and the operands collected for it, which is then run
+	against the processor. Once a stream has been compiled, running it
+	again costs no inflating, lexing or number parsing; so the op list
+	for a page or form is kept in the store, keyed by the contents
+	object, and reused by later runs (tiled patterns, repeated forms,
+	re-rendering at another zoom level).
+
+	An op list remembers the xref entries of the streams it was compiled
+	from, and is only reused if they have not been updated since.
+
+	Inline images are loaded as the stream is compiled, using the
+	resources it was processed with; op lists holding any are only
+	reused with the same resources.
+
+	Very long streams are compiled and run a batch at a time, so as not
+	to hold the whole of one in memory, and are not kept. Compiling stops
+	where running would, at an unknown operator outside BX/EX or when
+	the cookie asks us to abort.
+*/
+
+enum
+{
+	PDF_OP_LIST_BATCH = 4 << 20, /* bytes of records */
+
+	/* Not operators; what the lexer found instead. */
+	PDF_OP_SYNTAX_ERROR = -1,
+
+	/* Record flags */
+	PDF_OP_OBJ = 1,
+	PDF_OP_IMAGE = 2,
+	PDF_OP_WORD = 4 /* name holds the keyword, which was too long for key */
+};
+
+typedef struct pdf_op_s pdf_op;
+typedef struct pdf_op_part_s pdf_op_part;
+typedef struct pdf_op_list_s pdf_op_list;
+
+/* Followed by top floats, name_len bytes of name, and string_len bytes
+ * of string, padded to a multiple of 4 bytes. */
+struct pdf_op_s
+{
+	int key;
+	unsigned char top;
+	unsigned char flags;
+	unsigned short name_len;
+	unsigned short string_len;
+	unsigned short pad;
+	int ref; /* index into objs or images */
+};
+
+struct pdf_op_part_s
+{
+	int num;
+	fz_off_t stm_ofs;
+	fz_buffer *stm_buf;
+};
+
+struct pdf_op_list_s
+{
+	fz_storable storable;
+	pdf_document *doc;
+	pdf_obj *rdb; /* that inline images were loaded with, or NULL */
+	int complete;
+
+	int len, cap;
+	unsigned char *ops;
+
+	int num_objs, max_objs;
+	pdf_obj **objs;
+
+	int num_images, max_images;
+	fz_image **images;
+
+	int num_parts;
+	pdf_op_part *parts;
+};
+
 static void
-pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm)
+pdf_clear_op_list(fz_context *ctx, pdf_op_list *list)
+{
+	int i;
+
+	for (i = 0; i < list->num_objs; i++)
+		pdf_drop_obj(ctx, list->objs[i]);
+	for (i = 0; i < list->num_images; i++)
+		fz_drop_image(ctx, list->images[i]);
+	list->num_objs = 0;
+	list->num_images = 0;
+	list->len = 0;
+}
+
+static void
+pdf_drop_op_list_imp(fz_context *ctx, fz_storable *list_)
+{
+	pdf_op_list *list = (pdf_op_list *)list_;
+	int i;
+
+	pdf_clear_op_list(ctx, list);
+	for (i = 0; i < list->num_parts; i++)
+		fz_drop_buffer(ctx, list->parts[i].stm_buf);
+	pdf_drop_obj(ctx, list->rdb);
+	fz_free(ctx, list->parts);
+	fz_free(ctx, list->ops);
+	fz_free(ctx, list->objs);
+	fz_free(ctx, list->images);
+	fz_free(ctx, list);
+}
+
+static void
+pdf_drop_op_list(fz_context *ctx, pdf_op_list *list)
+{
+	if (list)
+		fz_drop_storable(ctx, &list->storable);
+}
+
+static pdf_op_list *
+pdf_new_op_list(fz_context *ctx, pdf_document *doc)
+{
+	pdf_op_list *list = fz_malloc_struct(ctx, pdf_op_list);
+	FZ_INIT_STORABLE(list, 1, pdf_drop_op_list_imp);
+	list->doc = doc;
+	list->complete = 1;
+	return list;
+}
+
+static size_t
+pdf_op_list_size(fz_context *ctx, pdf_op_list *list)
+{
+	size_t size = sizeof(*list) + list->cap + list->max_objs * sizeof(pdf_obj *);
+	int i;
+
+	/* Only count the inline images that nothing else holds; those that
+	 * are also held elsewhere are accounted for there. */
+	for (i = 0; i < list->num_images; i++)
+		if (list->images[i]->storable.refs == 1)
+			size += fz_image_size(ctx, list->images[i]);
+
+	return size;
+}
+
+/* Append the operator and the operands collected in csi to the list. */
+static void
+pdf_add_op(fz_context *ctx, pdf_op_list *list, pdf_csi *csi, int key, const char *word, fz_image *img)
+{
+	pdf_op op;
+	int name_len = strlen(csi->name);
+	int string_len = csi->string_len;
+	int size;
+	unsigned char *p;
+
+	op.key = key;
+	op.top = csi->top;
+	op.flags = 0;
+	op.pad = 0;
+	op.ref = 0;
+
+	if (key == 0)
+	{
+		/* Unknown keyword; we need it for the warning */
+		op.flags |= PDF_OP_WORD;
+		name_len = fz_mini(strlen(word), sizeof(csi->name) - 1);
+		string_len = 0;
+	}
+	op.name_len = name_len;
+	op.string_len = string_len;
+
+	if (csi->obj)
+	{
+		if (list->num_objs == list->max_objs)
+		{
+			int n = list->max_objs ? list->max_objs * 2 : 32;
+			list->objs = fz_resize_array(ctx, list->objs, n, sizeof(*list->objs));
+			list->max_objs = n;
+		}
+		op.flags |= PDF_OP_OBJ;
+		op.ref = list->num_objs;
+		list->objs[list->num_objs++] = pdf_keep_obj(ctx, csi->obj);
+	}
+	else if (img)
+	{
+		if (list->num_images == list->max_images)
+		{
+			int n = list->max_images ? list->max_images * 2 : 4;
+			list->images = fz_resize_array(ctx, list->images, n, sizeof(*list->images));
+			list->max_images = n;
+		}
+		op.flags |= PDF_OP_IMAGE;
+		op.ref = list->num_images;
+		list->images[list->num_images++] = fz_keep_image(ctx, img);
+	}
+
+	size = sizeof op + op.top * sizeof(float) + name_len + string_len;
+	size = (size + 3) & ~3;
+	if (list->len + size > list->cap)
+	{
+		int n = list->cap ? list->cap : 1024;
+		while (n < list->len + size)
+			n *= 2;
+		list->ops = fz_resize_array(ctx, list->ops, n, 1);
+		list->cap = n;
+	}
+
+	p = list->ops + list->len;
+	memcpy(p, &op, sizeof op);
+	p += sizeof op;
+	memcpy(p, csi->stack, op.top * sizeof(float));
+	p += op.top * sizeof(float);
+	memcpy(p, key == 0 ? word : csi->name, name_len);
+	p += name_len;
+	memcpy(p, csi->string, string_len);
+	list->len += size;
+}
+
+/*
+	Lex the stream into op records, until it ends or the list is full.
+	Returns 1 at the end of the stream, or at an operator that will stop
+	the run (an unknown one outside BX/EX), after which there is no point
+	in reading further. Whether we are in a text object (which changes
+	how arrays are read) and how deep in BX/EX we are carry over from
+	one batch to the next in *in_text and *xbalance.
+*/
+static int
+pdf_compile_stream(fz_context *ctx, pdf_op_list *list, pdf_csi *csi, fz_stream *stm, int *in_text, int *xbalance)
 {
 	pdf_document *doc = csi->doc;
 	pdf_lexbuf *buf = csi->buf;
 	fz_cookie *cookie = csi->cookie;
+	fz_image *img = NULL;
 
 	pdf_token tok = PDF_TOK_ERROR;
 	int in_text_array = 0;
-	int ignoring_errors = 0;
-
-	/* make sure we have a clean slate if we come here from flush_text */
-	pdf_clear_stack(ctx, csi);
+	int key;
 
 	fz_var(in_text_array);
 	fz_var(tok);
-
-	if (cookie)
-	{
-		cookie->progress_max = -1;
-		cookie->progress = 0;
-	}
+	fz_var(img);
 
 	do
 	{
@@ -1029,15 +1271,11 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 		{
 			do
 			{
-				/* Check the cookie */
-				if (cookie)
+				if (cookie && cookie->abort)
 				{
-					if (cookie->abort)
-					{
-						tok = PDF_TOK_EOF;
-						break;
-					}
-					cookie->progress++;
+					list->complete = 0;
+					tok = PDF_TOK_EOF;
+					break;
 				}
 
 				tok = pdf_lex(ctx, stm, buf);
@@ -1069,10 +1307,14 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 								pdf_obj *o = pdf_array_get(ctx, csi->obj, l-1);
 								if (pdf_is_number(ctx, o))
 								{
-									csi->stack[0] = pdf_to_real(ctx, o);
+									/* Record the operator on its own, leaving
+									 * the array we are building alone. */
+									pdf_csi tw = { 0 };
+									tw.top = 1;
+									tw.stack[0] = pdf_to_real(ctx, o);
 									pdf_array_delete(ctx, csi->obj, l-1);
-									if (pdf_process_keyword(ctx, proc, csi, stm, buf->scratch) == 0)
-										break;
+									pdf_add_op(ctx, list, &tw, pdf_keyword_key(buf->scratch), buf->scratch, NULL);
+									break;
 								}
 							}
 						}
@@ -1094,7 +1336,7 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 						pdf_drop_obj(ctx, csi->obj);
 						csi->obj = NULL;
 					}
-					if (csi->in_text)
+					if (*in_text)
 					{
 						in_text_array = 1;
 						csi->obj = pdf_new_array(ctx, doc, 4);
@@ -1161,18 +1403,154 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 					break;
 
 				case PDF_TOK_KEYWORD:
-					if (pdf_process_keyword(ctx, proc, csi, stm, buf->scratch))
+					key = pdf_keyword_key(buf->scratch);
+					switch (key)
 					{
-						tok = PDF_TOK_EOF;
+					case B('B','T'): *in_text = 1; break;
+					case B('E','T'): *in_text = 0; break;
+					case B('B','X'): ++*xbalance; break;
+					case B('E','X'): --*xbalance; break;
+					case B('B','I'):
+						img = parse_inline_image(ctx, csi, stm);
+						if (!list->rdb)
+							list->rdb = pdf_keep_obj(ctx, csi->rdb);
+						break;
 					}
+					pdf_add_op(ctx, list, csi, key, buf->scratch, img);
+					fz_drop_image(ctx, img);
+					img = NULL;
 					pdf_clear_stack(ctx, csi);
+					if (*xbalance == 0 && !pdf_is_known_keyword(key))
+						tok = PDF_TOK_EOF;
 					break;
 
 				default:
 					fz_throw(ctx, FZ_ERROR_GENERIC, "syntax error in content stream");
 				}
 			}
-			while (tok != PDF_TOK_EOF);
+			while (tok != PDF_TOK_EOF && (in_text_array || list->len < PDF_OP_LIST_BATCH));
+		}
+		fz_always(ctx)
+		{
+			fz_drop_image(ctx, img);
+			img = NULL;
+			pdf_clear_stack(ctx, csi);
+		}
+		fz_catch(ctx)
+		{
+			if (fz_caught(ctx) == FZ_ERROR_TRYLATER)
+			{
+				if (!cookie || !cookie->incomplete_ok)
+					fz_rethrow(ctx);
+				cookie->incomplete++;
+				list->complete = 0;
+			}
+			else
+			{
+				/* Leave the complaining to whoever runs the list */
+				csi->top = 0;
+				pdf_add_op(ctx, list, csi, PDF_OP_SYNTAX_ERROR, "", NULL);
+			}
+			/* If we do catch an error, then reset ourselves to a
+			 * base lexing state */
+			in_text_array = 0;
+		}
+	}
+	while (tok != PDF_TOK_EOF && list->len < PDF_OP_LIST_BATCH);
+
+	return tok == PDF_TOK_EOF;
+}
+
+/*
+	Run the op records against the processor. Returns 1 if processing
+	of the stream should stop.
+*/
+static int
+pdf_run_op_list(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, pdf_op_list *list, int *ignoring_errors)
+{
+	fz_cookie *cookie = csi->cookie;
+	unsigned char *p = list->ops;
+	unsigned char *end = list->ops + list->len;
+	int stop = 0;
+
+	fz_var(p);
+	fz_var(stop);
+
+	while (p < end && !stop)
+	{
+		fz_try(ctx)
+		{
+			while (p < end)
+			{
+				pdf_op op;
+				char word[4];
+				const char *w = word;
+				fz_image *img = NULL;
+				int size;
+
+				/* Check the cookie */
+				if (cookie)
+				{
+					if (cookie->abort)
+					{
+						stop = 1;
+						break;
+					}
+					cookie->progress++;
+				}
+
+				memcpy(&op, p, sizeof op);
+				size = sizeof op + op.top * sizeof(float) + op.name_len + op.string_len;
+				p += sizeof op;
+
+				memcpy(csi->stack, p, op.top * sizeof(float));
+				csi->top = op.top;
+				p += op.top * sizeof(float);
+				if (op.flags & PDF_OP_WORD)
+				{
+					memcpy(csi->name, p, op.name_len);
+					csi->name[op.name_len] = 0;
+					w = csi->name;
+				}
+				else
+				{
+					memcpy(csi->name, p, op.name_len);
+					csi->name[op.name_len] = 0;
+					word[0] = op.key;
+					word[1] = op.key >> 8;
+					word[2] = op.key >> 16;
+					word[3] = 0;
+				}
+				p += op.name_len;
+				memcpy(csi->string, p, op.string_len);
+				csi->string_len = op.string_len;
+				p += ((size + 3) & ~3) - size + op.string_len;
+
+				if (op.flags & PDF_OP_OBJ)
+					csi->obj = pdf_keep_obj(ctx, list->objs[op.ref]);
+				else if (op.flags & PDF_OP_IMAGE)
+					img = list->images[op.ref];
+
+				/* The lexer complained when the list was made */
+				if (op.key == PDF_OP_SYNTAX_ERROR)
+				{
+					if (cookie)
+						cookie->errors++;
+					if (!*ignoring_errors)
+					{
+						fz_warn(ctx, "Ignoring errors during rendering");
+						*ignoring_errors = 1;
+					}
+					continue;
+				}
+
+				if (pdf_process_keyword(ctx, proc, csi, op.key, w, img))
+				{
+					stop = 1;
+					break;
+				}
+				pdf_clear_stack(ctx, csi);
+			}
 		}
 		fz_always(ctx)
 		{
@@ -1201,17 +1579,169 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 			{
 				cookie->errors++;
 			}
-			if (!ignoring_errors)
+			if (!*ignoring_errors)
 			{
 				fz_warn(ctx, "Ignoring errors during rendering");
-				ignoring_errors = 1;
+				*ignoring_errors = 1;
+			}
+		}
+	}
+
+	return stop;
+}
+
+/*
+	Compile and run the stream a batch at a time. If the whole stream
+	went into one batch, returns the op list (for the caller to keep);
+	otherwise NULL.
+*/
+static pdf_op_list *
+pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm)
+{
+	fz_cookie *cookie = csi->cookie;
+	pdf_op_list *list;
+	int in_text = 0;
+	int xbalance = csi->xbalance;
+	int ignoring_errors = 0;
+	int done;
+
+	/* make sure we have a clean slate if we come here from flush_text */
+	pdf_clear_stack(ctx, csi);
+
+	if (cookie)
+	{
+		cookie->progress_max = -1;
+		cookie->progress = 0;
+	}
+
+	list = pdf_new_op_list(ctx, csi->doc);
+	fz_try(ctx)
+	{
+		do
+		{
+			done = pdf_compile_stream(ctx, list, csi, stm, &in_text, &xbalance);
+			if (pdf_run_op_list(ctx, proc, csi, list, &ignoring_errors))
+				break;
+			if (!done)
+			{
+				list->complete = 0;
+				pdf_clear_op_list(ctx, list);
 			}
-			/* If we do catch an error, then reset ourselves to a
-			 * base lexing state */
-			in_text_array = 0;
 		}
+		while (!done);
+	}
+	fz_catch(ctx)
+	{
+		pdf_drop_op_list(ctx, list);
+		fz_rethrow(ctx);
 	}
-	while (tok != PDF_TOK_EOF);
+
+	if (!done || !list->complete)
+	{
+		pdf_drop_op_list(ctx, list);
+		return NULL;
+	}
+	return list;
+}
+
+static void
+pdf_process_op_list(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, pdf_op_list *list)
+{
+	fz_cookie *cookie = csi->cookie;
+	int ignoring_errors = 0;
+
+	if (cookie)
+	{
+		cookie->progress_max = -1;
+		cookie->progress = 0;
+	}
+
+	pdf_run_op_list(ctx, proc, csi, list, &ignoring_errors);
+}
+
+/*
+	Note the xref entries of the streams making up the contents, so that
+	we can tell if any are changed after the op list was made. Returns 0
+	if the contents are not something we can keep an op list for.
+*/
+static int
+pdf_get_op_list_parts(fz_context *ctx, pdf_document *doc, pdf_obj *stmobj, pdf_op_part **partsp)
+{
+	pdf_op_part *parts;
+	int i, n;
+
+	n = pdf_is_array(ctx, stmobj) ? pdf_array_len(ctx, stmobj) : 1;
+	if (n == 0)
+		return 0;
+
+	parts = fz_calloc(ctx, n, sizeof(*parts));
+	for (i = 0; i < n; i++)
+	{
+		pdf_obj *obj = pdf_is_array(ctx, stmobj) ? pdf_array_get(ctx, stmobj, i) : stmobj;
+		pdf_xref_entry *entry;
+		int num = pdf_to_num(ctx, obj);
+
+		if (!pdf_is_indirect(ctx, obj) || num <= 0 || num >= pdf_xref_len(ctx, doc))
+		{
+			fz_free(ctx, parts);
+			return 0;
+		}
+		entry = pdf_get_xref_entry(ctx, doc, num);
+		parts[i].num = num;
+		parts[i].stm_ofs = entry->stm_ofs;
+		parts[i].stm_buf = entry->stm_buf;
+	}
+
+	*partsp = parts;
+	return n;
+}
+
+static int
+pdf_op_list_is_current(fz_context *ctx, pdf_op_list *list, pdf_document *doc, pdf_obj *rdb, pdf_obj *stmobj)
+{
+	pdf_op_part *parts;
+	int i, n, current;
+
+	if (list->doc != doc || (list->rdb && list->rdb != rdb))
+		return 0;
+
+	n = pdf_get_op_list_parts(ctx, doc, stmobj, &parts);
+	current = (n == list->num_parts);
+	for (i = 0; current && i < n; i++)
+		current = (parts[i].num == list->parts[i].num &&
+			parts[i].stm_ofs == list->parts[i].stm_ofs &&
+			parts[i].stm_buf == list->parts[i].stm_buf);
+	if (n > 0)
+		fz_free(ctx, parts);
+
+	return current;
+}
+
+static void
+pdf_store_op_list(fz_context *ctx, pdf_op_list *list, pdf_document *doc, pdf_obj *stmobj)
+{
+	int i;
+
+	list->num_parts = pdf_get_op_list_parts(ctx, doc, stmobj, &list->parts);
+	if (list->num_parts == 0)
+		return;
+
+	/* Hold on to the buffers, so they cannot be replaced by new ones
+	 * at the same address. */
+	for (i = 0; i < list->num_parts; i++)
+		fz_keep_buffer(ctx, list->parts[i].stm_buf);
+
+	if (list->len < list->cap)
+	{
+		unsigned char *ops = fz_resize_array_no_throw(ctx, list->ops, list->len ? list->len : 1, 1);
+		if (ops)
+		{
+			list->ops = ops;
+			list->cap = list->len;
+		}
+	}
+
+	pdf_store_item(ctx, stmobj, list, pdf_op_list_size(ctx, list));
 }
 
 void
@@ -1220,23 +1750,44 @@ pdf_process_contents(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pd
 	pdf_csi csi;
 	pdf_lexbuf buf;
 	fz_stream *stm = NULL;
+	pdf_op_list *list = NULL;
+	pdf_op_list *found;
 
 	if (!stmobj)
 		return;
 
 	fz_var(stm);
+	fz_var(list);
 
 	pdf_lexbuf_init(ctx, &buf, PDF_LEXBUF_SMALL);
 	pdf_init_csi(ctx, &csi, doc, rdb, &buf, cookie);
 
 	fz_try(ctx)
 	{
-		stm = pdf_open_contents_stream(ctx, doc, stmobj);
-		pdf_process_stream(ctx, proc, &csi, stm);
+		found = pdf_find_item(ctx, pdf_drop_op_list_imp, stmobj);
+		if (found && pdf_op_list_is_current(ctx, found, doc, rdb, stmobj))
+		{
+			list = found;
+			pdf_process_op_list(ctx, proc, &csi, list);
+		}
+		else
+		{
+			if (found)
+			{
+				pdf_drop_op_list(ctx, found);
+				pdf_remove_item(ctx, pdf_drop_op_list_imp, stmobj);
+			}
+
+			stm = pdf_open_contents_stream(ctx, doc, stmobj);
+			list = pdf_process_stream(ctx, proc, &csi, stm);
+			if (list)
+				pdf_store_op_list(ctx, list, doc, stmobj);
+		}
 		pdf_process_end(ctx, proc, &csi);
 	}
 	fz_always(ctx)
 	{
+		pdf_drop_op_list(ctx, list);
 		fz_drop_stream(ctx, stm);
 		pdf_clear_stack(ctx, &csi);
 		pdf_lexbuf_fin(ctx, &buf);
@@ -1301,7 +1852,7 @@ pdf_process_glyph(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pdf_o
 	fz_try(ctx)
 	{
 		stm = fz_open_buffer(ctx, contents);
-		pdf_process_stream(ctx, proc, &csi, stm);
+		pdf_drop_op_list(ctx, pdf_process_stream(ctx, proc, &csi, stm));
 		pdf_process_end(ctx, proc, &csi);
 	}
 	fz_always(ctx)
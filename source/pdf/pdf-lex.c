@@ -35,6 +35,191 @@ static inline int iswhite(int ch)
 		ch == '\040';
 }
 
+/*
+	Fast paths.
+
+	Most tokens lie wholly within the data already buffered in the
+	stream, so rather than fetching them a byte at a time with
+	fz_read_byte, we scan the buffer directly for the end of the token,
+	16 bytes at a time with SSE2 or NEON where we can. A token is only
+	taken from the buffer if we can see where it ends; if it runs up to
+	the end of the buffer we fall back to the byte-wise lexer, which will
+	refill the buffer as needed. Either way the results are identical.
+*/
+
+enum { LEX_WHITE = 1, LEX_DELIM = 2 };
+
+static const unsigned char lex_class[256] = {
+	1,0,0,0,0,0,0,0,0,1,1,0,1,1,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	1,0,0,0,0,2,0,0,2,2,0,0,0,0,0,2,
+	0,0,0,0,0,0,0,0,0,0,0,0,2,0,2,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,2,0,2,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,2,0,2,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+};
+
+#if FZ_ENABLE_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LEX_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define LEX_NEON
+#include <arm_neon.h>
+#endif
+#endif /* FZ_ENABLE_SIMD */
+
+#if defined(LEX_SSE2)
+
+/* Bit n of a mask describes byte n of a block. */
+typedef unsigned int lex_mask;
+#define LEX_MASK_ALL 0xffff
+#define LEX_MASK_SHIFT 0
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline int first_bit(lex_mask mask)
+{
+	unsigned long i;
+	_BitScanForward(&i, mask);
+	return (int)i;
+}
+#else
+#define first_bit(mask) __builtin_ctz(mask)
+#endif
+
+/* Set a bit for every byte of the block that is white space. */
+static inline lex_mask
+white_mask(const unsigned char *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i m = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0)), _mm_cmpeq_epi8(v, _mm_set1_epi8(32))),
+		_mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(9)), _mm_cmpeq_epi8(v, _mm_set1_epi8(10))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(12)), _mm_cmpeq_epi8(v, _mm_set1_epi8(13)))));
+	return (lex_mask)_mm_movemask_epi8(m);
+}
+
+/* Set a bit for every byte of the block that may be white space or a
+ * delimiter. We test for white space as any byte <= 32, so other
+ * control characters give false hits, which the caller must check for.
+ * The delimiters come in pairs that differ by a single bit: ( and ),
+ * < and >, [ and {, ] and }. */
+static inline lex_mask
+stop_mask(const unsigned char *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i b = _mm_and_si128(v, _mm_set1_epi8((char)0xdf));
+	__m128i m = _mm_or_si128(
+		_mm_or_si128(
+			_mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(32)), _mm_set1_epi8(32)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), _mm_cmpeq_epi8(v, _mm_set1_epi8('%')))),
+		_mm_or_si128(
+			_mm_or_si128(
+				_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xfe)), _mm_set1_epi8('(')),
+				_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xfd)), _mm_set1_epi8('<'))),
+			_mm_or_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8('[')), _mm_cmpeq_epi8(b, _mm_set1_epi8(']')))));
+	return (lex_mask)_mm_movemask_epi8(m);
+}
+
+#elif defined(LEX_NEON)
+
+/* NEON has no movemask; we narrow each byte of a comparison to a
+ * nibble, giving 4 bits of the mask per byte of the block. */
+typedef uint64_t lex_mask;
+#define LEX_MASK_ALL (~(uint64_t)0)
+#define LEX_MASK_SHIFT 2
+#define first_bit(mask) __builtin_ctzll(mask)
+
+static inline lex_mask
+neon_mask(uint8x16_t m)
+{
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+static inline lex_mask
+white_mask(const unsigned char *p)
+{
+	uint8x16_t v = vld1q_u8(p);
+	uint8x16_t m = vorrq_u8(
+		vorrq_u8(vceqq_u8(v, vdupq_n_u8(0)), vceqq_u8(v, vdupq_n_u8(32))),
+		vorrq_u8(
+			vorrq_u8(vceqq_u8(v, vdupq_n_u8(9)), vceqq_u8(v, vdupq_n_u8(10))),
+			vorrq_u8(vceqq_u8(v, vdupq_n_u8(12)), vceqq_u8(v, vdupq_n_u8(13)))));
+	return neon_mask(m);
+}
+
+static inline lex_mask
+stop_mask(const unsigned char *p)
+{
+	uint8x16_t v = vld1q_u8(p);
+	uint8x16_t b = vandq_u8(v, vdupq_n_u8(0xdf));
+	uint8x16_t m = vorrq_u8(
+		vorrq_u8(
+			vcleq_u8(v, vdupq_n_u8(32)),
+			vorrq_u8(vceqq_u8(v, vdupq_n_u8('/')), vceqq_u8(v, vdupq_n_u8('%')))),
+		vorrq_u8(
+			vorrq_u8(
+				vceqq_u8(vandq_u8(v, vdupq_n_u8(0xfe)), vdupq_n_u8('(')),
+				vceqq_u8(vandq_u8(v, vdupq_n_u8(0xfd)), vdupq_n_u8('<'))),
+			vorrq_u8(vceqq_u8(b, vdupq_n_u8('[')), vceqq_u8(b, vdupq_n_u8(']')))));
+	return neon_mask(m);
+}
+
+#endif
+
+/* Return the first byte in [p,e) that is not white space, or e. */
+static inline const unsigned char *
+skip_white(const unsigned char *p, const unsigned char *e)
+{
+#if defined(LEX_SSE2) || defined(LEX_NEON)
+	while (e - p >= 16)
+	{
+		lex_mask m = ~white_mask(p) & LEX_MASK_ALL;
+		if (m)
+			return p + (first_bit(m) >> LEX_MASK_SHIFT);
+		p += 16;
+	}
+#endif
+	while (p < e && lex_class[*p] == LEX_WHITE)
+		p++;
+	return p;
+}
+
+/* Return the first white space or delimiter in [p,e), or e. */
+static inline const unsigned char *
+skip_regular(const unsigned char *p, const unsigned char *e)
+{
+#if defined(LEX_SSE2) || defined(LEX_NEON)
+	while (e - p >= 16)
+	{
+		lex_mask m = stop_mask(p);
+		if (m)
+		{
+			p += first_bit(m) >> LEX_MASK_SHIFT;
+			if (lex_class[*p])
+				return p;
+			p++; /* a control character; carry on */
+		}
+		else
+			p += 16;
+	}
+#endif
+	while (p < e && !lex_class[*p])
+		p++;
+	return p;
+}
+
 static inline int unhex(int ch)
 {
 	if (ch >= '0' && ch <= '9') return ch - '0';
@@ -47,6 +232,9 @@ static void
 lex_white(fz_context *ctx, fz_stream *f)
 {
 	int c;
+	f->rp = (unsigned char *)skip_white(f->rp, f->wp);
+	if (f->rp < f->wp)
+		return;
 	do {
 		c = fz_read_byte(ctx, f);
 	} while ((c <= 32) && (iswhite(c)));
@@ -110,6 +298,55 @@ static float acrobat_compatible_atof(char *s)
 	}
 }
 
+/* Fast strtof for the plain [-+]ddd.ddd form in which nearly every real
+ * number in a PDF file is written. With at most 9 significant digits and
+ * 12 decimal places, the mantissa and 10^n are exact in a double and the
+ * quotient is correctly rounded; since the odd part of the divisor (5^n)
+ * is less than 2^28 the rounding to float cannot go astray either. In
+ * that range fz_strtof is correctly rounded too, so we get exactly the
+ * answer fz_atof would give. Anything else we leave to fz_atof. */
+static float fast_atof(char *s)
+{
+	static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12 };
+	char *p = s;
+	int m = 0;
+	int digits = 0; /* significant digits */
+	int any = 0;
+	int frac = -1;
+	int neg = 0;
+	double d;
+
+	if (*p == '-')
+		neg = 1, ++p;
+	else if (*p == '+')
+		++p;
+
+	for (;; ++p)
+	{
+		if (*p >= '0' && *p <= '9')
+		{
+			any = 1;
+			if (m || *p > '0')
+			{
+				if (++digits > 9)
+					return fz_atof(s);
+				m = m * 10 + (*p - '0');
+			}
+			if (frac >= 0)
+				++frac;
+		}
+		else if (*p == '.' && frac < 0)
+			frac = 0;
+		else
+			break;
+	}
+	if (*p || !any || frac > 12)
+		return fz_atof(s);
+
+	d = frac > 0 ? m / pow10[frac] : m;
+	return (float)(neg ? -d : d);
+}
+
 /* Fast but inaccurate atoi. */
 static int fast_atoi(char *s)
 {
@@ -143,9 +380,28 @@ lex_number(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf, int c)
 	char *e = buf->scratch + buf->size - 1; /* leave space for zero terminator */
 	char *isreal = (c == '.' ? s : NULL);
 	int neg = (c == '-');
+	const unsigned char *end = skip_regular(f->rp, f->wp);
 
 	*s++ = c;
 
+	/* If we can see the end of the number in the buffer, take it from
+	 * there in one go. */
+	if (end < f->wp && end - f->rp < e - s)
+	{
+		const unsigned char *p = f->rp;
+		while (p < end)
+		{
+			c = *p++;
+			if (c == '-')
+				neg++;
+			else if (c == '.')
+				isreal = s;
+			*s++ = c;
+		}
+		f->rp = (unsigned char *)end;
+		goto end;
+	}
+
 	while (s < e)
 	{
 		int c = fz_read_byte(ctx, f);
@@ -182,7 +438,7 @@ end:
 		if (neg > 1 || isreal - buf->scratch >= 10)
 			buf->f = acrobat_compatible_atof(buf->scratch);
 		else
-			buf->f = fz_atof(buf->scratch);
+			buf->f = fast_atof(buf->scratch);
 		return PDF_TOK_REAL;
 	}
 	else
@@ -197,6 +453,18 @@ lex_name(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf)
 {
 	char *s = buf->scratch;
 	int n = buf->size;
+	const unsigned char *end = skip_regular(f->rp, f->wp);
+
+	/* If we can see the end of the name in the buffer, and it has no
+	 * escapes, copy it from there in one go. */
+	if (end < f->wp && end - f->rp < n && !memchr(f->rp, '#', end - f->rp))
+	{
+		n = end - f->rp;
+		memcpy(s, f->rp, n);
+		s += n;
+		f->rp = (unsigned char *)end;
+		goto end;
+	}
 
 	while (n > 1)
 	{
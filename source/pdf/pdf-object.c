@@ -25,7 +25,9 @@ enum
 	PDF_FLAGS_SORTED = 2,
 	PDF_FLAGS_MEMO = 4,
 	PDF_FLAGS_MEMO_BOOL = 8,
-	PDF_FLAGS_DIRTY = 16
+	PDF_FLAGS_DIRTY = 16,
+	PDF_FLAGS_CHUNK = 32, /* allocated from an arena chunk */
+	PDF_FLAGS_INLINE_ITEMS = 64 /* items allocated along with the array or dict */
 };
 
 struct pdf_obj_s
@@ -55,6 +57,7 @@ typedef struct pdf_obj_string_s
 typedef struct pdf_obj_name_s
 {
 	pdf_obj super;
+	unsigned int hash;
 	char n[1];
 } pdf_obj_name;
 
@@ -76,6 +79,9 @@ typedef struct pdf_obj_dict_s
 	int len;
 	int cap;
 	struct keyval *items;
+	int *index; /* hash of key -> item+1, for large unsorted dicts */
+	int index_cap; /* power of 2, or 0 */
+	int index_used; /* live entries plus tombstones */
 } pdf_obj_dict;
 
 typedef struct pdf_obj_ref_s
@@ -93,6 +99,186 @@ typedef struct pdf_obj_ref_s
 #define ARRAY(obj) ((pdf_obj_array *)(obj))
 #define REF(obj) ((pdf_obj_ref *)(obj))
 
+/*
+	While a document is parsing objects into its arena (see
+	pdf_begin_object_arena), ints and reals are not allocated at all
+	on 64 bit systems: the value is packed into the top half of the
+	pdf_obj pointer, and the bottom half holds a tag that no real
+	pointer (nor any of the constants below PDF_OBJ__LIMIT) can have.
+	Such objects have no reference count, and cannot be changed.
+*/
+
+#if defined(_WIN64) || (defined(UINTPTR_MAX) && UINTPTR_MAX > 0xffffffffu)
+#define PDF_INLINE_NUMBERS
+#define INLINE_INT 0x80000001u
+#define INLINE_REAL 0x80000003u
+#define IS_INLINE(obj) ((obj) >= PDF_OBJ__LIMIT && ((uintptr_t)(obj) & 1))
+#else
+#define IS_INLINE(obj) 0
+#endif
+
+/* Only for obj >= PDF_OBJ__LIMIT */
+#define KIND(obj) (IS_INLINE(obj) ? ((uintptr_t)(obj) & 2 ? PDF_REAL : PDF_INT) : (obj)->kind)
+
+/* An object with a header we can look at */
+#define BOXED(obj) ((obj) >= PDF_OBJ__LIMIT && !IS_INLINE(obj))
+
+static inline fz_off_t
+num_int(pdf_obj *obj)
+{
+#ifdef PDF_INLINE_NUMBERS
+	if (IS_INLINE(obj))
+		return (int32_t)(uint32_t)((uintptr_t)obj >> 32);
+#endif
+	return NUM(obj)->u.i;
+}
+
+static inline float
+num_real(pdf_obj *obj)
+{
+#ifdef PDF_INLINE_NUMBERS
+	if (IS_INLINE(obj))
+	{
+		uint32_t u = (uint32_t)((uintptr_t)obj >> 32);
+		float f;
+		memcpy(&f, &u, sizeof f);
+		return f;
+	}
+#endif
+	return NUM(obj)->u.f;
+}
+
+/*
+	Objects parsed from the file are not allocated one by one, but
+	from per-document chunks. Each object in a chunk is preceded by a
+	pointer back to it, and the chunk counts the objects allocated from
+	it that are still alive (plus one while it is the document's
+	current chunk). It is freed once they have all been dropped. The
+	objects for an indirect object or object stream are parsed in one
+	go, so they sit next to each other in one chunk (or two), and go
+	away together when the xref entry is cleared.
+
+	Objects too large to be worth putting in a chunk, and all objects
+	made other than by parsing, use fz_malloc as before.
+*/
+
+enum
+{
+	PDF_OBJ_CHUNK_SIZE = 16 << 10,
+	PDF_OBJ_CHUNK_MAX = PDF_OBJ_CHUNK_SIZE / 8
+};
+
+struct pdf_obj_chunk_s
+{
+	int refs;
+	int len;
+};
+
+typedef union
+{
+	pdf_obj_chunk *chunk;
+	fz_off_t align;
+} pdf_obj_prefix;
+
+#define PARSING(doc) ((doc) && (doc)->arena_depth > 0)
+
+static void
+pdf_drop_obj_chunk(fz_context *ctx, pdf_obj_chunk *chunk)
+{
+	if (fz_drop_imp(ctx, chunk, &chunk->refs))
+		fz_free(ctx, chunk);
+}
+
+/* Returns NULL if the object should be allocated with fz_malloc. */
+static void *
+pdf_chunk_alloc(fz_context *ctx, pdf_document *doc, size_t size)
+{
+	pdf_obj_chunk *chunk = doc->arena;
+	pdf_obj_prefix *p;
+
+	size = (sizeof(pdf_obj_prefix) + size + 7) & ~(size_t)7;
+	if (size > PDF_OBJ_CHUNK_MAX)
+		return NULL;
+
+	if (chunk == NULL || chunk->len + size > PDF_OBJ_CHUNK_SIZE)
+	{
+		chunk = fz_malloc_no_throw(ctx, sizeof(pdf_obj_chunk) + PDF_OBJ_CHUNK_SIZE);
+		if (chunk == NULL)
+			return NULL;
+		chunk->refs = 1;
+		chunk->len = 0;
+		if (doc->arena)
+			pdf_drop_obj_chunk(ctx, doc->arena);
+		doc->arena = chunk;
+	}
+
+	p = (pdf_obj_prefix *)((unsigned char *)(chunk + 1) + chunk->len);
+	chunk->len += size;
+	p->chunk = fz_keep_imp(ctx, chunk, &chunk->refs);
+	return p + 1;
+}
+
+static pdf_obj *
+pdf_alloc_obj(fz_context *ctx, pdf_document *doc, size_t size, int kind, const char *label)
+{
+	pdf_obj *obj = NULL;
+	int flags = 0;
+
+	if (PARSING(doc))
+	{
+		obj = pdf_chunk_alloc(ctx, doc, size);
+		flags = PDF_FLAGS_CHUNK;
+	}
+	if (obj == NULL)
+	{
+		obj = Memento_label(fz_malloc(ctx, size), label);
+		flags = 0;
+	}
+	obj->refs = 1;
+	obj->kind = kind;
+	obj->flags = flags;
+	return obj;
+}
+
+static void
+pdf_free_obj(fz_context *ctx, pdf_obj *obj)
+{
+	if (obj->flags & PDF_FLAGS_CHUNK)
+		pdf_drop_obj_chunk(ctx, ((pdf_obj_prefix *)obj)[-1].chunk);
+	else
+		fz_free(ctx, obj);
+}
+
+void
+pdf_begin_object_arena(fz_context *ctx, pdf_document *doc)
+{
+	if (!doc->arena_disabled)
+		doc->arena_depth++;
+}
+
+void
+pdf_end_object_arena(fz_context *ctx, pdf_document *doc)
+{
+	if (!doc->arena_disabled)
+		doc->arena_depth--;
+}
+
+void
+pdf_set_object_arenas(fz_context *ctx, pdf_document *doc, int enable)
+{
+	if (doc->arena_depth > 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot change arena mode while parsing");
+	doc->arena_disabled = !enable;
+}
+
+void
+pdf_drop_object_arena(fz_context *ctx, pdf_document *doc)
+{
+	if (doc->arena)
+		pdf_drop_obj_chunk(ctx, doc->arena);
+	doc->arena = NULL;
+}
+
 pdf_obj *
 pdf_new_null(fz_context *ctx, pdf_document *doc)
 {
@@ -108,23 +294,18 @@ pdf_new_bool(fz_context *ctx, pdf_document *doc, int b)
 pdf_obj *
 pdf_new_int(fz_context *ctx, pdf_document *doc, int i)
 {
-	pdf_obj_num *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_num)), "pdf_obj(int)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_INT;
-	obj->super.flags = 0;
-	obj->u.i = i;
-	return &obj->super;
+	return pdf_new_int_offset(ctx, doc, i);
 }
 
 pdf_obj *
 pdf_new_int_offset(fz_context *ctx, pdf_document *doc, fz_off_t i)
 {
 	pdf_obj_num *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_num)), "pdf_obj(offset)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_INT;
-	obj->super.flags = 0;
+#ifdef PDF_INLINE_NUMBERS
+	if (PARSING(doc) && i >= INT32_MIN && i <= INT32_MAX)
+		return (pdf_obj *)(((uintptr_t)(uint32_t)i << 32) | INLINE_INT);
+#endif
+	obj = NUM(pdf_alloc_obj(ctx, doc, sizeof(pdf_obj_num), PDF_INT, "pdf_obj(int)"));
 	obj->u.i = i;
 	return &obj->super;
 }
@@ -133,10 +314,15 @@ pdf_obj *
 pdf_new_real(fz_context *ctx, pdf_document *doc, float f)
 {
 	pdf_obj_num *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_num)), "pdf_obj(real)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_REAL;
-	obj->super.flags = 0;
+#ifdef PDF_INLINE_NUMBERS
+	if (PARSING(doc))
+	{
+		uint32_t u;
+		memcpy(&u, &f, sizeof u);
+		return (pdf_obj *)(((uintptr_t)u << 32) | INLINE_REAL);
+	}
+#endif
+	obj = NUM(pdf_alloc_obj(ctx, doc, sizeof(pdf_obj_num), PDF_REAL, "pdf_obj(real)"));
 	obj->u.f = f;
 	return &obj->super;
 }
@@ -150,10 +336,7 @@ pdf_new_string(fz_context *ctx, pdf_document *doc, const char *str, size_t len)
 	if ((size_t)l != len)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Overflow in pdf string");
 
-	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj_string, buf) + len + 1), "pdf_obj(string)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_STRING;
-	obj->super.flags = 0;
+	obj = STRING(pdf_alloc_obj(ctx, doc, offsetof(pdf_obj_string, buf) + len + 1, PDF_STRING, "pdf_obj(string)"));
 	obj->len = l;
 	memcpy(obj->buf, str, len);
 	obj->buf[len] = '\0';
@@ -166,21 +349,138 @@ namecmp(const void *key, const void *name)
 	return strcmp((char *)key, *(char **)name);
 }
 
+static unsigned int
+pdf_name_hash(const char *s)
+{
+	unsigned int h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/*
+	Names other than the standard ones are interned per document: the
+	first time a name is created for a document it goes into an open
+	addressed table, and later requests for the same name get another
+	reference to that object. Each name is then stored once, however
+	many dicts use it as a key, and dict lookups can match keys by
+	pointer before comparing strings.
+
+	The table holds a reference to each name until the document is
+	dropped. Once a name has been shared PDF_NAME_MAX_SHARE times, we
+	hand out private copies again rather than risk overflowing its
+	(short) reference count.
+*/
+
+enum { PDF_NAME_MAX_SHARE = 16384 };
+
+struct pdf_name_table_s
+{
+	int len;
+	int cap; /* power of 2 */
+	pdf_obj_name **items;
+};
+
+static void
+pdf_intern_name(fz_context *ctx, pdf_document *doc, pdf_obj_name *name)
+{
+	pdf_name_table *table = doc->names;
+	int i;
+
+	if (table == NULL)
+	{
+		table = fz_malloc_no_throw(ctx, sizeof(pdf_name_table));
+		if (table == NULL)
+			return;
+		table->len = 0;
+		table->cap = 0;
+		table->items = NULL;
+		doc->names = table;
+	}
+
+	if ((table->len + 1) * 2 > table->cap)
+	{
+		int new_cap = table->cap ? table->cap * 2 : 256;
+		pdf_obj_name **items = fz_malloc_array_no_throw(ctx, new_cap, sizeof(pdf_obj_name *));
+		if (items == NULL)
+			return; /* Not interning it is no great loss */
+		memset(items, 0, new_cap * sizeof(pdf_obj_name *));
+		for (i = 0; i < table->cap; i++)
+		{
+			pdf_obj_name *n = table->items[i];
+			if (n)
+			{
+				int j = n->hash & (new_cap - 1);
+				while (items[j])
+					j = (j + 1) & (new_cap - 1);
+				items[j] = n;
+			}
+		}
+		fz_free(ctx, table->items);
+		table->items = items;
+		table->cap = new_cap;
+	}
+
+	i = name->hash & (table->cap - 1);
+	while (table->items[i])
+		i = (i + 1) & (table->cap - 1);
+	table->items[i] = (pdf_obj_name *)pdf_keep_obj(ctx, &name->super);
+	table->len++;
+}
+
+void
+pdf_drop_name_table(fz_context *ctx, pdf_document *doc)
+{
+	pdf_name_table *table = doc->names;
+	int i;
+
+	if (table == NULL)
+		return;
+	for (i = 0; i < table->cap; i++)
+		pdf_drop_obj(ctx, (pdf_obj *)table->items[i]);
+	fz_free(ctx, table->items);
+	fz_free(ctx, table);
+	doc->names = NULL;
+}
+
 pdf_obj *
 pdf_new_name(fz_context *ctx, pdf_document *doc, const char *str)
 {
+	pdf_name_table *table = doc ? doc->names : NULL;
 	pdf_obj_name *obj;
 	char **stdname;
+	unsigned int hash;
+	int intern = (doc != NULL);
 
 	stdname = bsearch(str, &PDF_NAMES[1], PDF_OBJ_ENUM_NAME__LIMIT-1, sizeof(char *), namecmp);
 	if (stdname != NULL)
 		return (pdf_obj *)(intptr_t)(stdname - &PDF_NAMES[0]);
 
+	hash = pdf_name_hash(str);
+	if (table)
+	{
+		int i = hash & (table->cap - 1);
+		while ((obj = table->items[i]) != NULL)
+		{
+			if (obj->hash == hash && !strcmp(obj->n, str))
+			{
+				if (obj->super.refs < PDF_NAME_MAX_SHARE)
+					return pdf_keep_obj(ctx, &obj->super);
+				intern = 0;
+				break;
+			}
+			i = (i + 1) & (table->cap - 1);
+		}
+	}
+
 	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj_name, n) + strlen(str) + 1), "pdf_obj(name)");
 	obj->super.refs = 1;
 	obj->super.kind = PDF_NAME;
 	obj->super.flags = 0;
+	obj->hash = hash;
 	strcpy(obj->n, str);
+	if (intern)
+		pdf_intern_name(ctx, doc, obj);
 	return &obj->super;
 }
 
@@ -188,10 +488,7 @@ pdf_obj *
 pdf_new_indirect(fz_context *ctx, pdf_document *doc, int num, int gen)
 {
 	pdf_obj_ref *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_ref)), "pdf_obj(indirect)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_INDIRECT;
-	obj->super.flags = 0;
+	obj = REF(pdf_alloc_obj(ctx, doc, sizeof(pdf_obj_ref), PDF_INDIRECT, "pdf_obj(indirect)"));
 	obj->doc = doc;
 	obj->num = num;
 	obj->gen = gen;
@@ -201,7 +498,7 @@ pdf_new_indirect(fz_context *ctx, pdf_document *doc, int num, int gen)
 pdf_obj *
 pdf_keep_obj(fz_context *ctx, pdf_obj *obj)
 {
-	if (obj >= PDF_OBJ__LIMIT)
+	if (BOXED(obj))
 	{
 		(void)Memento_takeRef(obj);
 		(void)fz_keep_imp16(ctx, obj, &obj->refs);
@@ -211,11 +508,11 @@ pdf_keep_obj(fz_context *ctx, pdf_obj *obj)
 
 int pdf_is_indirect(fz_context *ctx, pdf_obj *obj)
 {
-	return obj >= PDF_OBJ__LIMIT ? obj->kind == PDF_INDIRECT : 0;
+	return obj >= PDF_OBJ__LIMIT ? KIND(obj) == PDF_INDIRECT : 0;
 }
 
 #define RESOLVE(obj) \
-	if (obj >= PDF_OBJ__LIMIT && obj->kind == PDF_INDIRECT) \
+	if (obj >= PDF_OBJ__LIMIT && KIND(obj) == PDF_INDIRECT) \
 		obj = pdf_resolve_indirect_chain(ctx, obj); \
 
 int pdf_is_null(fz_context *ctx, pdf_obj *obj)
@@ -233,25 +530,25 @@ int pdf_is_bool(fz_context *ctx, pdf_obj *obj)
 int pdf_is_int(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	return obj >= PDF_OBJ__LIMIT ? obj->kind == PDF_INT : 0;
+	return obj >= PDF_OBJ__LIMIT ? KIND(obj) == PDF_INT : 0;
 }
 
 int pdf_is_real(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	return obj >= PDF_OBJ__LIMIT ? obj->kind == PDF_REAL : 0;
+	return obj >= PDF_OBJ__LIMIT ? KIND(obj) == PDF_REAL : 0;
 }
 
 int pdf_is_number(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	return obj >= PDF_OBJ__LIMIT ? (obj->kind == PDF_REAL || obj->kind == PDF_INT) : 0;
+	return obj >= PDF_OBJ__LIMIT ? (KIND(obj) == PDF_REAL || KIND(obj) == PDF_INT) : 0;
 }
 
 int pdf_is_string(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	return obj >= PDF_OBJ__LIMIT ? obj->kind == PDF_STRING : 0;
+	return obj >= PDF_OBJ__LIMIT ? KIND(obj) == PDF_STRING : 0;
 }
 
 int pdf_is_name(fz_context *ctx, pdf_obj *obj)
@@ -259,19 +556,19 @@ int pdf_is_name(fz_context *ctx, pdf_obj *obj)
 	RESOLVE(obj);
 	if (obj < PDF_OBJ__LIMIT)
 		return obj != NULL && obj < PDF_OBJ_NAME__LIMIT;
-	return obj->kind == PDF_NAME;
+	return KIND(obj) == PDF_NAME;
 }
 
 int pdf_is_array(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	return obj >= PDF_OBJ__LIMIT ? obj->kind == PDF_ARRAY : 0;
+	return obj >= PDF_OBJ__LIMIT ? KIND(obj) == PDF_ARRAY : 0;
 }
 
 int pdf_is_dict(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	return obj >= PDF_OBJ__LIMIT ? obj->kind == PDF_DICT : 0;
+	return obj >= PDF_OBJ__LIMIT ? KIND(obj) == PDF_DICT : 0;
 }
 
 int pdf_to_bool(fz_context *ctx, pdf_obj *obj)
@@ -285,10 +582,10 @@ int pdf_to_int(fz_context *ctx, pdf_obj *obj)
 	RESOLVE(obj);
 	if (obj < PDF_OBJ__LIMIT)
 		return 0;
-	if (obj->kind == PDF_INT)
-		return (int)NUM(obj)->u.i;
-	if (obj->kind == PDF_REAL)
-		return (int)(NUM(obj)->u.f + 0.5f); /* No roundf in MSVC */
+	if (KIND(obj) == PDF_INT)
+		return (int)num_int(obj);
+	if (KIND(obj) == PDF_REAL)
+		return (int)(num_real(obj) + 0.5f); /* No roundf in MSVC */
 	return 0;
 }
 
@@ -297,10 +594,10 @@ fz_off_t pdf_to_offset(fz_context *ctx, pdf_obj *obj)
 	RESOLVE(obj);
 	if (obj < PDF_OBJ__LIMIT)
 		return 0;
-	if (obj->kind == PDF_INT)
-		return NUM(obj)->u.i;
-	if (obj->kind == PDF_REAL)
-		return (fz_off_t)(NUM(obj)->u.f + 0.5f); /* No roundf in MSVC */
+	if (KIND(obj) == PDF_INT)
+		return num_int(obj);
+	if (KIND(obj) == PDF_REAL)
+		return (fz_off_t)(num_real(obj) + 0.5f); /* No roundf in MSVC */
 	return 0;
 }
 
@@ -309,10 +606,10 @@ float pdf_to_real(fz_context *ctx, pdf_obj *obj)
 	RESOLVE(obj);
 	if (obj < PDF_OBJ__LIMIT)
 		return 0;
-	if (obj->kind == PDF_REAL)
-		return NUM(obj)->u.f;
-	if (obj->kind == PDF_INT)
-		return NUM(obj)->u.i;
+	if (KIND(obj) == PDF_REAL)
+		return num_real(obj);
+	if (KIND(obj) == PDF_INT)
+		return num_int(obj);
 	return 0;
 }
 
@@ -323,7 +620,7 @@ char *pdf_to_name(fz_context *ctx, pdf_obj *obj)
 		return "";
 	if (obj < PDF_OBJ_NAME__LIMIT)
 		return PDF_NAMES[(intptr_t)obj];
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_NAME)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_NAME)
 		return "";
 	return NAME(obj)->n;
 }
@@ -331,7 +628,7 @@ char *pdf_to_name(fz_context *ctx, pdf_obj *obj)
 char *pdf_to_str_buf(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_STRING)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_STRING)
 		return "";
 	return STRING(obj)->buf;
 }
@@ -339,22 +636,25 @@ char *pdf_to_str_buf(fz_context *ctx, pdf_obj *obj)
 int pdf_to_str_len(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_STRING)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_STRING)
 		return 0;
 	return STRING(obj)->len;
 }
 
 void pdf_set_int(fz_context *ctx, pdf_obj *obj, int i)
 {
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_INT)
-		return;
-	NUM(obj)->u.i = i;
+	pdf_set_int_offset(ctx, obj, i);
 }
 
 void pdf_set_int_offset(fz_context *ctx, pdf_obj *obj, fz_off_t i)
 {
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_INT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_INT)
+		return;
+	if (IS_INLINE(obj))
+	{
+		fz_warn(ctx, "assert: cannot change an int parsed from the file");
 		return;
+	}
 	NUM(obj)->u.i = i;
 }
 
@@ -362,7 +662,7 @@ void pdf_set_int_offset(fz_context *ctx, pdf_obj *obj, fz_off_t i)
 void pdf_set_str_len(fz_context *ctx, pdf_obj *obj, int newlen)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_STRING)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_STRING)
 		return; /* This should never happen */
 	if (newlen < 0 || (unsigned int)newlen > STRING(obj)->len)
 		return; /* This should never happen */
@@ -372,26 +672,26 @@ void pdf_set_str_len(fz_context *ctx, pdf_obj *obj, int newlen)
 pdf_obj *pdf_to_dict(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	return (obj >= PDF_OBJ__LIMIT && obj->kind == PDF_DICT ? obj : NULL);
+	return (obj >= PDF_OBJ__LIMIT && KIND(obj) == PDF_DICT ? obj : NULL);
 }
 
 int pdf_to_num(fz_context *ctx, pdf_obj *obj)
 {
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_INDIRECT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_INDIRECT)
 		return 0;
 	return REF(obj)->num;
 }
 
 int pdf_to_gen(fz_context *ctx, pdf_obj *obj)
 {
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_INDIRECT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_INDIRECT)
 		return 0;
 	return REF(obj)->gen;
 }
 
 pdf_document *pdf_get_indirect_document(fz_context *ctx, pdf_obj *obj)
 {
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_INDIRECT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_INDIRECT)
 		return NULL;
 	return REF(obj)->doc;
 }
@@ -400,11 +700,11 @@ pdf_document *pdf_get_bound_document(fz_context *ctx, pdf_obj *obj)
 {
 	if (obj < PDF_OBJ__LIMIT)
 		return NULL;
-	if (obj->kind == PDF_INDIRECT)
+	if (KIND(obj) == PDF_INDIRECT)
 		return REF(obj)->doc;
-	if (obj->kind == PDF_ARRAY)
+	if (KIND(obj) == PDF_ARRAY)
 		return ARRAY(obj)->doc;
-	if (obj->kind == PDF_DICT)
+	if (KIND(obj) == PDF_DICT)
 		return DICT(obj)->doc;
 	return NULL;
 }
@@ -433,7 +733,7 @@ pdf_objcmp(fz_context *ctx, pdf_obj *a, pdf_obj *b)
 			return a != b;
 		if (b < PDF_OBJ__LIMIT)
 			return 1;
-		if (b->kind != PDF_NAME)
+		if (KIND(b) != PDF_NAME)
 			return 1;
 		return strcmp(NAME(b)->n, PDF_NAMES[(intptr_t)a]);
 	}
@@ -442,7 +742,7 @@ pdf_objcmp(fz_context *ctx, pdf_obj *a, pdf_obj *b)
 	{
 		if (a < PDF_OBJ__LIMIT)
 			return 1;
-		if (a->kind != PDF_NAME)
+		if (KIND(a) != PDF_NAME)
 			return 1;
 		return strcmp(NAME(a)->n, PDF_NAMES[(intptr_t)b]);
 	}
@@ -450,18 +750,18 @@ pdf_objcmp(fz_context *ctx, pdf_obj *a, pdf_obj *b)
 	if (a < PDF_OBJ__LIMIT || b < PDF_OBJ__LIMIT)
 		return a != b;
 
-	if (a->kind != b->kind)
+	if (KIND(a) != KIND(b))
 		return 1;
 
-	switch (a->kind)
+	switch (KIND(a))
 	{
 	case PDF_INT:
-		return NUM(a)->u.i - NUM(b)->u.i;
+		return num_int(a) - num_int(b);
 
 	case PDF_REAL:
-		if (NUM(a)->u.f < NUM(b)->u.f)
+		if (num_real(a) < num_real(b))
 			return -1;
-		if (NUM(a)->u.f > NUM(b)->u.f)
+		if (num_real(a) > num_real(b))
 			return 1;
 		return 0;
 
@@ -524,7 +824,7 @@ pdf_objkindstr(pdf_obj *obj)
 	if (obj == PDF_OBJ_NULL)
 		return "null";
 
-	switch (obj->kind)
+	switch (KIND(obj))
 	{
 	case PDF_INT: return "integer";
 	case PDF_REAL: return "real";
@@ -541,27 +841,35 @@ pdf_obj *
 pdf_new_array(fz_context *ctx, pdf_document *doc, int initialcap)
 {
 	pdf_obj_array *obj;
+	int cap = initialcap > 1 ? initialcap : 6;
 	int i;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_array)), "pdf_obj(array)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_ARRAY;
-	obj->super.flags = 0;
+	if (PARSING(doc) && cap <= 64)
+	{
+		/* Keep the items with the array until it has to grow */
+		obj = ARRAY(pdf_alloc_obj(ctx, doc, sizeof(pdf_obj_array) + cap * sizeof(pdf_obj*), PDF_ARRAY, "pdf_obj(array)"));
+		obj->super.flags |= PDF_FLAGS_INLINE_ITEMS;
+		obj->items = (pdf_obj **)(obj + 1);
+	}
+	else
+	{
+		obj = ARRAY(pdf_alloc_obj(ctx, doc, sizeof(pdf_obj_array), PDF_ARRAY, "pdf_obj(array)"));
+		fz_try(ctx)
+		{
+			obj->items = Memento_label(fz_malloc_array(ctx, cap, sizeof(pdf_obj*)), "pdf_obj(array items)");
+		}
+		fz_catch(ctx)
+		{
+			pdf_free_obj(ctx, &obj->super);
+			fz_rethrow(ctx);
+		}
+	}
 	obj->doc = doc;
 	obj->parent_num = 0;
 
 	obj->len = 0;
-	obj->cap = initialcap > 1 ? initialcap : 6;
+	obj->cap = cap;
 
-	fz_try(ctx)
-	{
-		obj->items = Memento_label(fz_malloc_array(ctx, obj->cap, sizeof(pdf_obj*)), "pdf_obj(array items)");
-	}
-	fz_catch(ctx)
-	{
-		fz_free(ctx, obj);
-		fz_rethrow(ctx);
-	}
 	for (i = 0; i < obj->cap; i++)
 		obj->items[i] = NULL;
 
@@ -574,7 +882,15 @@ pdf_array_grow(fz_context *ctx, pdf_obj_array *obj)
 	int i;
 	int new_cap = (obj->cap * 3) / 2;
 
-	obj->items = fz_resize_array(ctx, obj->items, new_cap, sizeof(pdf_obj*));
+	if (obj->super.flags & PDF_FLAGS_INLINE_ITEMS)
+	{
+		pdf_obj **items = fz_malloc_array(ctx, new_cap, sizeof(pdf_obj*));
+		memcpy(items, obj->items, obj->len * sizeof(pdf_obj*));
+		obj->items = items;
+		obj->super.flags &= ~PDF_FLAGS_INLINE_ITEMS;
+	}
+	else
+		obj->items = fz_resize_array(ctx, obj->items, new_cap, sizeof(pdf_obj*));
 	obj->cap = new_cap;
 
 	for (i = obj->len ; i < obj->cap; i++)
@@ -590,7 +906,7 @@ pdf_copy_array(fz_context *ctx, pdf_obj *obj)
 	int n;
 
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_ARRAY)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_ARRAY)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "assert: not an array (%s)", pdf_objkindstr(obj));
 
 	doc = ARRAY(obj)->doc;
@@ -607,7 +923,7 @@ int
 pdf_array_len(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_ARRAY)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_ARRAY)
 		return 0;
 	return ARRAY(obj)->len;
 }
@@ -616,7 +932,7 @@ pdf_obj *
 pdf_array_get(fz_context *ctx, pdf_obj *obj, int i)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_ARRAY)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_ARRAY)
 		return NULL;
 	if (i < 0 || i >= ARRAY(obj)->len)
 		return NULL;
@@ -635,7 +951,7 @@ static void prepare_object_for_alteration(fz_context *ctx, pdf_obj *obj, pdf_obj
 	if (obj < PDF_OBJ__LIMIT)
 		return;
 
-	switch (obj->kind)
+	switch (KIND(obj))
 	{
 	case PDF_DICT:
 		doc = DICT(obj)->doc;
@@ -680,7 +996,7 @@ pdf_array_put(fz_context *ctx, pdf_obj *obj, int i, pdf_obj *item)
 	{
 		prepare_object_for_alteration(ctx, obj, item);
 
-		if (obj->kind != PDF_ARRAY)
+		if (KIND(obj) != PDF_ARRAY)
 			fz_warn(ctx, "assert: not an array (%s)", pdf_objkindstr(obj));
 		else if (i < 0)
 			fz_warn(ctx, "assert: index %d < 0", i);
@@ -710,7 +1026,7 @@ pdf_array_push(fz_context *ctx, pdf_obj *obj, pdf_obj *item)
 	{
 		prepare_object_for_alteration(ctx, obj, item);
 
-		if (obj->kind != PDF_ARRAY)
+		if (KIND(obj) != PDF_ARRAY)
 			fz_warn(ctx, "assert: not an array (%s)", pdf_objkindstr(obj));
 		else
 		{
@@ -746,7 +1062,7 @@ pdf_array_insert(fz_context *ctx, pdf_obj *obj, pdf_obj *item, int i)
 	{
 		prepare_object_for_alteration(ctx, obj, item);
 
-		if (obj->kind != PDF_ARRAY)
+		if (KIND(obj) != PDF_ARRAY)
 			fz_warn(ctx, "assert: not an array (%s)", pdf_objkindstr(obj));
 		else
 		{
@@ -783,7 +1099,7 @@ pdf_array_delete(fz_context *ctx, pdf_obj *obj, int i)
 	RESOLVE(obj);
 	if (obj >= PDF_OBJ__LIMIT)
 	{
-		if (obj->kind != PDF_ARRAY)
+		if (KIND(obj) != PDF_ARRAY)
 			fz_warn(ctx, "assert: not an array (%s)", pdf_objkindstr(obj));
 		else
 		{
@@ -914,14 +1230,14 @@ static int keyvalcmp(const void *ap, const void *bp)
 	 * do, then they match. */
 	if (a->k < PDF_OBJ_NAME__LIMIT)
 		an = PDF_NAMES[(intptr_t)a->k];
-	else if (a->k >= PDF_OBJ__LIMIT && a->k->kind == PDF_NAME)
+	else if (a->k >= PDF_OBJ__LIMIT && KIND(a->k) == PDF_NAME)
 		an = NAME(a->k)->n;
 	else
 		return 0;
 
 	if (b->k < PDF_OBJ_NAME__LIMIT)
 		bn = PDF_NAMES[(intptr_t)b->k];
-	else if (b->k >= PDF_OBJ__LIMIT && b->k->kind == PDF_NAME)
+	else if (b->k >= PDF_OBJ__LIMIT && KIND(b->k) == PDF_NAME)
 		bn = NAME(b->k)->n;
 	else
 		return 0;
@@ -933,27 +1249,38 @@ pdf_obj *
 pdf_new_dict(fz_context *ctx, pdf_document *doc, int initialcap)
 {
 	pdf_obj_dict *obj;
+	int cap = initialcap > 1 ? initialcap : 10;
 	int i;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_dict)), "pdf_obj(dict)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_DICT;
-	obj->super.flags = 0;
+	if (PARSING(doc) && cap <= 64)
+	{
+		/* Keep the items with the dict until it has to grow */
+		obj = DICT(pdf_alloc_obj(ctx, doc, sizeof(pdf_obj_dict) + cap * sizeof(struct keyval), PDF_DICT, "pdf_obj(dict)"));
+		obj->super.flags |= PDF_FLAGS_INLINE_ITEMS;
+		obj->items = (struct keyval *)(obj + 1);
+	}
+	else
+	{
+		obj = DICT(pdf_alloc_obj(ctx, doc, sizeof(pdf_obj_dict), PDF_DICT, "pdf_obj(dict)"));
+		fz_try(ctx)
+		{
+			obj->items = Memento_label(fz_malloc_array(ctx, cap, sizeof(struct keyval)), "pdf_obj(dict items)");
+		}
+		fz_catch(ctx)
+		{
+			pdf_free_obj(ctx, &obj->super);
+			fz_rethrow(ctx);
+		}
+	}
 	obj->doc = doc;
 	obj->parent_num = 0;
 
 	obj->len = 0;
-	obj->cap = initialcap > 1 ? initialcap : 10;
+	obj->cap = cap;
+	obj->index = NULL;
+	obj->index_cap = 0;
+	obj->index_used = 0;
 
-	fz_try(ctx)
-	{
-		DICT(obj)->items = Memento_label(fz_malloc_array(ctx, DICT(obj)->cap, sizeof(struct keyval)), "pdf_obj(dict items)");
-	}
-	fz_catch(ctx)
-	{
-		fz_free(ctx, obj);
-		fz_rethrow(ctx);
-	}
 	for (i = 0; i < DICT(obj)->cap; i++)
 	{
 		DICT(obj)->items[i].k = NULL;
@@ -969,7 +1296,15 @@ pdf_dict_grow(fz_context *ctx, pdf_obj *obj)
 	int i;
 	int new_cap = (DICT(obj)->cap * 3) / 2;
 
-	DICT(obj)->items = fz_resize_array(ctx, DICT(obj)->items, new_cap, sizeof(struct keyval));
+	if (obj->flags & PDF_FLAGS_INLINE_ITEMS)
+	{
+		struct keyval *items = fz_malloc_array(ctx, new_cap, sizeof(struct keyval));
+		memcpy(items, DICT(obj)->items, DICT(obj)->len * sizeof(struct keyval));
+		DICT(obj)->items = items;
+		obj->flags &= ~PDF_FLAGS_INLINE_ITEMS;
+	}
+	else
+		DICT(obj)->items = fz_resize_array(ctx, DICT(obj)->items, new_cap, sizeof(struct keyval));
 	DICT(obj)->cap = new_cap;
 
 	for (i = DICT(obj)->len; i < DICT(obj)->cap; i++)
@@ -979,6 +1314,135 @@ pdf_dict_grow(fz_context *ctx, pdf_obj *obj)
 	}
 }
 
+/*
+	Unsorted dicts with PDF_DICT_INDEX_MIN or more entries (resource
+	dicts with many XObjects or fonts, for example) get an open
+	addressed hash index from key to item, built the first time they
+	are searched and kept up to date as keys are added and removed.
+	Sorted dicts are binary searched as before. The index is only ever
+	a shortcut: if we cannot allocate it we fall back to a linear
+	search.
+*/
+
+enum { PDF_DICT_INDEX_MIN = 32 };
+
+static unsigned int
+pdf_key_hash(pdf_obj *key)
+{
+	if (key < PDF_OBJ__LIMIT)
+		return pdf_name_hash(PDF_NAMES[(intptr_t)key]);
+	return NAME(key)->hash;
+}
+
+static void
+pdf_dict_drop_index(fz_context *ctx, pdf_obj *obj)
+{
+	fz_free(ctx, DICT(obj)->index);
+	DICT(obj)->index = NULL;
+	DICT(obj)->index_cap = 0;
+	DICT(obj)->index_used = 0;
+}
+
+static void
+pdf_dict_index_insert(pdf_obj *obj, int i, unsigned int hash)
+{
+	int mask = DICT(obj)->index_cap - 1;
+	int j = hash & mask;
+
+	while (DICT(obj)->index[j] > 0)
+		j = (j + 1) & mask;
+	if (DICT(obj)->index[j] == 0)
+		DICT(obj)->index_used++;
+	DICT(obj)->index[j] = i + 1;
+}
+
+/* Returns the index slot that refers to item i. */
+static int
+pdf_dict_index_slot(pdf_obj *obj, int i)
+{
+	int mask = DICT(obj)->index_cap - 1;
+	int j = pdf_key_hash(DICT(obj)->items[i].k) & mask;
+
+	while (DICT(obj)->index[j] != i + 1)
+		j = (j + 1) & mask;
+	return j;
+}
+
+static int
+pdf_dict_build_index(fz_context *ctx, pdf_obj *obj)
+{
+	int len = DICT(obj)->len;
+	int cap = 64;
+	int i;
+
+	while (cap < len * 4)
+		cap <<= 1;
+
+	pdf_dict_drop_index(ctx, obj);
+	DICT(obj)->index = fz_malloc_array_no_throw(ctx, cap, sizeof(int));
+	if (DICT(obj)->index == NULL)
+		return 0;
+	memset(DICT(obj)->index, 0, cap * sizeof(int));
+	DICT(obj)->index_cap = cap;
+	for (i = 0; i < len; i++)
+		pdf_dict_index_insert(obj, i, pdf_key_hash(DICT(obj)->items[i].k));
+	return 1;
+}
+
+/* Returns non-zero if obj has (or now has) an up to date index. */
+static int
+pdf_dict_has_index(fz_context *ctx, pdf_obj *obj)
+{
+	if (obj->flags & PDF_FLAGS_SORTED)
+		return 0;
+	if (DICT(obj)->index)
+		return 1;
+	if (DICT(obj)->len < PDF_DICT_INDEX_MIN)
+		return 0;
+	return pdf_dict_build_index(ctx, obj);
+}
+
+/* Key just appended as item i; keep the index in step. */
+static void
+pdf_dict_index_added(fz_context *ctx, pdf_obj *obj, int i)
+{
+	if (!DICT(obj)->index)
+		return;
+	if ((DICT(obj)->index_used + 1) * 2 > DICT(obj)->index_cap)
+		pdf_dict_build_index(ctx, obj);
+	else
+		pdf_dict_index_insert(obj, i, pdf_key_hash(DICT(obj)->items[i].k));
+}
+
+/* Look key up in the index. key_obj, if not NULL, is the name object
+ * for key, which lets interned names match without a strcmp. */
+static int
+pdf_dict_index_find(pdf_obj *obj, pdf_obj *key_obj, const char *key, unsigned int hash)
+{
+	int mask = DICT(obj)->index_cap - 1;
+	int j = hash & mask;
+	int e;
+
+	while ((e = DICT(obj)->index[j]) != 0)
+	{
+		if (e > 0)
+		{
+			pdf_obj *k = DICT(obj)->items[e-1].k;
+			if (k == key_obj)
+				return e-1;
+			if (k < PDF_OBJ__LIMIT)
+			{
+				if (!strcmp(PDF_NAMES[(intptr_t)k], key))
+					return e-1;
+			}
+			else if (NAME(k)->hash == hash && !strcmp(NAME(k)->n, key))
+				return e-1;
+		}
+		j = (j + 1) & mask;
+	}
+	return -1 - DICT(obj)->len;
+}
+
 pdf_obj *
 pdf_copy_dict(fz_context *ctx, pdf_obj *obj)
 {
@@ -990,7 +1454,7 @@ pdf_copy_dict(fz_context *ctx, pdf_obj *obj)
 	{
 		pdf_document *doc = DICT(obj)->doc;
 
-		if (obj->kind != PDF_DICT)
+		if (KIND(obj) != PDF_DICT)
 			fz_warn(ctx, "assert: not a dict (%s)", pdf_objkindstr(obj));
 
 		n = pdf_dict_len(ctx, obj);
@@ -1007,7 +1471,7 @@ int
 pdf_dict_len(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 		return 0;
 	return DICT(obj)->len;
 }
@@ -1016,7 +1480,7 @@ pdf_obj *
 pdf_dict_get_key(fz_context *ctx, pdf_obj *obj, int i)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 		return NULL;
 	if (i < 0 || i >= DICT(obj)->len)
 		return NULL;
@@ -1027,7 +1491,7 @@ pdf_obj *
 pdf_dict_get_val(fz_context *ctx, pdf_obj *obj, int i)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 		return NULL;
 	if (i < 0 || i >= DICT(obj)->len)
 		return NULL;
@@ -1038,7 +1502,7 @@ void
 pdf_dict_put_val_drop(fz_context *ctx, pdf_obj *obj, int i, pdf_obj *new_obj)
 {
 	RESOLVE(obj);
-	if (!obj || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 	{
 		pdf_drop_obj(ctx, new_obj);
 		return;
@@ -1059,6 +1523,8 @@ static int
 pdf_dict_finds(fz_context *ctx, pdf_obj *obj, const char *key)
 {
 	int len = DICT(obj)->len;
+	if (pdf_dict_has_index(ctx, obj))
+		return pdf_dict_index_find(obj, NULL, key, pdf_name_hash(key));
 	if ((obj->flags & PDF_FLAGS_SORTED) && len > 0)
 	{
 		int l = 0;
@@ -1098,6 +1564,8 @@ static int
 pdf_dict_find(fz_context *ctx, pdf_obj *obj, pdf_obj *key)
 {
 	int len = DICT(obj)->len;
+	if (pdf_dict_has_index(ctx, obj))
+		return pdf_dict_index_find(obj, key, PDF_NAMES[(intptr_t)key], pdf_key_hash(key));
 	if ((obj->flags & PDF_FLAGS_SORTED) && len > 0)
 	{
 		int l = 0;
@@ -1147,13 +1615,35 @@ pdf_dict_find(fz_context *ctx, pdf_obj *obj, pdf_obj *key)
 	}
 }
 
+/* As pdf_dict_finds, for a key that is a (non standard) name object. */
+static int
+pdf_dict_findn(fz_context *ctx, pdf_obj *obj, pdf_obj *key)
+{
+	if (pdf_dict_has_index(ctx, obj))
+		return pdf_dict_index_find(obj, key, NAME(key)->n, NAME(key)->hash);
+	if (!(obj->flags & PDF_FLAGS_SORTED))
+	{
+		int i, len = DICT(obj)->len;
+		for (i = 0; i < len; i++)
+		{
+			pdf_obj *k = DICT(obj)->items[i].k;
+			if (k == key)
+				return i;
+			if (k >= PDF_OBJ__LIMIT && NAME(k)->hash == NAME(key)->hash && !strcmp(NAME(k)->n, NAME(key)->n))
+				return i;
+		}
+		return -1 - len;
+	}
+	return pdf_dict_finds(ctx, obj, NAME(key)->n);
+}
+
 pdf_obj *
 pdf_dict_gets(fz_context *ctx, pdf_obj *obj, const char *key)
 {
 	int i;
 
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 		return NULL;
 
 	i = pdf_dict_finds(ctx, obj, key);
@@ -1221,13 +1711,15 @@ pdf_dict_get(fz_context *ctx, pdf_obj *obj, pdf_obj *key)
 	int i;
 
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 		return NULL;
 
 	if (key < PDF_OBJ__LIMIT)
 		i = pdf_dict_find(ctx, obj, key);
+	else if (KIND(key) == PDF_NAME)
+		i = pdf_dict_findn(ctx, obj, key);
 	else
-		i = pdf_dict_finds(ctx, obj, pdf_to_name(ctx, key));
+		return NULL;
 	if (i >= 0)
 		return DICT(obj)->items[i].v;
 	return NULL;
@@ -1261,14 +1753,14 @@ pdf_dict_put(fz_context *ctx, pdf_obj *obj, pdf_obj *key, pdf_obj *val)
 	{
 		int i;
 
-		if (obj->kind != PDF_DICT)
+		if (KIND(obj) != PDF_DICT)
 		{
 			fz_warn(ctx, "assert: not a dict (%s)", pdf_objkindstr(obj));
 			return;
 		}
 
 		RESOLVE(key);
-		if (!key || (key >= PDF_OBJ__LIMIT && key->kind != PDF_NAME))
+		if (!key || (key >= PDF_OBJ__LIMIT && KIND(key) != PDF_NAME))
 		{
 			fz_warn(ctx, "assert: key is not a name (%s)", pdf_objkindstr(obj));
 			return;
@@ -1282,13 +1774,10 @@ pdf_dict_put(fz_context *ctx, pdf_obj *obj, pdf_obj *key, pdf_obj *val)
 
 		prepare_object_for_alteration(ctx, obj, val);
 
-		if (DICT(obj)->len > 100 && !(obj->flags & PDF_FLAGS_SORTED))
-			pdf_sort_dict(ctx, obj);
-
 		if (key < PDF_OBJ__LIMIT)
 			i = pdf_dict_find(ctx, obj, key);
 		else
-			i = pdf_dict_finds(ctx, obj, pdf_to_name(ctx, key));
+			i = pdf_dict_findn(ctx, obj, key);
 		if (i >= 0 && i < DICT(obj)->len)
 		{
 			if (DICT(obj)->items[i].v != val)
@@ -1312,6 +1801,10 @@ pdf_dict_put(fz_context *ctx, pdf_obj *obj, pdf_obj *key, pdf_obj *val)
 			DICT(obj)->items[i].k = pdf_keep_obj(ctx, key);
 			DICT(obj)->items[i].v = pdf_keep_obj(ctx, val);
 			DICT(obj)->len ++;
+			if (obj->flags & PDF_FLAGS_SORTED)
+				pdf_dict_drop_index(ctx, obj);
+			else
+				pdf_dict_index_added(ctx, obj, i);
 		}
 	}
 	return; /* Can't warn :( */
@@ -1335,7 +1828,7 @@ pdf_dict_puts(fz_context *ctx, pdf_obj *obj, const char *key, pdf_obj *val)
 	pdf_obj *keyobj;
 
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "not a dictionary (%s)", pdf_objkindstr(obj));
 
 	doc = DICT(obj)->doc;
@@ -1356,7 +1849,7 @@ pdf_dict_puts_drop(fz_context *ctx, pdf_obj *obj, const char *key, pdf_obj *val)
 	pdf_obj *keyobj;
 
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "not a dictionary (%s)", pdf_objkindstr(obj));
 
 	doc = DICT(obj)->doc;
@@ -1386,7 +1879,7 @@ pdf_dict_putp(fz_context *ctx, pdf_obj *obj, const char *keys, pdf_obj *val)
 	pdf_obj *cobj = NULL;
 
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "not a dictionary (%s)", pdf_objkindstr(obj));
 
 	doc = DICT(obj)->doc;
@@ -1458,7 +1951,7 @@ pdf_dict_vputl(fz_context *ctx, pdf_obj *obj, pdf_obj *val, va_list keys)
 	pdf_document *doc;
 
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "not a dictionary (%s)", pdf_objkindstr(obj));
 
 	doc = DICT(obj)->doc;
@@ -1533,17 +2026,26 @@ pdf_dict_dels(fz_context *ctx, pdf_obj *obj, const char *key)
 	{
 		prepare_object_for_alteration(ctx, obj, NULL);
 
-		if (obj->kind != PDF_DICT)
+		if (KIND(obj) != PDF_DICT)
 			fz_warn(ctx, "assert: not a dict (%s)", pdf_objkindstr(obj));
 		else
 		{
 			int i = pdf_dict_finds(ctx, obj, key);
 			if (i >= 0)
 			{
+				int last = DICT(obj)->len-1;
+				if (DICT(obj)->index)
+				{
+					/* Leave a tombstone for item i, and repoint
+					 * the last item's slot at i. */
+					DICT(obj)->index[pdf_dict_index_slot(obj, i)] = -1;
+					if (i != last)
+						DICT(obj)->index[pdf_dict_index_slot(obj, last)] = i + 1;
+				}
 				pdf_drop_obj(ctx, DICT(obj)->items[i].k);
 				pdf_drop_obj(ctx, DICT(obj)->items[i].v);
 				obj->flags &= ~PDF_FLAGS_SORTED;
-				DICT(obj)->items[i] = DICT(obj)->items[DICT(obj)->len-1];
+				DICT(obj)->items[i] = DICT(obj)->items[last];
 				DICT(obj)->len --;
 			}
 		}
@@ -1560,7 +2062,7 @@ pdf_dict_del(fz_context *ctx, pdf_obj *obj, pdf_obj *key)
 
 	if (key < PDF_OBJ__LIMIT)
 		pdf_dict_dels(ctx, obj, PDF_NAMES[(intptr_t)key]);
-	else if (key->kind == PDF_NAME)
+	else if (KIND(key) == PDF_NAME)
 		pdf_dict_dels(ctx, obj, NAME(key)->n);
 	/* else Can't warn */
 }
@@ -1569,12 +2071,13 @@ void
 pdf_sort_dict(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT || obj->kind != PDF_DICT)
+	if (obj < PDF_OBJ__LIMIT || KIND(obj) != PDF_DICT)
 		return;
 	if (!(obj->flags & PDF_FLAGS_SORTED))
 	{
 		qsort(DICT(obj)->items, DICT(obj)->len, sizeof(struct keyval), keyvalcmp);
 		obj->flags |= PDF_FLAGS_SORTED;
+		pdf_dict_drop_index(ctx, obj);
 	}
 }
 
@@ -1585,7 +2088,7 @@ pdf_deep_copy_obj(fz_context *ctx, pdf_obj *obj)
 	{
 		return pdf_keep_obj(ctx, obj);
 	}
-	if (obj->kind == PDF_DICT)
+	if (KIND(obj) == PDF_DICT)
 	{
 		pdf_document *doc = DICT(obj)->doc;
 		int n = pdf_dict_len(ctx, obj);
@@ -1601,7 +2104,7 @@ pdf_deep_copy_obj(fz_context *ctx, pdf_obj *obj)
 
 		return dict;
 	}
-	else if (obj->kind == PDF_ARRAY)
+	else if (KIND(obj) == PDF_ARRAY)
 	{
 		pdf_document *doc = ARRAY(obj)->doc;
 		int n = pdf_array_len(ctx, obj);
@@ -1627,7 +2130,7 @@ int
 pdf_obj_marked(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT)
+	if (!BOXED(obj))
 		return 0;
 	return !!(obj->flags & PDF_FLAGS_MARKED);
 }
@@ -1637,7 +2140,7 @@ pdf_mark_obj(fz_context *ctx, pdf_obj *obj)
 {
 	int marked;
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT)
+	if (!BOXED(obj))
 		return 0;
 	marked = !!(obj->flags & PDF_FLAGS_MARKED);
 	obj->flags |= PDF_FLAGS_MARKED;
@@ -1648,7 +2151,7 @@ void
 pdf_unmark_obj(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT)
+	if (!BOXED(obj))
 		return;
 	obj->flags &= ~PDF_FLAGS_MARKED;
 }
@@ -1656,7 +2159,7 @@ pdf_unmark_obj(fz_context *ctx, pdf_obj *obj)
 void
 pdf_set_obj_memo(fz_context *ctx, pdf_obj *obj, int memo)
 {
-	if (obj < PDF_OBJ__LIMIT)
+	if (!BOXED(obj))
 		return;
 
 	obj->flags |= PDF_FLAGS_MEMO;
@@ -1669,7 +2172,7 @@ pdf_set_obj_memo(fz_context *ctx, pdf_obj *obj, int memo)
 int
 pdf_obj_memo(fz_context *ctx, pdf_obj *obj, int *memo)
 {
-	if (obj < PDF_OBJ__LIMIT)
+	if (!BOXED(obj))
 		return 0;
 	if (!(obj->flags & PDF_FLAGS_MEMO))
 		return 0;
@@ -1680,7 +2183,7 @@ pdf_obj_memo(fz_context *ctx, pdf_obj *obj, int *memo)
 int pdf_obj_is_dirty(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT)
+	if (!BOXED(obj))
 		return 0;
 	return !!(obj->flags & PDF_FLAGS_DIRTY);
 }
@@ -1688,14 +2191,14 @@ int pdf_obj_is_dirty(fz_context *ctx, pdf_obj *obj)
 void pdf_dirty_obj(fz_context *ctx, pdf_obj *obj)
 {
 	RESOLVE(obj);
-	if (obj < PDF_OBJ__LIMIT)
+	if (!BOXED(obj))
 		return;
 	obj->flags |= PDF_FLAGS_DIRTY;
 }
 
 void pdf_clean_obj(fz_context *ctx, pdf_obj *obj)
 {
-	if (obj < PDF_OBJ__LIMIT)
+	if (!BOXED(obj))
 		return;
 	obj->flags &= ~PDF_FLAGS_DIRTY;
 }
@@ -1705,11 +2208,12 @@ pdf_drop_array(fz_context *ctx, pdf_obj *obj)
 {
 	int i;
 
-	for (i = 0; i < DICT(obj)->len; i++)
+	for (i = 0; i < ARRAY(obj)->len; i++)
 		pdf_drop_obj(ctx, ARRAY(obj)->items[i]);
 
-	fz_free(ctx, DICT(obj)->items);
-	fz_free(ctx, obj);
+	if (!(obj->flags & PDF_FLAGS_INLINE_ITEMS))
+		fz_free(ctx, ARRAY(obj)->items);
+	pdf_free_obj(ctx, obj);
 }
 
 static void
@@ -1722,14 +2226,16 @@ pdf_drop_dict(fz_context *ctx, pdf_obj *obj)
 		pdf_drop_obj(ctx, DICT(obj)->items[i].v);
 	}
 
-	fz_free(ctx, DICT(obj)->items);
-	fz_free(ctx, obj);
+	fz_free(ctx, DICT(obj)->index);
+	if (!(obj->flags & PDF_FLAGS_INLINE_ITEMS))
+		fz_free(ctx, DICT(obj)->items);
+	pdf_free_obj(ctx, obj);
 }
 
 void
 pdf_drop_obj(fz_context *ctx, pdf_obj *obj)
 {
-	if (obj >= PDF_OBJ__LIMIT)
+	if (BOXED(obj))
 	{
 		(void)Memento_dropRef(obj);
 		if (fz_drop_imp16(ctx, obj, &obj->refs))
@@ -1739,7 +2245,7 @@ pdf_drop_obj(fz_context *ctx, pdf_obj *obj)
 			else if (obj->kind == PDF_DICT)
 				pdf_drop_dict(ctx, obj);
 			else
-				fz_free(ctx, obj);
+				pdf_free_obj(ctx, obj);
 		}
 	}
 }
@@ -1752,7 +2258,7 @@ pdf_set_obj_parent(fz_context *ctx, pdf_obj *obj, int num)
 	if (obj < PDF_OBJ__LIMIT)
 		return;
 
-	switch(obj->kind)
+	switch(KIND(obj))
 	{
 	case PDF_ARRAY:
 		ARRAY(obj)->parent_num = num;
@@ -1774,7 +2280,7 @@ int pdf_obj_parent_num(fz_context *ctx, pdf_obj *obj)
 	if (obj < PDF_OBJ__LIMIT)
 		return 0;
 
-	switch(obj->kind)
+	switch(KIND(obj))
 	{
 	case PDF_INDIRECT:
 		return REF(obj)->num;
@@ -2139,5 +2645,5 @@ int pdf_print_obj(fz_context *ctx, fz_output *out, pdf_obj *obj, int tight)
 
 int pdf_obj_refs(fz_context *ctx, pdf_obj *ref)
 {
-	return (ref >= PDF_OBJ__LIMIT ? ref->refs : 0);
+	return (BOXED(ref) ? ref->refs : 0);
 }
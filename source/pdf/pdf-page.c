@@ -16,6 +16,99 @@ enum
 	LOCAL_STACK_SIZE = 16
 };
 
+/*
+	Page number to page object index. Walking the page tree to find a
+	page costs an object load for every kid we skip over, which makes
+	random access into large flat trees linear in the page number. So
+	every page we pass on the way is remembered in doc->page_map, and
+	later lookups of any of them go straight to the page.
+
+	The index is only a cache; if we cannot grow it, we carry on
+	without it.
+*/
+
+void
+pdf_drop_page_map(fz_context *ctx, pdf_document *doc)
+{
+	int i;
+
+	for (i = 0; i < doc->page_map_len; i++)
+		pdf_drop_obj(ctx, doc->page_map[i]);
+	fz_free(ctx, doc->page_map);
+	doc->page_map = NULL;
+	doc->page_map_len = 0;
+}
+
+static int
+pdf_grow_page_map(fz_context *ctx, pdf_document *doc, int min_len)
+{
+	int len = doc->page_map_len;
+	pdf_obj **map;
+
+	if (min_len <= len)
+		return 1;
+	if (len < doc->page_count)
+		len = doc->page_count;
+	if (len < 64)
+		len = 64;
+	while (len < min_len)
+		len += len >> 1;
+	map = fz_resize_array_no_throw(ctx, doc->page_map, len, sizeof(*map));
+	if (map == NULL)
+		return 0;
+	memset(map + doc->page_map_len, 0, (len - doc->page_map_len) * sizeof(*map));
+	doc->page_map = map;
+	doc->page_map_len = len;
+	return 1;
+}
+
+static void
+pdf_page_map_set(fz_context *ctx, pdf_document *doc, int number, pdf_obj *kid)
+{
+	if (number < 0 || !pdf_grow_page_map(ctx, doc, number + 1))
+		return;
+	if (doc->page_map[number] != kid)
+	{
+		pdf_drop_obj(ctx, doc->page_map[number]);
+		doc->page_map[number] = pdf_keep_obj(ctx, kid);
+	}
+}
+
+static void
+pdf_page_map_insert(fz_context *ctx, pdf_document *doc, int at, pdf_obj *page_ref)
+{
+	int len = doc->page_map_len;
+
+	pdf_invalidate_xref_cache(ctx, doc);
+	if (at >= len)
+	{
+		pdf_page_map_set(ctx, doc, at, page_ref);
+		return;
+	}
+	if (doc->page_map[len - 1] && !pdf_grow_page_map(ctx, doc, len + 1))
+	{
+		pdf_drop_page_map(ctx, doc);
+		return;
+	}
+	len = doc->page_map_len;
+	pdf_drop_obj(ctx, doc->page_map[len - 1]);
+	memmove(&doc->page_map[at + 1], &doc->page_map[at], (len - at - 1) * sizeof(*doc->page_map));
+	doc->page_map[at] = pdf_keep_obj(ctx, page_ref);
+}
+
+static void
+pdf_page_map_delete(fz_context *ctx, pdf_document *doc, int at)
+{
+	int len = doc->page_map_len;
+
+	pdf_invalidate_xref_cache(ctx, doc);
+	if (at >= len)
+		return;
+	pdf_drop_obj(ctx, doc->page_map[at]);
+	memmove(&doc->page_map[at], &doc->page_map[at + 1], (len - at - 1) * sizeof(*doc->page_map));
+	doc->page_map[len - 1] = NULL;
+}
+
 static pdf_obj *
 pdf_lookup_page_loc_imp(fz_context *ctx, pdf_document *doc, pdf_obj *node, int *skip, pdf_obj **parentp, int *indexp)
 {
@@ -26,6 +119,7 @@ pdf_lookup_page_loc_imp(fz_context *ctx, pdf_document *doc, pdf_obj *node, int *
 	pdf_obj **stack = &local_stack[0];
 	int stack_max = LOCAL_STACK_SIZE;
 	int stack_len = 0;
+	int needle = *skip;
 
 	fz_var(hit);
 	fz_var(stack);
@@ -80,6 +174,7 @@ pdf_lookup_page_loc_imp(fz_context *ctx, pdf_document *doc, pdf_obj *node, int *
 				{
 					if (type ? !pdf_name_eq(ctx, type, PDF_NAME_Page) : !pdf_dict_get(ctx, kid, PDF_NAME_MediaBox))
 						fz_warn(ctx, "non-page object in page tree (%s)", pdf_to_name(ctx, type));
+					pdf_page_map_set(ctx, doc, needle - *skip, kid);
 					if (*skip == 0)
 					{
 						if (parentp) *parentp = node;
@@ -119,6 +214,11 @@ pdf_lookup_page_loc(fz_context *ctx, pdf_document *doc, int needle, pdf_obj **pa
 	int skip = needle;
 	pdf_obj *hit;
 
+	/* Callers that want to edit the tree need the parent, which the
+	 * index does not know; they have to walk. */
+	if (!parentp && !indexp && needle >= 0 && needle < doc->page_map_len && doc->page_map[needle])
+		return doc->page_map[needle];
+
 	if (!node)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find page tree");
 
@@ -633,6 +733,7 @@ pdf_delete_page(fz_context *ctx, pdf_document *doc, int at)
 	pdf_lookup_page_loc(ctx, doc, at, &parent, &i);
 	kids = pdf_dict_get(ctx, parent, PDF_NAME_Kids);
 	pdf_array_delete(ctx, kids, i);
+	pdf_page_map_delete(ctx, doc, at);
 
 	while (parent)
 	{
@@ -721,6 +822,7 @@ pdf_insert_page(fz_context *ctx, pdf_document *doc, int at, pdf_obj *page_ref)
 	}
 
 	pdf_dict_put(ctx, page_ref, PDF_NAME_Parent, parent);
+	pdf_page_map_insert(ctx, doc, at, page_ref);
 
 	/* Adjust page counts */
 	while (parent)
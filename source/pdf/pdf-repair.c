@@ -14,6 +14,171 @@ struct entry
 	int stm_len;
 };
 
+/*
+	When a stream has no usable Length we have to hunt for its
+	'endstream' token byte by byte, which for a large damaged file
+	means pushing most of the file through fz_read_byte on one thread.
+	Instead, the first time a hunt runs for more than a little while,
+	we read the rest of the file in large batches and search each
+	batch for 'endstream' markers on all the threads fz_run_tasks will
+	give us. Later hunts are then a binary search in the sorted table
+	of marker offsets. The table finds exactly the marker the byte by
+	byte search would have found, so the repaired xref is the same.
+*/
+
+enum
+{
+	STREAM_END_INLINE_SCAN = 64 << 10,
+	STREAM_END_CHUNK = 1 << 20,
+	STREAM_END_MAX_BATCH = 64 << 20,
+	STREAM_END_OVERLAP = 8
+};
+
+struct stream_ends
+{
+	int state; /* 0 = not scanned yet, 1 = scanned, -1 = cannot scan */
+	int len, cap;
+	fz_off_t *ofs;
+	fz_off_t start, size; /* the table covers start to size */
+};
+
+struct stream_end_batch
+{
+	unsigned char *data;
+	size_t len;
+	fz_off_t base;
+	struct stream_ends *found; /* one per chunk */
+};
+
+static void
+add_stream_end(fz_context *ctx, struct stream_ends *ends, fz_off_t ofs)
+{
+	if (ends->len == ends->cap)
+	{
+		int cap = ends->cap ? ends->cap * 2 : 256;
+		ends->ofs = fz_resize_array(ctx, ends->ofs, cap, sizeof(*ends->ofs));
+		ends->cap = cap;
+	}
+	ends->ofs[ends->len++] = ofs;
+}
+
+static void
+scan_stream_end_chunk(fz_context *ctx, void *arg, int chunk)
+{
+	struct stream_end_batch *batch = arg;
+	unsigned char *p = batch->data + (size_t)chunk * STREAM_END_CHUNK;
+	unsigned char *end = batch->data + fz_minz((size_t)(chunk + 1) * STREAM_END_CHUNK, batch->len);
+	unsigned char *limit = batch->data + batch->len;
+
+	/* Only report markers that start in our chunk; the last few
+	 * bytes of the next chunk are there so that we can see those
+	 * that straddle the boundary. */
+	while (p < end)
+	{
+		p = memchr(p, 'e', end - p);
+		if (p == NULL)
+			break;
+		if (limit - p >= 9 && memcmp(p, "endstream", 9) == 0)
+			add_stream_end(ctx, &batch->found[chunk], batch->base + (p - batch->data));
+		p++;
+	}
+}
+
+static void
+scan_stream_ends(fz_context *ctx, pdf_document *doc, struct stream_ends *ends, fz_off_t pos)
+{
+	struct stream_end_batch batch = { 0 };
+	size_t batch_size, n;
+	int i, nchunks = 0;
+
+	fz_var(batch.data);
+	fz_var(batch.found);
+	fz_var(nchunks);
+
+	fz_try(ctx)
+	{
+		fz_seek(ctx, doc->file, 0, 2);
+		ends->size = fz_tell(ctx, doc->file);
+		ends->start = pos;
+
+		batch_size = (size_t)fz_available_threads(ctx) * 4 * STREAM_END_CHUNK;
+		if (batch_size > STREAM_END_MAX_BATCH)
+			batch_size = STREAM_END_MAX_BATCH;
+		if ((fz_off_t)batch_size > ends->size - pos)
+			batch_size = (size_t)(ends->size - pos);
+		nchunks = (int)((batch_size + STREAM_END_CHUNK - 1) / STREAM_END_CHUNK);
+		batch.data = fz_malloc(ctx, batch_size + STREAM_END_OVERLAP);
+		batch.found = fz_calloc(ctx, nchunks, sizeof(*batch.found));
+
+		while (pos < ends->size)
+		{
+			fz_seek(ctx, doc->file, pos, 0);
+			batch.base = pos;
+			batch.len = fz_read(ctx, doc->file, batch.data, batch_size + STREAM_END_OVERLAP);
+			if (batch.len == 0)
+				break;
+
+			fz_run_tasks(ctx, 0, (int)((fz_minz(batch.len, batch_size) + STREAM_END_CHUNK - 1) / STREAM_END_CHUNK), scan_stream_end_chunk, &batch);
+
+			/* Chunks are in file order, so this keeps the table sorted */
+			for (i = 0; i < nchunks; i++)
+			{
+				for (n = 0; n < (size_t)batch.found[i].len; n++)
+					add_stream_end(ctx, ends, batch.found[i].ofs[n]);
+				batch.found[i].len = 0;
+			}
+
+			pos += fz_minz(batch.len, batch_size);
+		}
+		ends->state = 1;
+	}
+	fz_always(ctx)
+	{
+		for (i = 0; i < nchunks; i++)
+			fz_free(ctx, batch.found[i].ofs);
+		fz_free(ctx, batch.found);
+		fz_free(ctx, batch.data);
+	}
+	fz_catch(ctx)
+	{
+		/* Fall back to hunting byte by byte, which will report any
+		 * error (or ask us to try later) itself. */
+		ends->state = -1;
+	}
+}
+
+/* Seek to just after the first 'endstream' at or after pos (or to the end
+ * of the file if there is none). Returns 0, with the file where it was, if
+ * the table cannot tell us. */
+static int
+seek_stream_end(fz_context *ctx, pdf_document *doc, struct stream_ends *ends, fz_off_t pos)
+{
+	fz_off_t here = fz_tell(ctx, doc->file);
+	int l, r;
+
+	if (ends->state == 0)
+		scan_stream_ends(ctx, doc, ends, pos);
+	if (ends->state < 0 || pos < ends->start)
+	{
+		fz_seek(ctx, doc->file, here, 0);
+		return 0;
+	}
+
+	l = 0;
+	r = ends->len;
+	while (l < r)
+	{
+		int m = l + (r - l) / 2;
+		if (ends->ofs[m] < pos)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	fz_seek(ctx, doc->file, l < ends->len ? ends->ofs[l] + 9 : ends->size, 0);
+	return 1;
+}
+
 static void add_root(fz_context *ctx, pdf_obj *obj, pdf_obj ***roots, int *num_roots, int *max_roots)
 {
 	if (*num_roots == *max_roots)
@@ -27,12 +192,13 @@ static void add_root(fz_context *ctx, pdf_obj *obj, pdf_obj ***roots, int *num_r
 	(*roots)[(*num_roots)++] = pdf_keep_obj(ctx, obj);
 }
 
-int
-pdf_repair_obj(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf, fz_off_t *stmofsp, int *stmlenp, pdf_obj **encrypt, pdf_obj **id, pdf_obj **page, fz_off_t *tmpofs, pdf_obj **root)
+static int
+pdf_repair_obj_imp(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf, fz_off_t *stmofsp, int *stmlenp, pdf_obj **encrypt, pdf_obj **id, pdf_obj **page, fz_off_t *tmpofs, pdf_obj **root, struct stream_ends *ends)
 {
 	fz_stream *file = doc->file;
 	pdf_token tok;
 	int stm_len;
+	int scanned = 0;
 
 	*stmofsp = 0;
 	if (stmlenp)
@@ -163,6 +329,12 @@ pdf_repair_obj(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf, fz_off_t *st
 
 		while (memcmp(buf->scratch, "endstream", 9) != 0)
 		{
+			if (ends && ++scanned == STREAM_END_INLINE_SCAN)
+			{
+				/* The next candidate starts 8 bytes back */
+				if (seek_stream_end(ctx, doc, ends, fz_tell(ctx, file) - 8))
+					break;
+			}
 			c = fz_read_byte(ctx, file);
 			if (c == EOF)
 				break;
@@ -192,6 +364,12 @@ atobjend:
 	return tok;
 }
 
+int
+pdf_repair_obj(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf, fz_off_t *stmofsp, int *stmlenp, pdf_obj **encrypt, pdf_obj **id, pdf_obj **page, fz_off_t *tmpofs, pdf_obj **root)
+{
+	return pdf_repair_obj_imp(ctx, doc, buf, stmofsp, stmlenp, encrypt, id, page, tmpofs, root, NULL);
+}
+
 static void
 pdf_repair_obj_stm(fz_context *ctx, pdf_document *doc, int stm_num)
 {
@@ -288,6 +466,7 @@ pdf_repair_xref(fz_context *ctx, pdf_document *doc)
 	pdf_lexbuf *buf = &doc->lexbuf.base;
 	int num_roots = 0;
 	int max_roots = 0;
+	struct stream_ends ends = { 0 };
 
 	fz_var(encrypt);
 	fz_var(id);
@@ -382,7 +561,7 @@ pdf_repair_xref(fz_context *ctx, pdf_document *doc)
 				{
 					stm_len = 0;
 					stm_ofs = 0;
-					tok = pdf_repair_obj(ctx, doc, buf, &stm_ofs, &stm_len, &encrypt, &id, NULL, &tmpofs, &root);
+					tok = pdf_repair_obj_imp(ctx, doc, buf, &stm_ofs, &stm_len, &encrypt, &id, NULL, &tmpofs, &root, &ends);
 					if (root)
 						add_root(ctx, root, &roots, &num_roots, &max_roots);
 				}
@@ -630,6 +809,7 @@ pdf_repair_xref(fz_context *ctx, pdf_document *doc)
 		for (i = 0; i < num_roots; i++)
 			pdf_drop_obj(ctx, roots[i]);
 		fz_free(ctx, roots);
+		fz_free(ctx, ends.ofs);
 	}
 	fz_catch(ctx)
 	{
@@ -642,31 +822,271 @@ pdf_repair_xref(fz_context *ctx, pdf_document *doc)
 	}
 }
 
+/*
+	Object streams are decompressed in parallel too. We read the raw
+	data of a batch of them on this thread, read the headers on as
+	many threads as we can, and then update the xref from the headers
+	one stream at a time, in object number order, exactly as if we
+	had read them here. Streams whose filters need the document (for
+	indirect parameters, crypt filters or JBIG2 globals) are read here
+	when their turn comes.
+*/
+
+enum
+{
+	OBJ_STM_MAX_BATCH = 256,
+	OBJ_STM_MAX_BATCH_SIZE = 32 << 20
+};
+
+struct obj_stm_job
+{
+	int num;
+	int count;
+	int xref_len;
+	pdf_obj *dict;
+	fz_buffer *raw;
+	int len, cap;
+	int *nums;
+	int error;
+};
+
+static int
+pdf_obj_stm_filter_is_simple(fz_context *ctx, pdf_obj *f, pdf_obj *p)
+{
+	int i, n;
+
+	if (pdf_is_indirect(ctx, f) || pdf_is_indirect(ctx, p))
+		return 0;
+	if (pdf_is_array(ctx, f))
+	{
+		n = pdf_array_len(ctx, f);
+		for (i = 0; i < n; i++)
+			if (!pdf_obj_stm_filter_is_simple(ctx, pdf_array_get(ctx, f, i), pdf_array_get(ctx, p, i)))
+				return 0;
+		return 1;
+	}
+	if (pdf_name_eq(ctx, f, PDF_NAME_Crypt) || pdf_name_eq(ctx, f, PDF_NAME_JBIG2Decode))
+		return 0;
+	n = pdf_dict_len(ctx, p);
+	for (i = 0; i < n; i++)
+		if (pdf_is_indirect(ctx, pdf_dict_get_val(ctx, p, i)))
+			return 0;
+	return 1;
+}
+
+static void
+pdf_read_obj_stm_header(fz_context *ctx, fz_stream *stm, struct obj_stm_job *job)
+{
+	pdf_lexbuf buf;
+	pdf_token tok;
+	int i, n;
+
+	pdf_lexbuf_init(ctx, &buf, PDF_LEXBUF_SMALL);
+
+	fz_try(ctx)
+	{
+		for (i = 0; i < job->count; i++)
+		{
+			tok = pdf_lex(ctx, stm, &buf);
+			if (tok != PDF_TOK_INT)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt object stream (%d 0 R)", job->num);
+
+			n = buf.i;
+			if (job->len == job->cap)
+			{
+				int cap = job->cap ? job->cap * 2 : 64;
+				job->nums = fz_resize_array(ctx, job->nums, cap, sizeof(*job->nums));
+				job->cap = cap;
+			}
+			job->nums[job->len++] = n;
+			if (n < 0 || n >= job->xref_len)
+				continue;
+
+			tok = pdf_lex(ctx, stm, &buf);
+			if (tok != PDF_TOK_INT)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt object stream (%d 0 R)", job->num);
+		}
+	}
+	fz_always(ctx)
+	{
+		pdf_lexbuf_fin(ctx, &buf);
+	}
+	fz_catch(ctx)
+	{
+		job->error = 1;
+	}
+}
+
+static void
+pdf_read_obj_stm_task(fz_context *ctx, void *arg, int task)
+{
+	struct obj_stm_job *job = &((struct obj_stm_job *)arg)[task];
+	fz_stream *raw = NULL;
+	fz_stream *stm = NULL;
+
+	fz_var(raw);
+	fz_var(stm);
+
+	if (!job->raw)
+		return;
+
+	fz_try(ctx)
+	{
+		raw = fz_open_buffer(ctx, job->raw);
+		stm = pdf_open_inline_stream(ctx, NULL, job->dict, (int)job->raw->len, raw, NULL);
+		pdf_read_obj_stm_header(ctx, stm, job);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, stm);
+		fz_drop_stream(ctx, raw);
+	}
+	fz_catch(ctx)
+	{
+		job->error = 1;
+	}
+}
+
+static void
+pdf_apply_obj_stm_header(fz_context *ctx, pdf_document *doc, struct obj_stm_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->len; i++)
+	{
+		pdf_xref_entry *entry;
+		int n = job->nums[i];
+
+		if (n < 0 || n >= job->xref_len)
+		{
+			fz_warn(ctx, "ignoring object with invalid object number (%d %d R)", n, i);
+			continue;
+		}
+
+		entry = pdf_get_populating_xref_entry(ctx, doc, n);
+		entry->ofs = job->num;
+		entry->gen = i;
+		entry->num = n;
+		entry->stm_ofs = 0;
+		pdf_drop_obj(ctx, entry->obj);
+		entry->obj = NULL;
+		entry->type = 'o';
+	}
+
+	if (job->error)
+		fz_warn(ctx, "ignoring broken object stream (%d 0 R)", job->num);
+}
+
+static void
+pdf_repair_obj_stm_batch(fz_context *ctx, pdf_document *doc, struct obj_stm_job *jobs, int count)
+{
+	int i;
+
+	fz_run_tasks(ctx, 0, count, pdf_read_obj_stm_task, jobs);
+
+	for (i = 0; i < count; i++)
+	{
+		struct obj_stm_job *job = &jobs[i];
+
+		/* An earlier object stream may have claimed this one. */
+		if (pdf_get_populating_xref_entry(ctx, doc, job->num)->stm_ofs == 0)
+			continue;
+
+		if (job->raw)
+			pdf_apply_obj_stm_header(ctx, doc, job);
+		else
+		{
+			fz_try(ctx)
+				pdf_repair_obj_stm(ctx, doc, job->num);
+			fz_catch(ctx)
+				fz_warn(ctx, "ignoring broken object stream (%d 0 R)", job->num);
+		}
+	}
+}
+
+static void
+pdf_drop_obj_stm_jobs(fz_context *ctx, struct obj_stm_job *jobs, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		pdf_drop_obj(ctx, jobs[i].dict);
+		fz_drop_buffer(ctx, jobs[i].raw);
+		fz_free(ctx, jobs[i].nums);
+	}
+	memset(jobs, 0, count * sizeof(*jobs));
+}
+
 void
 pdf_repair_obj_stms(fz_context *ctx, pdf_document *doc)
 {
+	struct obj_stm_job *jobs;
 	pdf_obj *dict;
-	int i;
+	int i, count = 0;
+	size_t size = 0;
 	int xref_len = pdf_xref_len(ctx, doc);
 
-	for (i = 0; i < xref_len; i++)
-	{
-		pdf_xref_entry *entry = pdf_get_populating_xref_entry(ctx, doc, i);
+	jobs = fz_calloc(ctx, OBJ_STM_MAX_BATCH, sizeof(*jobs));
+
+	fz_var(count);
 
-		if (entry->stm_ofs)
+	fz_try(ctx)
+	{
+		for (i = 0; i < xref_len; i++)
 		{
+			pdf_xref_entry *entry = pdf_get_populating_xref_entry(ctx, doc, i);
+			struct obj_stm_job *job;
+
+			if (!entry->stm_ofs)
+				continue;
+
 			dict = pdf_load_object(ctx, doc, i);
-			fz_try(ctx)
+			if (!pdf_name_eq(ctx, pdf_dict_get(ctx, dict, PDF_NAME_Type), PDF_NAME_ObjStm))
 			{
-				if (pdf_name_eq(ctx, pdf_dict_get(ctx, dict, PDF_NAME_Type), PDF_NAME_ObjStm))
-					pdf_repair_obj_stm(ctx, doc, i);
+				pdf_drop_obj(ctx, dict);
+				continue;
 			}
-			fz_catch(ctx)
+
+			job = &jobs[count++];
+			job->num = i;
+			job->dict = dict;
+			job->xref_len = xref_len;
+			job->count = pdf_to_int(ctx, pdf_dict_get(ctx, dict, PDF_NAME_N));
+
+			if (pdf_obj_stm_filter_is_simple(ctx, pdf_dict_geta(ctx, dict, PDF_NAME_Filter, PDF_NAME_F), pdf_dict_geta(ctx, dict, PDF_NAME_DecodeParms, PDF_NAME_DP)))
 			{
-				fz_warn(ctx, "ignoring broken object stream (%d 0 R)", i);
+				fz_try(ctx)
+				{
+					job->raw = pdf_load_raw_stream(ctx, doc, i);
+					size += job->raw->len;
+				}
+				fz_catch(ctx)
+				{
+					/* Read it the slow way, and report the error then. */
+					job->raw = NULL;
+				}
+			}
+
+			if (count == OBJ_STM_MAX_BATCH || size >= OBJ_STM_MAX_BATCH_SIZE)
+			{
+				pdf_repair_obj_stm_batch(ctx, doc, jobs, count);
+				pdf_drop_obj_stm_jobs(ctx, jobs, count);
+				count = 0;
+				size = 0;
 			}
-			pdf_drop_obj(ctx, dict);
 		}
+
+		pdf_repair_obj_stm_batch(ctx, doc, jobs, count);
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj_stm_jobs(ctx, jobs, count);
+		fz_free(ctx, jobs);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
 	}
 
 	/* Ensure that streamed objects reside inside a known non-streamed object */
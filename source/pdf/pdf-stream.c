@@ -533,6 +533,66 @@ can_reuse_buffer(fz_context *ctx, pdf_xref_entry *entry, fz_compression_params *
 
 }
 
+/*
+ * Streams deflated by pdf_write_document with do_flate_restarts set
+ * carry the points at which the compression was restarted, so that we
+ * can inflate them on several threads. Anything unexpected sends us
+ * back to the filters.
+ */
+static fz_buffer *
+pdf_load_restarted_stream(fz_context *ctx, pdf_document *doc, int num, pdf_obj *dict)
+{
+	pdf_obj *f, *p, *points;
+	fz_buffer *raw = NULL;
+	fz_buffer *buf = NULL;
+	size_t *pts = NULL;
+	int i, n, dl;
+
+	points = pdf_dict_gets(ctx, dict, "MuPDF_FlateRestarts");
+	n = pdf_array_len(ctx, points);
+	dl = pdf_to_int(ctx, pdf_dict_gets(ctx, dict, "DL"));
+	if (n < 2 || (n & 1) || dl <= 0)
+		return NULL;
+
+	f = pdf_dict_geta(ctx, dict, PDF_NAME_Filter, PDF_NAME_F);
+	p = pdf_dict_geta(ctx, dict, PDF_NAME_DecodeParms, PDF_NAME_DP);
+	if (pdf_is_array(ctx, f))
+	{
+		if (pdf_array_len(ctx, f) != 1)
+			return NULL;
+		f = pdf_array_get(ctx, f, 0);
+		p = pdf_array_get(ctx, p, 0);
+	}
+	if (!pdf_name_eq(ctx, f, PDF_NAME_FlateDecode) && !pdf_name_eq(ctx, f, PDF_NAME_Fl))
+		return NULL;
+	if (pdf_to_int(ctx, pdf_dict_get(ctx, p, PDF_NAME_Predictor)) > 1)
+		return NULL;
+
+	fz_var(raw);
+	fz_var(pts);
+
+	fz_try(ctx)
+	{
+		pts = fz_malloc_array(ctx, n, sizeof(*pts));
+		for (i = 0; i < n; i++)
+			pts[i] = (size_t)pdf_to_int(ctx, pdf_array_get(ctx, points, i));
+		raw = pdf_load_raw_stream(ctx, doc, num);
+		buf = fz_inflate_restarts(ctx, raw->data, raw->len, pts, n / 2, dl);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, pts);
+		fz_drop_buffer(ctx, raw);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
+		buf = NULL;
+	}
+
+	return buf;
+}
+
 static fz_buffer *
 pdf_load_image_stream(fz_context *ctx, pdf_document *doc, int num, fz_compression_params *params, int *truncated)
 {
@@ -554,6 +614,24 @@ pdf_load_image_stream(fz_context *ctx, pdf_document *doc, int num, fz_compressio
 
 	dict = pdf_load_object(ctx, doc, num);
 
+	if (!params)
+	{
+		fz_try(ctx)
+			buf = pdf_load_restarted_stream(ctx, doc, num, dict);
+		fz_catch(ctx)
+		{
+			pdf_drop_obj(ctx, dict);
+			fz_rethrow(ctx);
+		}
+		if (buf)
+		{
+			if (truncated)
+				*truncated = 0;
+			pdf_drop_obj(ctx, dict);
+			return buf;
+		}
+	}
+
 	len = pdf_to_int(ctx, pdf_dict_get(ctx, dict, PDF_NAME_Length));
 	obj = pdf_dict_get(ctx, dict, PDF_NAME_Filter);
 	len = pdf_guess_filter_length(len, pdf_to_name(ctx, obj));
@@ -59,6 +59,7 @@ struct pdf_write_state_s
 	int do_garbage;
 	int do_linear;
 	int do_clean;
+	int do_flate_restarts;
 
 	int *use_list;
 	fz_off_t *ofs_list;
@@ -581,6 +582,49 @@ void indent()
 #define DEBUGGING_MARKING(A) do { } while (0)
 #endif
 
+/* Load the objects a dict or array refers to that we have not yet
+ * visited, in file order, before we walk down into them one by one. */
+static void prefetchrefs(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *obj)
+{
+	int is_dict = pdf_is_dict(ctx, obj);
+	int i, k, n, count = 0;
+	int xref_len = pdf_xref_len(ctx, doc);
+	int *nums = NULL;
+
+	n = is_dict ? pdf_dict_len(ctx, obj) : pdf_array_len(ctx, obj);
+	for (k = 0; k < 2; k++)
+	{
+		if (k == 1)
+		{
+			/* A single object gains nothing from sorting. */
+			if (count < 2)
+				return;
+			nums = fz_malloc_array(ctx, count, sizeof(*nums));
+			count = 0;
+		}
+		for (i = 0; i < n; i++)
+		{
+			pdf_obj *val = is_dict ? pdf_dict_get_val(ctx, obj, i) : pdf_array_get(ctx, obj, i);
+			int num;
+			if (!pdf_is_indirect(ctx, val))
+				continue;
+			num = pdf_to_num(ctx, val);
+			if (num <= 0 || num >= xref_len || opts->use_list[num])
+				continue;
+			if (k == 1)
+				nums[count] = num;
+			count++;
+		}
+	}
+
+	fz_try(ctx)
+		pdf_prefetch_objects(ctx, doc, nums, count);
+	fz_always(ctx)
+		fz_free(ctx, nums);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
 /* Recursively mark an object. If any references found are duff, then
  * replace them with nulls. */
 static int markobj(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *obj)
@@ -604,6 +648,7 @@ static int markobj(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pd
 	if (pdf_is_dict(ctx, obj))
 	{
 		int n = pdf_dict_len(ctx, obj);
+		prefetchrefs(ctx, doc, opts, obj);
 		for (i = 0; i < n; i++)
 		{
 			DEBUGGING_MARKING(indent(); printf("DICT[%d/%d] = %s\n", i, n, pdf_to_name(ctx, pdf_dict_get_key(ctx, obj, i))));
@@ -615,6 +660,7 @@ static int markobj(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pd
 	else if (pdf_is_array(ctx, obj))
 	{
 		int n = pdf_array_len(ctx, obj);
+		prefetchrefs(ctx, doc, opts, obj);
 		for (i = 0; i < n; i++)
 		{
 			DEBUGGING_MARKING(indent(); printf("ARRAY[%d/%d]\n", i, n));
@@ -1487,14 +1533,32 @@ update_linearization_params(fz_context *ctx, pdf_document *doc, pdf_write_state
 }
 
 /*
- * Make sure we have loaded objects from object streams.
+ * Make sure we have loaded objects from object streams. If we are
+ * going to write out every object anyway, load the rest as well, so
+ * that we read them in file order rather than seeking about for each.
  */
 
-static void preloadobjstms(fz_context *ctx, pdf_document *doc)
+static void preloadobjstms(fz_context *ctx, pdf_document *doc, int all)
 {
 	pdf_obj *obj;
-	int num;
+	int num, n = 0;
 	int xref_len = pdf_xref_len(ctx, doc);
+	int *nums = fz_malloc_array(ctx, xref_len, sizeof(*nums));
+
+	fz_try(ctx)
+	{
+		for (num = 1; num < xref_len; num++)
+		{
+			int type = pdf_get_xref_entry(ctx, doc, num)->type;
+			if (type == 'o' || (all && type == 'n'))
+				nums[n++] = num;
+		}
+		pdf_prefetch_objects(ctx, doc, nums, n);
+	}
+	fz_always(ctx)
+		fz_free(ctx, nums);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 
 	for (num = 0; num < xref_len; num++)
 	{
@@ -1603,25 +1667,49 @@ static void addhexfilter(fz_context *ctx, pdf_document *doc, pdf_obj *dict)
 
 }
 
-static fz_buffer *deflatebuf(fz_context *ctx, unsigned char *p, size_t n)
+/*
+ * Large streams are deflated on several threads. If asked to, we also
+ * note in the stream dictionary where the compression restarts, so that
+ * pdf_load_stream can inflate them on several threads as well.
+ */
+static fz_buffer *deflatebuf(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *dict, unsigned char *p, size_t n)
 {
-	fz_buffer *buf;
-	uLongf csize;
-	int t;
-	uLong longN = (uLong)n;
+	fz_deflater *z;
+	fz_buffer *buf = NULL;
+	const size_t *points;
+	pdf_obj *arr;
+	int i, count;
 
-	if (n != (size_t)longN)
+	if (n > INT_MAX)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Buffer to large to deflate");
 
-	buf = fz_new_buffer(ctx, compressBound(longN));
-	csize = (uLongf)buf->cap;
-	t = compress(buf->data, &csize, p, longN);
-	if (t != Z_OK)
+	z = fz_new_deflater(ctx, Z_DEFAULT_COMPRESSION, opts->do_flate_restarts);
+
+	fz_var(buf);
+
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer(ctx, n / 4 + 64);
+		fz_deflater_write(ctx, z, buf, p, n, 1);
+
+		pdf_dict_dels(ctx, dict, "MuPDF_FlateRestarts");
+		count = fz_deflater_restarts(ctx, z, &points);
+		if (count > 0)
+		{
+			arr = pdf_new_array(ctx, doc, 2 * count);
+			pdf_dict_puts_drop(ctx, dict, "MuPDF_FlateRestarts", arr);
+			for (i = 0; i < 2 * count; i++)
+				pdf_array_push_drop(ctx, arr, pdf_new_int(ctx, doc, (int)points[i]));
+			pdf_dict_puts_drop(ctx, dict, "DL", pdf_new_int(ctx, doc, (int)n));
+		}
+	}
+	fz_always(ctx)
+		fz_drop_deflater(ctx, z);
+	fz_catch(ctx)
 	{
 		fz_drop_buffer(ctx, buf);
-		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot deflate buffer");
+		fz_rethrow(ctx);
 	}
-	buf->len = csize;
 	return buf;
 }
 
@@ -1639,9 +1727,13 @@ static void copystream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts
 	{
 		pdf_dict_put(ctx, obj, PDF_NAME_Filter, PDF_NAME_FlateDecode);
 
-		tmp = deflatebuf(ctx, buf->data, buf->len);
+		tmp = deflatebuf(ctx, doc, opts, obj, buf->data, buf->len);
 		fz_drop_buffer(ctx, buf);
 		buf = tmp;
+
+		newlen = pdf_new_int(ctx, doc, (int)buf->len);
+		pdf_dict_put(ctx, obj, PDF_NAME_Length, newlen);
+		pdf_drop_obj(ctx, newlen);
 	}
 
 	if (opts->do_ascii && isbinarystream(buf))
@@ -1683,12 +1775,13 @@ static void expandstream(fz_context *ctx, pdf_document *doc, pdf_write_state *op
 	obj = pdf_copy_dict(ctx, obj_orig);
 	pdf_dict_del(ctx, obj, PDF_NAME_Filter);
 	pdf_dict_del(ctx, obj, PDF_NAME_DecodeParms);
+	pdf_dict_dels(ctx, obj, "MuPDF_FlateRestarts");
 
 	if (do_deflate)
 	{
 		pdf_dict_put(ctx, obj, PDF_NAME_Filter, PDF_NAME_FlateDecode);
 
-		tmp = deflatebuf(ctx, buf->data, buf->len);
+		tmp = deflatebuf(ctx, doc, opts, obj, buf->data, buf->len);
 		fz_drop_buffer(ctx, buf);
 		buf = tmp;
 	}
@@ -2242,6 +2335,11 @@ make_page_offset_hints(fz_context *ctx, pdf_document *doc, pdf_write_state *opts
 	max_shared_object = 1;
 	min_shared_length = opts->file_len;
 	max_shared_length = 0;
+	for (i=0; i < opts->page_count; i++)
+	{
+		pop[i]->min_ofs = opts->file_len;
+		pop[i]->max_ofs = 0;
+	}
 	for (i=1; i < xref_len; i++)
 	{
 		int min, max, page;
@@ -2291,6 +2389,14 @@ make_page_offset_hints(fz_context *ctx, pdf_document *doc, pdf_write_state *opts
 			if (pop[page]->max_ofs < max)
 				pop[page]->max_ofs = max;
 		}
+		else if ((opts->use_list[i] & (USE_SHARED | USE_PAGE1)) == (USE_SHARED | USE_PAGE1))
+		{
+			/* Shared objects that page 1 uses are written in the
+			 * first page section, so the next page starts after
+			 * them. */
+			if (pop[0]->max_ofs < max)
+				pop[0]->max_ofs = max;
+		}
 	}
 
 	min_objs_per_page = max_objs_per_page = pop[0]->num_objects;
@@ -2439,7 +2545,7 @@ make_page_offset_hints(fz_context *ctx, pdf_document *doc, pdf_write_state *opts
 	fz_write_buffer_bits(ctx, buf, pop[0]->num_shared, 32);
 	/* Header Item 4: The number of shared object entries for the shared
 	 * objects section + first page. */
-	fz_write_buffer_bits(ctx, buf, max_shared_object - min_shared_object + pop[0]->num_shared, 32);
+	fz_write_buffer_bits(ctx, buf, max_shared_object - min_shared_object + 1 + pop[0]->num_shared, 32);
 	/* Header Item 5: The number of bits needed to represent the greatest
 	 * number of objects in a shared object group (Always 0). */
 	fz_write_buffer_bits(ctx, buf, 0, 16);
@@ -2483,7 +2589,7 @@ make_page_offset_hints(fz_context *ctx, pdf_document *doc, pdf_write_state *opts
 	fz_write_buffer_pad(ctx, buf);
 
 	/* Item 2: MD5 presence flags */
-	for (i = max_shared_object - min_shared_object + pop[0]->num_shared; i > 0; i--)
+	for (i = max_shared_object - min_shared_object + 1 + pop[0]->num_shared; i > 0; i--)
 	{
 		fz_write_buffer_bits(ctx, buf, 0, 1);
 	}
@@ -2690,6 +2796,7 @@ static void initialise_write_state(fz_context *ctx, pdf_document *doc, const pdf
 	opts->do_garbage = in_opts->do_garbage;
 	opts->do_linear = in_opts->do_linear;
 	opts->do_clean = in_opts->do_clean;
+	opts->do_flate_restarts = in_opts->do_flate_restarts;
 	opts->start = 0;
 	opts->main_xref_offset = INT_MIN;
 
@@ -2745,6 +2852,7 @@ const char *fz_pdf_write_options_usage =
 	"\tcompress: compress all streams\n"
 	"\tcompress-fonts: compress embedded fonts\n"
 	"\tcompress-images: compress images\n"
+	"\tflate-restarts: record restart points in large compressed streams\n"
 	"\tascii: ASCII hex encode binary streams\n"
 	"\tpretty: pretty-print objects with indentation\n"
 	"\tlinearize: optimize for web browsers\n"
@@ -2779,6 +2887,8 @@ pdf_parse_write_options(fz_context *ctx, pdf_write_options *opts, const char *ar
 		opts->do_clean = opteq(val, "yes");
 	if (fz_has_option(ctx, args, "incremental", &val))
 		opts->do_incremental = opteq(val, "yes");
+	if (fz_has_option(ctx, args, "flate-restarts", &val))
+		opts->do_flate_restarts = opteq(val, "yes");
 	if (fz_has_option(ctx, args, "continue-on-error", &val))
 		opts->continue_on_error = opteq(val, "yes");
 	if (fz_has_option(ctx, args, "garbage", &val))
@@ -2809,6 +2919,7 @@ static void
 prepare_for_save(fz_context *ctx, pdf_document *doc, pdf_write_options *in_opts)
 {
 	doc->freeze_updates = 1;
+	pdf_invalidate_xref_cache(ctx, doc);
 
 	/* Sanitize the operator streams */
 	if (in_opts->do_clean)
@@ -2847,7 +2958,7 @@ do_pdf_save_document(fz_context *ctx, pdf_document *doc, pdf_write_state *opts,
 		if (!opts->do_incremental)
 		{
 			pdf_ensure_solid_xref(ctx, doc, xref_len);
-			preloadobjstms(ctx, doc);
+			preloadobjstms(ctx, doc, opts->do_garbage == 0 && !opts->do_linear);
 		}
 
 		/* Sweep & mark objects from the trailer */
@@ -1,6 +1,8 @@
 #include "mupdf/pdf.h"
 #include "mupdf/fitz/document.h"
 
+#include <sys/stat.h>
+
 #undef DEBUG_PROGESSIVE_ADVANCE
 
 #ifdef DEBUG_PROGESSIVE_ADVANCE
@@ -499,6 +501,10 @@ void pdf_replace_xref(fz_context *ctx, pdf_document *doc, pdf_xref_entry *entrie
 	pdf_xref_subsec *sub;
 	pdf_obj *trailer = pdf_keep_obj(ctx, pdf_trailer(ctx, doc));
 
+	/* The objects are about to be renumbered */
+	pdf_invalidate_xref_cache(ctx, doc);
+	pdf_drop_page_map(ctx, doc);
+
 	fz_var(xref);
 	fz_try(ctx)
 	{
@@ -624,22 +630,15 @@ static int fz_skip_string(fz_context *ctx, fz_stream *stm, const char *str)
  * trailer dictionary
  */
 
-static int
-pdf_xref_size_from_old_trailer(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
+/* Skip over an old style xref table, and parse the trailer that follows it. */
+static pdf_obj *
+pdf_read_old_trailer(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 {
 	fz_off_t len;
 	char *s;
 	fz_off_t t;
 	pdf_token tok;
 	int c;
-	int size;
-	fz_off_t ofs;
-	pdf_obj *trailer = NULL;
-
-	fz_var(trailer);
-
-	/* Record the current file read offset so that we can reinstate it */
-	ofs = fz_tell(ctx, doc->file);
 
 	fz_skip_space(ctx, doc->file);
 	if (fz_skip_string(ctx, doc->file, "xref"))
@@ -674,17 +673,32 @@ pdf_xref_size_from_old_trailer(fz_context *ctx, pdf_document *doc, pdf_lexbuf *b
 		fz_seek(ctx, doc->file, t + 20 * len, SEEK_SET);
 	}
 
-	fz_try(ctx)
-	{
-		tok = pdf_lex(ctx, doc->file, buf);
-		if (tok != PDF_TOK_TRAILER)
-			fz_throw(ctx, FZ_ERROR_GENERIC, "expected trailer marker");
+	tok = pdf_lex(ctx, doc->file, buf);
+	if (tok != PDF_TOK_TRAILER)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "expected trailer marker");
 
-		tok = pdf_lex(ctx, doc->file, buf);
-		if (tok != PDF_TOK_OPEN_DICT)
-			fz_throw(ctx, FZ_ERROR_GENERIC, "expected trailer dictionary");
+	tok = pdf_lex(ctx, doc->file, buf);
+	if (tok != PDF_TOK_OPEN_DICT)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "expected trailer dictionary");
+
+	return pdf_parse_dict(ctx, doc, doc->file, buf);
+}
+
+static int
+pdf_xref_size_from_old_trailer(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
+{
+	int size;
+	fz_off_t ofs;
+	pdf_obj *trailer = NULL;
+
+	fz_var(trailer);
+
+	/* Record the current file read offset so that we can reinstate it */
+	ofs = fz_tell(ctx, doc->file);
 
-		trailer = pdf_parse_dict(ctx, doc, doc->file, buf);
+	fz_try(ctx)
+	{
+		trailer = pdf_read_old_trailer(ctx, doc, buf);
 
 		size = pdf_to_int(ctx, pdf_dict_get(ctx, trailer, PDF_NAME_Size));
 		if (!size)
@@ -1195,6 +1209,404 @@ pdf_load_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 	}
 }
 
+/*
+ * xref cache
+ *
+ * Reading the xref of a large file means parsing every section in the
+ * Prev chain (and inflating the xref streams) before we can look at a
+ * single object. When the document is opened with
+ * pdf_open_document_with_xref_cache, we instead keep a sidecar file
+ * holding the flattened xref table and the page index, and use it on
+ * the next open if the file has not changed since.
+ *
+ * The cache is keyed on the file size, modification time (to the
+ * nanosecond where the platform has it), the startxref offset and the
+ * trailer ID and /Size. The trailer itself is not cached; we still
+ * read it from the file (it is small and sits at startxref), both to
+ * check the ID and so that the document trailer is exactly what a full
+ * load would have produced.
+ *
+ * Everything is stored in native byte order with natural alignment, so
+ * the file can be used in place (read or mapped) without any parsing:
+ *
+ *	header
+ *	trailer ID, as printed by pdf_sprint_obj, padded to 8 bytes
+ *	xref_len entries
+ *	page_len page references (num 0 for pages we have not seen)
+ *
+ * The cache is written when the document is dropped, so that it also
+ * holds whatever part of the page index was filled in while the
+ * document was in use. Documents that needed repair, or that were
+ * changed, are never cached.
+ */
+
+enum
+{
+	PDF_XREF_CACHE_BYTE_ORDER = 0x01020304,
+	PDF_XREF_CACHE_VERSION = 1,
+	PDF_XREF_CACHE_HAS_XREF_STREAMS = 1
+};
+
+static const char pdf_xref_cache_magic[8] = { 'M', 'U', 'X', 'R', 'E', 'F', 'C', '\n' };
+
+typedef struct pdf_xref_cache_header_s
+{
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t version;
+	int64_t file_size;
+	int64_t mtime;
+	int64_t startxref;
+	int32_t xref_len;
+	int32_t page_len;
+	int32_t id_len;
+	int32_t flags;
+	int32_t trailer_size;
+	int32_t pad;
+} pdf_xref_cache_header;
+
+typedef struct pdf_xref_cache_entry_s
+{
+	int64_t ofs;
+	int32_t num;
+	uint16_t gen;
+	char type;
+	char pad;
+} pdf_xref_cache_entry;
+
+typedef struct pdf_xref_cache_page_s
+{
+	int32_t num;
+	int32_t gen;
+} pdf_xref_cache_page;
+
+/* Modification time in nanoseconds, or 0 if the file cannot be found. */
+static int64_t
+pdf_file_mtime(const char *filename)
+{
+#ifdef _WIN32
+	struct _stat st;
+	wchar_t *wname;
+	int code;
+
+	wname = fz_wchar_from_utf8(filename);
+	if (!wname)
+		return 0;
+	code = _wstat(wname, &st);
+	free(wname);
+	if (code < 0)
+		return 0;
+	return (int64_t)st.st_mtime * 1000000000;
+#else
+	struct stat st;
+
+	if (stat(filename, &st) < 0)
+		return 0;
+#if defined(__APPLE__)
+	return (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L
+	return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+	return (int64_t)st.st_mtime * 1000000000;
+#endif
+#endif
+}
+
+/* Read the trailer of the last xref section, without reading the xref. */
+static pdf_obj *
+pdf_read_last_trailer(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
+{
+	int num, gen, c;
+	fz_off_t stm_ofs;
+
+	fz_seek(ctx, doc->file, doc->startxref, SEEK_SET);
+
+	while (iswhite(fz_peek_byte(ctx, doc->file)))
+		fz_read_byte(ctx, doc->file);
+
+	c = fz_peek_byte(ctx, doc->file);
+	if (c == 'x')
+		return pdf_read_old_trailer(ctx, doc, buf);
+	else if (c >= '0' && c <= '9')
+		return pdf_parse_ind_obj(ctx, doc, doc->file, buf, &num, &gen, &stm_ofs, NULL);
+	fz_throw(ctx, FZ_ERROR_GENERIC, "cannot recognize xref format");
+}
+
+static void
+pdf_install_xref_cache(fz_context *ctx, pdf_document *doc, const pdf_xref_cache_entry *cached, int len, pdf_obj *trailer)
+{
+	pdf_xref *xref;
+	pdf_xref_subsec *sub;
+	int i;
+
+	pdf_populate_next_xref_level(ctx, doc);
+	xref = &doc->xref_sections[0];
+	sub = xref->subsec = fz_malloc_struct(ctx, pdf_xref_subsec);
+	sub->table = fz_calloc(ctx, len, sizeof(pdf_xref_entry));
+	sub->start = 0;
+	sub->len = len;
+	xref->num_objects = len;
+	xref->trailer = pdf_keep_obj(ctx, trailer);
+
+	for (i = 0; i < len; i++)
+	{
+		pdf_xref_entry *entry = &sub->table[i];
+		int type = cached[i].type;
+
+		if (type == 'n' && (cached[i].ofs <= 0 || cached[i].ofs >= doc->file_size))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "object offset out of range");
+		if (type == 'o' && (cached[i].ofs <= 0 || cached[i].ofs >= len || cached[i].ofs == i))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "object stream out of range");
+		if (type != 0 && type != 'f' && type != 'n' && type != 'o')
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unknown object type");
+
+		entry->type = type;
+		entry->gen = cached[i].gen;
+		entry->num = cached[i].num;
+		entry->ofs = cached[i].ofs;
+	}
+
+	extend_xref_index(ctx, doc, len);
+	pdf_prime_xref_index(ctx, doc);
+}
+
+static void
+pdf_install_page_cache(fz_context *ctx, pdf_document *doc, const pdf_xref_cache_page *cached, int len)
+{
+	int i;
+
+	if (len == 0)
+		return;
+
+	doc->page_map = fz_calloc(ctx, len, sizeof(*doc->page_map));
+	doc->page_map_len = len;
+	for (i = 0; i < len; i++)
+	{
+		if (cached[i].num <= 0 || cached[i].num >= doc->max_xref_len)
+			continue;
+		doc->page_map[i] = pdf_new_indirect(ctx, doc, cached[i].num, cached[i].gen);
+	}
+}
+
+/*
+ * Check that the cache was made from the file as it is now. Returns the
+ * file's trailer if so, NULL if the cache is stale; throws if the cache
+ * is corrupt.
+ */
+static pdf_obj *
+pdf_check_xref_cache(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf, fz_buffer *cache, pdf_xref_cache_header *hdr)
+{
+	pdf_obj *trailer;
+	char id[1024];
+	int id_len, match;
+	size_t size;
+
+	if (cache->len < sizeof *hdr)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "xref cache is truncated");
+	memcpy(hdr, cache->data, sizeof *hdr);
+	if (memcmp(hdr->magic, pdf_xref_cache_magic, sizeof hdr->magic) != 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "not an xref cache");
+
+	/* Written by a different build; just replace it */
+	if (hdr->byte_order != PDF_XREF_CACHE_BYTE_ORDER || hdr->version != PDF_XREF_CACHE_VERSION)
+		return NULL;
+
+	if (hdr->xref_len <= 0 || hdr->page_len < 0 || hdr->id_len < 0 || hdr->id_len >= (int)sizeof id)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "xref cache header is corrupt");
+	size = sizeof *hdr + ((hdr->id_len + 7) & ~7) + (size_t)hdr->xref_len * sizeof(pdf_xref_cache_entry) + (size_t)hdr->page_len * sizeof(pdf_xref_cache_page);
+	if (cache->len != size)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "xref cache is truncated");
+
+	pdf_read_start_xref(ctx, doc);
+	if (hdr->file_size != doc->file_size || hdr->startxref != doc->startxref || hdr->mtime != doc->xref_cache_mtime)
+		return NULL;
+
+	trailer = pdf_read_last_trailer(ctx, doc, buf);
+	id_len = pdf_sprint_obj(ctx, id, sizeof id, pdf_dict_get(ctx, trailer, PDF_NAME_ID), 1);
+	match = (id_len == hdr->id_len && memcmp(id, cache->data + sizeof *hdr, id_len) == 0);
+	if (pdf_to_int(ctx, pdf_dict_get(ctx, trailer, PDF_NAME_Size)) != hdr->trailer_size)
+		match = 0;
+	if (!match)
+	{
+		pdf_drop_obj(ctx, trailer);
+		return NULL;
+	}
+	return trailer;
+}
+
+/*
+ * Set up the xref from the cache file, if there is one and it is still
+ * valid. Returns 0 (having left the document untouched) if the xref
+ * needs to be loaded from the file instead.
+ *
+ * File locked on entry, throughout and on exit.
+ */
+static int
+pdf_load_xref_cache(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
+{
+	fz_buffer *cache = NULL;
+	pdf_obj *trailer = NULL;
+	pdf_xref_cache_header hdr;
+	int loaded = 0;
+
+	/* No cache yet; don't have fz_read_file complain about it */
+	if (!doc->xref_cache || pdf_file_mtime(doc->xref_cache) == 0)
+		return 0;
+
+	fz_var(cache);
+	fz_var(trailer);
+	fz_var(loaded);
+
+	fz_try(ctx)
+	{
+		cache = fz_read_file(ctx, doc->xref_cache);
+		trailer = pdf_check_xref_cache(ctx, doc, buf, cache, &hdr);
+		if (trailer)
+		{
+			unsigned char *entries = cache->data + sizeof hdr + ((hdr.id_len + 7) & ~7);
+			unsigned char *pages = entries + (size_t)hdr.xref_len * sizeof(pdf_xref_cache_entry);
+
+			pdf_install_xref_cache(ctx, doc, (pdf_xref_cache_entry *)entries, hdr.xref_len, trailer);
+			pdf_install_page_cache(ctx, doc, (pdf_xref_cache_page *)pages, hdr.page_len);
+			doc->has_xref_streams = !!(hdr.flags & PDF_XREF_CACHE_HAS_XREF_STREAMS);
+			doc->xref_cache_pages = hdr.page_len;
+			loaded = 1;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, cache);
+		pdf_drop_obj(ctx, trailer);
+	}
+	fz_catch(ctx)
+	{
+		pdf_drop_xref_sections(ctx, doc);
+		pdf_drop_page_map(ctx, doc);
+		fz_free(ctx, doc->xref_index);
+		doc->xref_index = NULL;
+		doc->max_xref_len = 0;
+		doc->has_xref_streams = 0;
+		fz_warn(ctx, "ignoring xref cache: %s", fz_caught_message(ctx));
+	}
+
+	return loaded;
+}
+
+static void
+pdf_save_xref_cache(fz_context *ctx, pdf_document *doc)
+{
+	fz_buffer *buf = NULL;
+	char *tmp = NULL;
+	pdf_xref_cache_header hdr;
+	char id[1024];
+	int i, id_len, page_len, known;
+	size_t size, tmp_size;
+
+	/* Only cache what we read, unchanged, from the file */
+	if (doc->xref_cache_mtime <= 0 || doc->repair_attempted || doc->file_reading_linearly)
+		return;
+	if (doc->num_xref_sections == 0 || doc->num_incremental_sections > 0 || doc->dirty)
+		return;
+
+	known = page_len = 0;
+	for (i = 0; i < doc->page_map_len; i++)
+	{
+		if (pdf_is_indirect(ctx, doc->page_map[i]))
+		{
+			page_len = i + 1;
+			known++;
+		}
+	}
+
+	/* Nothing new to remember */
+	if (doc->xref_cache_pages >= 0 && known <= doc->xref_cache_pages)
+		return;
+
+	id_len = pdf_sprint_obj(ctx, id, sizeof id, pdf_dict_get(ctx, pdf_trailer(ctx, doc), PDF_NAME_ID), 1);
+	if (id_len >= (int)sizeof id)
+		return;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, pdf_xref_cache_magic, sizeof hdr.magic);
+	hdr.byte_order = PDF_XREF_CACHE_BYTE_ORDER;
+	hdr.version = PDF_XREF_CACHE_VERSION;
+	hdr.file_size = doc->file_size;
+	hdr.mtime = doc->xref_cache_mtime;
+	hdr.startxref = doc->startxref;
+	hdr.xref_len = pdf_xref_len(ctx, doc);
+	hdr.page_len = page_len;
+	hdr.id_len = id_len;
+	hdr.flags = doc->has_xref_streams ? PDF_XREF_CACHE_HAS_XREF_STREAMS : 0;
+	hdr.trailer_size = pdf_to_int(ctx, pdf_dict_get(ctx, pdf_trailer(ctx, doc), PDF_NAME_Size));
+
+	size = sizeof hdr + ((id_len + 7) & ~7) + (size_t)hdr.xref_len * sizeof(pdf_xref_cache_entry) + (size_t)page_len * sizeof(pdf_xref_cache_page);
+	tmp_size = strlen(doc->xref_cache) + 5;
+
+	fz_var(buf);
+	fz_var(tmp);
+
+	fz_try(ctx)
+	{
+		static const char zeros[8] = { 0 };
+
+		buf = fz_new_buffer(ctx, size);
+		fz_write_buffer(ctx, buf, &hdr, sizeof hdr);
+		fz_write_buffer(ctx, buf, id, id_len);
+		fz_write_buffer(ctx, buf, zeros, ((id_len + 7) & ~7) - id_len);
+
+		for (i = 0; i < hdr.xref_len; i++)
+		{
+			pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, i);
+			pdf_xref_cache_entry cached;
+
+			cached.ofs = entry->ofs;
+			cached.num = entry->num;
+			cached.gen = entry->gen;
+			cached.type = entry->type;
+			cached.pad = 0;
+			fz_write_buffer(ctx, buf, &cached, sizeof cached);
+		}
+
+		for (i = 0; i < page_len; i++)
+		{
+			pdf_xref_cache_page cached;
+
+			cached.num = pdf_to_num(ctx, doc->page_map[i]);
+			cached.gen = pdf_to_gen(ctx, doc->page_map[i]);
+			fz_write_buffer(ctx, buf, &cached, sizeof cached);
+		}
+
+		/* Write to the side and move into place, so that a reader never
+		 * sees a partly written cache. */
+		tmp = fz_malloc(ctx, tmp_size);
+		fz_strlcpy(tmp, doc->xref_cache, tmp_size);
+		fz_strlcat(tmp, ".tmp", tmp_size);
+		fz_save_buffer(ctx, buf, tmp);
+		remove(doc->xref_cache);
+		if (rename(tmp, doc->xref_cache) < 0)
+		{
+			remove(tmp);
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot rename '%s': %s", tmp, strerror(errno));
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_free(ctx, tmp);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+void
+pdf_invalidate_xref_cache(fz_context *ctx, pdf_document *doc)
+{
+	fz_free(ctx, doc->xref_cache);
+	doc->xref_cache = NULL;
+}
+
 static void
 pdf_load_linear(fz_context *ctx, pdf_document *doc)
 {
@@ -1238,6 +1650,11 @@ pdf_load_linear(fz_context *ctx, pdf_document *doc)
 		doc->hint_object_offset = pdf_to_int(ctx, pdf_array_get(ctx, hint, 0));
 		doc->hint_object_length = pdf_to_int(ctx, pdf_array_get(ctx, hint, 1));
 
+		/* Ask for the first page, and the hints we will need to find
+		 * the others. */
+		fz_prefetch_stream(ctx, doc->file, 0, pdf_to_int(ctx, pdf_dict_get(ctx, dict, PDF_NAME_E)));
+		fz_prefetch_stream(ctx, doc->file, doc->hint_object_offset, doc->hint_object_length);
+
 		entry = pdf_get_populating_xref_entry(ctx, doc, 0);
 		entry->type = 'f';
 	}
@@ -1432,7 +1849,10 @@ pdf_init_document(fz_context *ctx, pdf_document *doc)
 
 		/* Check to see if we should work in progressive mode */
 		if (fz_stream_meta(ctx, doc->file, FZ_STREAM_META_PROGRESSIVE, 0, NULL) > 0)
+		{
 			doc->file_reading_linearly = 1;
+			doc->file_ranged = (fz_stream_meta(ctx, doc->file, FZ_STREAM_META_PREFETCH, 0, NULL) > 0);
+		}
 
 		/* Try to load the linearized file if we are in progressive
 		 * mode. */
@@ -1442,7 +1862,7 @@ pdf_init_document(fz_context *ctx, pdf_document *doc)
 		/* If we aren't in progressive mode (or the linear load failed
 		 * and has set us back to non-progressive mode), load normally.
 		 */
-		if (!doc->file_reading_linearly)
+		if (!doc->file_reading_linearly && !pdf_load_xref_cache(ctx, doc, &doc->lexbuf.base))
 			pdf_load_xref(ctx, doc, &doc->lexbuf.base);
 	}
 	fz_catch(ctx)
@@ -1574,6 +1994,15 @@ pdf_drop_document_imp(fz_context *ctx, pdf_document *doc)
 	 * glyph cache at this point. */
 	fz_purge_glyph_cache(ctx);
 
+	if (doc->xref_cache)
+	{
+		fz_try(ctx)
+			pdf_save_xref_cache(ctx, doc);
+		fz_catch(ctx)
+			fz_warn(ctx, "cannot write xref cache: %s", fz_caught_message(ctx));
+		pdf_invalidate_xref_cache(ctx, doc);
+	}
+
 	if (doc->js)
 		pdf_drop_js(ctx, doc->js);
 
@@ -1616,6 +2045,10 @@ pdf_drop_document_imp(fz_context *ctx, pdf_document *doc)
 
 	pdf_drop_resource_tables(ctx, doc);
 
+	pdf_drop_page_map(ctx, doc);
+	pdf_drop_name_table(ctx, doc);
+	pdf_drop_object_arena(ctx, doc);
+
 	fz_free(ctx, doc);
 }
 
@@ -1647,25 +2080,52 @@ pdf_print_xref(fz_context *ctx, pdf_document *doc)
  * compressed object streams
  */
 
-static pdf_xref_entry *
-pdf_load_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf, int target)
+/* A decoded object stream, with its table of contents parsed, kept in
+ * the store. Objects we take out of an object stream are liable to be
+ * dropped again (by pdf_clear_xref_to_mark, after each page), and
+ * without this every miss on a member would mean inflating the whole
+ * stream and parsing every object in it once more. */
+typedef struct pdf_obj_stm_s
 {
-	fz_stream *stm = NULL;
-	pdf_obj *objstm = NULL;
-	int *numbuf = NULL;
-	fz_off_t *ofsbuf = NULL;
+	fz_storable storable;
+	fz_off_t stm_ofs; /* of the object stream in the file, to spot updates and repairs */
+	fz_buffer *buf;
+	int count;
+	int *nums;
+	fz_off_t *ofs; /* from the start of buf */
+} pdf_obj_stm;
 
-	pdf_obj *obj;
+static void
+pdf_drop_obj_stm_imp(fz_context *ctx, fz_storable *stm_)
+{
+	pdf_obj_stm *stm = (pdf_obj_stm *)stm_;
+
+	fz_drop_buffer(ctx, stm->buf);
+	fz_free(ctx, stm->nums);
+	fz_free(ctx, stm->ofs);
+	fz_free(ctx, stm);
+}
+
+static size_t
+pdf_obj_stm_size(pdf_obj_stm *stm)
+{
+	return sizeof(*stm) + stm->buf->cap + stm->count * (sizeof(*stm->nums) + sizeof(*stm->ofs));
+}
+
+static pdf_obj_stm *
+pdf_decode_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf)
+{
+	pdf_obj_stm *stm = NULL;
+	fz_stream *file = NULL;
+	pdf_obj *objstm = NULL;
+	pdf_token tok;
 	fz_off_t first;
 	int count;
 	int i;
-	pdf_token tok;
-	pdf_xref_entry *ret_entry = NULL;
 
-	fz_var(numbuf);
-	fz_var(ofsbuf);
-	fz_var(objstm);
 	fz_var(stm);
+	fz_var(file);
+	fz_var(objstm);
 
 	fz_try(ctx)
 	{
@@ -1679,42 +2139,127 @@ pdf_load_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf, i
 		if (first < 0)
 			fz_throw(ctx, FZ_ERROR_GENERIC, "first object in object stream resides outside stream");
 
-		numbuf = fz_calloc(ctx, count, sizeof(*numbuf));
-		ofsbuf = fz_calloc(ctx, count, sizeof(*ofsbuf));
+		stm = fz_malloc_struct(ctx, pdf_obj_stm);
+		FZ_INIT_STORABLE(stm, 1, pdf_drop_obj_stm_imp);
+		stm->stm_ofs = pdf_get_xref_entry(ctx, doc, num)->ofs;
+		stm->nums = fz_calloc(ctx, count, sizeof(*stm->nums));
+		stm->ofs = fz_calloc(ctx, count, sizeof(*stm->ofs));
+		stm->buf = pdf_load_stream(ctx, doc, num);
 
-		stm = pdf_open_stream(ctx, doc, num);
+		file = fz_open_buffer(ctx, stm->buf);
 		for (i = 0; i < count; i++)
 		{
-			tok = pdf_lex(ctx, stm, buf);
+			tok = pdf_lex(ctx, file, buf);
 			if (tok != PDF_TOK_INT)
 				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt object stream (%d 0 R)", num);
-			numbuf[i] = buf->i;
+			stm->nums[i] = buf->i;
 
-			tok = pdf_lex(ctx, stm, buf);
+			tok = pdf_lex(ctx, file, buf);
 			if (tok != PDF_TOK_INT)
 				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt object stream (%d 0 R)", num);
-			ofsbuf[i] = buf->i;
+			stm->ofs[i] = first + buf->i;
+		}
+		stm->count = count;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, file);
+		pdf_drop_obj(ctx, objstm);
+	}
+	fz_catch(ctx)
+	{
+		if (stm)
+			pdf_drop_obj_stm_imp(ctx, &stm->storable);
+		fz_rethrow(ctx);
+	}
+	return stm;
+}
+
+/* Find the decoded object stream in the store, or decode it and put it
+ * there. */
+static pdf_obj_stm *
+pdf_find_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf, int *fresh)
+{
+	pdf_xref_entry *x = pdf_get_xref_entry(ctx, doc, num);
+	pdf_obj_stm *stm;
+	pdf_obj *key = pdf_new_indirect(ctx, doc, num, 0);
+
+	fz_try(ctx)
+	{
+		stm = pdf_find_item(ctx, pdf_drop_obj_stm_imp, key);
+		if (stm && (x->type != 'n' || x->ofs != stm->stm_ofs || x->stm_buf))
+		{
+			/* The object stream has changed under us. */
+			fz_drop_storable(ctx, &stm->storable);
+			pdf_remove_item(ctx, pdf_drop_obj_stm_imp, key);
+			stm = NULL;
 		}
+		*fresh = (stm == NULL);
+		if (!stm)
+		{
+			stm = pdf_decode_obj_stm(ctx, doc, num, buf);
+			pdf_store_item(ctx, key, stm, pdf_obj_stm_size(stm));
+		}
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(ctx, key);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+	return stm;
+}
+
+/* Parse objects out of the object stream num. If we have just decoded
+ * it, take every object it holds that we have not already got, as we
+ * are likely to want them; if it came from the store, take only the
+ * target. */
+static pdf_xref_entry *
+pdf_load_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf, int target)
+{
+	pdf_obj_stm *objstm;
+	fz_stream *stm = NULL;
+	pdf_obj *obj;
+	int i, fresh;
+	pdf_xref_entry *ret_entry = NULL;
+
+	fz_var(stm);
 
-		fz_seek(ctx, stm, first, SEEK_SET);
+	objstm = pdf_find_obj_stm(ctx, doc, num, buf, &fresh);
 
-		for (i = 0; i < count; i++)
+	fz_try(ctx)
+	{
+		stm = fz_open_buffer(ctx, objstm->buf);
+
+		for (i = 0; i < objstm->count; i++)
 		{
 			int xref_len = pdf_xref_len(ctx, doc);
 			pdf_xref_entry *entry;
-			fz_seek(ctx, stm, first + ofsbuf[i], SEEK_SET);
 
-			obj = pdf_parse_stm_obj(ctx, doc, stm, buf);
+			if (!fresh && objstm->nums[i] != target)
+				continue;
+
+			fz_seek(ctx, stm, objstm->ofs[i], SEEK_SET);
+
+			pdf_begin_object_arena(ctx, doc);
+			fz_try(ctx)
+				obj = pdf_parse_stm_obj(ctx, doc, stm, buf);
+			fz_always(ctx)
+				pdf_end_object_arena(ctx, doc);
+			fz_catch(ctx)
+				fz_rethrow(ctx);
 
-			if (numbuf[i] <= 0 || numbuf[i] >= xref_len)
+			if (objstm->nums[i] <= 0 || objstm->nums[i] >= xref_len)
 			{
 				pdf_drop_obj(ctx, obj);
-				fz_throw(ctx, FZ_ERROR_GENERIC, "object id (%d 0 R) out of range (0..%d)", numbuf[i], xref_len - 1);
+				fz_throw(ctx, FZ_ERROR_GENERIC, "object id (%d 0 R) out of range (0..%d)", objstm->nums[i], xref_len - 1);
 			}
 
-			entry = pdf_get_xref_entry(ctx, doc, numbuf[i]);
+			entry = pdf_get_xref_entry(ctx, doc, objstm->nums[i]);
 
-			pdf_set_obj_parent(ctx, obj, numbuf[i]);
+			pdf_set_obj_parent(ctx, obj, objstm->nums[i]);
 
 			if (entry->type == 'o' && entry->ofs == num)
 			{
@@ -1727,7 +2272,7 @@ pdf_load_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf, i
 				if (entry->obj)
 				{
 					if (pdf_objcmp(ctx, entry->obj, obj))
-						fz_warn(ctx, "Encountered new definition for object %d - keeping the original one", numbuf[i]);
+						fz_warn(ctx, "Encountered new definition for object %d - keeping the original one", objstm->nums[i]);
 					pdf_drop_obj(ctx, obj);
 				}
 				else
@@ -1736,7 +2281,7 @@ pdf_load_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf, i
 					fz_drop_buffer(ctx, entry->stm_buf);
 					entry->stm_buf = NULL;
 				}
-				if (numbuf[i] == target)
+				if (objstm->nums[i] == target)
 					ret_entry = entry;
 			}
 			else
@@ -1748,9 +2293,7 @@ pdf_load_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf, i
 	fz_always(ctx)
 	{
 		fz_drop_stream(ctx, stm);
-		fz_free(ctx, ofsbuf);
-		fz_free(ctx, numbuf);
-		pdf_drop_obj(ctx, objstm);
+		fz_drop_storable(ctx, &objstm->storable);
 	}
 	fz_catch(ctx)
 	{
@@ -1891,6 +2434,23 @@ pdf_obj_read(fz_context *ctx, pdf_document *doc, fz_off_t *offset, int *nump, pd
 	return 0;
 }
 
+/* Ask for the ranges holding the objects of a page, and the shared
+ * objects it uses, all at once. */
+static void
+pdf_prefetch_hinted_page(fz_context *ctx, pdf_document *doc, int pagenum)
+{
+	int i;
+
+	fz_prefetch_stream(ctx, doc->file, doc->hint_page[pagenum].offset,
+		doc->hint_page[pagenum+1].offset - doc->hint_page[pagenum].offset);
+	for (i = doc->hint_page[pagenum].index; i < doc->hint_page[pagenum+1].index; i++)
+	{
+		int r = doc->hint_shared_ref[i];
+		fz_prefetch_stream(ctx, doc->file, doc->hint_shared[r].offset,
+			doc->hint_shared[r+1].offset - doc->hint_shared[r].offset);
+	}
+}
+
 static void
 pdf_load_hinted_page(fz_context *ctx, pdf_document *doc, int pagenum)
 {
@@ -1901,6 +2461,9 @@ pdf_load_hinted_page(fz_context *ctx, pdf_document *doc, int pagenum)
 	if (doc->linear_page_refs[pagenum])
 		return;
 
+	if (doc->file_ranged && doc->hint_page && doc->hint_shared)
+		pdf_prefetch_hinted_page(ctx, doc, pagenum);
+
 	fz_try(ctx)
 	{
 		int num = doc->hint_page[pagenum].number;
@@ -2021,11 +2584,16 @@ object_updated:
 	{
 		fz_seek(ctx, doc->file, x->ofs, SEEK_SET);
 
+		pdf_begin_object_arena(ctx, doc);
 		fz_try(ctx)
 		{
 			x->obj = pdf_parse_ind_obj(ctx, doc, doc->file, &doc->lexbuf.base,
 					&rnum, &rgen, &x->stm_ofs, &try_repair);
 		}
+		fz_always(ctx)
+		{
+			pdf_end_object_arena(ctx, doc);
+		}
 		fz_catch(ctx)
 		{
 			if (!try_repair || fz_caught(ctx) == FZ_ERROR_TRYLATER)
@@ -2050,6 +2618,7 @@ object_updated:
 			{
 				pdf_repair_xref(ctx, doc);
 				pdf_prime_xref_index(ctx, doc);
+				pdf_drop_page_map(ctx, doc);
 			}
 			fz_catch(ctx)
 			{
@@ -2100,6 +2669,95 @@ pdf_load_object(fz_context *ctx, pdf_document *doc, int num)
 	return pdf_keep_obj(ctx, entry->obj);
 }
 
+typedef struct
+{
+	fz_off_t ofs;
+	int num;
+} prefetch_entry;
+
+static int
+cmp_prefetch_entry(const void *a_, const void *b_)
+{
+	const prefetch_entry *a = a_;
+	const prefetch_entry *b = b_;
+
+	if (a->ofs != b->ofs)
+		return a->ofs < b->ofs ? -1 : 1;
+	return a->num - b->num;
+}
+
+void
+pdf_prefetch_objects(fz_context *ctx, pdf_document *doc, const int *nums, int n)
+{
+	prefetch_entry *list;
+	int xref_len = pdf_xref_len(ctx, doc);
+	int i, count = 0;
+
+	if (n <= 0)
+		return;
+
+	list = fz_malloc_array(ctx, n, sizeof(*list));
+
+	fz_try(ctx)
+	{
+		for (i = 0; i < n; i++)
+		{
+			int num = nums[i];
+			pdf_xref_entry *x;
+
+			if (num <= 0 || num >= xref_len)
+				continue;
+			x = pdf_get_xref_entry(ctx, doc, num);
+			if (x->obj)
+				continue;
+			if (x->type == 'n')
+				list[count].ofs = x->ofs;
+			else if (x->type == 'o')
+			{
+				/* Members of an object stream sort by where the
+				 * object stream lives, so they end up together
+				 * and the stream is decoded only once. */
+				int stm = (int)x->ofs;
+				pdf_xref_entry *y = NULL;
+				if (stm > 0 && stm < xref_len)
+					y = pdf_get_xref_entry(ctx, doc, stm);
+				list[count].ofs = (y && y->type == 'n') ? y->ofs : FZ_OFF_MAX;
+			}
+			else
+				continue;
+			list[count++].num = num;
+		}
+
+		qsort(list, count, sizeof(*list), cmp_prefetch_entry);
+
+		for (i = 0; i < count; i++)
+		{
+			/* A repair on the way may have shrunk the xref. */
+			if (list[i].num >= pdf_xref_len(ctx, doc))
+				continue;
+			if (pdf_get_xref_entry(ctx, doc, list[i].num)->obj)
+				continue;
+			fz_try(ctx)
+				pdf_cache_object(ctx, doc, list[i].num);
+			fz_catch(ctx)
+			{
+				/* Keep going: a TRYLATER has at least asked
+				 * for the data, and any other problem will be
+				 * reported to whoever loads the object for
+				 * real. */
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, list);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
 pdf_obj *
 pdf_resolve_indirect(fz_context *ctx, pdf_obj *ref)
 {
@@ -2242,6 +2900,8 @@ pdf_update_stream(fz_context *ctx, pdf_document *doc, pdf_obj *obj, fz_buffer *n
 	x->stm_buf = fz_keep_buffer(ctx, newbuf);
 
 	pdf_dict_puts_drop(ctx, obj, "Length", pdf_new_int(ctx, doc, (int)newbuf->len));
+	pdf_dict_dels(ctx, obj, "MuPDF_FlateRestarts");
+	pdf_dict_dels(ctx, obj, "DL");
 	if (!compressed)
 	{
 		pdf_dict_dels(ctx, obj, "Filter");
@@ -2348,8 +3008,39 @@ pdf_open_document(fz_context *ctx, const char *filename)
 
 	fz_try(ctx)
 	{
-		file = fz_open_file(ctx, filename);
+		file = fz_open_file_mapped(ctx, filename);
+		doc = pdf_new_document(ctx, file);
+		pdf_init_document(ctx, doc);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, file);
+	}
+	fz_catch(ctx)
+	{
+		pdf_drop_document_imp(ctx, doc);
+		fz_rethrow(ctx);
+	}
+	return doc;
+}
+
+pdf_document *
+pdf_open_document_with_xref_cache(fz_context *ctx, const char *filename, const char *cachename)
+{
+	fz_stream *file = NULL;
+	pdf_document *doc = NULL;
+
+	fz_var(file);
+	fz_var(doc);
+
+	fz_try(ctx)
+	{
+		file = fz_open_file_mapped(ctx, filename);
 		doc = pdf_new_document(ctx, file);
+		doc->xref_cache_mtime = pdf_file_mtime(filename);
+		doc->xref_cache_pages = -1;
+		if (cachename && doc->xref_cache_mtime > 0)
+			doc->xref_cache = fz_strdup(ctx, cachename);
 		pdf_init_document(ctx, doc);
 	}
 	fz_always(ctx)
@@ -2358,6 +3049,8 @@ pdf_open_document(fz_context *ctx, const char *filename)
 	}
 	fz_catch(ctx)
 	{
+		if (doc)
+			pdf_invalidate_xref_cache(ctx, doc);
 		pdf_drop_document_imp(ctx, doc);
 		fz_rethrow(ctx);
 	}
@@ -2409,7 +3102,7 @@ pdf_load_hints(fz_context *ctx, pdf_document *doc, int objnum)
 		 * pdf_reference17.pdf, this points to 2 objects before the
 		 * first pages page object. */
 		doc->hint_page[0].offset = fz_read_bits(ctx, stream, 32);
-		if (doc->hint_page[0].offset > doc->hint_object_offset)
+		if (doc->hint_page[0].offset >= doc->hint_object_offset)
 			doc->hint_page[0].offset += doc->hint_object_length;
 		page_obj_num_bits = fz_read_bits(ctx, stream, 16);
 		least_page_len = fz_read_bits(ctx, stream, 32);
@@ -2446,7 +3139,7 @@ pdf_load_hints(fz_context *ctx, pdf_document *doc, int objnum)
 
 			doc->hint_page[i].offset = j;
 			j += least_page_len + delta_page_len;
-			if (old <= doc->hint_object_offset && j > doc->hint_object_offset)
+			if (old < doc->hint_object_offset && j >= doc->hint_object_offset)
 				j += doc->hint_object_length;
 		}
 		doc->hint_page[i].offset = j;
@@ -2476,7 +3169,7 @@ pdf_load_hints(fz_context *ctx, pdf_document *doc, int objnum)
 		/* Read the shared object hints table: Header first */
 		shared_obj_num = fz_read_bits(ctx, stream, 32);
 		shared_obj_offset = fz_read_bits(ctx, stream, 32);
-		if (shared_obj_offset > doc->hint_object_offset)
+		if (shared_obj_offset >= doc->hint_object_offset)
 			shared_obj_offset += doc->hint_object_length;
 		shared_obj_count_page1 = fz_read_bits(ctx, stream, 32);
 		shared_obj_count_total = fz_read_bits(ctx, stream, 32);
@@ -2505,7 +3198,7 @@ pdf_load_hints(fz_context *ctx, pdf_document *doc, int objnum)
 			int old = j;
 			doc->hint_shared[i].offset = j;
 			j += off + least_shared_group_len;
-			if (old <= doc->hint_object_offset && j > doc->hint_object_offset)
+			if (old < doc->hint_object_offset && j >= doc->hint_object_offset)
 				j += doc->hint_object_length;
 		}
 		/* FIXME: We would have problems recreating the length of the
@@ -2518,7 +3211,7 @@ pdf_load_hints(fz_context *ctx, pdf_document *doc, int objnum)
 			int old = j;
 			doc->hint_shared[i].offset = j;
 			j += off + least_shared_group_len;
-			if (old <= doc->hint_object_offset && j > doc->hint_object_offset)
+			if (old < doc->hint_object_offset && j >= doc->hint_object_offset)
 				j += doc->hint_object_length;
 		}
 		doc->hint_shared[i].offset = j;
@@ -2635,6 +3328,20 @@ pdf_obj *pdf_progressive_advance(fz_context *ctx, pdf_document *doc, int pagenum
 	if (doc->linear_pos == doc->file_length)
 		return doc->linear_page_refs[pagenum];
 
+	/* If we can fetch any part of the file, there is no need to read
+	 * through it to the page we want; the hints take us straight
+	 * there. */
+	if (doc->file_ranged)
+	{
+		if (pagenum > 0 && !doc->hints_loaded && doc->hint_object_offset > 0)
+		{
+			pdf_load_hint_object(ctx, doc);
+			pdf_load_hinted_page(ctx, doc, pagenum);
+		}
+		if (doc->linear_page_refs[pagenum])
+			return doc->linear_page_refs[pagenum];
+	}
+
 	/* Only load hints once, and then only after we have got page 0 */
 	if (pagenum > 0 && !doc->hints_loaded && doc->hint_object_offset > 0 && doc->linear_pos >= doc->hint_object_offset)
 	{
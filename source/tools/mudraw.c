@@ -18,6 +18,10 @@
 #endif
 #endif
 
+/* In mutool.c */
+fz_locks_context *mutool_init_locks(void);
+void mutool_fin_locks(void);
+
 /* Enable for helpful threading debug */
 /* #define DEBUG_THREADS(A) do { printf A; fflush(stdout); } while (0) */
 #define DEBUG_THREADS(A) do { } while (0)
@@ -145,11 +149,6 @@ static const format_cs_table_t format_cs_table[] =
 #define THREAD_FIN(A) do { CloseHandle(A); } while (0)
 #define THREAD_RETURN_TYPE DWORD WINAPI
 #define THREAD_RETURN() return 0
-#define MUTEX CRITICAL_SECTION
-#define MUTEX_INIT(A) do { InitializeCriticalSection(&A); } while (0)
-#define MUTEX_FIN(A) do { DeleteCriticalSection(&A); } while (0)
-#define MUTEX_LOCK(A) do { EnterCriticalSection(&A); } while (0)
-#define MUTEX_UNLOCK(A) do { LeaveCriticalSection(&A); } while (0)
 
 #elif MUDRAW_THREADS == 2
 
@@ -246,54 +245,11 @@ my_semaphore_signal(my_semaphore_t * sem)
 #define THREAD_FIN(A) do { void *res; (void)pthread_join(A, &res); } while (0)
 #define THREAD_RETURN_TYPE void *
 #define THREAD_RETURN() return NULL
-#define MUTEX pthread_mutex_t
-#define MUTEX_INIT(A) do { (void)pthread_mutex_init(&A, NULL); } while (0)
-#define MUTEX_FIN(A) do { (void)pthread_mutex_destroy(&A); } while (0)
-#define MUTEX_LOCK(A) do { (void)pthread_mutex_lock(&A); } while (0)
-#define MUTEX_UNLOCK(A) do { (void)pthread_mutex_unlock(&A); } while (0)
 
 #else
 #error Unknown MUDRAW_THREADS setting
 #endif
 
-#define LOCKS_INIT() init_mudraw_locks()
-#define LOCKS_FIN() fin_mudraw_locks()
-
-static MUTEX mutexes[FZ_LOCK_MAX];
-
-static void mudraw_lock(void *user, int lock)
-{
-	MUTEX_LOCK(mutexes[lock]);
-}
-
-static void mudraw_unlock(void *user, int lock)
-{
-	MUTEX_UNLOCK(mutexes[lock]);
-}
-
-static fz_locks_context mudraw_locks =
-{
-	NULL, mudraw_lock, mudraw_unlock
-};
-
-static fz_locks_context *init_mudraw_locks(void)
-{
-	int i;
-
-	for (i = 0; i < FZ_LOCK_MAX; i++)
-		MUTEX_INIT(mutexes[i]);
-
-	return &mudraw_locks;
-}
-
-static void fin_mudraw_locks(void)
-{
-	int i;
-
-	for (i = 0; i < FZ_LOCK_MAX; i++)
-		MUTEX_FIN(mutexes[i]);
-}
-
 #else
 
 /* Null Threads implementation */
@@ -305,8 +261,6 @@ static void fin_mudraw_locks(void)
 #define SEMAPHORE_WAIT(A) do { A = 0; } while (0)
 #define THREAD_INIT(A,B,C) do { A = 0; (void)C; } while (0)
 #define THREAD_FIN(A) do { A = 0; } while (0)
-#define LOCKS_INIT() NULL
-#define LOCKS_FIN() do { } while (0)
 
 #endif
 
@@ -362,6 +316,7 @@ static int ignore_errors = 0;
 static int uselist = 1;
 static int alphabits_text = 8;
 static int alphabits_graphics = 8;
+static int rasterizer = FZ_RASTERIZER_GEL;
 
 static int out_cs = CS_UNSET;
 static float gamma_value = 1;
@@ -441,6 +396,7 @@ static void usage(void)
 		"\n"
 		"\t-A -\tnumber of bits of antialiasing (0 to 8)\n"
 		"\t-A -/-\tnumber of bits of antialiasing (0 to 8) (graphics, text)\n"
+		"\t-E -\tscan converter for graphics (gel, cells)\n"
 		"\t-D\tdisable use of display list\n"
 		"\t-i\tignore errors\n"
 		"\t-L\tlow memory mode (avoid caching, clear objects after each page)\n"
@@ -1361,7 +1317,7 @@ int mudraw_main(int argc, char **argv)
 
 	fz_var(doc);
 
-	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:c:G:Is:A:DiW:H:S:T:U:LvP")) != -1)
+	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:c:G:Is:A:E:DiW:H:S:T:U:LvP")) != -1)
 	{
 		switch (c)
 		{
@@ -1406,6 +1362,14 @@ int mudraw_main(int argc, char **argv)
 				alphabits_text = alphabits_graphics;
 			break;
 		}
+		case 'E':
+			if (!strcmp(fz_optarg, "cells"))
+				rasterizer = FZ_RASTERIZER_CELLS;
+			else if (!strcmp(fz_optarg, "gel"))
+				rasterizer = FZ_RASTERIZER_GEL;
+			else
+				usage();
+			break;
 		case 'D': uselist = 0; break;
 		case 'i': ignore_errors = 1; break;
 
@@ -1449,7 +1413,7 @@ int mudraw_main(int argc, char **argv)
 		}
 	}
 
-	ctx = fz_new_context((showmemory == 0 ? NULL : &alloc_ctx), LOCKS_INIT(), (lowmemory ? 1 : FZ_STORE_DEFAULT));
+	ctx = fz_new_context((showmemory == 0 ? NULL : &alloc_ctx), mutool_init_locks(), (lowmemory ? 1 : FZ_STORE_DEFAULT));
 	if (!ctx)
 	{
 		fprintf(stderr, "cannot initialise context\n");
@@ -1458,6 +1422,7 @@ int mudraw_main(int argc, char **argv)
 
 	fz_set_text_aa_level(ctx, alphabits_text);
 	fz_set_graphics_aa_level(ctx, alphabits_graphics);
+	fz_set_graphics_rasterizer(ctx, rasterizer);
 
 	if (bgprint.active)
 	{
@@ -1766,7 +1731,7 @@ int mudraw_main(int argc, char **argv)
 	}
 
 	fz_drop_context(ctx);
-	LOCKS_FIN();
+	mutool_fin_locks();
 
 	if (showmemory)
 	{
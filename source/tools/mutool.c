@@ -4,6 +4,14 @@
 
 #include "mupdf/fitz.h"
 
+#ifdef _MSC_VER
+#include <windows.h>
+#define MUTOOL_THREADS 1
+#elif defined(HAVE_PTHREADS)
+#include <pthread.h>
+#define MUTOOL_THREADS 2
+#endif
+
 #ifdef _MSC_VER
 #define main main_utf8
 #endif
@@ -43,6 +51,80 @@ static struct {
 #endif
 };
 
+/*
+	Locks for the tools that clone their context to work on several
+	threads. Without threads there are none; the tools are then given
+	NULL, and the library stays on the calling thread.
+*/
+#ifdef MUTOOL_THREADS
+#if MUTOOL_THREADS == 1
+
+/* Windows threads */
+#define MUTEX CRITICAL_SECTION
+#define MUTEX_INIT(A) do { InitializeCriticalSection(&A); } while (0)
+#define MUTEX_FIN(A) do { DeleteCriticalSection(&A); } while (0)
+#define MUTEX_LOCK(A) do { EnterCriticalSection(&A); } while (0)
+#define MUTEX_UNLOCK(A) do { LeaveCriticalSection(&A); } while (0)
+
+#else
+
+/* PThreads */
+#define MUTEX pthread_mutex_t
+#define MUTEX_INIT(A) do { (void)pthread_mutex_init(&A, NULL); } while (0)
+#define MUTEX_FIN(A) do { (void)pthread_mutex_destroy(&A); } while (0)
+#define MUTEX_LOCK(A) do { (void)pthread_mutex_lock(&A); } while (0)
+#define MUTEX_UNLOCK(A) do { (void)pthread_mutex_unlock(&A); } while (0)
+
+#endif
+
+static MUTEX mutexes[FZ_LOCK_MAX];
+
+static void mutool_lock(void *user, int lock)
+{
+	MUTEX_LOCK(mutexes[lock]);
+}
+
+static void mutool_unlock(void *user, int lock)
+{
+	MUTEX_UNLOCK(mutexes[lock]);
+}
+
+static fz_locks_context mutool_locks =
+{
+	NULL, mutool_lock, mutool_unlock
+};
+
+fz_locks_context *mutool_init_locks(void)
+{
+	int i;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		MUTEX_INIT(mutexes[i]);
+
+	return &mutool_locks;
+}
+
+void mutool_fin_locks(void)
+{
+	int i;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		MUTEX_FIN(mutexes[i]);
+}
+
+#else
+
+fz_locks_context *mutool_init_locks(void)
+{
+	return NULL;
+}
+
+void mutool_fin_locks(void)
+{
+}
+
+#endif
+
 static int
 namematch(const char *end, const char *start, const char *match)
 {
@@ -11,6 +11,10 @@
 
 #include "mupdf/pdf.h"
 
+/* In mutool.c */
+fz_locks_context *mutool_init_locks(void);
+void mutool_fin_locks(void);
+
 static void usage(void)
 {
 	fprintf(stderr,
@@ -23,6 +27,7 @@ static void usage(void)
 		"\t-a\tascii hex encode binary streams\n"
 		"\t-d\tdecompress streams\n"
 		"\t-z\tdeflate uncompressed streams\n"
+		"\t-zz\tin addition to -z record restart points for parallel inflate\n"
 		"\t-f\tcompress font streams\n"
 		"\t-i\tcompress image streams\n"
 		"\t-s\tclean content streams\n"
@@ -62,6 +67,9 @@ int pdfclean_main(int argc, char **argv)
 		}
 	}
 
+	if (opts.do_compress > 1)
+		opts.do_flate_restarts = 1;
+
 	if ((opts.do_ascii || opts.do_decompress) && !opts.do_compress)
 		opts.do_pretty = 1;
 
@@ -76,7 +84,8 @@ int pdfclean_main(int argc, char **argv)
 		outfile = argv[fz_optind++];
 	}
 
-	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	/* With locks, large streams can be deflated on all threads */
+	ctx = fz_new_context(NULL, mutool_init_locks(), FZ_STORE_UNLIMITED);
 	if (!ctx)
 	{
 		fprintf(stderr, "cannot initialise context\n");
@@ -92,6 +101,7 @@ int pdfclean_main(int argc, char **argv)
 		errors++;
 	}
 	fz_drop_context(ctx);
+	mutool_fin_locks();
 
 	return errors != 0;
 }
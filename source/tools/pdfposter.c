@@ -149,6 +149,11 @@ static void decimatepages(fz_context *ctx, pdf_document *doc)
 	/* Update page count and kids array */
 	pdf_dict_put_drop(ctx, pages, PDF_NAME_Count, pdf_new_int(ctx, doc, kidcount));
 	pdf_dict_put_drop(ctx, pages, PDF_NAME_Kids, kids);
+
+	/* The page tree has changed under any cached page lookups */
+	doc->page_count = 0;
+	pdf_drop_page_map(ctx, doc);
+	pdf_invalidate_xref_cache(ctx, doc);
 }
 
 int pdfposter_main(int argc, char **argv)
@@ -181,7 +181,7 @@ xps_open_document(fz_context *ctx, const char *filename)
 		return xps_open_document_with_directory(ctx, buf);
 	}
 
-	file = fz_open_file(ctx, filename);
+	file = fz_open_file_mapped(ctx, filename);
 
 	fz_try(ctx)
 		doc = xps_open_document_with_stream(ctx, file);